@@ -1,3 +1,4 @@
+#pragma once
 #include <util/bmem.h>
 #include <util/platform.h>
 #include <util/threading.h>
@@ -7,8 +8,12 @@
 #include <vector>
 #include <algorithm>
 #include <functional>
+#include <atomic>
+#include <memory>
 #include <windows.h>
 #include <util/windows/WinHandle.hpp>
+#include "rt-log.h"
+#include "trace-events.h"
 
 #define CAPTURE_INTERVAL INFINITE
 #define NSEC_PER_SEC  1000000000LL
@@ -20,6 +25,9 @@ class StreamableReader {
 	bool _active = false;
 	WinHandle _readerThread;
 protected:
+	/*written by the reader thread in Stream*/
+	std::atomic<uint64_t> _lag{0};
+	std::atomic<uint64_t> _dropped{0};
 public:
 	StreamableReader()
 	{
@@ -33,6 +41,28 @@ public:
 		return _stopStreamingSignal;
 	}
 
+	/*buffers written after the one the last Read got*/
+	uint64_t Lag() const
+	{
+		return _lag.load(std::memory_order_relaxed);
+	}
+
+	void Lag(uint64_t lag)
+	{
+		_lag.store(lag, std::memory_order_relaxed);
+	}
+
+	/*buffers overwritten before this reader got to them*/
+	uint64_t Dropped() const
+	{
+		return _dropped.load(std::memory_order_relaxed);
+	}
+
+	void Dropped(uint64_t count)
+	{
+		_dropped.fetch_add(count, std::memory_order_relaxed);
+	}
+
 	void Disconnect()
 	{
 		_active = false;
@@ -66,7 +96,10 @@ class StreamableBuffer {
 private:
 	std::vector<Data> _Buf;
 	std::vector<bool> _Used;
-	size_t _writeIndex;
+	/*per slot seqlock, odd while Write is in the slot*/
+	std::unique_ptr<std::atomic<uint32_t>[]> _version;
+	size_t _writeIndex = 0;
+	std::atomic<uint64_t> _writeCount{0};
 	bool _active = false;
 
 	void incrementWriteIndex()
@@ -99,6 +132,9 @@ public:
 			_Buf.push_back(c);
 			_Used.push_back(false);
 		}
+		_version.reset(new std::atomic<uint32_t>[count]);
+		for (size_t i = 0; i < count; i++)
+			_version[i] = 0;
 		_writtenToSignal = CreateEvent(nullptr, true, false, nullptr);
 		_stopStreamingSignal = CreateEvent(nullptr, true, false, nullptr);
 	}
@@ -132,6 +168,17 @@ public:
 		return i % _Buf.size();
 	}
 
+	size_t size()
+	{
+		return _Buf.size();
+	}
+
+	/*total number of buffers written, readers use this to detect lag*/
+	uint64_t writeCount()
+	{
+		return _writeCount.load(std::memory_order_acquire);
+	}
+
 	void Disconnect()
 	{
 		_active = false;
@@ -141,10 +188,17 @@ public:
 	template<class Callable>
 	void Write(Data &d, Callable c)
 	{
+		TraceScope trace("StreamableBuffer::Write");
 		SetEvent(_writtenToSignal);
+		std::atomic<uint32_t> &version = _version[_writeIndex];
+		uint32_t v = version.load(std::memory_order_relaxed);
+		version.store(v + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
 		std::invoke(c, d, _Buf[_writeIndex], _Used[_writeIndex]);
+		version.store(v + 2, std::memory_order_release);
 		_Used[_writeIndex] = true;
 		incrementWriteIndex();
+		_writeCount.fetch_add(1, std::memory_order_release);
 		ResetEvent(_writtenToSignal);
 	}
 
@@ -155,6 +209,21 @@ public:
 		else
 			return nullptr;
 	}
+
+	/*for readers that are not listeners: take the version, copy the
+	 *slot, and the copy holds if SlotUnchanged*/
+	uint32_t SlotVersion(size_t i)
+	{
+		return _version[actualIndex(i)].load(std::memory_order_acquire);
+	}
+
+	bool SlotUnchanged(size_t i, uint32_t version)
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return !(version & 1) &&
+		       _version[actualIndex(i)].load(
+			       std::memory_order_relaxed) == version;
+	}
 	
 	template<class Reader>
 	static DWORD WINAPI Stream(void *data)
@@ -168,21 +237,35 @@ public:
 
 		name += source->Name();
 		os_set_thread_name(name.c_str());
+		tracer.ThreadName(name.c_str());
 
 		int waitResult = 0;
 
-		size_t readIndex = device->writableIndex();
+		uint64_t readCount = device->writeCount();
+		/*the slot being written is never handed to a reader*/
+		uint64_t maxLag = device->size() - 1;
 		HANDLE signals[3] = { device->_writtenToSignal, device->_stopStreamingSignal, source->_stopStreamingSignal };
 
 		while (true) {
 			waitResult = WaitForMultipleObjects(3, signals, false, INFINITE);
 			switch (waitResult) {
-			case WAIT_OBJECT_0:
-				while (readIndex != device->writableIndex()) {
-					source->Read(device->Read(readIndex));
-					readIndex = device->actualIndex(readIndex + 1);
+			case WAIT_OBJECT_0: {
+				TraceScope trace("Stream wakeup");
+				uint64_t writeCount = device->writeCount();
+				if (writeCount - readCount > maxLag) {
+					source->Dropped(writeCount - readCount -
+							maxLag);
+					readCount = writeCount - maxLag;
+				}
+				while (readCount != writeCount) {
+					source->Lag(writeCount - readCount - 1);
+					source->Read(device->Read(
+						(size_t)(readCount %
+							 device->size())));
+					readCount++;
 				}
 				break;
+			}
 			case WAIT_OBJECT_0+1:
 			case WAIT_OBJECT_0+2:
 				delete p;
@@ -193,7 +276,8 @@ public:
 			case WAIT_TIMEOUT:
 			case WAIT_FAILED:
 			default:
-				blog(LOG_ERROR, "%i", waitResult);
+				rt_log(LOG_ERROR, "stream wait failed: %i",
+				       waitResult);
 				delete p;
 				return 0;
 			}
@@ -0,0 +1,422 @@
+#pragma once
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <windows.h>
+#include <util/windows/WinHandle.hpp>
+#include "circle-buffer.h"
+#include "sample-kernels.h"
+
+/*
+ * Records every channel of a stage to a Sony Wave64 file.
+ *
+ * The recorder is an ordinary StreamableBuffer listener: its reader thread
+ * interleaves and packs each buffer into one of two large sector aligned
+ * blocks, a dedicated writer thread writes full blocks with unbuffered
+ * sequential I/O into an extent that is grown ahead of time. Neither the
+ * Voicemeeter callback nor the reader ever wait on the disk, if the writer
+ * falls a whole block behind the data is dropped and counted.
+ */
+
+#define ISO_BLOCK_SIZE (4 * 1024 * 1024)
+#define ISO_BLOCKS 2
+#define ISO_SECTOR 4096
+#define ISO_EXTENT (256ULL * 1024 * 1024)
+/*header occupies the first sector so the data starts aligned*/
+#define ISO_HEADER_SIZE ISO_SECTOR
+
+enum iso_format {
+	iso_float32 = 0,
+	iso_int24,
+};
+
+static const uint8_t w64_riff[16] = {0x72, 0x69, 0x66, 0x66, 0x2E, 0x91,
+				     0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB,
+				     0x04, 0xC1, 0x00, 0x00};
+static const uint8_t w64_wave[16] = {0x77, 0x61, 0x76, 0x65, 0xF3, 0xAC,
+				     0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0,
+				     0x4F, 0x8E, 0xDB, 0x8A};
+static const uint8_t w64_fmt[16] = {0x66, 0x6D, 0x74, 0x20, 0xF3, 0xAC,
+				    0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0,
+				    0x4F, 0x8E, 0xDB, 0x8A};
+static const uint8_t w64_junk[16] = {0x6A, 0x75, 0x6E, 0x6B, 0xF3, 0xAC,
+				     0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0,
+				     0x4F, 0x8E, 0xDB, 0x8A};
+static const uint8_t w64_data[16] = {0x64, 0x61, 0x74, 0x61, 0xF3, 0xAC,
+				     0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0,
+				     0x4F, 0x8E, 0xDB, 0x8A};
+/*KSDATAFORMAT_SUBTYPE_PCM / _IEEE_FLOAT, first byte is the format tag*/
+static const uint8_t w64_subtype[16] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+					0x10, 0x00, 0x80, 0x00, 0x00, 0xAA,
+					0x00, 0x38, 0x9B, 0x71};
+
+static inline uint8_t *w64_put(uint8_t *p, const void *v, size_t size)
+{
+	memcpy(p, v, size);
+	return p + size;
+}
+
+/*fills the first ISO_HEADER_SIZE bytes of a Wave64 file*/
+static void w64_header(uint8_t *h, uint16_t channels, uint32_t rate,
+		       uint16_t bits, bool isFloat, uint64_t dataBytes)
+{
+	uint64_t dataChunk = 24 + dataBytes;
+	uint64_t fileSize = ISO_HEADER_SIZE + ((dataBytes + 7) & ~7ULL);
+	uint64_t fmtSize = 24 + 40;
+	uint64_t junkSize = ISO_HEADER_SIZE - 24 - 40 - fmtSize;
+	uint16_t tag = 0xFFFE;
+	uint16_t align = channels * (bits / 8);
+	uint32_t avg = rate * align;
+	uint16_t cb = 22;
+	uint32_t mask = 0;
+	uint8_t sub[16];
+	memcpy(sub, w64_subtype, 16);
+	sub[0] = isFloat ? 3 : 1;
+
+	memset(h, 0, ISO_HEADER_SIZE);
+	uint8_t *p = h;
+	p = w64_put(p, w64_riff, 16);
+	p = w64_put(p, &fileSize, 8);
+	p = w64_put(p, w64_wave, 16);
+
+	p = w64_put(p, w64_fmt, 16);
+	p = w64_put(p, &fmtSize, 8);
+	p = w64_put(p, &tag, 2);
+	p = w64_put(p, &channels, 2);
+	p = w64_put(p, &rate, 4);
+	p = w64_put(p, &avg, 4);
+	p = w64_put(p, &align, 2);
+	p = w64_put(p, &bits, 2);
+	p = w64_put(p, &cb, 2);
+	p = w64_put(p, &bits, 2);
+	p = w64_put(p, &mask, 4);
+	p = w64_put(p, sub, 16);
+
+	p = w64_put(p, w64_junk, 16);
+	p = w64_put(p, &junkSize, 8);
+	p = h + ISO_HEADER_SIZE - 24;
+
+	p = w64_put(p, w64_data, 16);
+	w64_put(p, &dataChunk, 8);
+}
+
+template<class Data> class IsoRecorder : public StreamableReader<Data> {
+	std::string _name = "iso recorder";
+	std::wstring _path;
+	iso_format _format = iso_float32;
+	WinHandle _file;
+	WinHandle _writerThread;
+	WinHandle _blockReady;
+	WinHandle _stopWriting;
+
+	uint8_t *_blocks[ISO_BLOCKS] = {nullptr};
+	size_t _blockBytes[ISO_BLOCKS] = {0};
+	std::atomic<uint64_t> _submitted{0};
+	std::atomic<uint64_t> _written{0};
+	size_t _fill = 0;
+	std::vector<uint8_t> _staging;
+	PcmDither _dither;
+
+	/*reader thread*/
+	uint32_t _channels = 0;
+	uint32_t _rate = 0;
+	bool _mismatch = false;
+
+	/*writer thread*/
+	uint64_t _reserved = 0;
+	uint64_t _offset = 0;
+
+	std::atomic<uint64_t> _dataBytes{0};
+	std::atomic<uint64_t> _busyNs{0};
+	std::atomic<uint64_t> _overruns{0};
+	std::atomic<uint64_t> _peakQueued{0};
+	uint64_t _startTime = 0;
+	bool _recording = false;
+
+	size_t sampleBytes() const { return _format == iso_int24 ? 3 : 4; }
+
+	void pack(const Data *buf, uint8_t *out)
+	{
+		pcm_interleave(out, buf->data.audiobuffer_r, _channels,
+			       buf->data.audiobuffer_nbs,
+			       _format == iso_int24 ? pcm_s24 : pcm_f32,
+			       &_dither);
+	}
+
+	bool blockAvailable()
+	{
+		return _submitted.load(std::memory_order_relaxed) -
+			       _written.load(std::memory_order_acquire) <
+		       ISO_BLOCKS;
+	}
+
+	void submit()
+	{
+		uint64_t s = _submitted.load(std::memory_order_relaxed);
+		_blockBytes[s % ISO_BLOCKS] = _fill;
+		_submitted.store(s + 1, std::memory_order_release);
+		uint64_t queued =
+			s + 1 - _written.load(std::memory_order_relaxed);
+		if (queued > _peakQueued.load(std::memory_order_relaxed))
+			_peakQueued.store(queued, std::memory_order_relaxed);
+		_fill = 0;
+		SetEvent(_blockReady);
+	}
+
+	bool reserve(uint64_t end)
+	{
+		if (end <= _reserved)
+			return true;
+		LARGE_INTEGER size;
+		size.QuadPart = (LONGLONG)(_reserved + ISO_EXTENT);
+		if (!SetFilePointerEx(_file, size, nullptr, FILE_BEGIN) ||
+		    !SetEndOfFile(_file))
+			return false;
+		_reserved = (uint64_t)size.QuadPart;
+		return true;
+	}
+
+	void writeBlock(const uint8_t *block, size_t bytes)
+	{
+		uint64_t start = os_gettime_ns();
+		reserve(_offset + bytes);
+		LARGE_INTEGER pos;
+		pos.QuadPart = (LONGLONG)_offset;
+		SetFilePointerEx(_file, pos, nullptr, FILE_BEGIN);
+		DWORD written = 0;
+		if (!WriteFile(_file, block, (DWORD)bytes, &written, nullptr))
+			rt_log(LOG_ERROR, "iso recorder: write failed (%u)",
+			       GetLastError());
+		_offset += written;
+		_busyNs.fetch_add(os_gettime_ns() - start,
+				  std::memory_order_relaxed);
+	}
+
+	void drainBlocks()
+	{
+		while (_written.load(std::memory_order_relaxed) <
+		       _submitted.load(std::memory_order_acquire)) {
+			uint64_t w = _written.load(std::memory_order_relaxed);
+			size_t i = w % ISO_BLOCKS;
+			/*unbuffered writes must be whole sectors*/
+			size_t bytes = (_blockBytes[i] + ISO_SECTOR - 1) &
+				       ~(size_t)(ISO_SECTOR - 1);
+			writeBlock(_blocks[i], bytes);
+			_written.store(w + 1, std::memory_order_release);
+		}
+	}
+
+	static DWORD WINAPI Writer(void *data)
+	{
+		IsoRecorder *r = static_cast<IsoRecorder *>(data);
+		os_set_thread_name("obs-voicemeeter: iso writer");
+		SetThreadPriority(GetCurrentThread(),
+				  THREAD_PRIORITY_BELOW_NORMAL);
+		HANDLE signals[2] = {r->_blockReady, r->_stopWriting};
+		while (true) {
+			DWORD ret = WaitForMultipleObjects(2, signals, false,
+							   INFINITE);
+			r->drainBlocks();
+			if (ret != WAIT_OBJECT_0)
+				break;
+		}
+		return 0;
+	}
+
+	/*rewrites the header and trims the preallocated tail, done with a
+	 *buffered handle since the sizes aren't sector aligned*/
+	void finalize()
+	{
+		HANDLE f = CreateFileW(_path.c_str(), GENERIC_WRITE, 0, nullptr,
+				       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+				       nullptr);
+		if (f == INVALID_HANDLE_VALUE) {
+			blog(LOG_ERROR, "iso recorder: could not finalize file");
+			return;
+		}
+		uint64_t dataBytes = _dataBytes.load();
+		uint8_t *header = (uint8_t *)_aligned_malloc(ISO_HEADER_SIZE,
+							     ISO_SECTOR);
+		w64_header(header, (uint16_t)_channels, _rate,
+			   (uint16_t)(sampleBytes() * 8),
+			   _format == iso_float32, dataBytes);
+		DWORD written = 0;
+		WriteFile(f, header, ISO_HEADER_SIZE, &written, nullptr);
+		_aligned_free(header);
+
+		LARGE_INTEGER end;
+		end.QuadPart = (LONGLONG)(ISO_HEADER_SIZE +
+					  ((dataBytes + 7) & ~7ULL));
+		SetFilePointerEx(f, end, nullptr, FILE_BEGIN);
+		SetEndOfFile(f);
+		CloseHandle(f);
+	}
+
+public:
+	IsoRecorder()
+	{
+		_blockReady = CreateEvent(nullptr, false, false, nullptr);
+		_stopWriting = CreateEvent(nullptr, true, false, nullptr);
+	}
+
+	~IsoRecorder()
+	{
+		Stop();
+		for (size_t i = 0; i < ISO_BLOCKS; i++)
+			_aligned_free(_blocks[i]);
+	}
+
+	std::string Name() { return _name; }
+
+	bool Recording() const { return _recording; }
+
+	/*call StreamableBuffer::AddListener afterwards to start feeding it*/
+	bool Start(const std::wstring &path, iso_format format)
+	{
+		if (_recording)
+			return false;
+		_path = path;
+		_format = format;
+		pcm_dither_init(&_dither, (uint32_t)os_gettime_ns());
+		_file = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+				    nullptr, CREATE_ALWAYS,
+				    FILE_FLAG_NO_BUFFERING |
+					    FILE_FLAG_SEQUENTIAL_SCAN,
+				    nullptr);
+		if (!_file.Valid()) {
+			blog(LOG_ERROR, "iso recorder: could not open file (%lu)",
+			     GetLastError());
+			return false;
+		}
+		for (size_t i = 0; i < ISO_BLOCKS; i++) {
+			if (!_blocks[i])
+				_blocks[i] = (uint8_t *)_aligned_malloc(
+					ISO_BLOCK_SIZE, ISO_SECTOR);
+		}
+
+		_reserved = 0;
+		_offset = 0;
+		_fill = 0;
+		_channels = 0;
+		_rate = 0;
+		_mismatch = false;
+		_submitted = 0;
+		_written = 0;
+		_dataBytes = 0;
+		_busyNs = 0;
+		_overruns = 0;
+		_peakQueued = 0;
+		reserve(ISO_HEADER_SIZE);
+
+		/*placeholder header, sizes are filled in by finalize*/
+		memset(_blocks[0], 0, ISO_HEADER_SIZE);
+		writeBlock(_blocks[0], ISO_HEADER_SIZE);
+
+		ResetEvent(_stopWriting);
+		_writerThread =
+			CreateThread(nullptr, 0, Writer, this, 0, nullptr);
+		_startTime = os_gettime_ns();
+		_recording = true;
+		return true;
+	}
+
+	void Stop()
+	{
+		if (!_recording)
+			return;
+		this->Disconnect();
+
+		/*the partial block goes out padded, finalize trims it*/
+		while (_fill && !blockAvailable())
+			Sleep(1);
+		if (_fill)
+			submit();
+		SetEvent(_stopWriting);
+		WaitForSingleObject(_writerThread, INFINITE);
+		_writerThread = nullptr;
+		_file = nullptr;
+		_recording = false;
+
+		if (_channels)
+			finalize();
+
+		double seconds = (os_gettime_ns() - _startTime) / 1e9;
+		blog(LOG_INFO,
+		     "iso recorder: %u channels, %.1f MB in %.1f s, "
+		     "%.2f MB/s sustained, writer headroom %.1f%%, "
+		     "peak queued blocks %llu/%d, %llu overruns",
+		     _channels, _dataBytes.load() / 1048576.0, seconds,
+		     MBPerSecond(), Headroom() * 100.0,
+		     (unsigned long long)_peakQueued.load(), ISO_BLOCKS,
+		     (unsigned long long)_overruns.load());
+	}
+
+	double MBPerSecond() const
+	{
+		double seconds = (os_gettime_ns() - _startTime) / 1e9;
+		return seconds > 0 ? _dataBytes.load() / 1048576.0 / seconds
+				   : 0.0;
+	}
+
+	/*fraction of wall time the writer spent idle*/
+	double Headroom() const
+	{
+		uint64_t elapsed = os_gettime_ns() - _startTime;
+		return elapsed ? 1.0 - (double)_busyNs.load() / elapsed : 1.0;
+	}
+
+	uint64_t Overruns() const { return _overruns.load(); }
+
+	void Read(const Data *buf)
+	{
+		TraceScope trace("IsoRecorder::Read");
+		if (_mismatch)
+			return;
+		if (!_channels) {
+			_channels = buf->data.audiobuffer_nbi;
+			_rate = buf->data.audiobuffer_sr;
+		} else if (_channels != (uint32_t)buf->data.audiobuffer_nbi ||
+			   _rate != (uint32_t)buf->data.audiobuffer_sr) {
+			rt_log(LOG_WARNING,
+			       "iso recorder: stream format changed, recording stopped");
+			_mismatch = true;
+			return;
+		}
+
+		size_t bytes = buf->data.audiobuffer_nbs * _channels *
+			       sampleBytes();
+		if (_staging.size() < bytes)
+			_staging.resize(bytes);
+		pack(buf, _staging.data());
+
+		/*drop whole buffers only so the file stays frame aligned*/
+		uint64_t queued = _submitted.load(std::memory_order_relaxed) -
+				  _written.load(std::memory_order_acquire);
+		bool needsNext = _fill + bytes > ISO_BLOCK_SIZE;
+		if ((_fill == 0 && queued >= ISO_BLOCKS) ||
+		    (needsNext && queued + 1 >= ISO_BLOCKS)) {
+			_overruns.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		const uint8_t *src = _staging.data();
+		while (bytes) {
+			uint8_t *block = _blocks[_submitted.load(
+							 std::memory_order_relaxed) %
+						 ISO_BLOCKS];
+			size_t n = min(bytes, (size_t)ISO_BLOCK_SIZE - _fill);
+			memcpy(block + _fill, src, n);
+			_fill += n;
+			src += n;
+			bytes -= n;
+			_dataBytes.fetch_add(n, std::memory_order_relaxed);
+			if (_fill == ISO_BLOCK_SIZE)
+				submit();
+		}
+	}
+};
@@ -0,0 +1,574 @@
+#pragma once
+#include <obs-module.h>
+#include <media-io/audio-resampler.h>
+#include <util/platform.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "VoicemeeterRemote.h"
+#include "trace-events.h"
+#include "sample-kernels.h"
+
+/*
+ * Sends OBS mixer tracks into Voicemeeter insert channels.
+ *
+ * An OBS output receives each selected track on the OBS audio thread
+ * (converted to the Voicemeeter sample rate) and pushes it into a single
+ * producer single consumer ring per track. The Voicemeeter callback pulls
+ * from the rings and overwrites the routed audiobuffer_w channels.
+ *
+ * The two clocks drift, so the consumer reads the ring at a ratio that
+ * is servoed to hold the fill at the latency target (cubic interpolation,
+ * at most SEND_MAX_PPM away from 1). An underrun fades out and waits for
+ * the ring to refill to the target before fading back in, a ring that
+ * runs far over the target is skipped back to it.
+ *
+ * "Send to Voicemeeter" filters use the same rings, one per filter, and
+ * are summed into their channels after the track send.
+ */
+
+#define SEND_RING_FRAMES 16384
+#define SEND_MAX_PPM 1000.0
+#define SEND_FADE_FRAMES 256
+#define SEND_MAX_FILTERS 64
+#define SEND_MAX_FRAMES 8192
+
+struct SendRoute {
+	int track;
+	int first;
+};
+
+/*planar float, producer and consumer each own one index*/
+class SendRing {
+	std::vector<float> _data;
+	size_t _channels = 0;
+	size_t _mask = 0;
+	std::atomic<uint64_t> _write{0};
+	std::atomic<uint64_t> _read{0};
+	std::atomic<size_t> _chunk{0};
+
+public:
+	void Init(size_t channels)
+	{
+		_channels = channels;
+		_mask = SEND_RING_FRAMES - 1;
+		_data.assign(channels * SEND_RING_FRAMES, 0.0f);
+		_write = 0;
+		_read = 0;
+		_chunk = 0;
+	}
+
+	size_t Channels() const { return _channels; }
+
+	/*consumer side*/
+	size_t Fill() const
+	{
+		return (size_t)(_write.load(std::memory_order_acquire) -
+				_read.load(std::memory_order_relaxed));
+	}
+
+	/*frames per producer push*/
+	size_t Chunk() const { return _chunk.load(std::memory_order_relaxed); }
+
+	uint64_t ReadPos() const
+	{
+		return _read.load(std::memory_order_relaxed);
+	}
+
+	float At(size_t channel, uint64_t pos) const
+	{
+		return _data[channel * SEND_RING_FRAMES + (pos & _mask)];
+	}
+
+	void Advance(size_t frames)
+	{
+		_read.store(_read.load(std::memory_order_relaxed) + frames,
+			    std::memory_order_release);
+	}
+
+	/*producer side, returns the number of frames that fit*/
+	size_t Push(const float *const *in, size_t frames)
+	{
+		uint64_t w = _write.load(std::memory_order_relaxed);
+		size_t used = (size_t)(w - _read.load(std::memory_order_acquire));
+		size_t n = SEND_RING_FRAMES - used;
+		if (n > frames)
+			n = frames;
+		size_t at = (size_t)(w & _mask);
+		size_t first = SEND_RING_FRAMES - at;
+		if (first > n)
+			first = n;
+		for (size_t c = 0; c < _channels; c++) {
+			float *dst = _data.data() + c * SEND_RING_FRAMES;
+			memcpy(dst + at, in[c], first * sizeof(float));
+			memcpy(dst, in[c] + first, (n - first) * sizeof(float));
+		}
+		_chunk.store(frames, std::memory_order_relaxed);
+		_write.store(w + n, std::memory_order_release);
+		return n;
+	}
+};
+
+static inline float send_hermite(float xm1, float x0, float x1, float x2,
+				 float t)
+{
+	float c = (x1 - xm1) * 0.5f;
+	float v = x0 - x1;
+	float w = c + v;
+	float a = w + v + (x2 - x0) * 0.5f;
+	float b = w + a;
+	return ((a * t - b) * t + c) * t + x0;
+}
+
+class SendTrack {
+	/*Voicemeeter callback only*/
+	double _frac = 0.0;
+	double _error = 0.0;
+	double _integral = 0.0;
+	bool _playing = false;
+	size_t _fade = SEND_FADE_FRAMES;
+	/*underrun fade-out of _held, carried across blocks like _fade*/
+	size_t _tail = SEND_FADE_FRAMES;
+	float _held[MAX_AV_PLANES] = {0};
+
+	/*fills o[from, frames) with the fade-out starting at position k*/
+	static void fadeOut(float *o, size_t from, size_t frames, float held,
+			    size_t k)
+	{
+		for (size_t i = from; i < frames; i++, k++)
+			o[i] = k < SEND_FADE_FRAMES
+				       ? held * (1.0f -
+						 (float)k / SEND_FADE_FRAMES)
+				       : 0.0f;
+	}
+
+public:
+	SendRing ring;
+	int first = -1;
+
+	std::atomic<uint64_t> underruns{0};
+	std::atomic<uint64_t> overruns{0};
+	std::atomic<uint64_t> resyncs{0};
+	std::atomic<double> ppm{0.0};
+	std::atomic<double> fillMs{0.0};
+
+	void Reset(size_t channels, int firstChannel)
+	{
+		ring.Init(channels);
+		first = firstChannel;
+		_frac = 0.0;
+		_error = 0.0;
+		_integral = 0.0;
+		_playing = false;
+		_fade = SEND_FADE_FRAMES;
+		_tail = SEND_FADE_FRAMES;
+		memset(_held, 0, sizeof(_held));
+		underruns = 0;
+		overruns = 0;
+		resyncs = 0;
+		ppm = 0.0;
+		fillMs = 0.0;
+	}
+
+	void Produce(const struct audio_data *frames)
+	{
+		if (ring.Push((const float *const *)frames->data,
+			      frames->frames) < frames->frames)
+			overruns.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/*out holds ring.Channels() pointers, null entries are skipped*/
+	void Render(float *const *out, size_t frames, size_t target,
+		    uint32_t rate)
+	{
+		size_t channels = ring.Channels();
+		size_t fill = ring.Fill();
+		fillMs.store(rate ? fill * 1000.0 / rate : 0.0,
+			     std::memory_order_relaxed);
+
+		/*OBS pushes whole ticks, hold the target on top of one*/
+		size_t setpoint = target + ring.Chunk();
+		if (!_playing) {
+			if (fill < setpoint) {
+				for (size_t c = 0; c < channels; c++) {
+					if (out[c])
+						fadeOut(out[c], 0, frames,
+							_held[c], _tail);
+				}
+				_tail = _tail + frames < SEND_FADE_FRAMES
+						? _tail + frames
+						: SEND_FADE_FRAMES;
+				return;
+			}
+			_playing = true;
+			_frac = 0.0;
+			_fade = 0;
+		}
+		if (fill > 2 * (setpoint + frames)) {
+			ring.Advance(fill - setpoint);
+			fill = setpoint;
+			resyncs.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		/*PI servo on the smoothed fill error in seconds, about a
+		 *minute to settle and critically damped*/
+		double maxRatio = SEND_MAX_PPM / 1e6;
+		double dt = (double)frames / rate;
+		double err = ((double)fill - (double)setpoint) / rate;
+		_error += (dt < 1.0 ? dt : 1.0) * (err - _error);
+		_integral += 0.01 * _error * dt;
+		_integral = _integral > maxRatio
+				    ? maxRatio
+				    : (_integral < -maxRatio ? -maxRatio
+							     : _integral);
+		double adjust = 0.2 * _error + _integral;
+		adjust = adjust > maxRatio
+				 ? maxRatio
+				 : (adjust < -maxRatio ? -maxRatio : adjust);
+		double ratio = 1.0 + adjust;
+		ppm.store(adjust * 1e6, std::memory_order_relaxed);
+
+		/*frame i reads around frac + 1 + i * ratio and needs the
+		 *samples either side of it*/
+		size_t n = frames;
+		if ((size_t)(_frac + 1.0 + (frames - 1) * ratio) + 3 > fill) {
+			double room = (double)fill - 3.0 - _frac - 1.0;
+			n = room < 0.0 ? 0 : (size_t)(room / ratio) + 1;
+			if (n > frames)
+				n = frames;
+		}
+
+		uint64_t base = ring.ReadPos();
+		for (size_t c = 0; c < channels; c++) {
+			float *o = out[c];
+			if (!o)
+				continue;
+			double p = _frac + 1.0;
+			for (size_t i = 0; i < n; i++, p += ratio) {
+				uint64_t idx = base + (uint64_t)p;
+				float t = (float)(p - floor(p));
+				o[i] = send_hermite(ring.At(c, idx - 1),
+						    ring.At(c, idx),
+						    ring.At(c, idx + 1),
+						    ring.At(c, idx + 2), t);
+			}
+			for (size_t i = 0; i < n && _fade + i < SEND_FADE_FRAMES;
+			     i++)
+				o[i] *= (float)(_fade + i) / SEND_FADE_FRAMES;
+			/*a fade-out left over from the last underrun keeps
+			 *going under the fade-in*/
+			for (size_t i = 0; i < n && _tail + i < SEND_FADE_FRAMES;
+			     i++)
+				o[i] += _held[c] *
+					(1.0f - (float)(_tail + i) /
+							SEND_FADE_FRAMES);
+			/*conceal an underrun by fading the last sample out*/
+			if (n < frames) {
+				if (n)
+					_held[c] = o[n - 1];
+				fadeOut(o, n, frames, _held[c], n ? 0 : _tail);
+			}
+		}
+
+		_fade = _fade + n < SEND_FADE_FRAMES ? _fade + n : SEND_FADE_FRAMES;
+		size_t tail = n < frames ? (n ? frames - n : _tail + frames)
+					 : _tail + n;
+		_tail = tail < SEND_FADE_FRAMES ? tail : SEND_FADE_FRAMES;
+
+		double end = _frac + 1.0 + n * ratio;
+		size_t consumed = (size_t)end - 1;
+		_frac = end - floor(end);
+		ring.Advance(consumed);
+
+		if (n < frames) {
+			_playing = false;
+			underruns.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+};
+
+class ObsSend {
+	SendTrack _tracks[MAX_AUDIO_MIXES];
+	size_t _channels = 0;
+	uint32_t _rate = 0;
+	size_t _target = 0;
+	int _stage = -1;
+	std::atomic<bool> _active{false};
+	std::atomic<int> _busy{0};
+
+	bool enter()
+	{
+		_busy.fetch_add(1);
+		if (_active.load())
+			return true;
+		_busy.fetch_sub(1);
+		return false;
+	}
+
+	void leave() { _busy.fetch_sub(1, std::memory_order_release); }
+
+public:
+	obs_output_t *output = nullptr;
+
+	uint32_t Rate() const { return _rate; }
+
+	bool Active() const { return _active.load(); }
+
+	/*call with the output stopped*/
+	size_t Configure(int stage, const std::vector<SendRoute> &routes,
+			 uint32_t rate, uint32_t latencyMs, size_t channels)
+	{
+		Deactivate();
+		_stage = stage;
+		_rate = rate;
+		_channels = channels;
+		_target = (size_t)rate * latencyMs / 1000;
+		size_t mixers = 0;
+		for (size_t t = 0; t < MAX_AUDIO_MIXES; t++)
+			_tracks[t].Reset(channels, -1);
+		for (const SendRoute &r : routes) {
+			if (r.track < 0 || r.track >= MAX_AUDIO_MIXES ||
+			    r.first < 0)
+				continue;
+			_tracks[r.track].first = r.first;
+			mixers |= (size_t)1 << r.track;
+		}
+		return mixers;
+	}
+
+	void Activate() { _active.store(true); }
+
+	/*waits until neither audio thread is inside the send*/
+	void Deactivate()
+	{
+		_active.store(false);
+		while (_busy.load(std::memory_order_acquire))
+			os_sleep_ms(1);
+	}
+
+	/*OBS audio thread*/
+	void Produce(size_t mix, const struct audio_data *frames)
+	{
+		if (mix >= MAX_AUDIO_MIXES || !enter())
+			return;
+		if (_tracks[mix].first >= 0)
+			_tracks[mix].Produce(frames);
+		leave();
+	}
+
+	/*Voicemeeter callback, after the pass-through copy*/
+	void Render(int stage, VBVMR_T_AUDIOBUFFER &buf)
+	{
+		if (stage != _stage || !enter())
+			return;
+		TraceScope trace("ObsSend::Render");
+		if ((uint32_t)buf.audiobuffer_sr != _rate) {
+			/*the output is restarted at the new rate*/
+			leave();
+			return;
+		}
+		float *out[MAX_AV_PLANES];
+		for (size_t t = 0; t < MAX_AUDIO_MIXES; t++) {
+			SendTrack &track = _tracks[t];
+			if (track.first < 0)
+				continue;
+			for (size_t c = 0; c < _channels; c++) {
+				size_t ch = track.first + c;
+				out[c] = ch < (size_t)buf.audiobuffer_nbo
+						 ? buf.audiobuffer_w[ch]
+						 : nullptr;
+			}
+			track.Render(out, buf.audiobuffer_nbs, _target, _rate);
+		}
+		leave();
+	}
+
+	std::string Describe()
+	{
+		std::memory_order relaxed = std::memory_order_relaxed;
+		std::string text;
+		char line[192];
+		for (size_t t = 0; t < MAX_AUDIO_MIXES; t++) {
+			SendTrack &track = _tracks[t];
+			if (track.first < 0)
+				continue;
+			snprintf(line, sizeof(line),
+				 "%strack %u -> %d-%d: fill %.1f ms, drift %.1f ppm, %llu underruns, %llu overruns, %llu resyncs",
+				 text.empty() ? "" : "; ", (unsigned)t + 1,
+				 track.first,
+				 track.first + (int)_channels - 1,
+				 track.fillMs.load(relaxed),
+				 track.ppm.load(relaxed),
+				 (unsigned long long)track.underruns.load(
+					 relaxed),
+				 (unsigned long long)track.overruns.load(
+					 relaxed),
+				 (unsigned long long)track.resyncs.load(
+					 relaxed));
+			text += line;
+		}
+		return text.empty() ? "no tracks routed" : text;
+	}
+};
+
+/*one "Send to Voicemeeter" filter*/
+class SendFilter {
+	audio_resampler_t *_resampler = nullptr;
+	std::atomic<bool> _open{false};
+	std::atomic<int> _producing{0};
+
+public:
+	obs_source_t *source = nullptr;
+	SendTrack track;
+	std::atomic<int> stage{-1};
+	uint32_t rate = 0;
+	size_t target = 0;
+
+	~SendFilter() { audio_resampler_destroy(_resampler); }
+
+	/*UI thread, with the filter out of the Voicemeeter callback*/
+	void Configure(int newStage, int first, uint32_t latencyMs,
+		       uint32_t vmRate)
+	{
+		_open.store(false);
+		while (_producing.load(std::memory_order_acquire))
+			os_sleep_ms(1);
+		audio_resampler_destroy(_resampler);
+		_resampler = nullptr;
+
+		obs_audio_info aoi;
+		obs_get_audio_info(&aoi);
+		track.Reset(get_audio_channels(aoi.speakers), first);
+		rate = vmRate;
+		target = (size_t)vmRate * latencyMs / 1000;
+		if (!vmRate || first < 0)
+			return;
+		if (aoi.samples_per_sec != vmRate) {
+			struct resample_info src = {aoi.samples_per_sec,
+						    AUDIO_FORMAT_FLOAT_PLANAR,
+						    aoi.speakers};
+			struct resample_info dst = {vmRate,
+						    AUDIO_FORMAT_FLOAT_PLANAR,
+						    aoi.speakers};
+			_resampler = audio_resampler_create(&dst, &src);
+			if (!_resampler)
+				return;
+		}
+		stage.store(newStage);
+		_open.store(true);
+	}
+
+	/*OBS audio thread*/
+	void Produce(const struct obs_audio_data *audio)
+	{
+		_producing.fetch_add(1);
+		if (!_open.load()) {
+			_producing.fetch_sub(1);
+			return;
+		}
+		struct audio_data frames = {};
+		frames.frames = audio->frames;
+		for (size_t c = 0; c < MAX_AV_PLANES; c++)
+			frames.data[c] = audio->data[c];
+		uint64_t offset;
+		if (!_resampler ||
+		    audio_resampler_resample(_resampler, frames.data,
+					     &frames.frames, &offset,
+					     (const uint8_t *const *)audio->data,
+					     audio->frames))
+			track.Produce(&frames);
+		_producing.fetch_sub(1, std::memory_order_release);
+	}
+};
+
+class SendFilters {
+	std::atomic<SendFilter *> _slots[SEND_MAX_FILTERS];
+	std::atomic<int> _busy{0};
+	/*per stage, Voicemeeter callback only*/
+	std::vector<float> _scratch[2];
+
+public:
+	SendFilters()
+	{
+		for (size_t i = 0; i < SEND_MAX_FILTERS; i++)
+			_slots[i] = nullptr;
+		for (size_t i = 0; i < 2; i++)
+			_scratch[i].resize(MAX_AV_PLANES * SEND_MAX_FRAMES);
+	}
+
+	bool Add(SendFilter *filter)
+	{
+		for (size_t i = 0; i < SEND_MAX_FILTERS; i++) {
+			SendFilter *empty = nullptr;
+			if (_slots[i].compare_exchange_strong(empty, filter))
+				return true;
+		}
+		return false;
+	}
+
+	/*waits for any callback that may still see the filter*/
+	void Remove(SendFilter *filter)
+	{
+		for (size_t i = 0; i < SEND_MAX_FILTERS; i++) {
+			SendFilter *f = filter;
+			_slots[i].compare_exchange_strong(f, nullptr);
+		}
+		Quiesce();
+	}
+
+	void Quiesce()
+	{
+		while (_busy.load(std::memory_order_acquire))
+			os_sleep_ms(1);
+	}
+
+	/*takes a filter out of the callback, then reconfigures it*/
+	void Configure(SendFilter *filter, int stage, int first,
+		       uint32_t latencyMs, uint32_t vmRate)
+	{
+		filter->stage.store(-1);
+		Quiesce();
+		filter->Configure(stage, first, latencyMs, vmRate);
+	}
+
+	template<class F> void Each(F fn)
+	{
+		for (size_t i = 0; i < SEND_MAX_FILTERS; i++) {
+			SendFilter *f = _slots[i].load();
+			if (f)
+				fn(f);
+		}
+	}
+
+	/*Voicemeeter callback, sums every filter of the stage*/
+	void Render(int stage, VBVMR_T_AUDIOBUFFER &buf)
+	{
+		size_t frames = buf.audiobuffer_nbs;
+		if (stage < 0 || stage > 1 || frames > SEND_MAX_FRAMES)
+			return;
+		_busy.fetch_add(1);
+		float *scratch = _scratch[stage].data();
+		float *out[MAX_AV_PLANES];
+		for (size_t c = 0; c < MAX_AV_PLANES; c++)
+			out[c] = scratch + c * SEND_MAX_FRAMES;
+		for (size_t i = 0; i < SEND_MAX_FILTERS; i++) {
+			SendFilter *f = _slots[i].load();
+			if (!f || f->stage.load() != stage)
+				continue;
+			if ((uint32_t)buf.audiobuffer_sr != f->rate)
+				continue;
+			SendTrack &track = f->track;
+			track.Render(out, frames, f->target, f->rate);
+			for (size_t c = 0; c < track.ring.Channels(); c++) {
+				size_t ch = track.first + c;
+				if (ch < (size_t)buf.audiobuffer_nbo)
+					pcm_mix_f32(buf.audiobuffer_w[ch],
+						    out[c], frames);
+			}
+		}
+		_busy.fetch_sub(1, std::memory_order_release);
+	}
+};
@@ -4,16 +4,42 @@
 
 #include <media-io/audio-math.h>
 #include <math.h>
+#include <functional>
+#include <memory>
+#include <unordered_map>
 
 #include <windows.h>
 #include "circle-buffer.h"
+#include "source-stats.h"
+#include "iso-recorder.h"
+#include "replay-buffer.h"
+#include "shm-export.h"
+#include "pipe-tap.h"
+#include "obs-send.h"
+#include "resampler.h"
+#include "vm-layouts.h"
+#include "vm-params.h"
+#include "vm-automation.h"
+#include "vm-midi.h"
+#include "vm-meters.h"
+#include "vm-loudness.h"
+#include "vm-spectrum.h"
+#include "vm-vad.h"
+#include "vm-delay.h"
 #include "VoicemeeterRemote.h"
 
+#include <QComboBox>
+#include <QDockWidget>
+#include <QGridLayout>
+#include <QInputDialog>
+#include <QLabel>
 #include <QMainWindow>
 #include <QMenu>
 #include <QString>
 #include <QMenuBar>
+#include <QPainter>
 #include <QTimer>
+#include <QVBoxLayout>
 
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE("obs-voicemeeter", "en-US")
@@ -58,9 +84,15 @@ enum voicemeeter_type {
 enum voicemeeter_hook {
 	voicemeeter_insert_in = 0,
 	voicemeeter_insert_out,
-	voicemeeter_main
+	voicemeeter_main,
+	/*sources only, routes pick a channel of any stage*/
+	voicemeeter_cross
 };
 
+/*cross-stage routes are stage << CROSS_STAGE_SHIFT | channel*/
+#define CROSS_STAGE_SHIFT 8
+#define CROSS_CHANNEL_MASK 0xff
+
 static char uninstDirKey[] =
 	"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Uninstall";
 
@@ -69,12 +101,65 @@ static char uninstDirKey[] =
 struct VBVMR_T_AUDIOBUFFER_TS {
 	VBVMR_T_AUDIOBUFFER data;
 	uint64_t ts;
+	/*callbacks of one Voicemeeter processing cycle share this*/
+	uint64_t cycle;
+	/*channel storage of a stage ring slot, see copyToBuffer*/
+	long allocated;
+	long capacity;
 };
 
 static StreamableBuffer<VBVMR_T_AUDIOBUFFER_TS> OBSBufferInsertIn;
 static StreamableBuffer<VBVMR_T_AUDIOBUFFER_TS> OBSBufferInsertOut;
 static StreamableBuffer<VBVMR_T_AUDIOBUFFER_TS> OBSBufferMain;
 
+static ObsSend obsSend;
+static SendFilters sendFilters;
+static std::atomic<uint32_t> vmSampleRate{0};
+static void send_restart(void *);
+static void route_plans_follow_rate(void *);
+
+static StreamableBuffer<VBVMR_T_AUDIOBUFFER_TS> *stageBuffer(int stage)
+{
+	switch (stage) {
+	case voicemeeter_insert_in:
+		return &OBSBufferInsertIn;
+	case voicemeeter_insert_out:
+		return &OBSBufferInsertOut;
+	case voicemeeter_main:
+		return &OBSBufferMain;
+	default:
+		return nullptr;
+	}
+}
+
+/*sources read these when the rates differ, each stage converted to the
+ *OBS rate once*/
+static StageResampler<VBVMR_T_AUDIOBUFFER_TS> stageResamplers[3];
+
+static uint32_t obsSampleRate()
+{
+	obs_audio_info aoi;
+	obs_get_audio_info(&aoi);
+	return aoi.samples_per_sec;
+}
+
+/*until Voicemeeter reports its rate it is taken to match*/
+static bool stagesNeedResampling()
+{
+	uint32_t rate = vmSampleRate;
+	return rate && rate != obsSampleRate();
+}
+
+static StageResampler<VBVMR_T_AUDIOBUFFER_TS> *stageResampler(int stage)
+{
+	static const char *names[] = {"insert in", "insert out", "main"};
+	StreamableBuffer<VBVMR_T_AUDIOBUFFER_TS> *buffer = stageBuffer(stage);
+	if (!buffer)
+		return nullptr;
+	stageResamplers[stage].Start(buffer, names[stage], obsSampleRate());
+	return &stageResamplers[stage];
+}
+
 void RemoveNameInPath(char *szPath)
 {
 	long ll;
@@ -151,134 +236,131 @@ struct version32_t {
 };
 static version32_t version = {0};
 static long vb_type;
-static std::vector<int32_t> validInputs = {0, 12, 22, 34};
-static std::vector<int32_t> validOutputs = {0, 16, 40, 64};
-static std::vector<int32_t> validMains = {0, 28, 62, 98};
-
-typedef std::pair<speaker_layout, std::string> vb_layout;
-typedef std::pair<speaker_layout, std::vector<std::string>> channel_layout;
-typedef std::pair<int, std::string> vb_layout_map;
+static constexpr int32_t validInputs[] = {0, vm_tables[1][0].count,
+					  vm_tables[2][0].count,
+					  vm_tables[3][0].count};
+static constexpr int32_t validOutputs[] = {0, vm_tables[1][1].count,
+					   vm_tables[2][1].count,
+					   vm_tables[3][1].count};
+static constexpr int32_t validMains[] = {0, vm_tables[1][2].count,
+					 vm_tables[2][2].count,
+					 vm_tables[3][2].count};
+
+struct channel_entry {
+	std::string label;
+	int value;
+	/*strip or bus of the channel, -1 for Mute*/
+	bool bus;
+	int index;
+	/*label with the name given in Voicemeeter, see namedEntries*/
+	std::string named;
+};
 
-static std::vector<vb_layout> inputLayouts[4] = {
-	{
-		/*Unknown*/
-	},
-	{
-		{SPEAKERS_STEREO, "Strip 1"},
-		{SPEAKERS_STEREO, "Strip 2"},
-		{SPEAKERS_7POINT1, "Virtual Input"},
-	},
-	{
-		{SPEAKERS_STEREO, "Strip 1"},
-		{SPEAKERS_STEREO, "Strip 2"},
-		{SPEAKERS_STEREO, "Strip 3"},
-		{SPEAKERS_7POINT1, "Virtual Input"},
-		{SPEAKERS_7POINT1, "Virtual Input (AUX)"},
-	},
-	{
-		{SPEAKERS_STEREO, "Strip 1"},
-		{SPEAKERS_STEREO, "Strip 2"},
-		{SPEAKERS_STEREO, "Strip 3"},
-		{SPEAKERS_STEREO, "Strip 4"},
-		{SPEAKERS_STEREO, "Strip 5"},
-		{SPEAKERS_7POINT1, "Virtual Input"},
-		{SPEAKERS_7POINT1, "Virtual Input (AUX)"},
-		{SPEAKERS_7POINT1, "Virtual Input 8"},
-	}};
-
-static std::vector<vb_layout> outputLayouts[4] = {
-	{
-		/*Unknown*/
-	},
-	{
-		{SPEAKERS_7POINT1, "Output A1 / A2"},
-		{SPEAKERS_7POINT1, "Virtual Output"},
-	},
-	{
-		{SPEAKERS_7POINT1, "Output A1"},
-		{SPEAKERS_7POINT1, "Output A2"},
-		{SPEAKERS_7POINT1, "Output A3"},
-		{SPEAKERS_7POINT1, "Virtual Output B1"},
-		{SPEAKERS_7POINT1, "Virtual Output B2"},
-	},
-	{
-		{SPEAKERS_7POINT1, "Output A1"},
-		{SPEAKERS_7POINT1, "Output A2"},
-		{SPEAKERS_7POINT1, "Output A3"},
-		{SPEAKERS_7POINT1, "Output A4"},
-		{SPEAKERS_7POINT1, "Output A5"},
-		{SPEAKERS_7POINT1, "Virtual Output B1"},
-		{SPEAKERS_7POINT1, "Virtual Output B2"},
-		{SPEAKERS_7POINT1, "Virtual Output B3"},
-	}};
-static std::vector<vb_layout> mainLayouts[4] = {};
-
-static std::vector<channel_layout> channelLayouts = {
-	{SPEAKERS_STEREO, {"(L)", "(R)"}},
-	{SPEAKERS_7POINT1,
-	 {"(L)", "(R)", "(C)", "(LFE)", "(SL)", "(SR)", "(BL)", "(BR)"}},
+/*route list entries per type and stage (cross-stage last), Mute first,
+ *built once at load*/
+static std::vector<channel_entry> channelEntries[4][4];
+/*parameter text generation the named labels were built for*/
+static uint64_t channelNamesBuilt[4][4];
+/*set when Voicemeeter reports a change, see dialogType*/
+static std::atomic<bool> vbTypeStale{true};
+
+/*cached parameter handles of the running edition, -1 when unused*/
+struct vm_strip_params {
+	std::atomic<int> label{-1};
+	std::atomic<int> gain{-1};
+	std::atomic<int> mute{-1};
+	/*strips only, A1.. then B1..*/
+	std::atomic<int> bus[VM_MAX_BUSES] = {-1, -1, -1, -1, -1, -1, -1, -1};
 };
-/*mainLayouts is made by appending outputLayouts to inputLayouts*/
 
-static std::vector<vb_layout_map> inputMap[4];
-static std::vector<vb_layout_map> outputMap[4];
-static std::vector<vb_layout_map> mainMap[4];
+static VmParamCache vmParams;
+static VmParamWriter vmWriter;
+static vm_strip_params stripParams[VM_MAX_STRIPS];
+static vm_strip_params busParams[VM_MAX_BUSES];
+static void vm_params_apply();
+static void loudness_apply();
+
+/*UI thread, features that depend on the Voicemeeter type follow it*/
+static void vm_type_changed(void *)
+{
+	vm_params_apply();
+	loudness_apply();
+}
+
+static VmMeter stageMeters[3];
+/*stage ring channels that became too small. Cross-stage readers may
+ *still be copying from them, so they are freed at unload only*/
+static std::vector<float *> stageRetired[3];
 
+/*levels are measured during the copy, while the block is in cache*/
 static void copyToBuffer(VBVMR_T_AUDIOBUFFER_TS &buf,
-			 VBVMR_T_AUDIOBUFFER_TS &out, bool used)
+			 VBVMR_T_AUDIOBUFFER_TS &out, bool used, int stage)
 {
-	size_t bufSize = buf.data.audiobuffer_nbs * sizeof(float);
-	if (used) {
-		size_t oldBufSize = out.data.audiobuffer_nbs * sizeof(float);
-		if (bufSize > oldBufSize) {
-			for (int i = 0; i < buf.data.audiobuffer_nbi; i++) {
-				bfree(out.data.audiobuffer_r[i]);
-				out.data.audiobuffer_r[i] = (float *)bmemdup(
-					buf.data.audiobuffer_r[i], bufSize);
-			}
-		} else {
-			for (int i = 0; i < buf.data.audiobuffer_nbi; i++)
-				memcpy(out.data.audiobuffer_r[i],
-				       buf.data.audiobuffer_r[i], bufSize);
+	int frames = buf.data.audiobuffer_nbs;
+	int channels = buf.data.audiobuffer_nbi;
+	UNUSED_PARAMETER(used);
+	if (frames > out.capacity) {
+		for (long i = 0; i < out.allocated; i++)
+			stageRetired[stage].push_back(
+				out.data.audiobuffer_r[i]);
+		out.allocated = 0;
+		out.capacity = frames;
+	}
+	for (; out.allocated < channels; out.allocated++)
+		out.data.audiobuffer_r[out.allocated] =
+			(float *)bmalloc(out.capacity * sizeof(float));
+	float peaks[VM_METER_MAX_CHANNELS];
+	float squares[VM_METER_MAX_CHANNELS];
+	for (int i = 0; i < channels; i++) {
+		float peak, sumSq;
+		pcm_copy_level_f32(out.data.audiobuffer_r[i],
+				   buf.data.audiobuffer_r[i], frames, &peak,
+				   &sumSq);
+		if (i < VM_METER_MAX_CHANNELS) {
+			peaks[i] = peak;
+			squares[i] = sumSq;
 		}
-	} else {
-		for (int i = 0; i < buf.data.audiobuffer_nbi; i++)
-			out.data.audiobuffer_r[i] = (float *)bmemdup(
-				buf.data.audiobuffer_r[i], bufSize);
 	}
+	stageMeters[stage].Publish(peaks, squares, channels, frames, buf.ts,
+				   buf.cycle);
 	out.data.audiobuffer_nbi = buf.data.audiobuffer_nbi;
 	out.data.audiobuffer_nbo = buf.data.audiobuffer_nbo;
 	out.data.audiobuffer_nbs = buf.data.audiobuffer_nbs;
 	out.data.audiobuffer_sr = buf.data.audiobuffer_sr;
 	out.ts = buf.ts;
+	out.cycle = buf.cycle;
 }
 
 static void writeInsertAudio(VBVMR_T_AUDIOBUFFER_TS &buf,
 			     VBVMR_T_AUDIOBUFFER_TS &out, bool used)
 {
-	copyToBuffer(buf, out, used);
+	copyToBuffer(buf, out, used, voicemeeter_insert_in);
 	size_t bufSize = buf.data.audiobuffer_nbs * sizeof(float);
 	/*pass-through*/
 	for (int i = 0; i < validInputs[vb_type]; i++)
 		memcpy(buf.data.audiobuffer_w[i], buf.data.audiobuffer_r[i],
 		       bufSize);
+	obsSend.Render(voicemeeter_insert_in, buf.data);
+	sendFilters.Render(voicemeeter_insert_in, buf.data);
 }
 
 static void writeInsertOutAudio(VBVMR_T_AUDIOBUFFER_TS &buf,
 				VBVMR_T_AUDIOBUFFER_TS &out, bool used)
 {
-	copyToBuffer(buf, out, used);
+	copyToBuffer(buf, out, used, voicemeeter_insert_out);
 	size_t bufSize = buf.data.audiobuffer_nbs * sizeof(float);
 	/*pass-through*/
 	for (int i = 0; i < validOutputs[vb_type]; i++)
 		memcpy(buf.data.audiobuffer_w[i], buf.data.audiobuffer_r[i],
 		       bufSize);
+	obsSend.Render(voicemeeter_insert_out, buf.data);
+	sendFilters.Render(voicemeeter_insert_out, buf.data);
 }
 
 static void writeMainAudio(VBVMR_T_AUDIOBUFFER_TS &buf,
 			   VBVMR_T_AUDIOBUFFER_TS &out, bool used)
 {
-	copyToBuffer(buf, out, used);
+	copyToBuffer(buf, out, used, voicemeeter_main);
 	size_t bufSize = buf.data.audiobuffer_nbs * sizeof(float);
 	/*pass-through*/
 	for (int i = 0; i < validOutputs[vb_type]; i++)
@@ -295,40 +377,94 @@ int vm_register();
 int vm_unregister();
 int vm_launch();
 
+static const char *callbackTraceName(long nCommand)
+{
+	switch (nCommand) {
+	case VBVMR_CBCOMMAND_STARTING:
+		return "audioCallback STARTING";
+	case VBVMR_CBCOMMAND_CHANGE:
+		return "audioCallback CHANGE";
+	case VBVMR_CBCOMMAND_ENDING:
+		return "audioCallback ENDING";
+	case VBVMR_CBCOMMAND_BUFFER_IN:
+		return "audioCallback BUFFER_IN";
+	case VBVMR_CBCOMMAND_BUFFER_OUT:
+		return "audioCallback BUFFER_OUT";
+	case VBVMR_CBCOMMAND_BUFFER_MAIN:
+		return "audioCallback BUFFER_MAIN";
+	default:
+		return "audioCallback";
+	}
+}
+
+/*
+ * Voicemeeter processes a cycle as input insert, output insert, main. A
+ * stage that does not come after the previous one starts the next cycle,
+ * so a cycle missing a stage still gets its own id.
+ */
+static uint64_t vmCycle = 0;
+static int vmCycleStage = voicemeeter_main;
+
+static uint64_t nextCycle(int stage)
+{
+	if (stage <= vmCycleStage)
+		vmCycle++;
+	vmCycleStage = stage;
+	return vmCycle;
+}
+
 static long audioCallback(void *lpUser, long nCommand, void *lpData, long nnn)
 {
 	uint64_t tStamp = os_gettime_ns();
 	VBVMR_T_AUDIOBUFFER_TS audioBuf;
+	TraceScope trace(callbackTraceName(nCommand));
 
 	switch (nCommand) {
-	case VBVMR_CBCOMMAND_STARTING:
+	case VBVMR_CBCOMMAND_STARTING: {
 		/*update the application version (in case user opens alternate version)*/
 		iVMR.VBVMR_GetVoicemeeterType(&vb_type);
+		vbTypeStale = false;
+		uint32_t rate = ((VBVMR_LPT_AUDIOINFO)lpData)->samplerate;
+		/*sources read the stages directly at equal rates*/
+		if (vmSampleRate.exchange(rate) != rate)
+			obs_queue_task(OBS_TASK_UI, route_plans_follow_rate,
+				       nullptr, false);
+		/*the send output converts to the Voicemeeter rate*/
+		if (obsSend.Rate() != rate)
+			obs_queue_task(OBS_TASK_UI, send_restart, nullptr,
+				       false);
 		break;
+	}
 	case VBVMR_CBCOMMAND_CHANGE:
 		iVMR.VBVMR_GetVoicemeeterType(&vb_type);
+		vbTypeStale = true;
+		obs_queue_task(OBS_TASK_UI, vm_type_changed, nullptr, false);
 		QTimer::singleShot(100, []() {
 			vm_stop();
 			vm_start();
 		});
 		break;
 	case VBVMR_CBCOMMAND_ENDING:
+		vbTypeStale = true;
 		UNUSED_PARAMETER(lpUser);
 		UNUSED_PARAMETER(nnn);
 		break;
 	case VBVMR_CBCOMMAND_BUFFER_IN:
 		audioBuf.data = *((VBVMR_LPT_AUDIOBUFFER)lpData);
 		audioBuf.ts = tStamp;
+		audioBuf.cycle = nextCycle(voicemeeter_insert_in);
 		OBSBufferInsertIn.Write(audioBuf, writeInsertAudio);
 		break;
 	case VBVMR_CBCOMMAND_BUFFER_OUT:
 		audioBuf.data = *((VBVMR_LPT_AUDIOBUFFER)lpData);
 		audioBuf.ts = tStamp;
+		audioBuf.cycle = nextCycle(voicemeeter_insert_out);
 		OBSBufferInsertOut.Write(audioBuf, writeInsertOutAudio);
 		break;
 	case VBVMR_CBCOMMAND_BUFFER_MAIN:
 		audioBuf.data = *((VBVMR_LPT_AUDIOBUFFER)lpData);
 		audioBuf.ts = tStamp;
+		audioBuf.cycle = nextCycle(voicemeeter_main);
 		OBSBufferMain.Write(audioBuf, writeMainAudio);
 		break;
 	}
@@ -510,6 +646,8 @@ int vm_info()
 		     version.v4, version.v3, version.v2, version.v1);
 		break;
 	}
+	vm_params_apply();
+	loudness_apply();
 	return ret;
 }
 
@@ -547,124 +685,172 @@ int vm_deviceinfo()
 	return num;
 }
 
-static void makeMainLayout(int mode)
+static void makeChannelEntries()
 {
-	std::vector<vb_layout> main;
-	main.reserve(inputLayouts[mode].size() + outputLayouts[mode].size());
-	main.insert(main.end(), inputLayouts[mode].begin(),
-		    inputLayouts[mode].end());
-	main.insert(main.end(), outputLayouts[mode].begin(),
-		    outputLayouts[mode].end());
-	mainLayouts[mode] = main;
+	static const char *prefixes[] = {"Insert.Input", "Insert.Output",
+					  "Main"};
+	channel_entry mute = {obs_module_text("Mute"), -1, false, -1};
+	for (int type = 0; type < 4; type++) {
+		std::vector<channel_entry> &cross =
+			channelEntries[type][voicemeeter_cross];
+		cross.assign(1, mute);
+		for (int stage = 0; stage < 3; stage++) {
+			const vm_stage_table &t = vm_tables[type][stage];
+			std::vector<channel_entry> &entries =
+				channelEntries[type][stage];
+			std::string prefix = obs_module_text(prefixes[stage]);
+			entries.assign(1, mute);
+			for (int i = 0; i < t.count; i++) {
+				std::string label = std::to_string(i) + ": " +
+						    t.channels[i].strip + " " +
+						    t.channels[i].sub;
+				int tagged = stage << CROSS_STAGE_SHIFT | i;
+				bool bus = stage == voicemeeter_insert_out ||
+					   (stage == voicemeeter_main &&
+					    i >= validInputs[type]);
+				int index = t.channels[i].index;
+				cross.push_back(
+					{prefix + " " + label, tagged, bus, index});
+				entries.push_back({label, i, bus, index});
+			}
+		}
+	}
 }
 
-static void makeMap(int mode)
+/*the Voicemeeter type for property lists, the DLL is only asked again
+ *after Voicemeeter reported a change (or could not be asked)*/
+static long dialogType()
 {
-	int channel = -1;
-
-	for (size_t i = 0; i < inputLayouts[mode].size(); i++) {
-		channel += get_audio_channels(inputLayouts[mode][i].first);
-		inputMap[mode].push_back(
-			{channel, inputLayouts[mode][i].second});
+	if (vbTypeStale.exchange(false)) {
+		long type = 0;
+		if (iVMR.VBVMR_GetVoicemeeterType(&type) != 0) {
+			vbTypeStale = true;
+			type = 0;
+		}
+		vb_type = type;
 	}
+	return vb_type >= 0 && vb_type <= 3 ? vb_type : 0;
+}
 
-	channel = -1;
-	for (size_t i = 0; i < outputLayouts[mode].size(); i++) {
-		channel += get_audio_channels(outputLayouts[mode][i].first);
-		outputMap[mode].push_back(
-			{channel, outputLayouts[mode][i].second});
-	}
+static void vm_param_set(std::atomic<int> &slot, bool used,
+			 const std::string &name, vm_param_kind kind)
+{
+	int handle = used ? vmParams.Subscribe(name.c_str(), kind) : -1;
+	vmParams.Unsubscribe(slot.exchange(handle));
+}
 
-	channel = -1;
-	for (size_t i = 0; i < inputLayouts[mode].size(); i++) {
-		channel += get_audio_channels(inputLayouts[mode][i].first);
-		mainMap[mode].push_back(
-			{channel, inputLayouts[mode][i].second});
+/*subscribes the strips and buses of the running edition, new handles are
+ *taken before the old ones are dropped so shared names stay cached*/
+static void vm_params_apply()
+{
+	long type = vb_type >= 0 && vb_type <= 3 ? vb_type : 0;
+	for (int i = 0; i < VM_MAX_STRIPS; i++) {
+		vm_strip_params &p = stripParams[i];
+		bool used = i < vm_strip_count[type];
+		std::string base = "Strip[" + std::to_string(i) + "].";
+		vm_param_set(p.label, used, base + "Label", vm_param_string);
+		vm_param_set(p.gain, used, base + "Gain", vm_param_float);
+		vm_param_set(p.mute, used, base + "Mute", vm_param_float);
+		for (int b = 0; b < VM_MAX_BUSES; b++) {
+			int a = vm_bus_a[type];
+			std::string bus = b < a ? "A" + std::to_string(b + 1)
+						: "B" + std::to_string(b - a + 1);
+			vm_param_set(p.bus[b], used && b < vm_bus_count[type],
+				     base + bus, vm_param_float);
+		}
 	}
-	for (size_t i = 0; i < outputLayouts[mode].size(); i++) {
-		channel += get_audio_channels(outputLayouts[mode][i].first);
-		mainMap[mode].push_back(
-			{channel, outputLayouts[mode][i].second});
+	for (int i = 0; i < VM_MAX_BUSES; i++) {
+		vm_strip_params &p = busParams[i];
+		bool used = i < vm_bus_count[type];
+		std::string base = "Bus[" + std::to_string(i) + "].";
+		vm_param_set(p.label, used, base + "Label", vm_param_string);
+		vm_param_set(p.gain, used, base + "Gain", vm_param_float);
+		vm_param_set(p.mute, used, base + "Mute", vm_param_float);
 	}
+}
 
-	return;
+/*the label given to a strip or bus in Voicemeeter, false if it has none*/
+static bool vm_label(bool bus, int index, char *out, size_t size)
+{
+	if (index < 0 || index >= (bus ? VM_MAX_BUSES : VM_MAX_STRIPS))
+		return false;
+	vm_strip_params &p = bus ? busParams[index] : stripParams[index];
+	return vmParams.String(p.label, out, size) && *out;
 }
 
-static std::string getChannelName(int index, int mode)
+/*UI thread, entries with their named labels, rebuilt only once the
+ *parameter cache has seen a name change*/
+static const std::vector<channel_entry> &namedEntries(long type, int stage)
 {
-	std::vector<vb_layout_map>::iterator it;
-	std::vector<std::string> channels;
-	std::string c = "";
-	ptrdiff_t idx;
-	int layout;
-	int count;
-	int offset;
-	vb_layout_map search = {index, ""};
-	switch (mode) {
-	case voicemeeter_insert_in:
-		it = std::lower_bound(
-			inputMap[vb_type].begin(), inputMap[vb_type].end(),
-			search, [](vb_layout_map left, vb_layout_map right) {
-				return left.first < right.first;
-			});
-		if (it == inputMap[vb_type].end())
-			return "";
-		idx = std::distance(inputMap[vb_type].begin(), it);
-		layout = inputLayouts[vb_type][idx].first;
-		count = get_audio_channels((speaker_layout)layout);
-		offset = (count - 1) - abs(it->first - index);
-		for (size_t i = 0; i < channelLayouts.size(); i++) {
-			if (channelLayouts[i].first == layout) {
-				channels = channelLayouts[i].second;
-				break;
-			}
-		}
-		c = channels[offset];
-		return it->second + " " + c;
-	case voicemeeter_insert_out:
-		it = std::lower_bound(
-			outputMap[vb_type].begin(), outputMap[vb_type].end(),
-			search, [](vb_layout_map left, vb_layout_map right) {
-				return left.first < right.first;
-			});
-		if (it == outputMap[vb_type].end())
-			return "";
-		idx = std::distance(outputMap[vb_type].begin(), it);
-		layout = outputLayouts[vb_type][idx].first;
-		count = get_audio_channels((speaker_layout)layout);
-		offset = (count - 1) - abs(it->first - index);
-		for (size_t i = 0; i < channelLayouts.size(); i++) {
-			if (channelLayouts[i].first == layout) {
-				channels = channelLayouts[i].second;
-				break;
-			}
+	std::vector<channel_entry> &entries = channelEntries[type][stage];
+	uint64_t generation = vmParams.TextGeneration();
+	if (channelNamesBuilt[type][stage] == generation)
+		return entries;
+	channelNamesBuilt[type][stage] = generation;
+	char name[VM_PARAM_TEXT];
+	for (channel_entry &e : entries) {
+		if (vm_label(e.bus, e.index, name, sizeof(name)))
+			e.named = e.label + " - " + name;
+		else
+			e.named = e.label;
+	}
+	return entries;
+}
+
+static void vm_params_log()
+{
+	long type = vb_type >= 0 && vb_type <= 3 ? vb_type : 0;
+	char label[VM_PARAM_TEXT];
+	for (int i = 0; i < vm_strip_count[type] + vm_bus_count[type]; i++) {
+		bool bus = i >= vm_strip_count[type];
+		int index = bus ? i - vm_strip_count[type] : i;
+		vm_strip_params &p = bus ? busParams[index] : stripParams[index];
+		float gain, mute;
+		if (!vmParams.Float(p.gain, gain) ||
+		    !vmParams.Float(p.mute, mute))
+			continue;
+		std::string routes;
+		for (int b = 0; b < VM_MAX_BUSES; b++) {
+			float on;
+			if (vmParams.Float(p.bus[b], on) && on != 0.0f)
+				routes += " " + std::to_string(b);
 		}
-		c = channels[offset];
-		return it->second + " " + c;
-	case voicemeeter_main:
-		it = std::lower_bound(
-			mainMap[vb_type].begin(), mainMap[vb_type].end(),
-			search, [](vb_layout_map left, vb_layout_map right) {
-				return left.first < right.first;
-			});
-		if (it == mainMap[vb_type].end())
-			return "";
-		idx = std::distance(outputMap[vb_type].begin(), it);
-		layout = mainLayouts[vb_type][idx].first;
-		count = get_audio_channels((speaker_layout)layout);
-		offset = (count - 1) - abs(it->first - index);
-		for (size_t i = 0; i < channelLayouts.size(); i++) {
-			if (channelLayouts[i].first == layout) {
-				channels = channelLayouts[i].second;
-				break;
-			}
+		blog(LOG_INFO, "%s %d \"%s\": %.1f dB%s, buses:%s",
+		     bus ? "bus" : "strip", index,
+		     vm_label(bus, index, label, sizeof(label)) ? label : "",
+		     gain, mute != 0.0f ? " (muted)" : "",
+		     routes.empty() ? " -" : routes.c_str());
+	}
+	blog(LOG_INFO, "parameter cache: %s", vmParams.Stats().c_str());
+	blog(LOG_INFO, "parameter writer: %s", vmWriter.Stats().c_str());
+}
+
+static void vm_levels_log()
+{
+	static const char *stages[] = {"insert (input)", "insert (output)",
+				       "main"};
+	long type = dialogType();
+	for (int stage = 0; stage < 3; stage++) {
+		VmMeterSnapshot snap;
+		if (!stageMeters[stage].Read(snap))
+			continue;
+		blog(LOG_INFO, "%s levels, cycle %llu:", stages[stage],
+		     (unsigned long long)snap.cycle);
+		const std::vector<channel_entry> &entries =
+			channelEntries[type][stage];
+		for (int i = 0; i < snap.channels; i++) {
+			const VmMeterChannel &c = snap.levels[i];
+			/*entries start with Mute*/
+			const char *name = i + 1 < (int)entries.size()
+						   ? entries[i + 1].label.c_str()
+						   : "";
+			blog(LOG_INFO,
+			     "  %-32s peak %6.1f dB, rms %6.1f dB, "
+			     "hold %6.1f dB, %u clips",
+			     name, vm_meter_db(c.peak), vm_meter_db(c.rms),
+			     vm_meter_db(c.hold), c.clips);
 		}
-		c = channels[offset];
-		return it->second + " " + c;
-	default:
-		break;
 	}
-	return "";
 }
 
 static long InitializeDLLInterfaces(void)
@@ -829,15 +1015,563 @@ static long InitializeDLLInterfaces(void)
 
 static int voicemeeter_channel_count;
 
-class vi_data : public StreamableReader<VBVMR_T_AUDIOBUFFER_TS> {
+/*
+ * Everything a source does with a block that depends only on its settings,
+ * stage, layout, routes and drift compensation. Sources with identical
+ * settings share one plan: one reader thread gathers (and resamples) the
+ * block once, then hands it to each source's obs_source_output_audio.
+ */
+struct RoutePlanKey {
+	int stage = -1;
+	enum speaker_layout layout = SPEAKERS_UNKNOWN;
+	bool asrc = false;
+	/*only the routes the layout uses, the rest are -1*/
+	int16_t route[MAX_AV_PLANES];
+
+	bool operator==(const RoutePlanKey &o) const
+	{
+		return stage == o.stage && layout == o.layout &&
+		       asrc == o.asrc &&
+		       memcmp(route, o.route, sizeof(route)) == 0;
+	}
+};
+
+struct RoutePlanHash {
+	size_t operator()(const RoutePlanKey &key) const
+	{
+		/*FNV-1a*/
+		uint64_t h = 14695981039346656037ULL;
+		auto mix = [&h](uint64_t v) {
+			h ^= v;
+			h *= 1099511628211ULL;
+		};
+		mix((uint64_t)key.stage);
+		mix((uint64_t)key.layout);
+		mix(key.asrc);
+		for (int i = 0; i < MAX_AV_PLANES; i++)
+			mix((uint64_t)(uint16_t)key.route[i]);
+		return (size_t)h;
+	}
+};
+
+/*channels a source may route from a stage of a Voicemeeter type*/
+static int stageLimit(int stage, long type)
+{
+	switch (stage) {
+	case voicemeeter_insert_in:
+		return validInputs[type];
+	case voicemeeter_insert_out:
+		return validOutputs[type];
+	case voicemeeter_main:
+		return validMains[type];
+	default:
+		return 0;
+	}
+}
+
+/*reader side copy of another stage's block, only the channels asked for
+ *are set*/
+struct CycleBlock {
+	VBVMR_T_AUDIOBUFFER_TS block;
+	std::vector<float> samples;
+};
+
+/*the block of an earlier stage from the same cycle, if it was written.
+ *The callback keeps rewriting that ring, so the slot's header and then
+ *the channels are copied out under its seqlock. Channel storage of the
+ *stage rings is never freed while readers run (see stageRetired), a copy
+ *racing a rewrite reads stale samples at worst and is discarded.*/
+static const VBVMR_T_AUDIOBUFFER_TS *
+cycleBlock(int stage, uint64_t cycle, const std::vector<int> &channels,
+	   CycleBlock &copy)
+{
+	const long maxInputs = (long)(sizeof(copy.block.data.audiobuffer_r) /
+				      sizeof(copy.block.data.audiobuffer_r[0]));
+	StreamableBuffer<VBVMR_T_AUDIOBUFFER_TS> *b = stageBuffer(stage);
+	uint64_t written = b->writeCount();
+	uint64_t depth = min(written, (uint64_t)b->size() - 1);
+	for (uint64_t k = 1; k <= depth; k++) {
+		size_t slot = (size_t)((written - k) % b->size());
+		uint32_t version = b->SlotVersion(slot);
+		VBVMR_T_AUDIOBUFFER_TS header;
+		memcpy(&header, b->Read(slot), sizeof(header));
+		/*only the oldest slot is ever rewritten, the cycle would
+		 *have been in a newer one*/
+		if (!b->SlotUnchanged(slot, version))
+			return nullptr;
+		if (header.cycle < cycle)
+			break;
+		if (header.cycle != cycle)
+			continue;
+
+		long frames = header.data.audiobuffer_nbs;
+		long inputs = header.data.audiobuffer_nbi;
+		if (frames <= 0 || inputs < 0 || inputs > maxInputs)
+			return nullptr;
+		copy.block = header;
+		memset(copy.block.data.audiobuffer_r, 0,
+		       sizeof(copy.block.data.audiobuffer_r));
+		memset(copy.block.data.audiobuffer_w, 0,
+		       sizeof(copy.block.data.audiobuffer_w));
+		if (copy.samples.size() < channels.size() * frames)
+			copy.samples.resize(channels.size() * frames);
+		for (size_t i = 0; i < channels.size(); i++) {
+			int c = channels[i];
+			if (c < 0 || c >= inputs)
+				continue;
+			float *dst = copy.samples.data() + i * frames;
+			memcpy(dst, header.data.audiobuffer_r[c],
+			       frames * sizeof(float));
+			copy.block.data.audiobuffer_r[c] = dst;
+		}
+		if (!b->SlotUnchanged(slot, version))
+			return nullptr;
+		return &copy.block;
+	}
+	return nullptr;
+}
+
+static VmVadQueue vadQueue;
+static void vad_dispatch(void *);
+
+/*cross-stage channel held back by the delay estimate (-1 for none) and
+ *by how many samples. Packed in one word so a reader never pairs one
+ *setting's channel with another's samples, the generation moves with
+ *every change so delay lines drop what they held from an earlier one.*/
+struct DelayComp {
+	int channel;
+	int samples;
+	uint32_t generation;
+};
+static std::atomic<uint64_t> delayComp{0xffff};
+
+static DelayComp delay_comp()
+{
+	uint64_t v = delayComp.load(std::memory_order_relaxed);
+	return {(int16_t)(v & 0xffff), (int)((v >> 16) & 0xffffff),
+		(uint32_t)(v >> 40)};
+}
+
+/*UI thread*/
+static void delay_comp_set(int channel, int samples)
+{
+	uint64_t generation = (delayComp.load() >> 40) + 1;
+	delayComp = (uint64_t)(uint16_t)channel |
+		    (uint64_t)(samples & 0xffffff) << 16 |
+		    (generation & 0xffffff) << 40;
+}
+
+/*reader threads, the UI thread emits the signal and releases the ref*/
+static void vad_push(obs_source_t *source, bool active, float db)
+{
+	VmVadEvent e = {obs_source_get_weak_source(source), active, db,
+			os_gettime_ns()};
+	bool notify = false;
+	if (!vadQueue.Push(e, notify))
+		obs_weak_source_release(e.source);
+	else if (notify)
+		obs_queue_task(OBS_TASK_UI, vad_dispatch, nullptr, false);
+}
+
+class RoutePlan : public StreamableReader<VBVMR_T_AUDIOBUFFER_TS> {
+	RoutePlanKey _key;
+	std::string _name;
+	int _channels;
+	/*cross-stage plans read the last stage of the cycle they need and
+	 *look the earlier ones up by cycle, so joining adds no latency*/
+	int _trigger = -1;
+	bool _needs[3] = {false, false, false};
+	std::vector<int> _stageChannels[3];
+	CycleBlock _copies[3];
+	std::vector<float> _silence;
+	uint64_t _lastDropped = 0;
+	std::mutex _lock;
+	std::vector<obs_source_t *> _sources;
+	/*parallel to _sources, owned by the sources*/
+	std::vector<VmVoiceDetector *> _voices;
+	VmVadAnalyzer _vad;
+	VmDelayLine _delays[MAX_AV_PLANES];
+	uint32_t _compGeneration = 0;
+	/*listening to the stage resampler rather than the stage*/
+	bool _resampled = false;
+
+	void useChannels(int delta)
+	{
+		if (_key.stage < 0 || _key.stage >= 3)
+			return;
+		for (int i = 0; i < _channels; i++)
+			stageResamplers[_key.stage].Use(_key.route[i], delta);
+	}
+
+public:
+	/*guarded by routePlanLock*/
+	int refs = 0;
+	SourceStats stats;
+	DriftResampler drift;
+	/*cross-stage blocks whose earlier stage never arrived*/
+	std::atomic<uint64_t> missing{0};
+	/*hands each subscribed source its block, the benchmark replaces it*/
+	void (*output)(obs_source_t *,
+		       const struct obs_source_audio *) = obs_source_output_audio;
+
+	RoutePlan(const RoutePlanKey &key) : _key(key)
+	{
+		_channels = min(MAX_AV_PLANES,
+				(int)get_audio_channels(_key.layout));
+		_name = "plan " + std::to_string(_key.stage);
+		for (int i = 0; i < _channels; i++)
+			_name += " " + std::to_string(_key.route[i]);
+		if (_key.stage != voicemeeter_cross)
+			return;
+		for (int i = 0; i < _channels; i++) {
+			if (_key.route[i] < 0)
+				continue;
+			int stage = _key.route[i] >> CROSS_STAGE_SHIFT;
+			if (stage < 3) {
+				_needs[stage] = true;
+				_stageChannels[stage].push_back(
+					_key.route[i] & CROSS_CHANNEL_MASK);
+				_trigger = max(_trigger, stage);
+			}
+		}
+	}
+
+	std::string Name() { return _name; }
+
+	const RoutePlanKey &Key() const { return _key; }
+
+	void Start()
+	{
+		/*blocks of one cycle must line up, so no stage resampler*/
+		if (_key.stage == voicemeeter_cross) {
+			if (_trigger >= 0)
+				stageBuffer(_trigger)->AddListener(this);
+			return;
+		}
+		StreamableBuffer<VBVMR_T_AUDIOBUFFER_TS> *b =
+			stageBuffer(_key.stage);
+		if (!b)
+			return;
+		/*at equal rates the stage is read as is*/
+		_resampled = stagesNeedResampling();
+		if (!_resampled) {
+			b->AddListener(this);
+			return;
+		}
+		useChannels(1);
+		stageResampler(_key.stage)->buffer.AddListener(this);
+	}
+
+	void Stop()
+	{
+		Disconnect();
+		if (_resampled)
+			useChannels(-1);
+		_resampled = false;
+	}
+
+	bool Resampled() const { return _resampled; }
+
+	void Subscribe(obs_source_t *source, VmVoiceDetector *voice)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_sources.push_back(source);
+		_voices.push_back(voice);
+	}
+
+	/*once this returns the reader no longer outputs to the source*/
+	void Unsubscribe(obs_source_t *source)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		for (size_t i = _sources.size(); i-- > 0;) {
+			if (_sources[i] != source)
+				continue;
+			_sources.erase(_sources.begin() + i);
+			_voices.erase(_voices.begin() + i);
+		}
+	}
+
+	size_t Sources()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		return _sources.size();
+	}
+
+	/*voice activity of the routed channels, before drift compensation,
+	 *only while a subscribed source detects*/
+	void detect(const struct obs_source_audio &out)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		bool used = false;
+		for (VmVoiceDetector *voice : _voices)
+			used = used ||
+			       (voice && (voice->Enabled() || voice->Active()));
+		if (!used || !out.frames || !out.samples_per_sec)
+			return;
+		uint64_t start = os_gettime_ns();
+		VmVadFeatures f = _vad.Analyze((const float *const *)out.data,
+					       _channels, out.frames,
+					       out.samples_per_sec);
+		uint64_t blockNs = (uint64_t)out.frames * 1000000000ULL /
+				   out.samples_per_sec;
+		for (size_t i = 0; i < _sources.size(); i++) {
+			VmVoiceDetector *voice = _voices[i];
+			if (voice && voice->Update(f, blockNs))
+				vad_push(_sources[i], voice->Active(), f.db);
+		}
+		vadQueue.Analyzed(os_gettime_ns() - start, blockNs);
+	}
+
+	void Read(const VBVMR_T_AUDIOBUFFER_TS *buf) { Route(buf, vb_type); }
+
+	/* Sends audio data to OBS */
+	void Route(const VBVMR_T_AUDIOBUFFER_TS *buf, long type)
+	{
+		TraceScope trace("RoutePlan::Read");
+		uint64_t readStart = os_gettime_ns();
+		struct obs_source_audio out;
+		out.timestamp = buf->ts;
+
+		switch (type) {
+		case voicemeeter_potato:
+		case voicemeeter_banana:
+		case voicemeeter_normal:
+			break;
+		default:
+			return;
+		}
+
+		const VBVMR_T_AUDIOBUFFER_TS *blocks[3] = {nullptr, nullptr,
+							   nullptr};
+		bool cross = _key.stage == voicemeeter_cross;
+		if (cross) {
+			bool lost = false;
+			for (int s = 0; s < 3; s++) {
+				if (!_needs[s])
+					continue;
+				blocks[s] = s == _trigger
+						    ? buf
+						    : cycleBlock(s, buf->cycle,
+								 _stageChannels[s],
+								 _copies[s]);
+				lost = lost || !blocks[s];
+			}
+			if (lost)
+				missing.fetch_add(1, std::memory_order_relaxed);
+		} else if (_key.stage >= 0 && _key.stage < 3) {
+			blocks[_key.stage] = buf;
+		} else {
+			return;
+		}
+
+		long frames = buf->data.audiobuffer_nbs;
+		if (_silence.size() < (size_t)frames)
+			_silence.resize(frames, 0.0f);
+		DelayComp comp = delay_comp();
+		if (comp.generation != _compGeneration) {
+			_compGeneration = comp.generation;
+			for (VmDelayLine &line : _delays)
+				line.Reset();
+		}
+		for (int i = 0; i < _channels; i++) {
+			int stage = _key.stage;
+			int channel = _key.route[i];
+			if (cross && channel >= 0) {
+				stage = channel >> CROSS_STAGE_SHIFT;
+				channel &= CROSS_CHANNEL_MASK;
+			}
+			const VBVMR_T_AUDIOBUFFER_TS *block =
+				stage < 3 ? blocks[stage] : nullptr;
+			const float *samples = nullptr;
+			if (block && channel >= 0 &&
+			    channel < stageLimit(stage, type) &&
+			    block->data.audiobuffer_nbs >= frames)
+				samples = block->data.audiobuffer_r[channel];
+			out.data[i] = (const uint8_t *)(samples ? samples
+								: _silence.data());
+			/*held back to line up with the channel it leads*/
+			if (comp.samples > 0 && channel >= 0 &&
+			    (stage << CROSS_STAGE_SHIFT | channel) ==
+				    comp.channel) {
+				const float *delayed = _delays[i].Process(
+					(const float *)out.data[i], frames,
+					comp.samples);
+				out.data[i] = (const uint8_t *)delayed;
+			}
+		}
+
+		out.samples_per_sec = buf->data.audiobuffer_sr;
+		out.frames = buf->data.audiobuffer_nbs;
+		out.format = AUDIO_FORMAT_FLOAT_PLANAR;
+		out.speakers = _key.layout;
+		detect(out);
+
+		/*resample onto the OBS clock*/
+		if (_key.asrc) {
+			uint64_t ts;
+			size_t n = drift.Process((const float *const *)out.data,
+						 _channels, out.frames,
+						 out.samples_per_sec,
+						 out.timestamp, &ts);
+			if (!n)
+				return;
+			const float *const *resampled = drift.Output();
+			for (int i = 0; i < _channels; i++)
+				out.data[i] = (const uint8_t *)resampled[i];
+			out.frames = (uint32_t)n;
+			out.timestamp = ts;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			for (obs_source_t *source : _sources)
+				output(source, &out);
+		}
+
+		uint64_t dropped = Dropped();
+		stats.Update(buf->ts, out.frames, out.samples_per_sec, Lag(),
+			     dropped - _lastDropped,
+			     os_gettime_ns() - readStart);
+		_lastDropped = dropped;
+	}
+};
+
+static std::mutex routePlanLock;
+static std::unordered_map<RoutePlanKey, RoutePlan *, RoutePlanHash>
+	routePlans;
+
+static RoutePlan *route_plan_acquire(const RoutePlanKey &key)
+{
+	std::lock_guard<std::mutex> lock(routePlanLock);
+	RoutePlan *&plan = routePlans[key];
+	if (!plan) {
+		plan = new RoutePlan(key);
+		plan->Start();
+	}
+	plan->refs++;
+	return plan;
+}
+
+static void route_plan_release(RoutePlan *plan)
+{
+	{
+		std::lock_guard<std::mutex> lock(routePlanLock);
+		if (--plan->refs > 0)
+			return;
+		routePlans.erase(plan->Key());
+	}
+	plan->Stop();
+	delete plan;
+}
+
+/*UI thread, once Voicemeeter reports a new rate plans move between the
+ *stages and their resamplers, which only run while the rates differ*/
+static void route_plans_follow_rate(void *)
+{
+	bool resample = stagesNeedResampling();
+	std::lock_guard<std::mutex> lock(routePlanLock);
+	for (auto &entry : routePlans) {
+		RoutePlan *plan = entry.second;
+		if (plan->Key().stage == voicemeeter_cross ||
+		    plan->Resampled() == resample)
+			continue;
+		plan->Stop();
+		plan->Start();
+	}
+	if (!resample) {
+		for (int i = 0; i < 3; i++)
+			stageResamplers[i].Stop();
+	}
+}
+
+/*stands in for a source in route_plan_benchmark, copies the planes out
+ *like obs_source_output_audio does. The source pointer is its buffer*/
+static void route_plan_bench_output(obs_source_t *source,
+				    const struct obs_source_audio *audio)
+{
+	std::vector<float> &copy = *(std::vector<float> *)source;
+	size_t frames = audio->frames;
+	if (copy.size() < 2 * frames)
+		copy.resize(2 * frames);
+	for (size_t c = 0; c < 2; c++)
+		memcpy(copy.data() + c * frames, audio->data[c],
+		       frames * sizeof(float));
+}
+
+/*per block cost of routing synthetic blocks to drift compensated stereo
+ *sources, each source on its own plan versus all subscribed to one shared
+ *plan. Every source gets every block either way*/
+static std::string route_plan_benchmark()
+{
+	const long channels = 2, frames = 480;
+	const uint32_t rate = 48000;
+	const int blocks = 200;
+	std::vector<float> in(channels * frames);
+	uint32_t seed = 1;
+	for (size_t i = 0; i < in.size(); i++)
+		in[i] = pcm_uniform(pcm_xorshift(seed)) * 2.0f - 1.0f;
+
+	VBVMR_T_AUDIOBUFFER_TS buf = {};
+	buf.data.audiobuffer_sr = rate;
+	buf.data.audiobuffer_nbs = frames;
+	buf.data.audiobuffer_nbi = channels;
+	for (long c = 0; c < channels; c++)
+		buf.data.audiobuffer_r[c] = in.data() + c * frames;
+
+	RoutePlanKey key;
+	key.stage = voicemeeter_main;
+	key.layout = SPEAKERS_STEREO;
+	key.asrc = true;
+	for (int i = 0; i < MAX_AV_PLANES; i++)
+		key.route[i] = i < channels ? (int16_t)i : -1;
+
+	std::string report;
+	char line[192];
+	for (int sources : {10, 25, 50}) {
+		std::vector<std::vector<float>> sinks(sources);
+		double us[2];
+		for (int shared = 0; shared < 2; shared++) {
+			std::vector<std::unique_ptr<RoutePlan>> plans;
+			for (int i = 0; i < sources; i++) {
+				if (!shared || !i) {
+					plans.emplace_back(new RoutePlan(key));
+					plans.back()->output =
+						route_plan_bench_output;
+				}
+				plans.back()->Subscribe(
+					(obs_source_t *)&sinks[i], nullptr);
+			}
+			uint64_t start = os_gettime_ns();
+			for (int b = 0; b < blocks; b++) {
+				buf.ts = (uint64_t)b * frames * 1000000000ULL /
+					 rate;
+				buf.cycle = b;
+				for (auto &plan : plans)
+					plan->Route(&buf, voicemeeter_potato);
+			}
+			us[shared] = (double)(os_gettime_ns() - start) /
+				     blocks / 1000.0;
+		}
+		snprintf(line, sizeof(line),
+			 "\n%d sources: %.1f us per block unshared, %.1f us "
+			 "shared (%.0f%% saved), %d fewer reader threads",
+			 sources, us[0], us[1],
+			 us[0] > 0.0 ? 100.0 * (1.0 - us[1] / us[0]) : 0.0,
+			 sources - 1);
+		report += line;
+	}
+	return report;
+}
+
+class vi_data {
 	std::string _name;
 	obs_data_t *_settings;
 	obs_source_t *_source;
 	std::vector<int16_t> _route;
-	std::vector<uint8_t> _silentBuffer;
-	int _maxChannels;
 	enum speaker_layout _layout;
 	int _stage;
+	RoutePlan *_plan = nullptr;
+	VmVoiceDetector _voice;
 
 	//	enum speaker_layout {
 	//		SPEAKERS_UNKNOWN,   /**< Unknown setting, fallback is stereo. */
@@ -854,18 +1588,20 @@ public:
 		: _settings(settings), _source(source)
 	{
 		_route.reserve(MAX_AV_PLANES);
-		_silentBuffer.reserve(MAX_AUDIO_SIZE);
 		_stage = -1;
 		for (int i = 0; i < MAX_AV_PLANES; i++) {
 			_route.push_back(-1);
 		}
-		for (int i = 0; i < MAX_AUDIO_SIZE; i++) {
-			_silentBuffer.push_back(0);
-		}
 		update(settings);
 	}
 
-	~vi_data() {}
+	~vi_data()
+	{
+		if (_plan) {
+			_plan->Unsubscribe(_source);
+			route_plan_release(_plan);
+		}
+	}
 
 	std::string Name() { return _name; }
 
@@ -887,26 +1623,31 @@ public:
 			_route[i] = (int16_t)obs_data_get_int(settings,
 							      name.c_str());
 		}
-		int nStage = (int)obs_data_get_int(settings, "stage");
-		if (_stage != nStage) {
-			Disconnect();
-			_stage = nStage;
-			switch (_stage) {
-			case voicemeeter_insert_in:
-				OBSBufferInsertIn.AddListener(this);
-				break;
-			case voicemeeter_insert_out:
-				OBSBufferInsertOut.AddListener(this);
-				break;
-			case voicemeeter_main:
-				OBSBufferMain.AddListener(this);
-				break;
-			default:
-				break;
-			}
-		}
+		_stage = (int)obs_data_get_int(settings, "stage");
+		_voice.Configure(
+			obs_data_get_bool(settings, "vad"),
+			(float)obs_data_get_double(settings, "vad_threshold"),
+			(uint32_t)obs_data_get_int(settings, "vad_hold"));
+
+		RoutePlanKey key;
+		key.stage = _stage;
+		key.layout = _layout;
+		key.asrc = obs_data_get_bool(settings, "asrc");
+		int channels = min(MAX_AV_PLANES,
+				   (int)get_audio_channels(_layout));
+		for (int i = 0; i < MAX_AV_PLANES; i++)
+			key.route[i] = i < channels ? _route[i] : -1;
+		if (_plan && _plan->Key() == key)
+			return;
 
-		return;
+		/*subscribe before letting go, a shared plan keeps running*/
+		RoutePlan *plan = route_plan_acquire(key);
+		plan->Subscribe(_source, &_voice);
+		if (_plan) {
+			_plan->Unsubscribe(_source);
+			route_plan_release(_plan);
+		}
+		_plan = plan;
 	}
 
 	static void fillLayouts(obs_property_t *list)
@@ -979,232 +1720,1993 @@ public:
 		}
 	}
 
-	static bool channelsModified(obs_properties_t *props,
-				     obs_property_t *list, obs_data_t *settings)
+	static void fillChannels(obs_property_t *list, long type, int stage)
 	{
-		UNUSED_PARAMETER(props);
 		obs_property_list_clear(list);
-		obs_property_list_add_int(list, obs_module_text("Mute"), -1);
-		int stage = (int)obs_data_get_int(settings, "stage");
-
-		int ret = iVMR.VBVMR_GetVoicemeeterType(&vb_type);
-		if (ret != 0) {
-			vb_type = 0;
-			return true;
+		if (stage < 0 || stage > voicemeeter_cross) {
+			obs_property_list_add_int(list, obs_module_text("Mute"),
+						  -1);
+			return;
 		}
-		int total = 0;
-
-		int inputs = validInputs[vb_type];
-		int outputs = validOutputs[vb_type];
-		int mains = validMains[vb_type];
-
-		std::string name;
+		for (const channel_entry &e : namedEntries(type, stage))
+			obs_property_list_add_int(list, e.named.c_str(),
+						  e.value);
+	}
 
-		switch (stage) {
-		case voicemeeter_insert_in:
-			total = inputs;
+	static int layoutChannels(obs_data_t *settings)
+	{
+		enum speaker_layout layout =
+			(enum speaker_layout)obs_data_get_int(settings,
+							      "layout");
+		if (layout == SPEAKERS_UNKNOWN) {
+			obs_audio_info aoi;
+			obs_get_audio_info(&aoi);
+			layout = aoi.speakers;
+		}
+		return min(MAX_AV_PLANES, (int)get_audio_channels(layout));
+	}
+
+	static bool channelsModified(obs_properties_t *props,
+				     obs_property_t *list, obs_data_t *settings)
+	{
+		UNUSED_PARAMETER(props);
+		fillChannels(list, dialogType(),
+			     (int)obs_data_get_int(settings, "stage"));
+		return true;
+	}
+
+	static bool stageChanged(obs_properties_t *props, obs_property_t *list,
+				 obs_data_t *settings)
+	{
+		UNUSED_PARAMETER(list);
+		long type = dialogType();
+		int stage = (int)obs_data_get_int(settings, "stage");
+		int channels = layoutChannels(settings);
+		for (int i = 0; i < MAX_AV_PLANES; i++) {
+			std::string name = "route " + std::to_string(i);
+			obs_property_t *route =
+				obs_properties_get(props, name.c_str());
+			if (!route)
+				continue;
+			/*hidden lists are filled once the layout shows them*/
+			if (i < channels)
+				fillChannels(route, type, stage);
+			else
+				obs_property_list_clear(route);
+		}
+
+		return true;
+	}
+
+	static bool layoutChanged(obs_properties_t *props, obs_property_t *list,
+				  obs_data_t *settings)
+	{
+		UNUSED_PARAMETER(list);
+		int stage = (int)obs_data_get_int(settings, "stage");
+		int channels = layoutChannels(settings);
+		for (int i = 0; i < MAX_AV_PLANES; i++) {
+			std::string name = "route " + std::to_string(i);
+			obs_property_t *route =
+				obs_properties_get(props, name.c_str());
+			if (!route)
+				continue;
+			bool visible = i < channels;
+			obs_property_set_visible(route, visible);
+			if (visible && !obs_property_list_item_count(route))
+				fillChannels(route, dialogType(), stage);
+		}
+
+		return true;
+	}
+
+	void fillStats(obs_properties_t *props)
+	{
+		std::memory_order relaxed = std::memory_order_relaxed;
+		char text[256];
+		obs_property_t *p;
+		if (!_plan)
+			return;
+		SourceStats &stats = _plan->stats;
+		DriftResampler &drift = _plan->drift;
+
+		p = obs_properties_get(props, "stats_lag");
+		snprintf(text, sizeof(text), "%s: %llu (%.2f ms)",
+			 obs_module_text("Stats.Lag"),
+			 (unsigned long long)stats.lagFrames.load(relaxed),
+			 stats.lagMs.load(relaxed));
+		obs_property_set_description(p, text);
+
+		p = obs_properties_get(props, "stats_dropped");
+		snprintf(text, sizeof(text), "%s: %llu",
+			 obs_module_text("Stats.Dropped"),
+			 (unsigned long long)stats.droppedFrames.load(relaxed));
+		obs_property_set_description(p, text);
+
+		p = obs_properties_get(props, "stats_rate");
+		snprintf(text, sizeof(text), "%s: %.1f/s",
+			 obs_module_text("Stats.CallRate"),
+			 stats.callRate.load(relaxed));
+		obs_property_set_description(p, text);
+
+		p = obs_properties_get(props, "stats_read");
+		snprintf(text, sizeof(text), "%s: %.1f / %.1f us",
+			 obs_module_text("Stats.ReadTime"),
+			 stats.readAvgNs.load(relaxed) / 1000.0,
+			 stats.readPeakNs.load(relaxed) / 1000.0);
+		obs_property_set_description(p, text);
+
+		p = obs_properties_get(props, "stats_sample_rate");
+		snprintf(text, sizeof(text), "%s: %.1f Hz",
+			 obs_module_text("Stats.SampleRate"),
+			 stats.sampleRate.load(relaxed));
+		obs_property_set_description(p, text);
+
+		p = obs_properties_get(props, "stats_jitter");
+		snprintf(text, sizeof(text), "%s: %.1f us",
+			 obs_module_text("Stats.Jitter"),
+			 stats.jitterUs.load(relaxed));
+		obs_property_set_description(p, text);
+
+		p = obs_properties_get(props, "stats_drift");
+		snprintf(text, sizeof(text),
+			 "%s: %+.1f ppm, %.2f ms held, %+.2f ms offset, %llu",
+			 obs_module_text("Stats.Drift"),
+			 drift.ppm.load(relaxed), drift.fillMs.load(relaxed),
+			 drift.offsetMs.load(relaxed),
+			 (unsigned long long)drift.resyncs.load(relaxed));
+		obs_property_set_description(p, text);
+		obs_property_set_visible(p, _plan->Key().asrc);
+
+		p = obs_properties_get(props, "stats_missing");
+		snprintf(text, sizeof(text), "%s: %llu",
+			 obs_module_text("Stats.Missing"),
+			 (unsigned long long)_plan->missing.load(relaxed));
+		obs_property_set_description(p, text);
+		bool cross = _plan->Key().stage == voicemeeter_cross;
+		obs_property_set_visible(p, cross);
+
+		p = obs_properties_get(props, "stats_shared");
+		snprintf(text, sizeof(text), "%s: %u",
+			 obs_module_text("Stats.Shared"),
+			 (unsigned)_plan->Sources());
+		obs_property_set_description(p, text);
+
+		p = obs_properties_get(props, "stats_vad");
+		snprintf(text, sizeof(text), "%s: %s",
+			 obs_module_text("Stats.VAD"),
+			 obs_module_text(_voice.Active() ? "VAD.Talking"
+							 : "VAD.Quiet"));
+		obs_property_set_description(p, text);
+		obs_property_set_visible(p, _voice.Enabled());
+	}
+
+	static bool statsRefresh(obs_properties_t *props,
+				 obs_property_t *button, void *data)
+	{
+		UNUSED_PARAMETER(button);
+		UNUSED_PARAMETER(data);
+		vi_data *self =
+			static_cast<vi_data *>(obs_properties_get_param(props));
+		if (self)
+			self->fillStats(props);
+		return true;
+	}
+
+	obs_properties_t *get_properties()
+	{
+		obs_properties_t *props = obs_properties_create();
+		obs_property_t *prop = nullptr;
+		obs_property_t *stageProperty = obs_properties_add_list(
+			props, "stage", obs_module_text("Stage"),
+			OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+		obs_property_list_add_int(stageProperty, "None", -1);
+		obs_property_list_add_int(
+			stageProperty,
+			obs_module_text("Voicemeeter Insert (input)"), 0);
+		obs_property_list_add_int(
+			stageProperty,
+			obs_module_text("Voicemeeter Insert (output)"), 1);
+		obs_property_list_add_int(
+			stageProperty, obs_module_text("Voicemeeter Main"), 2);
+		obs_property_list_add_int(stageProperty,
+					  obs_module_text("CrossStage"),
+					  voicemeeter_cross);
+		obs_property_set_modified_callback(stageProperty, stageChanged);
+
+		obs_property_t *layoutProperty = obs_properties_add_list(
+			props, "layout", obs_module_text("Speaker Layout"),
+			OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+		obs_property_set_modified_callback(layoutProperty,
+						   layoutChanged);
+		fillLayouts(layoutProperty);
+		for (int i = 0; i < MAX_AV_PLANES; i++) {
+			prop = obs_properties_add_list(
+				props, ("route " + std::to_string(i)).c_str(),
+				obs_module_text(
+					("Route." + std::to_string(i)).c_str()),
+				OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+			obs_property_set_visible(
+				prop, i < (int)get_audio_channels(_layout));
+		}
+		obs_properties_add_bool(props, "asrc", obs_module_text("ASRC"));
+
+		obs_properties_t *vad = obs_properties_create();
+		prop = obs_properties_add_float_slider(
+			vad, "vad_threshold", obs_module_text("VAD.Threshold"),
+			-70.0, -10.0, 1.0);
+		obs_property_float_set_suffix(prop, " dB");
+		prop = obs_properties_add_int_slider(
+			vad, "vad_hold", obs_module_text("VAD.Hold"), 50, 3000,
+			50);
+		obs_property_int_set_suffix(prop, " ms");
+		prop = obs_properties_add_list(vad, "vad_scene",
+					       obs_module_text("VAD.Scene"),
+					       OBS_COMBO_TYPE_LIST,
+					       OBS_COMBO_FORMAT_STRING);
+		obs_property_list_add_string(
+			prop, obs_module_text("VAD.NoScene"), "");
+		struct obs_frontend_source_list scenes = {};
+		obs_frontend_get_scenes(&scenes);
+		for (size_t i = 0; i < scenes.sources.num; i++) {
+			const char *name =
+				obs_source_get_name(scenes.sources.array[i]);
+			obs_property_list_add_string(prop, name, name);
+		}
+		obs_frontend_source_list_free(&scenes);
+		obs_properties_add_group(props, "vad", obs_module_text("VAD"),
+					 OBS_GROUP_CHECKABLE, vad);
+
+		obs_properties_t *stats = obs_properties_create();
+		obs_properties_add_text(stats, "stats_lag", "", OBS_TEXT_INFO);
+		obs_properties_add_text(stats, "stats_dropped", "",
+					OBS_TEXT_INFO);
+		obs_properties_add_text(stats, "stats_rate", "", OBS_TEXT_INFO);
+		obs_properties_add_text(stats, "stats_read", "", OBS_TEXT_INFO);
+		obs_properties_add_text(stats, "stats_sample_rate", "",
+					OBS_TEXT_INFO);
+		obs_properties_add_text(stats, "stats_jitter", "",
+					OBS_TEXT_INFO);
+		obs_properties_add_text(stats, "stats_drift", "",
+					OBS_TEXT_INFO);
+		obs_properties_add_text(stats, "stats_missing", "",
+					OBS_TEXT_INFO);
+		obs_properties_add_text(stats, "stats_shared", "",
+					OBS_TEXT_INFO);
+		obs_properties_add_text(stats, "stats_vad", "", OBS_TEXT_INFO);
+		obs_properties_add_button(stats, "stats_refresh",
+					  obs_module_text("Stats.Refresh"),
+					  statsRefresh);
+		obs_properties_add_group(props, "stats",
+					 obs_module_text("Stats"),
+					 OBS_GROUP_NORMAL, stats);
+		obs_properties_set_param(props, this, nullptr);
+		fillStats(props);
+		return props;
+	}
+};
+
+static void *vi_create(obs_data_t *settings, obs_source_t *source)
+{
+	signal_handler_add(
+		obs_source_get_signal_handler(source),
+		"void voice_activity(ptr source, bool active, float db)");
+	vi_data *data = new vi_data(settings, source);
+	return data;
+}
+
+static void vi_destroy(void *vptr)
+{
+	vi_data *data = static_cast<vi_data *>(vptr);
+	delete data;
+}
+
+static void vi_update(void *vptr, obs_data_t *settings)
+{
+	vi_data *data = static_cast<vi_data *>(vptr);
+	data->update(settings);
+}
+
+static const char *vi_name(void *unused)
+{
+	UNUSED_PARAMETER(unused);
+	return obs_module_text("Voicemeeter");
+}
+
+static obs_properties_t *vi_get_properties(void *vptr)
+{
+	vi_data *data = static_cast<vi_data *>(vptr);
+	return data->get_properties();
+}
+
+static void vi_get_defaults(obs_data_t *settings)
+{
+	obs_data_set_default_int(settings, "stage", -1);
+	obs_data_set_default_double(settings, "vad_threshold", -45.0);
+	obs_data_set_default_int(settings, "vad_hold", 400);
+	/*Mute by default*/
+	for (int i = 0; i < MAX_AV_PLANES; i++) {
+		std::string name = "route " + std::to_string(i);
+		obs_data_set_default_int(settings, name.c_str(), -1);
+	}
+}
+
+/*module settings files, nullptr when missing*/
+static obs_data_t *settings_load(const char *file)
+{
+	char *path = obs_module_config_path(file);
+	obs_data_t *data = obs_data_create_from_json_file_safe(path, "bak");
+	bfree(path);
+	return data;
+}
+
+/*writes and releases data*/
+static void settings_save(const char *file, obs_data_t *data)
+{
+	char *dir = obs_module_config_path("");
+	os_mkdirs(dir);
+	bfree(dir);
+
+	char *path = obs_module_config_path(file);
+	obs_data_save_json_safe(data, path, "tmp", "bak");
+	bfree(path);
+	obs_data_release(data);
+}
+
+/*checkable action bound to a flag, changed runs after the flag is set*/
+static QAction *menu_add_toggle(QMenu *menu, const char *name, bool &value,
+				std::function<void()> changed)
+{
+	QAction *action = menu->addAction(name);
+	action->setCheckable(true);
+	action->setChecked(value);
+	QObject::connect(action, &QAction::toggled,
+			 [&value, changed](bool checked) {
+				 value = checked;
+				 if (changed)
+					 changed();
+			 });
+	return action;
+}
+
+struct menu_choice {
+	const char *name;
+	int *value;
+	int option;
+};
+
+/*radio groups of checkable actions, consecutive choices sharing a value
+ *form one group and a separator starts the next*/
+template<size_t N>
+static void menu_add_choices(QMenu *menu, const menu_choice (&choices)[N],
+			     std::function<void()> changed)
+{
+	auto actions = std::make_shared<std::vector<QAction *>>(N);
+	for (size_t i = 0; i < N; i++) {
+		const menu_choice &c = choices[i];
+		if (i && c.value != choices[i - 1].value)
+			menu->addSeparator();
+		QAction *action = menu->addAction(c.name);
+		action->setCheckable(true);
+		action->setChecked(*c.value == c.option);
+		(*actions)[i] = action;
+		QObject::connect(action, &QAction::triggered, [=, &choices]() {
+			int *value = choices[i].value;
+			*value = choices[i].option;
+			for (size_t j = 0; j < N; j++) {
+				if (choices[j].value == value)
+					(*actions)[j]->setChecked(i == j);
+			}
+			changed();
+		});
+	}
+}
+
+static IsoRecorder<VBVMR_T_AUDIOBUFFER_TS> isoRecorder;
+static bool isoEnabled = false;
+static int isoStage = voicemeeter_main;
+static iso_format isoFormat = iso_float32;
+
+static void iso_load_settings()
+{
+	obs_data_t *data = settings_load("iso-recorder.json");
+	if (!data)
+		return;
+	obs_data_set_default_int(data, "stage", voicemeeter_main);
+	isoEnabled = obs_data_get_bool(data, "enabled");
+	isoStage = (int)obs_data_get_int(data, "stage");
+	isoFormat = (iso_format)obs_data_get_int(data, "format");
+	obs_data_release(data);
+}
+
+static void iso_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	obs_data_set_bool(data, "enabled", isoEnabled);
+	obs_data_set_int(data, "stage", isoStage);
+	obs_data_set_int(data, "format", isoFormat);
+	settings_save("iso-recorder.json", data);
+}
+
+static void iso_start()
+{
+	StreamableBuffer<VBVMR_T_AUDIOBUFFER_TS> *stage = stageBuffer(isoStage);
+	if (!stage || isoRecorder.Recording())
+		return;
+
+	char *dir = obs_frontend_get_current_record_output_path();
+	char *file = os_generate_formatted_filename(
+		"w64", true, "ISO %CCYY-%MM-%DD %hh-%mm-%ss");
+	std::string path = std::string(dir ? dir : ".") + "/" + file;
+	bfree(file);
+	bfree(dir);
+
+	wchar_t *wpath = nullptr;
+	os_utf8_to_wcs_ptr(path.c_str(), 0, &wpath);
+	if (wpath && isoRecorder.Start(wpath, isoFormat)) {
+		stage->AddListener(isoRecorder);
+		blog(LOG_INFO, "iso recorder: recording to %s", path.c_str());
+	}
+	bfree(wpath);
+}
+
+static void iso_frontend_event(enum obs_frontend_event event, void *data)
+{
+	UNUSED_PARAMETER(data);
+	switch (event) {
+	case OBS_FRONTEND_EVENT_RECORDING_STARTED:
+		if (isoEnabled)
+			iso_start();
+		break;
+	case OBS_FRONTEND_EVENT_RECORDING_STOPPING:
+	case OBS_FRONTEND_EVENT_EXIT:
+		isoRecorder.Stop();
+		break;
+	default:
+		break;
+	}
+}
+
+static void iso_add_menu(QMenu *menu)
+{
+	QMenu *iso = menu->addMenu("ISO Recorder");
+	menu_add_toggle(iso, "Record With OBS Recordings", isoEnabled, []() {
+		iso_save_settings();
+		if (isoEnabled && obs_frontend_recording_active())
+			iso_start();
+		else if (!isoEnabled)
+			isoRecorder.Stop();
+	});
+	iso->addSeparator();
+
+	static const menu_choice choices[] = {
+		{"Insert (input)", &isoStage, voicemeeter_insert_in},
+		{"Insert (output)", &isoStage, voicemeeter_insert_out},
+		{"Main", &isoStage, voicemeeter_main},
+		{"32-bit float", (int *)&isoFormat, iso_float32},
+		{"24-bit PCM", (int *)&isoFormat, iso_int24},
+	};
+	menu_add_choices(iso, choices, iso_save_settings);
+}
+
+static ReplayBuffer<VBVMR_T_AUDIOBUFFER_TS> replayBuffer;
+static obs_hotkey_id replayHotkey = OBS_INVALID_HOTKEY_ID;
+static bool replayEnabled = false;
+static int replayStage = voicemeeter_main;
+static double replaySeconds = 60.0;
+static int replayMemoryMB = 512;
+static std::string replayChannels;
+
+/*"0-7,34,40-47" style channel list, empty means every channel*/
+static std::vector<int> parseChannelList(const std::string &list)
+{
+	std::vector<int> channels;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		int first = 0, last = 0;
+		int n = sscanf(item.c_str(), "%d-%d", &first, &last);
+		if (n < 1)
+			continue;
+		if (n == 1)
+			last = first;
+		for (int c = first; c <= last && c < 128; c++)
+			channels.push_back(c);
+	}
+	return channels;
+}
+
+static void replay_load_settings()
+{
+	obs_data_t *data = settings_load("replay-buffer.json");
+	if (!data)
+		return;
+	obs_data_set_default_int(data, "stage", voicemeeter_main);
+	obs_data_set_default_double(data, "seconds", 60.0);
+	obs_data_set_default_int(data, "memory_mb", 512);
+	replayEnabled = obs_data_get_bool(data, "enabled");
+	replayStage = (int)obs_data_get_int(data, "stage");
+	replaySeconds = obs_data_get_double(data, "seconds");
+	replayMemoryMB = (int)obs_data_get_int(data, "memory_mb");
+	replayChannels = obs_data_get_string(data, "channels");
+	obs_data_array_t *hotkey = obs_data_get_array(data, "hotkey");
+	obs_hotkey_load(replayHotkey, hotkey);
+	obs_data_array_release(hotkey);
+	obs_data_release(data);
+}
+
+static void replay_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	obs_data_set_bool(data, "enabled", replayEnabled);
+	obs_data_set_int(data, "stage", replayStage);
+	obs_data_set_double(data, "seconds", replaySeconds);
+	obs_data_set_int(data, "memory_mb", replayMemoryMB);
+	obs_data_set_string(data, "channels", replayChannels.c_str());
+	obs_data_array_t *hotkey = obs_hotkey_save(replayHotkey);
+	obs_data_set_array(data, "hotkey", hotkey);
+	obs_data_array_release(hotkey);
+	settings_save("replay-buffer.json", data);
+}
+
+static void replay_apply()
+{
+	StreamableBuffer<VBVMR_T_AUDIOBUFFER_TS> *stage =
+		stageBuffer(replayStage);
+	if (!replayEnabled || !stage) {
+		replayBuffer.Release();
+		return;
+	}
+	replayBuffer.Configure(parseChannelList(replayChannels),
+			       replaySeconds,
+			       (size_t)replayMemoryMB * 1024 * 1024);
+	stage->AddListener(replayBuffer);
+}
+
+static void replay_save(void *data, obs_hotkey_id id, obs_hotkey_t *hotkey,
+			bool pressed)
+{
+	UNUSED_PARAMETER(data);
+	UNUSED_PARAMETER(id);
+	UNUSED_PARAMETER(hotkey);
+	if (!pressed || !replayEnabled)
+		return;
+
+	char *dir = obs_frontend_get_current_record_output_path();
+	char *file = os_generate_formatted_filename(
+		"w64", true, "Voicemeeter Replay %CCYY-%MM-%DD %hh-%mm-%ss");
+	std::string path = std::string(dir ? dir : ".") + "/" + file;
+	bfree(file);
+	bfree(dir);
+
+	wchar_t *wpath = nullptr;
+	os_utf8_to_wcs_ptr(path.c_str(), 0, &wpath);
+	if (wpath && replayBuffer.Save(wpath))
+		blog(LOG_INFO, "replay buffer: saving to %s", path.c_str());
+	bfree(wpath);
+}
+
+static void replay_add_menu(QMenu *menu)
+{
+	QMenu *replay = menu->addMenu("Replay Buffer");
+	menu_add_toggle(replay, "Enabled", replayEnabled, []() {
+		replay_save_settings();
+		replay_apply();
+	});
+	QAction *save = replay->addAction("Save Replay");
+	QObject::connect(save, &QAction::triggered, []() {
+		replay_save(nullptr, replayHotkey, nullptr, true);
+	});
+	QAction *stats = replay->addAction("Log Statistics");
+	QObject::connect(stats, &QAction::triggered, []() {
+		blog(LOG_INFO, "replay buffer: %s",
+		     replayBuffer.Describe().c_str());
+	});
+	replay->addSeparator();
+
+	static const menu_choice stages[] = {
+		{"Insert (input)", &replayStage, voicemeeter_insert_in},
+		{"Insert (output)", &replayStage, voicemeeter_insert_out},
+		{"Main", &replayStage, voicemeeter_main},
+	};
+	menu_add_choices(replay, stages, []() {
+		replay_save_settings();
+		replay_apply();
+	});
+}
+
+/*strips first, then buses*/
+static obs_hotkey_id muteHotkeys[VM_MAX_STRIPS + VM_MAX_BUSES] = {
+	OBS_INVALID_HOTKEY_ID};
+
+static std::string mute_hotkey_name(int n)
+{
+	bool bus = n >= VM_MAX_STRIPS;
+	return std::string(bus ? "voicemeeter_bus_mute_"
+			       : "voicemeeter_strip_mute_") +
+	       std::to_string(bus ? n - VM_MAX_STRIPS : n);
+}
+
+/*flips the cached mute state, strips the running edition does not have
+ *are never cached and ignored. The cache takes the new state right away
+ *so a second press before the next poll flips it back.*/
+static void mute_toggle(void *data, obs_hotkey_id id, obs_hotkey_t *hotkey,
+			bool pressed)
+{
+	UNUSED_PARAMETER(id);
+	UNUSED_PARAMETER(hotkey);
+	if (!pressed)
+		return;
+	int n = (int)(intptr_t)data;
+	bool bus = n >= VM_MAX_STRIPS;
+	int index = bus ? n - VM_MAX_STRIPS : n;
+	vm_strip_params &p = bus ? busParams[index] : stripParams[index];
+	float mute;
+	if (!vmParams.Float(p.mute, mute))
+		return;
+	char name[VM_PARAM_NAME];
+	snprintf(name, sizeof(name), "%s[%d].Mute", bus ? "Bus" : "Strip",
+		 index);
+	float toggled = mute != 0.0f ? 0.0f : 1.0f;
+	vmWriter.Set(name, toggled);
+	vmParams.Assume(p.mute, toggled);
+}
+
+static void mute_register_hotkeys()
+{
+	for (int n = 0; n < VM_MAX_STRIPS + VM_MAX_BUSES; n++) {
+		bool bus = n >= VM_MAX_STRIPS;
+		std::string description =
+			std::string("Toggle Voicemeeter ") +
+			(bus ? "Bus " : "Strip ") +
+			std::to_string((bus ? n - VM_MAX_STRIPS : n) + 1) +
+			" Mute";
+		muteHotkeys[n] = obs_hotkey_register_frontend(
+			mute_hotkey_name(n).c_str(), description.c_str(),
+			mute_toggle, (void *)(intptr_t)n);
+	}
+}
+
+static void mute_load_settings()
+{
+	obs_data_t *data = settings_load("parameters.json");
+	if (!data)
+		return;
+	for (int n = 0; n < VM_MAX_STRIPS + VM_MAX_BUSES; n++) {
+		obs_data_array_t *hotkey =
+			obs_data_get_array(data, mute_hotkey_name(n).c_str());
+		obs_hotkey_load(muteHotkeys[n], hotkey);
+		obs_data_array_release(hotkey);
+	}
+	obs_data_release(data);
+}
+
+static void mute_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	for (int n = 0; n < VM_MAX_STRIPS + VM_MAX_BUSES; n++) {
+		obs_data_array_t *hotkey = obs_hotkey_save(muteHotkeys[n]);
+		obs_data_set_array(data, mute_hotkey_name(n).c_str(), hotkey);
+		obs_data_array_release(hotkey);
+	}
+	settings_save("parameters.json", data);
+}
+
+static VmAutomation vmAutomation(vmParams, vmWriter);
+static bool automationEnabled = false;
+static std::string automationRules;
+static std::vector<VmSceneRule> automationParsed;
+/*cache subscriptions for the start value of every ruled parameter*/
+static std::unordered_map<std::string, int> automationHandles;
+
+static void automation_load_settings()
+{
+	obs_data_t *data = settings_load("automation.json");
+	if (!data)
+		return;
+	automationEnabled = obs_data_get_bool(data, "enabled");
+	automationRules = obs_data_get_string(data, "rules");
+	obs_data_release(data);
+}
+
+static void automation_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	obs_data_set_bool(data, "enabled", automationEnabled);
+	obs_data_set_string(data, "rules", automationRules.c_str());
+	settings_save("automation.json", data);
+}
+
+static void automation_apply()
+{
+	for (auto &h : automationHandles)
+		vmParams.Unsubscribe(h.second);
+	automationHandles.clear();
+	automationParsed.clear();
+	if (!automationEnabled) {
+		vmAutomation.Stop();
+		return;
+	}
+
+	automationParsed = vm_automation_parse(automationRules);
+	for (const VmSceneRule &rule : automationParsed)
+		for (const VmRampTarget &t : rule.targets)
+			if (!automationHandles.count(t.param))
+				automationHandles[t.param] = vmParams.Subscribe(
+					t.param.c_str(), vm_param_float);
+	vmAutomation.Start();
+}
+
+/*ramps to the rules of the new program scene over the transition*/
+static void automation_scene_changed()
+{
+	obs_source_t *scene = obs_frontend_get_current_scene();
+	if (!scene)
+		return;
+	std::string name = obs_source_get_name(scene);
+	obs_source_release(scene);
+
+	uint64_t duration = 0;
+	obs_source_t *transition = obs_frontend_get_current_transition();
+	if (transition) {
+		if (!obs_transition_fixed(transition))
+			duration = obs_frontend_get_transition_duration() *
+				   1000000ULL;
+		obs_source_release(transition);
+	}
+
+	std::vector<std::string> ramped;
+	auto fade = [&](const VmSceneRule &rule) {
+		for (const VmRampTarget &t : rule.targets) {
+			if (std::find(ramped.begin(), ramped.end(), t.param) !=
+			    ramped.end())
+				continue;
+			ramped.push_back(t.param);
+			vmAutomation.Fade(t.param, automationHandles[t.param],
+					  t.value, duration);
+		}
+	};
+	for (const VmSceneRule &rule : automationParsed)
+		if (rule.scene == name)
+			fade(rule);
+	for (const VmSceneRule &rule : automationParsed)
+		if (rule.scene == "*")
+			fade(rule);
+}
+
+static void automation_frontend_event(enum obs_frontend_event event,
+				      void *data)
+{
+	UNUSED_PARAMETER(data);
+	switch (event) {
+	case OBS_FRONTEND_EVENT_SCENE_CHANGED:
+		if (automationEnabled)
+			automation_scene_changed();
+		break;
+	case OBS_FRONTEND_EVENT_EXIT:
+		vmAutomation.Stop();
+		break;
+	default:
+		break;
+	}
+}
+
+static void automation_add_menu(QMenu *menu)
+{
+	QMenu *automation = menu->addMenu("Scene Automation");
+	menu_add_toggle(automation, "Enabled", automationEnabled, []() {
+		automation_save_settings();
+		automation_apply();
+	});
+	QAction *rules = automation->addAction("Edit Rules...");
+	QObject::connect(rules, &QAction::triggered, []() {
+		bool ok = false;
+		QString text = QInputDialog::getMultiLineText(
+			nullptr, "Scene Automation",
+			"One scene per line, * for every other scene, e.g.\n"
+			"BRB: Strip[3].Gain=-30, Bus[1].Gain=-12\n"
+			"*: Strip[3].Gain=0",
+			automationRules.c_str(), &ok);
+		if (!ok)
+			return;
+		automationRules = text.toUtf8().constData();
+		automation_save_settings();
+		automation_apply();
+	});
+	QAction *stats = automation->addAction("Log Statistics");
+	QObject::connect(stats, &QAction::triggered, []() {
+		blog(LOG_INFO, "automation: %s", vmAutomation.Stats().c_str());
+	});
+}
+
+static VmMidiPump midiPump;
+static bool midiEnabled = false;
+static bool midiLog = false;
+static std::string midiBindingText;
+static std::unordered_map<uint32_t, VmMidiBinding> midiBindings;
+/*resolved hotkeys by "name@source", looked up again when missing*/
+static std::unordered_map<std::string, obs_hotkey_id> midiHotkeys;
+
+static obs_hotkey_id midi_find_hotkey(const VmMidiBinding &b)
+{
+	std::string key = b.hotkey + "@" + b.source;
+	auto it = midiHotkeys.find(key);
+	if (it != midiHotkeys.end())
+		return it->second;
+
+	struct lookup {
+		const VmMidiBinding *binding;
+		obs_hotkey_id id;
+	} l = {&b, OBS_INVALID_HOTKEY_ID};
+	auto match = [](void *data, obs_hotkey_id id, obs_hotkey_t *key) {
+		lookup *l = static_cast<lookup *>(data);
+		if (l->binding->hotkey != obs_hotkey_get_name(key))
+			return true;
+		if (!l->binding->source.empty()) {
+			if (obs_hotkey_get_registerer_type(key) !=
+			    OBS_HOTKEY_REGISTERER_SOURCE)
+				return true;
+			obs_source_t *source = obs_weak_source_get_source(
+				(obs_weak_source_t *)obs_hotkey_get_registerer(
+					key));
+			bool found = source && l->binding->source ==
+						       obs_source_get_name(source);
+			obs_source_release(source);
+			if (!found)
+				return true;
+		}
+		l->id = id;
+		return false;
+	};
+	obs_enum_hotkeys(match, &l);
+	if (l.id != OBS_INVALID_HOTKEY_ID)
+		midiHotkeys[key] = l.id;
+	return l.id;
+}
+
+static void midi_forget_hotkeys(void *)
+{
+	midiHotkeys.clear();
+}
+
+/*source hotkeys go away with their source and a renamed source no longer
+ *matches its bindings, the UI thread looks them up again*/
+static void midi_source_changed(void *data, calldata_t *cd)
+{
+	UNUSED_PARAMETER(data);
+	UNUSED_PARAMETER(cd);
+	obs_queue_task(OBS_TASK_UI, midi_forget_hotkeys, nullptr, false);
+}
+
+static const char *midiSourceSignals[] = {"source_destroy",
+					  "source_rename"};
+
+/*notes hold the hotkey while down, controllers while at 64 or above,
+ *program changes press and release*/
+static void midi_dispatch(void *data)
+{
+	UNUSED_PARAMETER(data);
+	midiPump.Drain([](const VmMidiEvent &e) {
+		if (midiLog)
+			blog(LOG_INFO, "midi: %02x %u %u", e.status, e.data1,
+			     e.data2);
+		auto it = midiBindings.find(vm_midi_key(e.status, e.data1));
+		obs_hotkey_id id = it == midiBindings.end()
+					   ? OBS_INVALID_HOTKEY_ID
+					   : midi_find_hotkey(it->second);
+		if (id == OBS_INVALID_HOTKEY_ID) {
+			midiPump.Handled(e, false);
+			return;
+		}
+		switch (e.status & 0xF0) {
+		case vm_midi_note_off:
+			obs_hotkey_trigger_routed_callback(id, false);
 			break;
-		case voicemeeter_insert_out:
-			total = outputs;
+		case vm_midi_note:
+			obs_hotkey_trigger_routed_callback(id, e.data2 != 0);
 			break;
-		case voicemeeter_main:
-			total = mains;
+		case vm_midi_cc:
+			obs_hotkey_trigger_routed_callback(id, e.data2 >= 64);
 			break;
-		default:
-			return true;
-		};
+		case vm_midi_pc:
+			obs_hotkey_trigger_routed_callback(id, true);
+			obs_hotkey_trigger_routed_callback(id, false);
+			break;
+		}
+		midiPump.Handled(e, true);
+	});
+}
+
+static void midi_notify()
+{
+	obs_queue_task(OBS_TASK_UI, midi_dispatch, nullptr, false);
+}
+
+static void midi_load_settings()
+{
+	obs_data_t *data = settings_load("midi.json");
+	if (!data)
+		return;
+	midiEnabled = obs_data_get_bool(data, "enabled");
+	midiBindingText = obs_data_get_string(data, "bindings");
+	obs_data_release(data);
+}
+
+static void midi_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	obs_data_set_bool(data, "enabled", midiEnabled);
+	obs_data_set_string(data, "bindings", midiBindingText.c_str());
+	settings_save("midi.json", data);
+}
+
+static void midi_apply()
+{
+	midiBindings.clear();
+	midiHotkeys.clear();
+	for (VmMidiBinding &b : vm_midi_parse(midiBindingText))
+		midiBindings[b.key] = std::move(b);
+	if (midiEnabled)
+		midiPump.Start(iVMR.VBVMR_GetMidiMessage, midi_notify);
+	else
+		midiPump.Stop();
+}
+
+static void midi_add_menu(QMenu *menu)
+{
+	QMenu *midi = menu->addMenu("MIDI Control");
+	menu_add_toggle(midi, "Enabled", midiEnabled, []() {
+		midi_save_settings();
+		midi_apply();
+	});
+	QAction *bindings = midi->addAction("Edit Bindings...");
+	QObject::connect(bindings, &QAction::triggered, []() {
+		bool ok = false;
+		QString text = QInputDialog::getMultiLineText(
+			nullptr, "MIDI Control",
+			"<note|cc|pc> <channel> <number>: <hotkey>[@<source>]"
+			", e.g.\n"
+			"note 1 60: OBSBasic.StartRecording\n"
+			"pc 1 3: OBSBasic.SelectScene@BRB",
+			midiBindingText.c_str(), &ok);
+		if (!ok)
+			return;
+		midiBindingText = text.toUtf8().constData();
+		midi_save_settings();
+		midi_apply();
+	});
+	menu_add_toggle(midi, "Log Incoming Messages", midiLog, nullptr);
+	QAction *stats = midi->addAction("Log Statistics");
+	QObject::connect(stats, &QAction::triggered, []() {
+		blog(LOG_INFO, "midi: %s", midiPump.Stats().c_str());
+	});
+}
+
+static VmLoudnessMeter<VBVMR_T_AUDIOBUFFER_TS> loudnessMeter;
+static bool loudnessEnabled = false;
+static bool loudnessBuses[VM_MAX_BUSES] = {true};
+/*what the meter was configured with, read by the dock*/
+static std::vector<VmLoudnessBus> loudnessConfig;
+
+/*the main stage channels of each selected bus of the running edition*/
+static std::vector<VmLoudnessBus> loudness_buses(long type)
+{
+	std::vector<VmLoudnessBus> buses;
+	const vm_stage_table &t = vm_tables[type][voicemeeter_main];
+	for (int b = 0; b < vm_bus_count[type]; b++) {
+		if (!loudnessBuses[b])
+			continue;
+		VmLoudnessBus bus = {-1, 0, b, ""};
+		for (int i = validInputs[type]; i < t.count; i++) {
+			if (t.channels[i].index != b)
+				continue;
+			if (bus.first < 0)
+				bus.first = i;
+			bus.channels++;
+		}
+		if (bus.first < 0)
+			continue;
+		int a = vm_bus_a[type];
+		bus.name = b < a ? "A" + std::to_string(b + 1)
+				 : "B" + std::to_string(b - a + 1);
+		buses.push_back(std::move(bus));
+	}
+	return buses;
+}
+
+static void loudness_apply()
+{
+	loudnessMeter.Disconnect();
+	long type = vb_type >= 0 && vb_type <= 3 ? vb_type : 0;
+	loudnessConfig.clear();
+	if (!loudnessEnabled || !type)
+		return;
+	loudnessConfig = loudness_buses(type);
+	loudnessMeter.Configure("main", loudnessConfig);
+	if (!loudnessConfig.empty())
+		OBSBufferMain.AddListener(loudnessMeter);
+}
+
+static void loudness_load_settings()
+{
+	obs_data_t *data = settings_load("loudness.json");
+	if (!data)
+		return;
+	loudnessEnabled = obs_data_get_bool(data, "enabled");
+	for (int b = 0; b < VM_MAX_BUSES; b++) {
+		std::string key = "bus" + std::to_string(b);
+		loudnessBuses[b] = obs_data_get_bool(data, key.c_str());
+	}
+	obs_data_release(data);
+}
+
+static void loudness_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	obs_data_set_bool(data, "enabled", loudnessEnabled);
+	for (int b = 0; b < VM_MAX_BUSES; b++) {
+		std::string key = "bus" + std::to_string(b);
+		obs_data_set_bool(data, key.c_str(), loudnessBuses[b]);
+	}
+	settings_save("loudness.json", data);
+}
+
+static void loudness_log()
+{
+	VmLoudnessSnapshot snap;
+	if (loudnessMeter.Read(snap)) {
+		int count = min(snap.buses, (int)loudnessConfig.size());
+		for (int i = 0; i < count; i++) {
+			const VmLoudnessValues &v = snap.values[i];
+			blog(LOG_INFO,
+			     "loudness %s: M %.1f LUFS (max %.1f), "
+			     "S %.1f LUFS, I %.1f LUFS, true peak %.1f dBTP",
+			     loudnessConfig[i].name.c_str(), v.momentary,
+			     v.momentaryMax, v.shortTerm, v.integrated,
+			     v.truePeak);
+		}
+	}
+	blog(LOG_INFO, "loudness: %s", loudnessMeter.Stats().c_str());
+}
+
+static QString loudness_text(float v)
+{
+	return isfinite(v) ? QString::number(v, 'f', 1) : QString("-");
+}
+
+/*one row per configured bus, refreshed while the dock is visible*/
+static void loudness_add_dock(QMainWindow *main_window)
+{
+	static const char *headers[] = {"Bus", "M", "S", "I", "TP"};
+	QDockWidget *dock =
+		new QDockWidget("Voicemeeter Loudness", main_window);
+	dock->setObjectName("VoicemeeterLoudness");
+	QWidget *widget = new QWidget();
+	QGridLayout *grid = new QGridLayout(widget);
+	for (int c = 0; c < 5; c++)
+		grid->addWidget(new QLabel(headers[c]), 0, c);
+	QLabel *cells[VM_LOUDNESS_MAX_BUSES][5];
+	for (int r = 0; r < VM_LOUDNESS_MAX_BUSES; r++) {
+		for (int c = 0; c < 5; c++) {
+			cells[r][c] = new QLabel();
+			cells[r][c]->setVisible(false);
+			grid->addWidget(cells[r][c], r + 1, c);
+		}
+	}
+	dock->setWidget(widget);
+
+	QTimer *timer = new QTimer(dock);
+	QObject::connect(timer, &QTimer::timeout, [dock, cells]() {
+		if (!dock->isVisible())
+			return;
+		VmLoudnessSnapshot snap;
+		int rows = 0;
+		if (loudnessEnabled && loudnessMeter.Read(snap))
+			rows = min(snap.buses, (int)loudnessConfig.size());
+		for (int r = 0; r < VM_LOUDNESS_MAX_BUSES; r++) {
+			for (int c = 0; c < 5; c++)
+				cells[r][c]->setVisible(r < rows);
+			if (r >= rows)
+				continue;
+			const VmLoudnessValues &v = snap.values[r];
+			const VmLoudnessBus &bus = loudnessConfig[r];
+			char label[VM_PARAM_TEXT];
+			std::string name = bus.name;
+			if (vm_label(true, bus.index, label, sizeof(label)))
+				name += std::string(" - ") + label;
+			cells[r][0]->setText(name.c_str());
+			cells[r][1]->setText(loudness_text(v.momentary));
+			cells[r][2]->setText(loudness_text(v.shortTerm));
+			cells[r][3]->setText(loudness_text(v.integrated));
+			cells[r][4]->setText(loudness_text(v.truePeak));
+		}
+	});
+	timer->start(VM_LOUDNESS_HOP_MS);
+	obs_frontend_add_dock(dock);
+}
+
+static void loudness_add_menu(QMenu *menu)
+{
+	QMenu *loudness = menu->addMenu("Loudness");
+	menu_add_toggle(loudness, "Enabled", loudnessEnabled, []() {
+		loudness_save_settings();
+		loudness_apply();
+	});
+	QMenu *buses = loudness->addMenu("Buses");
+	for (int b = 0; b < VM_MAX_BUSES; b++) {
+		std::string name = "Bus[" + std::to_string(b) + "]";
+		menu_add_toggle(buses, name.c_str(), loudnessBuses[b], []() {
+			loudness_save_settings();
+			loudness_apply();
+		});
+	}
+	QAction *reset = loudness->addAction("Reset Integrated");
+	QObject::connect(reset, &QAction::triggered,
+			 []() { loudnessMeter.Reset(); });
+	QAction *stats = loudness->addAction("Log Statistics");
+	QObject::connect(stats, &QAction::triggered, loudness_log);
+}
+
+static VmSpectrum<VBVMR_T_AUDIOBUFFER_TS> spectrumAnalyzers[3];
+static bool spectrumAttached[3] = {false, false, false};
+static int spectrumSize = VM_SPECTRUM_DEFAULT_SIZE;
+/*stage << CROSS_STAGE_SHIFT | channel, -1 for none*/
+static int spectrumChannel = -1;
+
+/*a stage is only read while something is subscribed to it*/
+static void spectrum_attach(int stage)
+{
+	bool subscribed = spectrumAnalyzers[stage].Subscribed();
+	if (subscribed == spectrumAttached[stage])
+		return;
+	if (subscribed)
+		stageBuffer(stage)->AddListener(spectrumAnalyzers[stage]);
+	else
+		spectrumAnalyzers[stage].Disconnect();
+	spectrumAttached[stage] = subscribed;
+}
+
+static void spectrum_load_settings()
+{
+	obs_data_t *data = settings_load("spectrum.json");
+	if (!data)
+		return;
+	obs_data_set_default_int(data, "size", VM_SPECTRUM_DEFAULT_SIZE);
+	obs_data_set_default_int(data, "channel", -1);
+	spectrumSize = (int)vm_spectrum_size(
+		(size_t)obs_data_get_int(data, "size"));
+	spectrumChannel = (int)obs_data_get_int(data, "channel");
+	obs_data_release(data);
+}
+
+static void spectrum_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	obs_data_set_int(data, "size", spectrumSize);
+	obs_data_set_int(data, "channel", spectrumChannel);
+	settings_save("spectrum.json", data);
+}
+
+class SpectrumWidget : public QWidget {
+	int _stage = -1;
+	int _handle = -1;
+	VmSpectrumSnapshot _snapshot = {};
+	bool _valid = false;
+
+public:
+	bool Subscribed() const { return _handle >= 0; }
+
+	void Subscribe(int tagged, int size)
+	{
+		Unsubscribe();
+		if (tagged < 0)
+			return;
+		int stage = tagged >> CROSS_STAGE_SHIFT;
+		int channel = tagged & ((1 << CROSS_STAGE_SHIFT) - 1);
+		if (stage < 0 || stage > 2)
+			return;
+		_handle = spectrumAnalyzers[stage].Subscribe(channel, size);
+		if (_handle < 0) {
+			blog(LOG_WARNING, "spectrum: no free analyzer slot");
+			return;
+		}
+		_stage = stage;
+		spectrum_attach(stage);
+	}
+
+	void Unsubscribe()
+	{
+		if (_handle >= 0) {
+			spectrumAnalyzers[_stage].Unsubscribe(_handle);
+			spectrum_attach(_stage);
+		}
+		_handle = -1;
+		_stage = -1;
+		_valid = false;
+		update();
+	}
+
+	void Refresh()
+	{
+		_valid = _handle >= 0 &&
+			 spectrumAnalyzers[_stage].Read(_handle, _snapshot);
+		update();
+	}
+
+protected:
+	void paintEvent(QPaintEvent *event) override
+	{
+		UNUSED_PARAMETER(event);
+		const float range = -90.0f;
+		QPainter painter(this);
+		painter.fillRect(rect(), QColor(24, 24, 24));
+		if (!_valid)
+			return;
+		int w = width(), h = height();
+		int bands = _snapshot.bands;
+		for (int b = 0; b < bands; b++) {
+			float level = (range - _snapshot.db[b]) / range;
+			level = max(0.0f, min(level, 1.0f));
+			int x0 = b * w / bands, x1 = (b + 1) * w / bands;
+			int bar = (int)(level * h);
+			painter.fillRect(x0, h - bar, max(x1 - x0 - 1, 1), bar,
+					 QColor(80, 200, 120));
+		}
+	}
+};
+
+static SpectrumWidget *spectrumWidget = nullptr;
+
+/*the dock only subscribes while it is visible*/
+static void spectrum_add_dock(QMainWindow *main_window)
+{
+	QDockWidget *dock =
+		new QDockWidget("Voicemeeter Spectrum", main_window);
+	dock->setObjectName("VoicemeeterSpectrum");
+	QWidget *widget = new QWidget();
+	QVBoxLayout *layout = new QVBoxLayout(widget);
+	QComboBox *channels = new QComboBox();
+	spectrumWidget = new SpectrumWidget();
+	spectrumWidget->setMinimumSize(256, 96);
+	layout->addWidget(channels);
+	layout->addWidget(spectrumWidget);
+	dock->setWidget(widget);
+
+	/*filled when shown, the edition may have changed*/
+	std::shared_ptr<std::vector<int>> values =
+		std::make_shared<std::vector<int>>();
+	auto fill = [channels, values]() {
+		const std::vector<channel_entry> &entries =
+			channelEntries[dialogType()][voicemeeter_cross];
+		channels->blockSignals(true);
+		channels->clear();
+		values->clear();
+		int current = -1;
+		/*entries start with Mute*/
+		for (size_t i = 1; i < entries.size(); i++) {
+			if (entries[i].value == spectrumChannel)
+				current = (int)values->size();
+			values->push_back(entries[i].value);
+			channels->addItem(entries[i].label.c_str());
+		}
+		if (current < 0 && !values->empty()) {
+			current = 0;
+			spectrumChannel = values->front();
+		}
+		channels->setCurrentIndex(current);
+		channels->blockSignals(false);
+	};
+	QObject::connect(
+		channels,
+		static_cast<void (QComboBox::*)(int)>(
+			&QComboBox::currentIndexChanged),
+		[values](int index) {
+			if (index < 0 || index >= (int)values->size())
+				return;
+			spectrumChannel = (*values)[index];
+			spectrum_save_settings();
+			if (spectrumWidget->Subscribed())
+				spectrumWidget->Subscribe(spectrumChannel,
+							  spectrumSize);
+		});
+	QObject::connect(dock, &QDockWidget::visibilityChanged,
+			 [fill](bool visible) {
+				 if (!visible) {
+					 spectrumWidget->Unsubscribe();
+					 return;
+				 }
+				 fill();
+				 spectrumWidget->Subscribe(spectrumChannel,
+							   spectrumSize);
+			 });
+
+	QTimer *timer = new QTimer(dock);
+	QObject::connect(timer, &QTimer::timeout, []() {
+		if (spectrumWidget->Subscribed())
+			spectrumWidget->Refresh();
+	});
+	timer->start(33);
+	obs_frontend_add_dock(dock);
+}
 
-		int i;
+static void spectrum_add_menu(QMenu *menu)
+{
+	QMenu *spectrum = menu->addMenu("Spectrum Analyzer");
+	static const menu_choice sizes[] = {
+		{"FFT Size 1024", &spectrumSize, 1024},
+		{"FFT Size 2048", &spectrumSize, 2048},
+		{"FFT Size 4096", &spectrumSize, 4096},
+		{"FFT Size 8192", &spectrumSize, 8192},
+	};
+	menu_add_choices(spectrum, sizes, []() {
+		spectrum_save_settings();
+		if (spectrumWidget && spectrumWidget->Subscribed())
+			spectrumWidget->Subscribe(spectrumChannel,
+						  spectrumSize);
+	});
+	spectrum->addSeparator();
+	QAction *stats = spectrum->addAction("Log Statistics");
+	QObject::connect(stats, &QAction::triggered, []() {
+		static const char *names[] = {"insert (input)",
+					      "insert (output)", "main"};
+		for (int i = 0; i < 3; i++)
+			blog(LOG_INFO, "spectrum %s: %s", names[i],
+			     spectrumAnalyzers[i].Stats().c_str());
+	});
+}
 
-		for (i = 0; i < total; i++) {
-			name = getChannelName(i, stage);
-			obs_property_list_add_int(
-				list, (std::to_string(i) + ": " + name).c_str(),
-				i);
-		}
+static bool vadLog = false;
 
-		return true;
+static void vad_load_settings()
+{
+	obs_data_t *data = settings_load("vad.json");
+	if (!data)
+		return;
+	vadLog = obs_data_get_bool(data, "log");
+	obs_data_release(data);
+}
+
+static void vad_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	obs_data_set_bool(data, "log", vadLog);
+	settings_save("vad.json", data);
+}
+
+/*switches to the scene named in the source's settings when it talks*/
+static void vad_switch_scene(obs_source_t *source)
+{
+	obs_data_t *settings = obs_source_get_settings(source);
+	std::string name = obs_data_get_string(settings, "vad_scene");
+	obs_data_release(settings);
+	if (name.empty())
+		return;
+	obs_source_t *scene = obs_get_source_by_name(name.c_str());
+	if (!scene) {
+		blog(LOG_WARNING, "voice activity: no scene '%s'",
+		     name.c_str());
+		return;
 	}
+	obs_frontend_set_current_scene(scene);
+	obs_source_release(scene);
+}
 
-	static bool stageChanged(obs_properties_t *props, obs_property_t *list,
-				 obs_data_t *settings)
-	{
-		UNUSED_PARAMETER(list);
-		obs_property_t *pn = obs_properties_first(props);
-		/* single pass over properties */
-		do {
-			const char *name = obs_property_name(pn);
-			if (strncmp("route ", name, 6) == 0) {
-				//obs_property_list_clear(pn);
-				channelsModified(props, pn, settings);
-			}
-		} while (obs_property_next(&pn));
+static void vad_dispatch(void *)
+{
+	vadQueue.Drain([](const VmVadEvent &e) {
+		obs_source_t *source = obs_weak_source_get_source(e.source);
+		obs_weak_source_release(e.source);
+		if (!source)
+			return;
+		if (vadLog)
+			blog(LOG_INFO, "voice activity: '%s' %s (%.1f dB)",
+			     obs_source_get_name(source),
+			     e.active ? "talking" : "quiet", e.db);
+
+		calldata_t data;
+		calldata_init(&data);
+		calldata_set_ptr(&data, "source", source);
+		calldata_set_bool(&data, "active", e.active);
+		calldata_set_float(&data, "db", e.db);
+		signal_handler_signal(obs_source_get_signal_handler(source),
+				      "voice_activity", &data);
+		calldata_free(&data);
+
+		if (e.active)
+			vad_switch_scene(source);
+		obs_source_release(source);
+	});
+}
 
-		return true;
+static void vad_add_menu(QMenu *menu)
+{
+	QMenu *vad = menu->addMenu("Voice Activity");
+	menu_add_toggle(vad, "Log Events", vadLog, []() {
+		vad_save_settings();
+	});
+	QAction *stats = vad->addAction("Log Statistics");
+	QObject::connect(stats, &QAction::triggered, []() {
+		blog(LOG_INFO, "voice activity: %s",
+		     vadQueue.Stats().c_str());
+	});
+}
+
+/*feeds the estimator the two channels of each cycle*/
+class DelayReader : public StreamableReader<VBVMR_T_AUDIOBUFFER_TS> {
+	int _channels[2] = {-1, -1};
+	int _trigger = -1;
+	std::vector<int> _wanted[2];
+	CycleBlock _copies[2];
+
+public:
+	VmDelayEstimator estimator;
+	std::atomic<uint64_t> missing{0};
+
+	std::string Name() { return "delay estimator"; }
+
+	/*UI thread, the stage the reader attaches to or -1*/
+	int Configure(int a, int b)
+	{
+		_channels[0] = a;
+		_channels[1] = b;
+		_wanted[0].assign(1, a & CROSS_CHANNEL_MASK);
+		_wanted[1].assign(1, b & CROSS_CHANNEL_MASK);
+		_trigger = -1;
+		if (a < 0 || b < 0 || a == b)
+			return -1;
+		_trigger = max(a >> CROSS_STAGE_SHIFT, b >> CROSS_STAGE_SHIFT);
+		return _trigger < 3 ? _trigger : (_trigger = -1);
 	}
 
-	static bool layoutChanged(obs_properties_t *props, obs_property_t *list,
-				  obs_data_t *settings)
+	void Read(const VBVMR_T_AUDIOBUFFER_TS *buf)
 	{
-		enum speaker_layout layout =
-			(enum speaker_layout)obs_data_get_int(
-				settings, obs_property_name(list));
-		if (layout == SPEAKERS_UNKNOWN) {
-			obs_audio_info aoi;
-			obs_get_audio_info(&aoi);
-			layout = aoi.speakers;
-		}
-		int channels = get_audio_channels(layout);
-
-		obs_property_t *pn = obs_properties_first(props);
-		/* single pass over properties */
-		int i = 0;
-		do {
-			const char *name = obs_property_name(pn);
-			if (strncmp("route ", name, 6) == 0) {
-				std::string in = (name + 6);
-				i = std::stoi(in);
-				obs_property_set_visible(pn, i < channels);
+		TraceScope trace("DelayReader::Read");
+		const float *data[2];
+		size_t frames = (size_t)buf->data.audiobuffer_nbs;
+		for (int i = 0; i < 2; i++) {
+			int stage = _channels[i] >> CROSS_STAGE_SHIFT;
+			int channel = _channels[i] & CROSS_CHANNEL_MASK;
+			const VBVMR_T_AUDIOBUFFER_TS *block =
+				stage == _trigger
+					? buf
+					: cycleBlock(stage, buf->cycle,
+						     _wanted[i], _copies[i]);
+			if (!block || channel >= stageLimit(stage, vb_type) ||
+			    (size_t)block->data.audiobuffer_nbs < frames ||
+			    !block->data.audiobuffer_r[channel]) {
+				missing.fetch_add(1, std::memory_order_relaxed);
+				return;
 			}
-		} while (obs_property_next(&pn));
-
-		return true;
+			data[i] = block->data.audiobuffer_r[channel];
+		}
+		estimator.Feed(data[0], data[1], frames,
+			       buf->data.audiobuffer_sr, buf->ts);
 	}
+};
 
-	obs_properties_t *get_properties()
-	{
-		obs_properties_t *props = obs_properties_create();
-		obs_property_t *prop = nullptr;
-		obs_property_t *stageProperty = obs_properties_add_list(
-			props, "stage", obs_module_text("Stage"),
-			OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
-		obs_property_list_add_int(stageProperty, "None", -1);
-		obs_property_list_add_int(
-			stageProperty,
-			obs_module_text("Voicemeeter Insert (input)"), 0);
-		obs_property_list_add_int(
-			stageProperty,
-			obs_module_text("Voicemeeter Insert (output)"), 1);
-		obs_property_list_add_int(
-			stageProperty, obs_module_text("Voicemeeter Main"), 2);
-		obs_property_set_modified_callback(stageProperty, stageChanged);
+static DelayReader delayReader;
+static bool delayEnabled = false;
+static int delayChannels[2] = {-1, -1};
 
-		obs_property_t *layoutProperty = obs_properties_add_list(
-			props, "layout", obs_module_text("Speaker Layout"),
-			OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
-		obs_property_set_modified_callback(layoutProperty,
-						   layoutChanged);
-		fillLayouts(layoutProperty);
-		for (int i = 0; i < MAX_AV_PLANES; i++) {
-			prop = obs_properties_add_list(
-				props, ("route " + std::to_string(i)).c_str(),
-				obs_module_text(
-					("Route." + std::to_string(i)).c_str()),
-				OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
-			obs_property_set_visible(
-				prop, i < (int)get_audio_channels(_layout));
-		}
-		return props;
+static std::string delay_label(int tagged)
+{
+	for (const channel_entry &e :
+	     channelEntries[dialogType()][voicemeeter_cross])
+		if (e.value == tagged)
+			return e.label;
+	return "channel " + std::to_string(tagged);
+}
+
+static void delay_load_settings()
+{
+	obs_data_t *data = settings_load("delay.json");
+	if (!data)
+		return;
+	obs_data_set_default_int(data, "first", -1);
+	obs_data_set_default_int(data, "second", -1);
+	obs_data_set_default_int(data, "compensate", -1);
+	delayEnabled = obs_data_get_bool(data, "enabled");
+	delayChannels[0] = (int)obs_data_get_int(data, "first");
+	delayChannels[1] = (int)obs_data_get_int(data, "second");
+	delay_comp_set((int)obs_data_get_int(data, "compensate"),
+		       (int)obs_data_get_int(data, "samples"));
+	obs_data_release(data);
+}
+
+static void delay_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	obs_data_set_bool(data, "enabled", delayEnabled);
+	obs_data_set_int(data, "first", delayChannels[0]);
+	obs_data_set_int(data, "second", delayChannels[1]);
+	DelayComp comp = delay_comp();
+	obs_data_set_int(data, "compensate", comp.channel);
+	obs_data_set_int(data, "samples", comp.samples);
+	settings_save("delay.json", data);
+}
+
+static void delay_apply()
+{
+	delayReader.Disconnect();
+	delayReader.estimator.Stop();
+	int stage = delayReader.Configure(delayChannels[0], delayChannels[1]);
+	if (!delayEnabled || stage < 0)
+		return;
+	delayReader.estimator.Start();
+	stageBuffer(stage)->AddListener(delayReader);
+}
+
+static void delay_log()
+{
+	VmDelayEstimate e = delayReader.estimator.Estimate();
+	blog(LOG_INFO,
+	     "delay estimator: '%s' lags '%s' by %.2f ms (%d samples at "
+	     "%ld Hz), confidence %.2f over %llu blocks",
+	     delay_label(delayChannels[1]).c_str(),
+	     delay_label(delayChannels[0]).c_str(), e.ms, e.samples,
+	     e.sampleRate, e.confidence, (unsigned long long)e.blocks);
+	blog(LOG_INFO, "delay estimator: %s, %llu cycles missing a channel",
+	     delayReader.estimator.Stats().c_str(),
+	     (unsigned long long)delayReader.missing.load());
+	DelayComp comp = delay_comp();
+	if (comp.channel >= 0)
+		blog(LOG_INFO, "delay estimator: holding back '%s' by %d "
+			       "samples",
+		     delay_label(comp.channel).c_str(), comp.samples);
+}
+
+/*the leading channel is held back, a delay can't bring the other forward*/
+static void delay_compensate()
+{
+	VmDelayEstimate e = delayReader.estimator.Estimate();
+	if (!e.blocks || e.confidence < VM_DELAY_CONFIDENCE) {
+		blog(LOG_WARNING,
+		     "delay estimator: no confident estimate to apply "
+		     "(%.2f over %llu blocks)",
+		     e.confidence, (unsigned long long)e.blocks);
+		return;
 	}
-	/* Sends audio data to OBS */
-	void Read(const VBVMR_T_AUDIOBUFFER_TS *buf)
-	{
-		struct obs_source_audio out;
-		out.timestamp = buf->ts;
+	/*the estimator reads the stages, so this doesn't shift what it
+	 *measures next*/
+	delay_comp_set(e.samples >= 0 ? delayChannels[0] : delayChannels[1],
+		       min(abs(e.samples), VM_DELAY_MAX_LAG));
+	delay_save_settings();
+	delay_log();
+}
 
-		int limit;
-		switch (vb_type) {
-		case voicemeeter_potato:
-		case voicemeeter_banana:
-		case voicemeeter_normal:
-			break;
-		default:
-			return;
-		}
+static bool delay_choose(int i)
+{
+	const std::vector<channel_entry> &entries =
+		channelEntries[dialogType()][voicemeeter_cross];
+	QStringList labels;
+	int current = 0;
+	/*entries start with Mute*/
+	for (size_t e = 1; e < entries.size(); e++) {
+		if (entries[e].value == delayChannels[i])
+			current = (int)e - 1;
+		labels << entries[e].label.c_str();
+	}
+	bool ok = false;
+	QString label = QInputDialog::getItem(
+		nullptr, "Delay Estimation",
+		i ? "Channel that may lag:" : "Reference channel:", labels,
+		current, false, &ok);
+	int index = labels.indexOf(label);
+	if (!ok || index < 0)
+		return false;
+	delayChannels[i] = entries[index + 1].value;
+	return true;
+}
 
-		switch (_stage) {
-		case voicemeeter_insert_in:
-			limit = validInputs[vb_type];
-			break;
-		case voicemeeter_insert_out:
-			limit = validOutputs[vb_type];
-			break;
-		case voicemeeter_main:
-			limit = validOutputs[vb_type];
-			break;
-		default:
+static void delay_add_menu(QMenu *menu)
+{
+	QMenu *delay = menu->addMenu("Delay Estimation");
+	menu_add_toggle(delay, "Enabled", delayEnabled, []() {
+		delay_save_settings();
+		delay_apply();
+	});
+	QAction *channels = delay->addAction("Choose Channels...");
+	QObject::connect(channels, &QAction::triggered, []() {
+		if (!delay_choose(0) || !delay_choose(1))
 			return;
-		}
+		delay_save_settings();
+		delay_apply();
+	});
+	delay->addSeparator();
+	QAction *apply = delay->addAction("Compensate Estimate");
+	QObject::connect(apply, &QAction::triggered, delay_compensate);
+	QAction *clear = delay->addAction("Clear Compensation");
+	QObject::connect(clear, &QAction::triggered, []() {
+		delay_comp_set(-1, 0);
+		delay_save_settings();
+	});
+	QAction *reset = delay->addAction("Reset Average");
+	QObject::connect(reset, &QAction::triggered,
+			 []() { delayReader.estimator.Reset(); });
+	QAction *log = delay->addAction("Log Estimate");
+	QObject::connect(log, &QAction::triggered, delay_log);
+}
 
-		_maxChannels =
-			min((MAX_AV_PLANES), (get_audio_channels(_layout)));
-		for (int i = 0; i < _maxChannels; i++) {
-			if (_route[i] >= 0 && _route[i] < limit) {
-				out.data[i] = (const uint8_t *)buf->data
-						      .audiobuffer_r[_route[i]];
-			} else {
-				if (buf->data.audiobuffer_nbs * 4 >
-				    _silentBuffer.size()) {
-					_silentBuffer.reserve(
-						buf->data.audiobuffer_nbs * 4);
-					do {
-						_silentBuffer.push_back(0);
-					} while (buf->data.audiobuffer_nbs * 4 >
-						 _silentBuffer.size());
-				}
-				out.data[i] =
-					(const uint8_t *)_silentBuffer.data();
-			}
-		}
+static ShmExporter<VBVMR_T_AUDIOBUFFER_TS> shmExporters[3];
+static const char *shmStageNames[3] = {"insert-in", "insert-out", "main"};
+static bool shmEnabled[3] = {false, false, false};
 
-		out.samples_per_sec = buf->data.audiobuffer_sr;
-		out.frames = buf->data.audiobuffer_nbs;
-		out.format = AUDIO_FORMAT_FLOAT_PLANAR;
-		out.speakers = _layout;
+static void shm_apply(int stage)
+{
+	ShmExporter<VBVMR_T_AUDIOBUFFER_TS> &e = shmExporters[stage];
+	if (!shmEnabled[stage]) {
+		e.Close();
+		return;
+	}
+	if (!e.Active() && e.Open(shmStageNames[stage], stage))
+		stageBuffer(stage)->AddListener(e);
+}
 
-		obs_source_output_audio(_source, &out);
+static void shm_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	for (int i = 0; i < 3; i++)
+		obs_data_set_bool(data, shmStageNames[i], shmEnabled[i]);
+	settings_save("shm-export.json", data);
+}
+
+static void shm_load_settings()
+{
+	obs_data_t *data = settings_load("shm-export.json");
+	if (!data)
+		return;
+	for (int i = 0; i < 3; i++)
+		shmEnabled[i] = obs_data_get_bool(data, shmStageNames[i]);
+	obs_data_release(data);
+}
+
+static void shm_add_menu(QMenu *menu)
+{
+	static const char *labels[3] = {"Insert (input)", "Insert (output)",
+					"Main"};
+	QMenu *shm = menu->addMenu("Shared Memory Export");
+	for (int i = 0; i < 3; i++) {
+		menu_add_toggle(shm, labels[i], shmEnabled[i], [i]() {
+			shm_save_settings();
+			shm_apply(i);
+		});
 	}
-};
+}
 
-static void *vi_create(obs_data_t *settings, obs_source_t *source)
+static PipeTap<VBVMR_T_AUDIOBUFFER_TS> pipeTap;
+static bool tapEnabled = false;
+static int tapStage = voicemeeter_main;
+static pcm_format tapFormat = pcm_f32;
+static pipe_tap_policy tapPolicy = pipe_tap_drop_oldest;
+static std::string tapChannels = "0-7";
+static std::string tapPipe = "obs-voicemeeter-tap";
+
+static void tap_load_settings()
 {
-	vi_data *data = new vi_data(settings, source);
-	return data;
+	obs_data_t *data = settings_load("pcm-tap.json");
+	if (!data)
+		return;
+	obs_data_set_default_int(data, "stage", voicemeeter_main);
+	obs_data_set_default_string(data, "channels", "0-7");
+	obs_data_set_default_string(data, "pipe", "obs-voicemeeter-tap");
+	tapEnabled = obs_data_get_bool(data, "enabled");
+	tapStage = (int)obs_data_get_int(data, "stage");
+	tapFormat = (pcm_format)obs_data_get_int(data, "format");
+	tapPolicy = (pipe_tap_policy)obs_data_get_int(data, "policy");
+	tapChannels = obs_data_get_string(data, "channels");
+	tapPipe = obs_data_get_string(data, "pipe");
+	obs_data_release(data);
 }
 
-static void vi_destroy(void *vptr)
+static void tap_save_settings()
 {
-	vi_data *data = static_cast<vi_data *>(vptr);
-	data->Disconnect();
-	delete data;
+	obs_data_t *data = obs_data_create();
+	obs_data_set_bool(data, "enabled", tapEnabled);
+	obs_data_set_int(data, "stage", tapStage);
+	obs_data_set_int(data, "format", tapFormat);
+	obs_data_set_int(data, "policy", tapPolicy);
+	obs_data_set_string(data, "channels", tapChannels.c_str());
+	obs_data_set_string(data, "pipe", tapPipe.c_str());
+	settings_save("pcm-tap.json", data);
 }
 
-static void vi_update(void *vptr, obs_data_t *settings)
+static void tap_apply()
 {
-	vi_data *data = static_cast<vi_data *>(vptr);
-	data->update(settings);
+	pipeTap.Stop();
+	StreamableBuffer<VBVMR_T_AUDIOBUFFER_TS> *stage = stageBuffer(tapStage);
+	if (!tapEnabled || !stage)
+		return;
+	if (pipeTap.Start(tapPipe.c_str(), parseChannelList(tapChannels),
+			  tapFormat, tapPolicy))
+		stage->AddListener(pipeTap);
 }
 
-static const char *vi_name(void *unused)
+static void tap_add_menu(QMenu *menu)
+{
+	QMenu *tap = menu->addMenu("PCM Pipe Tap");
+	menu_add_toggle(tap, "Enabled", tapEnabled, []() {
+		tap_save_settings();
+		tap_apply();
+	});
+	tap->addSeparator();
+
+	static const menu_choice choices[] = {
+		{"Insert (input)", &tapStage, voicemeeter_insert_in},
+		{"Insert (output)", &tapStage, voicemeeter_insert_out},
+		{"Main", &tapStage, voicemeeter_main},
+		{"32-bit float", (int *)&tapFormat, pcm_f32},
+		{"16-bit PCM", (int *)&tapFormat, pcm_s16},
+		{"24-bit PCM", (int *)&tapFormat, pcm_s24},
+		{"32-bit PCM", (int *)&tapFormat, pcm_s32},
+		{"Drop Oldest When Full", (int *)&tapPolicy,
+		 pipe_tap_drop_oldest},
+		{"Wait For Encoder When Full", (int *)&tapPolicy,
+		 pipe_tap_block_writer},
+	};
+	menu_add_choices(tap, choices, []() {
+		tap_save_settings();
+		tap_apply();
+	});
+}
+
+static obs_output_t *sendOutput = nullptr;
+static bool sendEnabled = false;
+static int sendStage = voicemeeter_insert_in;
+static int sendLatencyMs = 20;
+static std::string sendRoutes = "1:0";
+
+/*"1:0,2:8" pairs of OBS track (from 1) and first Voicemeeter channel*/
+static std::vector<SendRoute> parseSendRoutes(const std::string &list)
+{
+	std::vector<SendRoute> routes;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		int track = 0, first = 0;
+		if (sscanf(item.c_str(), "%d:%d", &track, &first) == 2)
+			routes.push_back({track - 1, first});
+	}
+	return routes;
+}
+
+static const char *send_name(void *unused)
 {
 	UNUSED_PARAMETER(unused);
-	return obs_module_text("Voicemeeter");
+	return "Voicemeeter Send";
 }
 
-static obs_properties_t *vi_get_properties(void *vptr)
+static void *send_create(obs_data_t *settings, obs_output_t *output)
 {
-	vi_data *data = static_cast<vi_data *>(vptr);
-	return data->get_properties();
+	UNUSED_PARAMETER(settings);
+	obsSend.output = output;
+	return &obsSend;
 }
 
-static void vi_get_defaults(obs_data_t *settings)
+static void send_destroy(void *data)
 {
-	obs_data_set_default_int(settings, "stage", -1);
-	/*Mute by default*/
-	for (int i = 0; i < MAX_AV_PLANES; i++) {
-		std::string name = "route " + std::to_string(i);
-		obs_data_set_default_int(settings, name.c_str(), -1);
-	}
+	UNUSED_PARAMETER(data);
+	obsSend.output = nullptr;
+}
+
+static bool send_start(void *data)
+{
+	UNUSED_PARAMETER(data);
+	if (!obs_output_can_begin_data_capture(obsSend.output, 0))
+		return false;
+	obsSend.Activate();
+	return obs_output_begin_data_capture(obsSend.output, 0);
+}
+
+static void send_stop(void *data, uint64_t ts)
+{
+	UNUSED_PARAMETER(data);
+	UNUSED_PARAMETER(ts);
+	obsSend.Deactivate();
+	obs_output_end_data_capture(obsSend.output);
+}
+
+static void send_raw_audio2(void *data, size_t mix_idx,
+			    struct audio_data *frames)
+{
+	UNUSED_PARAMETER(data);
+	obsSend.Produce(mix_idx, frames);
+}
+
+static void send_load_settings()
+{
+	obs_data_t *data = settings_load("obs-send.json");
+	if (!data)
+		return;
+	obs_data_set_default_int(data, "latency_ms", 20);
+	obs_data_set_default_string(data, "routes", "1:0");
+	sendEnabled = obs_data_get_bool(data, "enabled");
+	sendStage = (int)obs_data_get_int(data, "stage");
+	sendLatencyMs = (int)obs_data_get_int(data, "latency_ms");
+	sendRoutes = obs_data_get_string(data, "routes");
+	obs_data_release(data);
+}
+
+static void send_save_settings()
+{
+	obs_data_t *data = obs_data_create();
+	obs_data_set_bool(data, "enabled", sendEnabled);
+	obs_data_set_int(data, "stage", sendStage);
+	obs_data_set_int(data, "latency_ms", sendLatencyMs);
+	obs_data_set_string(data, "routes", sendRoutes.c_str());
+	settings_save("obs-send.json", data);
+}
+
+static void send_apply()
+{
+	if (sendOutput)
+		obs_output_stop(sendOutput);
+	obsSend.Deactivate();
+	/*the rate is only known once the audio callback started*/
+	uint32_t rate = vmSampleRate;
+	if (!sendEnabled || !rate)
+		return;
+
+	obs_audio_info aoi;
+	obs_get_audio_info(&aoi);
+	size_t mixers = obsSend.Configure(sendStage,
+					  parseSendRoutes(sendRoutes), rate,
+					  sendLatencyMs,
+					  get_audio_channels(aoi.speakers));
+	if (!mixers)
+		return;
+	if (!sendOutput)
+		sendOutput = obs_output_create("voicemeeter_send",
+					       "Voicemeeter Send", nullptr,
+					       nullptr);
+	struct audio_convert_info conv = {};
+	conv.samples_per_sec = rate;
+	conv.format = AUDIO_FORMAT_FLOAT_PLANAR;
+	conv.speakers = aoi.speakers;
+	obs_output_set_audio_conversion(sendOutput, &conv);
+	obs_output_set_mixers(sendOutput, mixers);
+	if (obs_output_start(sendOutput))
+		blog(LOG_INFO, "send: routing %s at %u Hz, %d ms target",
+		     sendRoutes.c_str(), rate, sendLatencyMs);
+	else
+		blog(LOG_WARNING, "send: could not start output");
+}
+
+static void send_add_menu(QMenu *menu)
+{
+	QMenu *send = menu->addMenu("Send OBS Audio");
+	menu_add_toggle(send, "Enabled", sendEnabled, []() {
+		send_save_settings();
+		send_apply();
+	});
+	QAction *routing = send->addAction("Edit Routing...");
+	QObject::connect(routing, &QAction::triggered, []() {
+		bool ok = false;
+		QString text = QInputDialog::getText(
+			nullptr, "Send OBS Audio",
+			"Track:first channel pairs, e.g. 1:0,2:8",
+			QLineEdit::Normal, sendRoutes.c_str(), &ok);
+		if (!ok)
+			return;
+		sendRoutes = text.toUtf8().constData();
+		send_save_settings();
+		send_apply();
+	});
+	QAction *stats = send->addAction("Log Statistics");
+	QObject::connect(stats, &QAction::triggered, []() {
+		blog(LOG_INFO, "send: %s", obsSend.Describe().c_str());
+	});
+	send->addSeparator();
+
+	static const menu_choice choices[] = {
+		{"Insert (input)", &sendStage, voicemeeter_insert_in},
+		{"Insert (output)", &sendStage, voicemeeter_insert_out},
+		{"10 ms", &sendLatencyMs, 10},
+		{"20 ms", &sendLatencyMs, 20},
+		{"40 ms", &sendLatencyMs, 40},
+		{"80 ms", &sendLatencyMs, 80},
+	};
+	menu_add_choices(send, choices, []() {
+		send_save_settings();
+		send_apply();
+	});
+}
+
+static const char *sf_name(void *unused)
+{
+	UNUSED_PARAMETER(unused);
+	return obs_module_text("SendFilter");
+}
+
+static void sf_update(void *data, obs_data_t *settings)
+{
+	SendFilter *f = static_cast<SendFilter *>(data);
+	sendFilters.Configure(f, (int)obs_data_get_int(settings, "stage"),
+			      (int)obs_data_get_int(settings, "channel"),
+			      (uint32_t)obs_data_get_int(settings, "latency_ms"),
+			      vmSampleRate);
+}
+
+static void *sf_create(obs_data_t *settings, obs_source_t *source)
+{
+	SendFilter *f = new SendFilter();
+	f->source = source;
+	if (!sendFilters.Add(f))
+		blog(LOG_WARNING, "send filter: more than %d filters",
+		     SEND_MAX_FILTERS);
+	sf_update(f, settings);
+	return f;
+}
+
+static void sf_destroy(void *data)
+{
+	SendFilter *f = static_cast<SendFilter *>(data);
+	sendFilters.Remove(f);
+	delete f;
+}
+
+static struct obs_audio_data *sf_filter_audio(void *data,
+					      struct obs_audio_data *audio)
+{
+	static_cast<SendFilter *>(data)->Produce(audio);
+	return audio;
+}
+
+static void sf_get_defaults(obs_data_t *settings)
+{
+	obs_data_set_default_int(settings, "stage", voicemeeter_insert_in);
+	obs_data_set_default_int(settings, "channel", -1);
+	obs_data_set_default_int(settings, "latency_ms", 40);
+}
+
+static bool sf_stage_changed(obs_properties_t *props, obs_property_t *list,
+			     obs_data_t *settings)
+{
+	UNUSED_PARAMETER(list);
+	return vi_data::channelsModified(props,
+					 obs_properties_get(props, "channel"),
+					 settings);
+}
+
+static obs_properties_t *sf_get_properties(void *data)
+{
+	SendFilter *f = static_cast<SendFilter *>(data);
+	obs_properties_t *props = obs_properties_create();
+	obs_property_t *stage = obs_properties_add_list(
+		props, "stage", obs_module_text("Stage"), OBS_COMBO_TYPE_LIST,
+		OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(stage,
+				  obs_module_text("Voicemeeter Insert (input)"),
+				  voicemeeter_insert_in);
+	obs_property_list_add_int(
+		stage, obs_module_text("Voicemeeter Insert (output)"),
+		voicemeeter_insert_out);
+	obs_property_set_modified_callback(stage, sf_stage_changed);
+	obs_properties_add_list(props, "channel",
+				obs_module_text("SendFilter.Channel"),
+				OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_properties_add_int_slider(props, "latency_ms",
+				      obs_module_text("SendFilter.Latency"),
+				      10, 200, 5);
+
+	char text[192];
+	snprintf(text, sizeof(text), "%s: %.1f ms, %.1f ppm, %llu / %llu",
+		 obs_module_text("SendFilter.Status"),
+		 f->track.fillMs.load(), f->track.ppm.load(),
+		 (unsigned long long)f->track.underruns.load(),
+		 (unsigned long long)f->track.overruns.load());
+	obs_properties_add_text(props, "status", text, OBS_TEXT_INFO);
+	return props;
+}
+
+/*reconfigures every send once Voicemeeter reports its sample rate, runs
+ *on the UI thread*/
+static void send_restart(void *)
+{
+	send_apply();
+	sendFilters.Each([](SendFilter *f) {
+		obs_data_t *settings = obs_source_get_settings(f->source);
+		sf_update(f, settings);
+		obs_data_release(settings);
+	});
 }
 
 bool obs_module_load(void)
@@ -1214,17 +3716,14 @@ bool obs_module_load(void)
 		blog(LOG_INFO, ".dll failed to be initalized");
 		return false;
 	}
+	rtLogger.Start();
 
 	//make data structures for properties window
-	makeMainLayout(0);
-	makeMainLayout(voicemeeter_normal);
-	makeMainLayout(voicemeeter_banana);
-	makeMainLayout(voicemeeter_potato);
-
-	makeMap(0);
-	makeMap(voicemeeter_normal);
-	makeMap(voicemeeter_banana);
-	makeMap(voicemeeter_potato);
+	makeChannelEntries();
+	vmParams.Start(iVMR.VBVMR_IsParametersDirty,
+		       iVMR.VBVMR_GetParameterFloat,
+		       iVMR.VBVMR_GetParameterStringA);
+	vmWriter.Start(iVMR.VBVMR_SetParameters);
 
 	QMainWindow *main_window =
 		(QMainWindow *)obs_frontend_get_main_window();
@@ -1232,6 +3731,8 @@ bool obs_module_load(void)
 	QMenu *vb_menu = nullptr;
 	QAction *vb_start = nullptr;
 	QAction *vb_restart = nullptr;
+	QAction *vb_trace = nullptr;
+	QAction *vb_trace_save = nullptr;
 	if (main_window) {
 		QString vm = "Voicemeeter";
 		QString restart = "Restart Audio Engine";
@@ -1255,6 +3756,121 @@ bool obs_module_load(void)
 			if (vb_restart)
 				vb_restart->setEnabled(ret == 0);
 		});
+		vb_menu->addSeparator();
+		vb_trace = vb_menu->addAction("Record Trace");
+		vb_trace->setCheckable(true);
+		QObject::connect(vb_trace, &QAction::toggled, [](bool checked) {
+			tracer.Enable(checked);
+			blog(LOG_INFO, "tracing %s",
+			     checked ? "enabled" : "disabled");
+		});
+		vb_trace_save = vb_menu->addAction("Save Trace");
+		QObject::connect(vb_trace_save, &QAction::triggered, []() {
+			char *dir = obs_module_config_path("");
+			os_mkdirs(dir);
+			bfree(dir);
+
+			char *file = os_generate_formatted_filename(
+				"json", true, "trace %CCYY-%MM-%DD %hh-%mm-%ss");
+			char *path = obs_module_config_path(file);
+			if (tracer.Dump(path))
+				blog(LOG_INFO, "saved trace to %s", path);
+			else
+				blog(LOG_WARNING, "could not save trace to %s",
+				     path);
+			bfree(path);
+			bfree(file);
+		});
+		QAction *vb_bench = vb_menu->addAction("Benchmark Sample Kernels");
+		QObject::connect(vb_bench, &QAction::triggered, []() {
+			blog(LOG_INFO, "sample kernels, using %s:%s",
+			     pcm_isa_name(pcm_best_isa()),
+			     pcm_kernels_benchmark().c_str());
+			blog(LOG_INFO, "resampler:%s",
+			     resample_benchmark().c_str());
+			blog(LOG_INFO, "loudness:%s",
+			     vm_loudness_benchmark().c_str());
+			blog(LOG_INFO, "spectrum:%s",
+			     vm_spectrum_benchmark().c_str());
+			blog(LOG_INFO, "voice activity:%s",
+			     vm_vad_benchmark().c_str());
+		});
+		QAction *vb_plans =
+			vb_menu->addAction("Benchmark Routing Plans");
+		QObject::connect(vb_plans, &QAction::triggered, []() {
+			size_t active;
+			{
+				std::lock_guard<std::mutex> lock(routePlanLock);
+				active = routePlans.size();
+			}
+			blog(LOG_INFO, "routing plans, %u active:%s",
+			     (unsigned)active, route_plan_benchmark().c_str());
+		});
+		QAction *vb_params = vb_menu->addAction("Log Parameters");
+		QObject::connect(vb_params, &QAction::triggered, vm_params_log);
+		QAction *vb_levels = vb_menu->addAction("Log Levels");
+		QObject::connect(vb_levels, &QAction::triggered, vm_levels_log);
+		QAction *vb_clips = vb_menu->addAction("Reset Clip Counters");
+		QObject::connect(vb_clips, &QAction::triggered, []() {
+			for (VmMeter &meter : stageMeters)
+				meter.ResetClips();
+		});
+		vb_menu->addSeparator();
+		iso_load_settings();
+		iso_add_menu(vb_menu);
+		obs_frontend_add_event_callback(iso_frontend_event, nullptr);
+
+		replayHotkey = obs_hotkey_register_frontend(
+			"voicemeeter_replay_save", "Save Voicemeeter Replay",
+			replay_save, nullptr);
+		replay_load_settings();
+		replay_add_menu(vb_menu);
+		replay_apply();
+
+		mute_register_hotkeys();
+		mute_load_settings();
+
+		automation_load_settings();
+		automation_add_menu(vb_menu);
+		automation_apply();
+		obs_frontend_add_event_callback(automation_frontend_event,
+						nullptr);
+
+		midi_load_settings();
+		midi_add_menu(vb_menu);
+		midi_apply();
+		for (const char *signal : midiSourceSignals)
+			signal_handler_connect(obs_get_signal_handler(), signal,
+					       midi_source_changed, nullptr);
+
+		loudness_load_settings();
+		loudness_add_menu(vb_menu);
+		loudness_add_dock(main_window);
+
+		spectrum_load_settings();
+		for (int i = 0; i < 3; i++)
+			spectrumAnalyzers[i].SetName(shmStageNames[i]);
+		spectrum_add_menu(vb_menu);
+		spectrum_add_dock(main_window);
+
+		vad_load_settings();
+		vad_add_menu(vb_menu);
+
+		delay_load_settings();
+		delay_add_menu(vb_menu);
+		delay_apply();
+
+		shm_load_settings();
+		shm_add_menu(vb_menu);
+		for (int i = 0; i < 3; i++)
+			shm_apply(i);
+
+		tap_load_settings();
+		tap_add_menu(vb_menu);
+		tap_apply();
+
+		send_load_settings();
+		send_add_menu(vb_menu);
 	}
 
 	ret = vm_login();
@@ -1300,27 +3916,110 @@ bool obs_module_load(void)
 
 	obs_register_source(&voicemeeter_input_capture);
 
+	struct obs_output_info voicemeeter_send = {0};
+	voicemeeter_send.id = "voicemeeter_send";
+	voicemeeter_send.flags = OBS_OUTPUT_AUDIO | OBS_OUTPUT_MULTI_TRACK;
+	voicemeeter_send.get_name = send_name;
+	voicemeeter_send.create = send_create;
+	voicemeeter_send.destroy = send_destroy;
+	voicemeeter_send.start = send_start;
+	voicemeeter_send.stop = send_stop;
+	voicemeeter_send.raw_audio2 = send_raw_audio2;
+
+	obs_register_output(&voicemeeter_send);
+	/*needs the output type, the rate may be known if Voicemeeter is up*/
+	send_apply();
+
+	struct obs_source_info voicemeeter_send_filter = {0};
+	voicemeeter_send_filter.id = "voicemeeter_send_filter";
+	voicemeeter_send_filter.type = OBS_SOURCE_TYPE_FILTER;
+	voicemeeter_send_filter.output_flags = OBS_SOURCE_AUDIO;
+	voicemeeter_send_filter.create = sf_create;
+	voicemeeter_send_filter.destroy = sf_destroy;
+	voicemeeter_send_filter.update = sf_update;
+	voicemeeter_send_filter.get_defaults = sf_get_defaults;
+	voicemeeter_send_filter.get_name = sf_name;
+	voicemeeter_send_filter.get_properties = sf_get_properties;
+	voicemeeter_send_filter.filter_audio = sf_filter_audio;
+
+	obs_register_source(&voicemeeter_send_filter);
+
 	return true;
 }
 
 void obs_module_unload()
 {
 	blog(LOG_INFO, "closing streams");
+	obs_frontend_remove_event_callback(iso_frontend_event, nullptr);
+	obs_frontend_remove_event_callback(automation_frontend_event, nullptr);
+	vmAutomation.Stop();
+	midiPump.Stop();
+	for (const char *signal : midiSourceSignals)
+		signal_handler_disconnect(obs_get_signal_handler(), signal,
+					  midi_source_changed, nullptr);
+	loudnessMeter.Disconnect();
+	for (int i = 0; i < 3; i++)
+		spectrumAnalyzers[i].Disconnect();
+	delayReader.Disconnect();
+	delayReader.estimator.Stop();
+	isoRecorder.Stop();
+	if (replayHotkey != OBS_INVALID_HOTKEY_ID) {
+		replay_save_settings();
+		obs_hotkey_unregister(replayHotkey);
+	}
+	if (muteHotkeys[0] != OBS_INVALID_HOTKEY_ID) {
+		mute_save_settings();
+		for (obs_hotkey_id &id : muteHotkeys) {
+			obs_hotkey_unregister(id);
+			id = OBS_INVALID_HOTKEY_ID;
+		}
+	}
+	replayBuffer.Release();
+	for (int i = 0; i < 3; i++)
+		shmExporters[i].Close();
+	pipeTap.Stop();
+	if (sendOutput) {
+		obs_output_stop(sendOutput);
+		obs_output_release(sendOutput);
+		sendOutput = nullptr;
+	}
+	obsSend.Deactivate();
+	for (int i = 0; i < 3; i++)
+		stageResamplers[i].Stop();
 	OBSBufferInsertIn.Disconnect();
 	OBSBufferInsertOut.Disconnect();
 	OBSBufferMain.Disconnect();
 
 	vm_stop();
 	vm_unregister();
+	vmWriter.Stop();
+	vmParams.Stop();
 	vm_logout();
 
+	auto cleanUpStage = [](VBVMR_T_AUDIOBUFFER_TS &buf) {
+		for (long i = 0; i < buf.allocated; i++) {
+			bfree(buf.data.audiobuffer_r[i]);
+			buf.data.audiobuffer_r[i] = nullptr;
+		}
+		buf.allocated = 0;
+		buf.capacity = 0;
+	};
+	OBSBufferInsertIn.Clear(cleanUpStage);
+	OBSBufferInsertOut.Clear(cleanUpStage);
+	OBSBufferMain.Clear(cleanUpStage);
+	for (int i = 0; i < 3; i++) {
+		for (float *channel : stageRetired[i])
+			bfree(channel);
+		stageRetired[i].clear();
+	}
 	auto cleanUp = [](VBVMR_T_AUDIOBUFFER_TS &buf) {
 		for (int i = 0; i < buf.data.audiobuffer_nbi; i++) {
 			bfree(buf.data.audiobuffer_r[i]);
 			buf.data.audiobuffer_r[i] = nullptr;
 		}
 	};
-	OBSBufferInsertIn.Clear(cleanUp);
-	OBSBufferInsertOut.Clear(cleanUp);
-	OBSBufferMain.Clear(cleanUp);
+	for (int i = 0; i < 3; i++)
+		stageResamplers[i].buffer.Clear(cleanUp);
+
+	rtLogger.Stop();
 }
@@ -0,0 +1,251 @@
+#pragma once
+#include <util/platform.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <windows.h>
+#include <util/windows/WinHandle.hpp>
+#include "circle-buffer.h"
+#include "sample-kernels.h"
+
+/*
+ * Streams interleaved PCM of selected channels to a named pipe so an
+ * external encoder can read it directly, e.g.
+ *   ffmpeg -f f32le -ar 48000 -ac 8 -i \\.\pipe\obs-voicemeeter-tap ...
+ *
+ * The listener's reader thread converts each buffer into a chunk and
+ * queues it, a dedicated thread writes chunks to the pipe. When the queue
+ * is full the policy decides: drop the oldest chunk, or block the reader
+ * thread until the pipe catches up (the Voicemeeter callback never waits,
+ * the stage ring drops for this listener instead).
+ */
+
+#define PIPE_TAP_QUEUE 32
+
+enum pipe_tap_policy {
+	pipe_tap_drop_oldest = 0,
+	pipe_tap_block_writer,
+};
+
+template<class Data> class PipeTap : public StreamableReader<Data> {
+	std::string _name = "pcm tap";
+	std::string _pipeName;
+	std::vector<int> _channels;
+	pcm_format _format = pcm_f32;
+	PcmDither _dither;
+	/*per buffer channel pointers, silence for missing channels*/
+	std::vector<const float *> _sources;
+	std::vector<float> _silence;
+	pipe_tap_policy _policy = pipe_tap_drop_oldest;
+
+	WinHandle _pipe;
+	WinHandle _writerThread;
+	std::atomic<bool> _running{false};
+	std::atomic<bool> _connected{false};
+
+	std::mutex _lock;
+	std::condition_variable _notEmpty;
+	std::condition_variable _notFull;
+	std::vector<uint8_t> _chunks[PIPE_TAP_QUEUE];
+	size_t _chunkBytes[PIPE_TAP_QUEUE] = {0};
+	size_t _head = 0;
+	size_t _count = 0;
+
+	std::atomic<uint64_t> _written{0};
+	std::atomic<uint64_t> _overflows{0};
+
+	void pack(const Data *buf, uint8_t *out)
+	{
+		size_t frames = buf->data.audiobuffer_nbs;
+		if (_silence.size() < frames)
+			_silence.resize(frames, 0.0f);
+		for (size_t c = 0; c < _channels.size(); c++) {
+			int src = _channels[c];
+			_sources[c] = src >= 0 && src < buf->data.audiobuffer_nbi
+					      ? buf->data.audiobuffer_r[src]
+					      : _silence.data();
+		}
+		pcm_interleave(out, _sources.data(), _sources.size(), frames,
+			       _format, &_dither);
+	}
+
+	/*unblocks a ConnectNamedPipe that is waiting for a client*/
+	void wakeConnect()
+	{
+		HANDLE h = CreateFileA(_pipeName.c_str(), GENERIC_READ, 0,
+				       nullptr, OPEN_EXISTING, 0, nullptr);
+		if (h != INVALID_HANDLE_VALUE)
+			CloseHandle(h);
+	}
+
+	static DWORD WINAPI Writer(void *data)
+	{
+		PipeTap *t = static_cast<PipeTap *>(data);
+		os_set_thread_name("obs-voicemeeter: pcm tap");
+		/*swapped with the queue slot, so buffers are reused*/
+		std::vector<uint8_t> chunk;
+
+		while (t->_running) {
+			BOOL ok = ConnectNamedPipe(t->_pipe, nullptr);
+			if (!ok && GetLastError() != ERROR_PIPE_CONNECTED) {
+				Sleep(100);
+				continue;
+			}
+			if (!t->_running)
+				break;
+			blog(LOG_INFO, "pcm tap: client connected to %s",
+			     t->_pipeName.c_str());
+			t->_connected = true;
+
+			while (t->_running) {
+				size_t bytes;
+				{
+					std::unique_lock<std::mutex> lock(
+						t->_lock);
+					t->_notEmpty.wait(lock, [t]() {
+						return t->_count ||
+						       !t->_running;
+					});
+					if (!t->_running)
+						break;
+					chunk.swap(t->_chunks[t->_head]);
+					bytes = t->_chunkBytes[t->_head];
+					t->_head = (t->_head + 1) %
+						   PIPE_TAP_QUEUE;
+					t->_count--;
+				}
+				t->_notFull.notify_one();
+
+				DWORD written = 0;
+				ok = WriteFile(t->_pipe, chunk.data(),
+					       (DWORD)bytes, &written, nullptr);
+				if (!ok)
+					break;
+				t->_written.fetch_add(written);
+			}
+
+			{
+				/*the next client starts with fresh audio*/
+				std::lock_guard<std::mutex> lock(t->_lock);
+				t->_connected = false;
+				t->_count = 0;
+			}
+			t->_notFull.notify_all();
+			DisconnectNamedPipe(t->_pipe);
+			blog(LOG_INFO, "pcm tap: client disconnected");
+		}
+		return 0;
+	}
+
+public:
+	~PipeTap() { Stop(); }
+
+	std::string Name() { return _name; }
+
+	bool Running() const { return _running; }
+
+	bool Start(const char *name, const std::vector<int> &channels,
+		   pcm_format format, pipe_tap_policy policy)
+	{
+		Stop();
+		_pipeName = std::string("\\\\.\\pipe\\") + name;
+		_channels = channels;
+		_sources.resize(channels.size());
+		_format = format;
+		pcm_dither_init(&_dither, (uint32_t)os_gettime_ns());
+		_policy = policy;
+		_head = 0;
+		_count = 0;
+		_written = 0;
+		_overflows = 0;
+		if (_channels.empty())
+			return false;
+
+		_pipe = CreateNamedPipeA(_pipeName.c_str(), PIPE_ACCESS_OUTBOUND,
+					 PIPE_TYPE_BYTE | PIPE_WAIT, 1,
+					 1024 * 1024, 0, 0, nullptr);
+		if (!_pipe.Valid()) {
+			blog(LOG_ERROR, "pcm tap: could not create %s (%lu)",
+			     _pipeName.c_str(), GetLastError());
+			return false;
+		}
+		_running = true;
+		_writerThread =
+			CreateThread(nullptr, 0, Writer, this, 0, nullptr);
+		blog(LOG_INFO, "pcm tap: serving %u channels on %s",
+		     (unsigned)_channels.size(), _pipeName.c_str());
+		return true;
+	}
+
+	void Stop()
+	{
+		if (_running) {
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				_running = false;
+			}
+			/*Read may be parked waiting for room in the queue*/
+			_notEmpty.notify_all();
+			_notFull.notify_all();
+			/*the writer is either waiting for a client or in
+			 *WriteFile, retried since it may enter either after
+			 *the first attempt*/
+			do {
+				if (_connected)
+					CancelSynchronousIo(_writerThread);
+				else
+					wakeConnect();
+			} while (WaitForSingleObject(_writerThread, 100) ==
+				 WAIT_TIMEOUT);
+			_writerThread = nullptr;
+			_pipe = nullptr;
+			blog(LOG_INFO,
+			     "pcm tap: wrote %.1f MB, %llu chunks dropped",
+			     _written.load() / 1048576.0,
+			     (unsigned long long)_overflows.load());
+		}
+		/*only once the reader thread can't be blocked in Read*/
+		this->Disconnect();
+	}
+
+	uint64_t Overflows() const { return _overflows.load(); }
+
+	void Read(const Data *buf)
+	{
+		TraceScope trace("PipeTap::Read");
+		/*nothing is queued until an encoder is reading*/
+		if (!_connected)
+			return;
+
+		size_t bytes = buf->data.audiobuffer_nbs * _channels.size() *
+			       pcm_sample_bytes(_format);
+		std::unique_lock<std::mutex> lock(_lock);
+		if (_count == PIPE_TAP_QUEUE) {
+			if (_policy == pipe_tap_block_writer) {
+				_notFull.wait(lock, [this]() {
+					return _count < PIPE_TAP_QUEUE ||
+					       !_running || !_connected;
+				});
+				if (!_running || !_connected)
+					return;
+			} else {
+				_head = (_head + 1) % PIPE_TAP_QUEUE;
+				_count--;
+				_overflows.fetch_add(1);
+			}
+		}
+		size_t tail = (_head + _count) % PIPE_TAP_QUEUE;
+		std::vector<uint8_t> &chunk = _chunks[tail];
+		if (chunk.size() < bytes)
+			chunk.resize(bytes);
+		pack(buf, chunk.data());
+		_chunkBytes[tail] = bytes;
+		_count++;
+		lock.unlock();
+		_notEmpty.notify_one();
+	}
+};
@@ -0,0 +1,545 @@
+#pragma once
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <windows.h>
+#include <util/windows/WinHandle.hpp>
+#include "circle-buffer.h"
+#include "iso-recorder.h"
+#include "sample-kernels.h"
+
+/*
+ * Rolling in-memory copy of the last few seconds of selected channels.
+ *
+ * Each buffer is quantized to 24 bits and every channel is encoded on its
+ * own with the better of a first or second order fixed predictor followed
+ * by Rice coding of the residuals (raw 24 bit if that would be smaller).
+ * Packets are independent so the oldest can be evicted at any time, they
+ * live back to back in a fixed size arena which caps the memory use.
+ *
+ * Encoding happens on the listener's reader thread, never on the
+ * Voicemeeter callback. Save snapshots the packet index and decodes it to
+ * a Wave64 file on its own thread, copying one packet at a time out of the
+ * arena and skipping any the writer has overwritten in the meantime.
+ */
+
+#define REPLAY_RICE_ESCAPE 32
+#define REPLAY_RAW_BITS 26
+
+enum replay_mode {
+	replay_raw = 0,
+	replay_order1,
+	replay_order2,
+};
+
+class BitWriter {
+	uint8_t *_out;
+	size_t _pos = 0;
+	uint64_t _acc = 0;
+	int _bits = 0;
+
+public:
+	BitWriter(uint8_t *out) : _out(out) {}
+
+	void Put(uint32_t value, int bits)
+	{
+		_acc = (_acc << bits) | (value & ((1ULL << bits) - 1));
+		_bits += bits;
+		while (_bits >= 8) {
+			_bits -= 8;
+			_out[_pos++] = (uint8_t)(_acc >> _bits);
+		}
+	}
+
+	void Unary(uint32_t q)
+	{
+		while (q >= 24) {
+			Put(0xFFFFFF, 24);
+			q -= 24;
+		}
+		Put((1u << q) - 1, q);
+	}
+
+	size_t Finish()
+	{
+		if (_bits)
+			_out[_pos++] = (uint8_t)(_acc << (8 - _bits));
+		_bits = 0;
+		return _pos;
+	}
+};
+
+class BitReader {
+	const uint8_t *_in;
+	size_t _pos = 0;
+	uint64_t _acc = 0;
+	int _bits = 0;
+
+public:
+	BitReader(const uint8_t *in) : _in(in) {}
+
+	uint32_t Get(int bits)
+	{
+		while (_bits < bits) {
+			_acc = (_acc << 8) | _in[_pos++];
+			_bits += 8;
+		}
+		_bits -= bits;
+		return (uint32_t)(_acc >> _bits) & (uint32_t)((1ULL << bits) - 1);
+	}
+
+	size_t Finish()
+	{
+		_bits = 0;
+		return _pos;
+	}
+};
+
+static inline uint32_t zigzag(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t u)
+{
+	return (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+}
+
+static inline int32_t replay_predict(int mode, const int32_t *x, size_t i)
+{
+	if (mode == replay_order1)
+		return x[i - 1];
+	return 2 * x[i - 1] - x[i - 2];
+}
+
+/*scratch needed to encode n samples, every residual could escape*/
+static inline size_t replay_max_bytes(size_t n)
+{
+	return 2 + 6 + n * 8;
+}
+
+static size_t replay_encode_raw(const int32_t *x, size_t n, uint8_t *out)
+{
+	out[0] = replay_raw;
+	for (size_t i = 0; i < n; i++) {
+		out[1 + i * 3] = (uint8_t)x[i];
+		out[2 + i * 3] = (uint8_t)(x[i] >> 8);
+		out[3 + i * 3] = (uint8_t)(x[i] >> 16);
+	}
+	return 1 + n * 3;
+}
+
+/*encodes one channel of n 24 bit samples, returns the bytes written*/
+static size_t replay_encode(const int32_t *x, size_t n, uint8_t *out)
+{
+	uint64_t sum1 = 0, sum2 = 0;
+	for (size_t i = 2; i < n; i++) {
+		sum1 += zigzag(x[i] - x[i - 1]);
+		sum2 += zigzag(x[i] - 2 * x[i - 1] + x[i - 2]);
+	}
+	int mode = sum2 < sum1 ? replay_order2 : replay_order1;
+	uint64_t sum = mode == replay_order2 ? sum2 : sum1;
+	uint64_t mean = n > 2 ? sum / (n - 2) : 0;
+	int k = 0;
+	while (k < 24 && (1ULL << (k + 1)) <= mean)
+		k++;
+
+	/*estimated size, escape hatch to raw when coding doesn't pay off*/
+	uint64_t estimate = n * (uint64_t)(k + 1) + (sum >> k);
+	if (n < 3 || estimate >= n * 24ULL)
+		return replay_encode_raw(x, n, out);
+
+	out[0] = (uint8_t)mode;
+	out[1] = (uint8_t)k;
+	BitWriter w(out + 2);
+	w.Put((uint32_t)x[0], 24);
+	w.Put((uint32_t)x[1], 24);
+	for (size_t i = 2; i < n; i++) {
+		uint32_t u = zigzag(x[i] - replay_predict(mode, x, i));
+		uint32_t q = u >> k;
+		if (q < REPLAY_RICE_ESCAPE) {
+			w.Unary(q);
+			w.Put(0, 1);
+			if (k)
+				w.Put(u, k);
+		} else {
+			w.Unary(REPLAY_RICE_ESCAPE);
+			w.Put(u, REPLAY_RAW_BITS);
+		}
+	}
+	size_t bytes = 2 + w.Finish();
+	if (bytes > 1 + n * 3)
+		return replay_encode_raw(x, n, out);
+	return bytes;
+}
+
+static inline int32_t sign_extend24(uint32_t v)
+{
+	return (int32_t)(v << 8) >> 8;
+}
+
+/*decodes n samples of one channel, returns the bytes consumed*/
+static size_t replay_decode(const uint8_t *in, size_t n, int32_t *x)
+{
+	if (in[0] == replay_raw) {
+		for (size_t i = 0; i < n; i++)
+			x[i] = sign_extend24((uint32_t)in[1 + i * 3] |
+					     ((uint32_t)in[2 + i * 3] << 8) |
+					     ((uint32_t)in[3 + i * 3] << 16));
+		return 1 + n * 3;
+	}
+
+	int mode = in[0];
+	int k = in[1];
+	BitReader r(in + 2);
+	x[0] = sign_extend24(r.Get(24));
+	x[1] = sign_extend24(r.Get(24));
+	for (size_t i = 2; i < n; i++) {
+		uint32_t q = 0;
+		while (q < REPLAY_RICE_ESCAPE && r.Get(1))
+			q++;
+		uint32_t u;
+		if (q == REPLAY_RICE_ESCAPE)
+			u = r.Get(REPLAY_RAW_BITS);
+		else
+			u = (q << k) | (k ? r.Get(k) : 0);
+		x[i] = unzigzag(u) + replay_predict(mode, x, i);
+	}
+	return 2 + r.Finish();
+}
+
+struct ReplayPacket {
+	size_t offset;
+	/*arena bytes consumed before this packet, tells if it was overwritten*/
+	uint64_t pos;
+	uint32_t bytes;
+	uint32_t frames;
+	uint64_t ts;
+};
+
+template<class Data> class ReplayBuffer : public StreamableReader<Data> {
+	std::string _name = "replay buffer";
+	std::vector<int> _channels;
+	uint64_t _maxNs = 0;
+
+	std::mutex _lock;
+	std::vector<uint8_t> _arena;
+	std::deque<ReplayPacket> _packets;
+	size_t _head = 0;
+	uint64_t _written = 0;
+	uint64_t _epoch = 0;
+	uint32_t _rate = 0;
+
+	/*reader thread scratch*/
+	std::vector<int32_t> _quantized;
+	std::vector<uint8_t> _encoded;
+
+	std::atomic<uint64_t> _rawBytes{0};
+	std::atomic<uint64_t> _encodedBytes{0};
+	std::atomic<uint64_t> _encodeNs{0};
+	std::atomic<uint64_t> _encodedFrames{0};
+
+	WinHandle _saveThread;
+
+	struct Snapshot {
+		ReplayBuffer *owner;
+		std::wstring path;
+		std::deque<ReplayPacket> packets;
+		std::vector<int> channels;
+		uint32_t rate;
+		uint64_t epoch;
+	};
+
+	bool overlaps(const ReplayPacket &p, size_t bytes) const
+	{
+		return p.offset < _head + bytes && p.offset + p.bytes > _head;
+	}
+
+	/*without a wrap the packets the write overlaps are the oldest ones,
+	 *after a wrap any of them can be, the older ones go along so the
+	 *index stays in arena order*/
+	void evict(size_t bytes, uint64_t ts, bool wrapped)
+	{
+		size_t drop = 0;
+		if (wrapped) {
+			for (size_t i = 0; i < _packets.size(); i++) {
+				if (overlaps(_packets[i], bytes))
+					drop = i + 1;
+			}
+		}
+		_packets.erase(_packets.begin(), _packets.begin() + drop);
+		while (!_packets.empty()) {
+			const ReplayPacket &p = _packets.front();
+			if (!overlaps(p, bytes) && ts - p.ts <= _maxNs)
+				break;
+			_packets.pop_front();
+		}
+	}
+
+	void store(const uint8_t *data, size_t bytes, uint32_t frames,
+		   uint64_t ts)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (bytes > _arena.size())
+			return;
+		bool wrapped = _head + bytes > _arena.size();
+		if (wrapped) {
+			/*packets never straddle the end, the tail is skipped*/
+			_written += _arena.size() - _head;
+			_head = 0;
+		}
+		evict(bytes, ts, wrapped);
+		memcpy(_arena.data() + _head, data, bytes);
+		_packets.push_back(
+			{_head, _written, (uint32_t)bytes, frames, ts});
+		_head += bytes;
+		_written += bytes;
+	}
+
+	/*copies one packet out unless the writer came around to it or the
+	 *buffer was reset since the snapshot*/
+	bool copy(const ReplayPacket &p, uint64_t epoch,
+		  std::vector<uint8_t> &out)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (epoch != _epoch || _written > p.pos + _arena.size())
+			return false;
+		out.assign(_arena.begin() + p.offset,
+			   _arena.begin() + p.offset + p.bytes);
+		return true;
+	}
+
+	/*forgets every packet, called with _lock held*/
+	void clear()
+	{
+		_packets.clear();
+		_head = 0;
+		_written = 0;
+		_epoch++;
+	}
+
+	static DWORD WINAPI SaveThread(void *data)
+	{
+		Snapshot *s = static_cast<Snapshot *>(data);
+		os_set_thread_name("obs-voicemeeter: replay save");
+		SetThreadPriority(GetCurrentThread(),
+				  THREAD_PRIORITY_BELOW_NORMAL);
+
+		HANDLE f = CreateFileW(s->path.c_str(), GENERIC_WRITE, 0,
+				       nullptr, CREATE_ALWAYS,
+				       FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (f == INVALID_HANDLE_VALUE) {
+			blog(LOG_ERROR, "replay buffer: could not open file");
+			delete s;
+			return 0;
+		}
+
+		size_t channels = s->channels.size();
+		uint8_t *header = (uint8_t *)bzalloc(ISO_HEADER_SIZE);
+		DWORD written = 0;
+		WriteFile(f, header, ISO_HEADER_SIZE, &written, nullptr);
+
+		uint64_t frames = 0;
+		size_t lost = 0;
+		std::vector<uint8_t> packet;
+		std::vector<int32_t> x;
+		std::vector<float> out;
+		for (const ReplayPacket &p : s->packets) {
+			if (!s->owner->copy(p, s->epoch, packet)) {
+				lost++;
+				continue;
+			}
+			frames += p.frames;
+			x.resize(p.frames);
+			out.resize(p.frames * channels);
+			const uint8_t *in = packet.data();
+			for (size_t c = 0; c < channels; c++) {
+				in += replay_decode(in, p.frames, x.data());
+				for (size_t i = 0; i < p.frames; i++)
+					out[i * channels + c] =
+						x[i] / 8388608.0f;
+			}
+			WriteFile(f, out.data(),
+				  (DWORD)(out.size() * sizeof(float)),
+				  &written, nullptr);
+		}
+		/*chunks are 8 byte aligned*/
+		uint64_t dataBytes = frames * channels * sizeof(float);
+		uint64_t pad = ((dataBytes + 7) & ~7ULL) - dataBytes;
+		if (pad) {
+			uint64_t zero = 0;
+			WriteFile(f, &zero, (DWORD)pad, &written, nullptr);
+		}
+		LARGE_INTEGER start = {};
+		SetFilePointerEx(f, start, nullptr, FILE_BEGIN);
+		w64_header(header, (uint16_t)channels, s->rate, 32, true,
+			   dataBytes);
+		WriteFile(f, header, ISO_HEADER_SIZE, &written, nullptr);
+		bfree(header);
+		CloseHandle(f);
+
+		if (lost)
+			blog(LOG_WARNING,
+			     "replay buffer: %zu packets were overwritten "
+			     "while saving",
+			     lost);
+		blog(LOG_INFO,
+		     "replay buffer: saved %.1f s of %u channels, %s",
+		     s->rate ? (double)frames / s->rate : 0.0,
+		     (unsigned)channels, s->owner->Describe().c_str());
+		delete s;
+		return 0;
+	}
+
+public:
+	~ReplayBuffer()
+	{
+		this->Disconnect();
+		if (_saveThread.Valid())
+			WaitForSingleObject(_saveThread, INFINITE);
+	}
+
+	std::string Name() { return _name; }
+
+	/*an empty channel list records every channel of the stage*/
+	void Configure(const std::vector<int> &channels, double seconds,
+		       size_t memoryBytes)
+	{
+		this->Disconnect();
+		std::lock_guard<std::mutex> guard(_lock);
+		_channels = channels;
+		_maxNs = (uint64_t)(seconds * 1000000000.0);
+		_arena.assign(memoryBytes, 0);
+		_arena.shrink_to_fit();
+		clear();
+		_rate = 0;
+		_rawBytes = 0;
+		_encodedBytes = 0;
+		_encodeNs = 0;
+		_encodedFrames = 0;
+	}
+
+	void Release()
+	{
+		this->Disconnect();
+		std::lock_guard<std::mutex> guard(_lock);
+		std::vector<uint8_t>().swap(_arena);
+		clear();
+	}
+
+	/*encoded size relative to the float input*/
+	double CompressionRatio() const
+	{
+		uint64_t raw = _rawBytes.load();
+		return raw ? (double)_encodedBytes.load() / raw : 0.0;
+	}
+
+	/*milliseconds of encoding per second of audio*/
+	double EncodeCost() const
+	{
+		uint64_t frames = _encodedFrames.load();
+		if (!frames || !_rate)
+			return 0.0;
+		double seconds = (double)frames / _rate;
+		return _encodeNs.load() / 1000000.0 / seconds;
+	}
+
+	std::string Describe()
+	{
+		char text[128];
+		snprintf(text, sizeof(text),
+			 "%.1f%% of float size, %.3f ms encode per second of audio",
+			 CompressionRatio() * 100.0, EncodeCost());
+		return text;
+	}
+
+	bool Save(const std::wstring &path)
+	{
+		if (_saveThread.Valid() &&
+		    WaitForSingleObject(_saveThread, 0) == WAIT_TIMEOUT) {
+			blog(LOG_WARNING, "replay buffer: save in progress");
+			return false;
+		}
+
+		Snapshot *s = new Snapshot();
+		s->owner = this;
+		s->path = path;
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			if (_packets.empty()) {
+				delete s;
+				return false;
+			}
+			s->packets = _packets;
+			s->channels = _channels;
+			s->rate = _rate;
+			s->epoch = _epoch;
+		}
+		_saveThread = CreateThread(nullptr, 0, SaveThread, s, 0,
+					   nullptr);
+		return true;
+	}
+
+	void Read(const Data *buf)
+	{
+		TraceScope trace("ReplayBuffer::Read");
+		if (_arena.empty())
+			return;
+		uint64_t start = os_gettime_ns();
+		size_t frames = buf->data.audiobuffer_nbs;
+		uint32_t rate = buf->data.audiobuffer_sr;
+
+		if (rate != _rate) {
+			std::lock_guard<std::mutex> guard(_lock);
+			if (_channels.empty()) {
+				for (int i = 0; i < buf->data.audiobuffer_nbi;
+				     i++)
+					_channels.push_back(i);
+			}
+			clear();
+			_rate = rate;
+		}
+
+		_quantized.resize(frames);
+		_encoded.resize(replay_max_bytes(frames) * _channels.size());
+		size_t bytes = 0;
+		for (int c : _channels) {
+			/*missing channels are kept as silence so the channel
+			 *count of every packet matches*/
+			if (c < 0 || c >= buf->data.audiobuffer_nbi) {
+				std::fill(_quantized.begin(), _quantized.end(),
+					  0);
+				bytes += replay_encode(_quantized.data(),
+						       frames,
+						       _encoded.data() + bytes);
+				continue;
+			}
+			/*full scale 32 bit through the shared kernels, the
+			 *shift keeps the top 24 bits*/
+			pcm_convert(_quantized.data(),
+				    buf->data.audiobuffer_r[c], frames, pcm_s32,
+				    nullptr);
+			for (size_t i = 0; i < frames; i++)
+				_quantized[i] >>= 8;
+			bytes += replay_encode(_quantized.data(), frames,
+					       _encoded.data() + bytes);
+		}
+
+		store(_encoded.data(), bytes, (uint32_t)frames, buf->ts);
+
+		_rawBytes.fetch_add(frames * _channels.size() * sizeof(float),
+				    std::memory_order_relaxed);
+		_encodedBytes.fetch_add(bytes, std::memory_order_relaxed);
+		_encodedFrames.fetch_add(frames, std::memory_order_relaxed);
+		_encodeNs.fetch_add(os_gettime_ns() - start,
+				    std::memory_order_relaxed);
+	}
+};
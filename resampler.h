@@ -0,0 +1,589 @@
+#pragma once
+#include <util/platform.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "circle-buffer.h"
+#include "sample-kernels.h"
+
+/*
+ * Polyphase windowed sinc resampler for planar float audio.
+ *
+ * A bank holds the taps of a Kaiser windowed sinc for a set of fractional
+ * delays. Fixed rate pairs whose reduced ratio up/down has few enough
+ * phases get an exact bank, output n uses phase (n * down) % up directly.
+ * Anything else (and the drift servo, whose step changes on every call)
+ * interpolates the taps of the two nearest of RESAMPLE_PHASES phases.
+ * Either way the taps are prepared once per output frame and each channel
+ * is one dot product, both with the SIMD kernels from sample-kernels.h.
+ *
+ * Banks are built once per rate pair and shared. StageResampler uses them
+ * to convert a whole stage to the OBS rate on one reader thread, every
+ * source of the stage then reads audio that OBS does not resample again.
+ */
+
+#define RESAMPLE_TAPS 32
+#define RESAMPLE_HALF (RESAMPLE_TAPS / 2)
+#define RESAMPLE_PHASES 128
+#define RESAMPLE_MAX_PHASES 1024
+#define RESAMPLE_BETA 8.6
+#define RESAMPLE_MAX_CHANNELS 128
+/*slot buffers grow in steps so a varying output size does not realloc*/
+#define RESAMPLE_SLOT_FRAMES 256
+
+#define ASRC_MAX_PPM 1000.0
+#define ASRC_RESYNC_NS 100000000ULL
+
+static inline double resample_bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	for (int k = 1; k < 32; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+	return sum;
+}
+
+static inline uint32_t resample_gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+struct ResampleBank {
+	/*exact ratio, up is 0 for an interpolated bank*/
+	uint32_t up = 0;
+	uint32_t down = 0;
+	size_t phases = 0;
+	/*fraction of the input nyquist that passes*/
+	double cutoff = 0.0;
+	std::vector<float> taps;
+
+	void Build(size_t phaseCount, double newCutoff)
+	{
+		phases = phaseCount;
+		cutoff = newCutoff;
+		taps.resize((phases + 1) * RESAMPLE_TAPS);
+		double norm = resample_bessel_i0(RESAMPLE_BETA);
+		for (size_t k = 0; k <= phases; k++) {
+			double frac = (double)k / phases;
+			float *h = taps.data() + k * RESAMPLE_TAPS;
+			for (size_t j = 0; j < RESAMPLE_TAPS; j++) {
+				double t =
+					(double)j - (RESAMPLE_HALF - 1) - frac;
+				double x = M_PI * cutoff * t;
+				double sinc = fabs(x) < 1e-9 ? 1.0 : sin(x) / x;
+				double w = t / RESAMPLE_HALF;
+				w = fabs(w) >= 1.0
+					    ? 0.0
+					    : resample_bessel_i0(
+						      RESAMPLE_BETA *
+						      sqrt(1.0 - w * w)) /
+						      norm;
+				h[j] = (float)(cutoff * sinc * w);
+			}
+		}
+	}
+
+	const float *Phase(size_t k) const
+	{
+		return taps.data() + k * RESAMPLE_TAPS;
+	}
+};
+
+/*shared bank for converting from -> to, from == to gives the drift bank*/
+static inline std::shared_ptr<const ResampleBank> resample_bank(uint32_t from,
+								uint32_t to)
+{
+	static std::mutex lock;
+	static std::map<std::pair<uint32_t, uint32_t>,
+			std::shared_ptr<const ResampleBank>>
+		banks;
+	std::lock_guard<std::mutex> guard(lock);
+	auto found = banks.find({from, to});
+	if (found != banks.end())
+		return found->second;
+
+	std::shared_ptr<ResampleBank> bank = std::make_shared<ResampleBank>();
+	uint32_t g = from && to ? resample_gcd(from, to) : 1;
+	double cutoff = 0.97 * (to < from ? (double)to / from : 1.0);
+	if (from != to && to / g <= RESAMPLE_MAX_PHASES) {
+		bank->up = to / g;
+		bank->down = from / g;
+		bank->Build(bank->up, cutoff);
+	} else {
+		bank->Build(RESAMPLE_PHASES, cutoff);
+	}
+	blog(LOG_INFO, "resampler: %u -> %u Hz, %u phases%s", from, to,
+	     (unsigned)bank->phases, bank->up ? "" : " (interpolated)");
+	banks[{from, to}] = bank;
+	return bank;
+}
+
+class PolyphaseResampler {
+	std::shared_ptr<const ResampleBank> _bank;
+	pcm_isa _isa = pcm_best_isa();
+	/*per channel input, the first frames are history*/
+	std::vector<std::vector<float>> _input;
+	size_t _channels = 0;
+	size_t _fill = 0;
+	/*interpolated position*/
+	double _pos = 0.0;
+	/*exact position, frame plus phase out of up*/
+	size_t _index = 0;
+	uint32_t _phase = 0;
+
+	void append(const float *const *in, size_t frames)
+	{
+		if (_input[0].size() < _fill + frames) {
+			for (auto &buf : _input)
+				buf.resize(_fill + frames);
+		}
+		for (size_t c = 0; c < _channels; c++)
+			memcpy(_input[c].data() + _fill, in[c],
+			       frames * sizeof(float));
+		_fill += frames;
+	}
+
+	/*keep what the next output still reaches back to*/
+	size_t compact(size_t index)
+	{
+		size_t drop = index + 1 - RESAMPLE_HALF;
+		if (drop > _fill)
+			drop = _fill;
+		for (auto &buf : _input)
+			memmove(buf.data(), buf.data() + drop,
+				(_fill - drop) * sizeof(float));
+		_fill -= drop;
+		return drop;
+	}
+
+public:
+	void Reset(size_t channels, std::shared_ptr<const ResampleBank> bank)
+	{
+		_bank = std::move(bank);
+		_channels = channels;
+		_input.resize(channels);
+		for (auto &in : _input)
+			in.assign(RESAMPLE_TAPS, 0.0f);
+		/*the first output lines up with the first input frame*/
+		_fill = RESAMPLE_HALF - 1;
+		_pos = RESAMPLE_HALF - 1;
+		_index = RESAMPLE_HALF - 1;
+		_phase = 0;
+	}
+
+	/*drops the filter history, the next output starts from fresh input*/
+	void Clear()
+	{
+		if (_bank)
+			Reset(_channels, _bank);
+	}
+
+	size_t Channels() const { return _channels; }
+
+	bool Exact() const { return _bank && _bank->up; }
+
+	/*input frames held back for the filter*/
+	double Latency() const
+	{
+		if (Exact())
+			return (double)(_fill - _index) -
+			       (double)_phase / _bank->up;
+		return (double)_fill - _pos;
+	}
+
+	/*output frames for one call, step is input frames per output*/
+	static size_t MaxOutput(size_t frames, double step)
+	{
+		return (size_t)((double)frames / step) + 2;
+	}
+
+	/*out must hold MaxOutput(frames, step) frames per channel*/
+	size_t Process(float *const *out, const float *const *in,
+		       size_t frames, double step)
+	{
+		if (_input.empty())
+			return 0;
+		append(in, frames);
+
+		const ResampleBank &bank = *_bank;
+		alignas(32) float coef[RESAMPLE_TAPS];
+		size_t n = 0;
+		for (;; n++) {
+			size_t i = (size_t)_pos;
+			if (i + RESAMPLE_HALF >= _fill)
+				break;
+			double phase = (_pos - (double)i) * bank.phases;
+			size_t k = (size_t)phase;
+			pcm_lerp_f32_isa(_isa, coef, bank.Phase(k),
+					 bank.Phase(k + 1),
+					 (float)(phase - (double)k),
+					 RESAMPLE_TAPS);
+			size_t from = i + 1 - RESAMPLE_HALF;
+			for (size_t c = 0; c < _channels; c++)
+				out[c][n] = pcm_dot_f32_isa(
+					_isa, _input[c].data() + from, coef,
+					RESAMPLE_TAPS);
+			_pos += step;
+		}
+		_pos -= (double)compact((size_t)_pos);
+		return n;
+	}
+
+	/*exact banks only, channels with active[c] false are skipped but
+	 *keep their history so enabling them later is seamless*/
+	size_t ProcessExact(float *const *out, const float *const *in,
+			    size_t frames, const bool *active)
+	{
+		if (_input.empty())
+			return 0;
+		append(in, frames);
+
+		const ResampleBank &bank = *_bank;
+		size_t n = 0;
+		for (;; n++) {
+			if (_index + RESAMPLE_HALF >= _fill)
+				break;
+			const float *coef = bank.Phase(_phase);
+			size_t from = _index + 1 - RESAMPLE_HALF;
+			for (size_t c = 0; c < _channels; c++) {
+				if (active[c])
+					out[c][n] = pcm_dot_f32_isa(
+						_isa, _input[c].data() + from,
+						coef, RESAMPLE_TAPS);
+			}
+			_phase += bank.down;
+			_index += _phase / bank.up;
+			_phase %= bank.up;
+		}
+		_index -= compact(_index);
+		return n;
+	}
+};
+
+/*
+ * Drift compensating ASRC. The OBS time of the last output frame is
+ * compared against the OBS timestamp of the input, the difference is the
+ * error of Voicemeeter's device clock against the OBS clock. A PI servo
+ * (same tuning as the send tracks) turns it into a resampling ratio
+ * within ASRC_MAX_PPM, and the output carries continuous timestamps so OBS
+ * never sees the drift as a gap or an overlap.
+ */
+class DriftResampler {
+	PolyphaseResampler _resampler;
+	std::vector<std::vector<float>> _out;
+	std::vector<float *> _outPtrs;
+	uint32_t _rate = 0;
+	uint64_t _start = 0;
+	uint64_t _produced = 0;
+	double _offset = 0.0;
+	double _error = 0.0;
+	double _integral = 0.0;
+	bool _locked = false;
+
+public:
+	std::atomic<double> ppm{0.0};
+	std::atomic<double> fillMs{0.0};
+	std::atomic<double> offsetMs{0.0};
+	std::atomic<uint64_t> resyncs{0};
+
+	void Reset()
+	{
+		_resampler.Clear();
+		_rate = 0;
+		_locked = false;
+		ppm = 0.0;
+		fillMs = 0.0;
+		offsetMs = 0.0;
+		resyncs = 0;
+	}
+
+	const float *const *Output() const { return _outPtrs.data(); }
+
+	/*returns the output frame count and the OBS timestamp of the first*/
+	size_t Process(const float *const *in, size_t channels, size_t frames,
+		       uint32_t rate, uint64_t ts, uint64_t *outTs)
+	{
+		if (!rate || !frames)
+			return 0;
+		if (rate != _rate || channels != _resampler.Channels()) {
+			_rate = rate;
+			_resampler.Reset(channels, resample_bank(rate, rate));
+			_locked = false;
+		}
+		if (!_locked) {
+			_start = ts;
+			_produced = 0;
+			_error = 0.0;
+			_integral = 0.0;
+		}
+
+		double maxRatio = ASRC_MAX_PPM / 1e6;
+		double adjust = _locked ? 0.2 * _error + _integral : 0.0;
+		adjust = adjust > maxRatio
+				 ? maxRatio
+				 : (adjust < -maxRatio ? -maxRatio : adjust);
+		ppm.store(adjust * 1e6, std::memory_order_relaxed);
+
+		size_t room =
+			PolyphaseResampler::MaxOutput(frames, 1.0 + adjust);
+		if (_out.size() != channels || _out[0].size() < room) {
+			_out.resize(channels);
+			_outPtrs.resize(channels);
+			for (size_t c = 0; c < channels; c++) {
+				_out[c].resize(room);
+				_outPtrs[c] = _out[c].data();
+			}
+		}
+		*outTs = _start + (uint64_t)((double)_produced * 1e9 / rate);
+		size_t n = _resampler.Process(_outPtrs.data(), in, frames,
+					      1.0 + adjust);
+		_produced += n;
+
+		/*seconds the output (plus what the filter holds) runs ahead
+		 *of the input on the OBS clock*/
+		double held = _resampler.Latency();
+		double err = (double)(int64_t)(_start - ts) / 1e9 +
+			     ((double)_produced + held - (double)frames) / rate;
+		if (!_locked) {
+			_offset = err;
+			_locked = true;
+		}
+		err -= _offset;
+		fillMs.store(held * 1000.0 / rate, std::memory_order_relaxed);
+		offsetMs.store(err * 1000.0, std::memory_order_relaxed);
+
+		/*a stalled or restarted engine is not drift, start over*/
+		if (fabs(err) * 1e9 > (double)ASRC_RESYNC_NS) {
+			_locked = false;
+			resyncs.fetch_add(1, std::memory_order_relaxed);
+			return n;
+		}
+
+		double dt = (double)frames / rate;
+		_error += (dt < 1.0 ? dt : 1.0) * (err - _error);
+		_integral += 0.01 * _error * dt;
+		_integral = _integral > maxRatio
+				    ? maxRatio
+				    : (_integral < -maxRatio ? -maxRatio
+							     : _integral);
+		return n;
+	}
+};
+
+/*
+ * Converts one stage to the OBS rate, once for all sources. Listens to the
+ * stage buffer like any other reader and republishes each block through
+ * its own StreamableBuffer, sources listen to that one instead. Only
+ * channels some source routes are filtered. It only runs while the rates
+ * differ, at equal rates sources listen to the stage itself; a block that
+ * still arrives at the OBS rate is passed through as is.
+ */
+template<class Data> class StageResampler : public StreamableReader<Data> {
+	std::string _name;
+	std::atomic<bool> _started{false};
+	uint32_t _to = 0;
+	uint32_t _from = 0;
+	PolyphaseResampler _resampler;
+	std::vector<std::vector<float>> _out;
+	std::atomic<int> _users[RESAMPLE_MAX_CHANNELS];
+	bool _active[RESAMPLE_MAX_CHANNELS];
+
+	static size_t slotFrames(size_t frames)
+	{
+		return (frames + RESAMPLE_SLOT_FRAMES - 1) /
+		       RESAMPLE_SLOT_FRAMES * RESAMPLE_SLOT_FRAMES;
+	}
+
+	static void copy(Data &buf, Data &out, bool used)
+	{
+		size_t bytes = buf.data.audiobuffer_nbs * sizeof(float);
+		size_t capacity = slotFrames(buf.data.audiobuffer_nbs);
+		bool grow = !used ||
+			    out.data.audiobuffer_nbi !=
+				    buf.data.audiobuffer_nbi ||
+			    capacity > slotFrames(out.data.audiobuffer_nbs);
+		if (grow && used) {
+			for (int i = 0; i < out.data.audiobuffer_nbi; i++)
+				bfree(out.data.audiobuffer_r[i]);
+		}
+		for (int i = 0; i < buf.data.audiobuffer_nbi; i++) {
+			if (grow)
+				out.data.audiobuffer_r[i] = (float *)bmalloc(
+					capacity * sizeof(float));
+			memcpy(out.data.audiobuffer_r[i],
+			       buf.data.audiobuffer_r[i], bytes);
+		}
+		out.data.audiobuffer_nbi = buf.data.audiobuffer_nbi;
+		out.data.audiobuffer_nbo = buf.data.audiobuffer_nbo;
+		out.data.audiobuffer_nbs = buf.data.audiobuffer_nbs;
+		out.data.audiobuffer_sr = buf.data.audiobuffer_sr;
+		out.ts = buf.ts;
+		out.cycle = buf.cycle;
+	}
+
+public:
+	StreamableBuffer<Data> buffer;
+	std::atomic<uint64_t> readNs{0};
+
+	StageResampler()
+	{
+		for (size_t c = 0; c < RESAMPLE_MAX_CHANNELS; c++) {
+			_users[c] = 0;
+			_active[c] = false;
+		}
+	}
+
+	~StageResampler() { Stop(); }
+
+	std::string Name() { return _name; }
+
+	/*starts listening to the stage the first time a source needs it*/
+	void Start(StreamableBuffer<Data> *stage, const char *name,
+		   uint32_t obsRate)
+	{
+		bool expected = false;
+		if (!_started.compare_exchange_strong(expected, true))
+			return;
+		_name = std::string("resample ") + name;
+		_to = obsRate;
+		_from = 0;
+		stage->AddListener(this);
+	}
+
+	void Stop()
+	{
+		this->Disconnect();
+		buffer.Disconnect();
+		_started = false;
+	}
+
+	void Use(int channel, int delta)
+	{
+		if (channel >= 0 && channel < RESAMPLE_MAX_CHANNELS)
+			_users[channel].fetch_add(delta);
+	}
+
+	void Read(const Data *buf)
+	{
+		TraceScope trace("StageResampler::Read");
+		uint64_t start = os_gettime_ns();
+		Data d = *buf;
+		uint32_t from = (uint32_t)buf->data.audiobuffer_sr;
+		size_t channels = (size_t)buf->data.audiobuffer_nbi;
+		if (channels > RESAMPLE_MAX_CHANNELS)
+			channels = RESAMPLE_MAX_CHANNELS;
+		if (from == _to || !from || !_to) {
+			_from = 0;
+			buffer.Write(d, copy);
+			return;
+		}
+
+		if (from != _from || channels != _resampler.Channels()) {
+			_from = from;
+			_resampler.Reset(channels, resample_bank(from, _to));
+		}
+		size_t frames = (size_t)buf->data.audiobuffer_nbs;
+		size_t room = PolyphaseResampler::MaxOutput(
+			frames, (double)from / _to);
+		if (_out.size() != channels || _out[0].size() < room) {
+			_out.resize(channels);
+			for (auto &o : _out)
+				o.assign(room, 0.0f);
+		}
+		for (size_t c = 0; c < channels; c++) {
+			d.data.audiobuffer_r[c] = _out[c].data();
+			bool active =
+				_users[c].load(std::memory_order_relaxed) > 0;
+			/*stale samples must not reach a source that starts
+			 *using the channel before the next block*/
+			if (!active && _active[c])
+				memset(_out[c].data(), 0, room * sizeof(float));
+			_active[c] = active;
+		}
+
+		/*the held frames come out first, stamp the block with them*/
+		double held = _resampler.Latency();
+		d.ts = buf->ts - (uint64_t)(held * 1e9 / from);
+		size_t n = _resampler.Exact()
+				   ? _resampler.ProcessExact(
+					     d.data.audiobuffer_r,
+					     buf->data.audiobuffer_r, frames,
+					     _active)
+				   : _resampler.Process(d.data.audiobuffer_r,
+							buf->data.audiobuffer_r,
+							frames,
+							(double)from / _to);
+		d.data.audiobuffer_nbi = (long)channels;
+		d.data.audiobuffer_nbs = (long)n;
+		d.data.audiobuffer_sr = (long)_to;
+		if (n)
+			buffer.Write(d, copy);
+		readNs.store(os_gettime_ns() - start,
+			     std::memory_order_relaxed);
+	}
+};
+
+/*frames per second one channel converts at, for the common rate pairs*/
+static inline std::string resample_benchmark()
+{
+	const uint32_t pairs[][2] = {{44100, 48000}, {96000, 48000},
+				     {48000, 44100}};
+	const size_t channels = 8, frames = 4096;
+	const int rounds = 50;
+	std::vector<float> in(channels * frames);
+	std::vector<const float *> inPtrs(channels);
+	std::vector<float *> outPtrs(channels);
+	std::vector<std::vector<float>> out(channels);
+	bool active[channels];
+	uint32_t seed = 1;
+	for (size_t i = 0; i < in.size(); i++)
+		in[i] = pcm_uniform(pcm_xorshift(seed)) * 2.0f - 1.0f;
+	for (size_t c = 0; c < channels; c++) {
+		inPtrs[c] = in.data() + c * frames;
+		out[c].resize(frames * 3);
+		outPtrs[c] = out[c].data();
+		active[c] = true;
+	}
+
+	std::string report;
+	char line[160];
+	for (auto &pair : pairs) {
+		PolyphaseResampler r;
+		r.Reset(channels, resample_bank(pair[0], pair[1]));
+		double step = (double)pair[0] / pair[1];
+		uint64_t start = os_gettime_ns();
+		for (int i = 0; i < rounds; i++) {
+			if (r.Exact())
+				r.ProcessExact(outPtrs.data(), inPtrs.data(),
+					       frames, active);
+			else
+				r.Process(outPtrs.data(), inPtrs.data(), frames,
+					  step);
+		}
+		double seconds = (double)(os_gettime_ns() - start) / 1e9;
+		snprintf(line, sizeof(line),
+			 "\nresample %u -> %u: %.1fx realtime per channel",
+			 pair[0], pair[1],
+			 seconds > 0.0 ? (double)rounds * frames * channels /
+						 pair[0] / seconds
+				       : 0.0);
+		report += line;
+	}
+	return report;
+}
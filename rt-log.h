@@ -0,0 +1,323 @@
+#pragma once
+#include <util/base.h>
+#include <util/platform.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <windows.h>
+#include <util/windows/WinHandle.hpp>
+
+/*
+ * Deferred logging for the audio callback and reader threads.
+ *
+ * rt_log pushes a fixed size record (a format string literal and up to
+ * RT_LOG_MAX_ARGS numeric arguments) into a preallocated lock-free queue,
+ * nothing is formatted or allocated on the calling thread. A low priority
+ * thread formats the records and forwards them to blog, folding repeats of
+ * the same message and limiting how many lines per second reach the log.
+ *
+ * Only %d/%i/%u/%x/%c, %f/%e/%g and %s with string literals are supported.
+ */
+
+#define RT_LOG_QUEUE_SIZE 1024
+#define RT_LOG_MAX_ARGS 4
+#define RT_LOG_POLL_MS 50
+#define RT_LOG_LINES_PER_SEC 20
+
+union RtLogArg {
+	int64_t i;
+	double d;
+	const char *s;
+};
+
+struct RtLogRecord {
+	std::atomic<size_t> sequence;
+	int level;
+	const char *format;
+	int argc;
+	RtLogArg args[RT_LOG_MAX_ARGS];
+};
+
+static inline void rt_log_set(RtLogArg &a, const char *v)
+{
+	a.s = v;
+}
+
+static inline void rt_log_set(RtLogArg &a, double v)
+{
+	a.d = v;
+}
+
+static inline void rt_log_set(RtLogArg &a, float v)
+{
+	a.d = v;
+}
+
+template<class T> static inline void rt_log_set(RtLogArg &a, T v)
+{
+	a.i = (int64_t)v;
+}
+
+template<class... Args>
+static inline void rt_log_pack(RtLogRecord &r, Args... args)
+{
+	int n = 0;
+	((n < RT_LOG_MAX_ARGS ? rt_log_set(r.args[n++], args) : (void)0),
+	 ...);
+	r.argc = n;
+}
+
+class RtLogger {
+	/*bounded multi-producer queue, one sequence number per slot*/
+	RtLogRecord _queue[RT_LOG_QUEUE_SIZE];
+	std::atomic<size_t> _head{0};
+	std::atomic<size_t> _tail{0};
+	std::atomic<uint64_t> _overflow{0};
+
+	WinHandle _thread;
+	WinHandle _stopSignal;
+
+	/*consumer thread only*/
+	const char *_lastFormat = nullptr;
+	int _lastLevel = 0;
+	uint64_t _repeats = 0;
+	uint64_t _repeatStart = 0;
+	uint64_t _suppressed = 0;
+	uint64_t _windowStart = 0;
+	int _windowLines = 0;
+
+	bool pop(RtLogRecord &out)
+	{
+		size_t pos = _tail.load(std::memory_order_relaxed);
+		RtLogRecord &r = _queue[pos % RT_LOG_QUEUE_SIZE];
+		size_t seq = r.sequence.load(std::memory_order_acquire);
+		if (seq != pos + 1)
+			return false;
+		out.level = r.level;
+		out.format = r.format;
+		out.argc = r.argc;
+		memcpy(out.args, r.args, sizeof(r.args));
+		r.sequence.store(pos + RT_LOG_QUEUE_SIZE,
+				 std::memory_order_release);
+		_tail.store(pos + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	static void format(const RtLogRecord &r, char *out, size_t size)
+	{
+		const char *f = r.format;
+		size_t len = 0;
+		int arg = 0;
+		while (*f && len + 1 < size) {
+			if (*f != '%') {
+				out[len++] = *f++;
+				continue;
+			}
+			if (f[1] == '%') {
+				out[len++] = '%';
+				f += 2;
+				continue;
+			}
+			/*copy flags/width/precision, drop length modifiers*/
+			char spec[32] = "%";
+			size_t s = 1;
+			f++;
+			while (*f && strchr("-+ #0123456789.", *f) &&
+			       s < sizeof(spec) - 4)
+				spec[s++] = *f++;
+			while (*f && strchr("hlLzjt", *f))
+				f++;
+			char conv = *f ? *f++ : 0;
+			if (!conv)
+				break;
+
+			int n = 0;
+			RtLogArg a = arg < r.argc ? r.args[arg] : RtLogArg{0};
+			arg++;
+			switch (conv) {
+			case 'd':
+			case 'i':
+			case 'u':
+			case 'x':
+			case 'X':
+			case 'c':
+				spec[s++] = 'l';
+				spec[s++] = 'l';
+				spec[s++] = conv == 'c' ? 'd' : conv;
+				spec[s] = 0;
+				if (conv == 'c')
+					n = snprintf(out + len, size - len,
+						     "%c", (char)a.i);
+				else
+					n = snprintf(out + len, size - len,
+						     spec, (long long)a.i);
+				break;
+			case 'f':
+			case 'e':
+			case 'g':
+			case 'E':
+			case 'G':
+				spec[s++] = conv;
+				spec[s] = 0;
+				n = snprintf(out + len, size - len, spec, a.d);
+				break;
+			case 's':
+				spec[s++] = 's';
+				spec[s] = 0;
+				n = snprintf(out + len, size - len, spec,
+					     a.s ? a.s : "(null)");
+				break;
+			default:
+				break;
+			}
+			if (n > 0)
+				len = min(len + (size_t)n, size - 1);
+		}
+		out[len] = 0;
+	}
+
+	void flushRepeats()
+	{
+		if (_repeats)
+			blog(_lastLevel,
+			     "obs-voicemeeter: last message repeated %llu times",
+			     (unsigned long long)_repeats);
+		_repeats = 0;
+	}
+
+	void emit(const RtLogRecord &r, uint64_t now)
+	{
+		/*identical format strings are treated as duplicates, the
+		 *arguments are usually counters that change every time*/
+		if (r.format == _lastFormat && r.level == _lastLevel) {
+			_repeats++;
+			return;
+		}
+		flushRepeats();
+		_lastFormat = r.format;
+		_lastLevel = r.level;
+		_repeatStart = now;
+
+		if (now - _windowStart >= 1000000000ULL) {
+			if (_suppressed)
+				blog(LOG_WARNING,
+				     "obs-voicemeeter: %llu log messages suppressed",
+				     (unsigned long long)_suppressed);
+			_windowStart = now;
+			_windowLines = 0;
+			_suppressed = 0;
+		}
+		if (_windowLines >= RT_LOG_LINES_PER_SEC) {
+			_suppressed++;
+			return;
+		}
+		_windowLines++;
+
+		char text[512];
+		format(r, text, sizeof(text));
+		blog(r.level, "obs-voicemeeter: %s", text);
+	}
+
+	void drain()
+	{
+		RtLogRecord r;
+		uint64_t now = os_gettime_ns();
+		while (pop(r))
+			emit(r, now);
+
+		/*a message that keeps repeating is reported once a second*/
+		if (_repeats && now - _repeatStart >= 1000000000ULL) {
+			flushRepeats();
+			_lastFormat = nullptr;
+		}
+
+		uint64_t overflow = _overflow.exchange(0);
+		if (overflow)
+			blog(LOG_WARNING,
+			     "obs-voicemeeter: log queue full, %llu messages lost",
+			     (unsigned long long)overflow);
+	}
+
+	static DWORD WINAPI Run(void *data)
+	{
+		RtLogger *log = static_cast<RtLogger *>(data);
+		os_set_thread_name("obs-voicemeeter: log");
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+		while (WaitForSingleObject(log->_stopSignal, RT_LOG_POLL_MS) ==
+		       WAIT_TIMEOUT)
+			log->drain();
+		log->drain();
+		log->flushRepeats();
+		return 0;
+	}
+
+public:
+	RtLogger()
+	{
+		for (size_t i = 0; i < RT_LOG_QUEUE_SIZE; i++)
+			_queue[i].sequence = i;
+		_stopSignal = CreateEvent(nullptr, true, false, nullptr);
+	}
+
+	/*static destruction runs under the loader lock, waiting for the
+	 *thread there can deadlock. obs_module_unload stops it, this only
+	 *signals a thread that is somehow left*/
+	~RtLogger()
+	{
+		if (_thread.Valid())
+			SetEvent(_stopSignal);
+	}
+
+	void Start()
+	{
+		if (_thread.Valid())
+			return;
+		ResetEvent(_stopSignal);
+		_thread = CreateThread(nullptr, 0, Run, this, 0, nullptr);
+	}
+
+	void Stop()
+	{
+		if (!_thread.Valid())
+			return;
+		SetEvent(_stopSignal);
+		WaitForSingleObject(_thread, INFINITE);
+		_thread = nullptr;
+	}
+
+	/*never blocks, drops the record (and counts it) if the queue is full*/
+	template<class... Args>
+	void Push(int level, const char *format, Args... args)
+	{
+		size_t pos = _head.load(std::memory_order_relaxed);
+		RtLogRecord *r;
+		for (;;) {
+			r = &_queue[pos % RT_LOG_QUEUE_SIZE];
+			size_t seq = r->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (_head.compare_exchange_weak(
+					    pos, pos + 1,
+					    std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				_overflow.fetch_add(1,
+						    std::memory_order_relaxed);
+				return;
+			} else {
+				pos = _head.load(std::memory_order_relaxed);
+			}
+		}
+		r->level = level;
+		r->format = format;
+		rt_log_pack(*r, args...);
+		r->sequence.store(pos + 1, std::memory_order_release);
+	}
+};
+
+static RtLogger rtLogger;
+
+#define rt_log(level, format, ...) \
+	rtLogger.Push(level, format, ##__VA_ARGS__)
@@ -0,0 +1,1380 @@
+#pragma once
+#include <util/platform.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#define PCM_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define PCM_AVX2
+#else
+#define PCM_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define PCM_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * Planar <-> interleaved transposes and float -> integer sample conversion
+ * for every path that hands Voicemeeter audio to something outside OBS.
+ *
+ * Each kernel has a scalar version and a 4 lane version (SSE2 or NEON)
+ * written once against the small pcm_v4 wrapper below, x86 additionally
+ * has AVX2 versions selected at runtime. Integer formats are scaled by
+ * 2^(bits-1), saturated, and optionally TPDF dithered (one LSB peak each
+ * way) from a per stream xorshift generator. 24 bit output is packed
+ * little endian, three bytes per sample.
+ */
+
+#define PCM_BLOCK 4096
+
+enum pcm_format {
+	pcm_f32 = 0,
+	pcm_s16,
+	pcm_s24,
+	pcm_s32,
+};
+
+enum pcm_isa {
+	pcm_isa_scalar = 0,
+	pcm_isa_simd,
+	pcm_isa_avx2,
+};
+
+struct PcmDither {
+	uint32_t state[8];
+};
+
+static inline void pcm_dither_init(PcmDither *d, uint32_t seed)
+{
+	for (uint32_t i = 0; i < 8; i++) {
+		/*xorshift must never start at zero*/
+		uint32_t s = (seed + i + 1) * 2654435761u;
+		d->state[i] = s ? s : 1;
+	}
+}
+
+static inline size_t pcm_sample_bytes(pcm_format format)
+{
+	switch (format) {
+	case pcm_s16:
+		return 2;
+	case pcm_s24:
+		return 3;
+	default:
+		return 4;
+	}
+}
+
+static inline float pcm_scale(pcm_format format)
+{
+	switch (format) {
+	case pcm_s16:
+		return 32768.0f;
+	case pcm_s24:
+		return 8388608.0f;
+	default:
+		return 2147483648.0f;
+	}
+}
+
+static inline float pcm_max(pcm_format format)
+{
+	switch (format) {
+	case pcm_s16:
+		return 32767.0f;
+	case pcm_s24:
+		return 8388607.0f;
+	default:
+		/*largest float below 2^31*/
+		return 2147483520.0f;
+	}
+}
+
+static inline bool pcm_cpu_avx2()
+{
+#if defined(PCM_X86) && defined(_MSC_VER) && !defined(__clang__)
+	int r[4];
+	__cpuid(r, 0);
+	if (r[0] < 7)
+		return false;
+	__cpuid(r, 1);
+	/*OSXSAVE and AVX, then the OS must save the YMM state*/
+	if ((r[2] & (3 << 27)) != (3 << 27) || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(r, 7, 0);
+	return (r[1] & (1 << 5)) != 0;
+#elif defined(PCM_X86)
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+static inline pcm_isa pcm_best_isa()
+{
+	static const pcm_isa isa = pcm_cpu_avx2() ? pcm_isa_avx2
+#if defined(PCM_X86) || defined(PCM_NEON)
+						  : pcm_isa_simd;
+#else
+						  : pcm_isa_scalar;
+#endif
+	return isa;
+}
+
+static inline const char *pcm_isa_name(pcm_isa isa)
+{
+	switch (isa) {
+	case pcm_isa_avx2:
+		return "avx2";
+	case pcm_isa_simd:
+#ifdef PCM_NEON
+		return "neon";
+#else
+		return "sse2";
+#endif
+	default:
+		return "scalar";
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * scalar
+ */
+
+static inline void pcm_interleave_scalar(float *out, const float *const *in,
+					 size_t offset, size_t channels,
+					 size_t first, size_t frames)
+{
+	for (size_t c = 0; c < channels; c++) {
+		const float *s = in[c] + offset;
+		float *o = out + first * channels + c;
+		for (size_t f = first; f < frames; f++, o += channels)
+			*o = s[f];
+	}
+}
+
+static inline void pcm_deinterleave_scalar(float *const *out, const float *in,
+					   size_t offset, size_t channels,
+					   size_t first, size_t frames)
+{
+	for (size_t c = 0; c < channels; c++) {
+		float *o = out[c] + offset;
+		const float *s = in + first * channels + c;
+		for (size_t f = first; f < frames; f++, s += channels)
+			o[f] = *s;
+	}
+}
+
+static inline uint32_t pcm_xorshift(uint32_t &x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static inline float pcm_uniform(uint32_t x)
+{
+	/*23 random mantissa bits give [1, 2)*/
+	uint32_t bits = (x >> 9) | 0x3f800000;
+	float f;
+	memcpy(&f, &bits, 4);
+	return f - 1.0f;
+}
+
+static inline int32_t pcm_quantize(float v, float scale, float max,
+				   PcmDither *d)
+{
+	v *= scale;
+	if (d) {
+		uint32_t &x = d->state[0];
+		v += pcm_uniform(pcm_xorshift(x)) - pcm_uniform(pcm_xorshift(x));
+	}
+	v = v > max ? max : (v < -scale ? -scale : v);
+	/*NaN fails both comparisons*/
+	if (v != v)
+		v = 0.0f;
+	return (int32_t)lrintf(v);
+}
+
+static inline void pcm_store_s24(uint8_t *o, int32_t s)
+{
+	o[0] = (uint8_t)s;
+	o[1] = (uint8_t)(s >> 8);
+	o[2] = (uint8_t)(s >> 16);
+}
+
+static inline void pcm_convert_scalar(void *out, const float *in,
+				      size_t first, size_t samples,
+				      pcm_format format, PcmDither *d)
+{
+	float scale = pcm_scale(format);
+	float max = pcm_max(format);
+	if (format == pcm_s32)
+		d = nullptr;
+	for (size_t i = first; i < samples; i++) {
+		int32_t s = pcm_quantize(in[i], scale, max, d);
+		switch (format) {
+		case pcm_s16:
+			((int16_t *)out)[i] = (int16_t)s;
+			break;
+		case pcm_s24:
+			pcm_store_s24((uint8_t *)out + i * 3, s);
+			break;
+		default:
+			((int32_t *)out)[i] = s;
+			break;
+		}
+	}
+}
+
+static inline void pcm_mix_scalar(float *dst, const float *src,
+				  size_t first, size_t samples)
+{
+	for (size_t i = first; i < samples; i++)
+		dst[i] += src[i];
+}
+
+static inline float pcm_dot_scalar(const float *a, const float *b,
+				   size_t first, size_t n, float sum)
+{
+	for (size_t i = first; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+static inline void pcm_lerp_scalar(float *dst, const float *a, const float *b,
+				   float t, size_t first, size_t n)
+{
+	for (size_t i = first; i < n; i++)
+		dst[i] = a[i] + (b[i] - a[i]) * t;
+}
+
+static inline void pcm_copy_level_scalar(float *dst, const float *src,
+					 size_t first, size_t n, float *peak,
+					 float *sumSq)
+{
+	float p = *peak, s = *sumSq;
+	for (size_t i = first; i < n; i++) {
+		float v = src[i];
+		dst[i] = v;
+		p = fmaxf(p, fabsf(v));
+		s += v * v;
+	}
+	*peak = p;
+	*sumSq = s;
+}
+
+/* ------------------------------------------------------------------------
+ * 4 lanes, SSE2 or NEON
+ */
+
+#if defined(PCM_X86) || defined(PCM_NEON)
+
+#ifdef PCM_X86
+typedef __m128 pcm_v4;
+typedef __m128i pcm_u4;
+
+static inline pcm_v4 pcm_load(const float *p)
+{
+	return _mm_loadu_ps(p);
+}
+
+static inline void pcm_store(float *p, pcm_v4 v)
+{
+	_mm_storeu_ps(p, v);
+}
+
+static inline void pcm_transpose4(pcm_v4 &a, pcm_v4 &b, pcm_v4 &c, pcm_v4 &d)
+{
+	_MM_TRANSPOSE4_PS(a, b, c, d);
+}
+
+/*a0 b0 a1 b1 and a2 b2 a3 b3*/
+static inline void pcm_zip(pcm_v4 a, pcm_v4 b, pcm_v4 &lo, pcm_v4 &hi)
+{
+	lo = _mm_unpacklo_ps(a, b);
+	hi = _mm_unpackhi_ps(a, b);
+}
+
+/*inverse of pcm_zip*/
+static inline void pcm_unzip(pcm_v4 lo, pcm_v4 hi, pcm_v4 &a, pcm_v4 &b)
+{
+	a = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+	b = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+}
+
+static inline void pcm_store_lo(float *p, pcm_v4 v)
+{
+	_mm_storel_pi((__m64 *)p, v);
+}
+
+static inline void pcm_store_hi(float *p, pcm_v4 v)
+{
+	_mm_storeh_pi((__m64 *)p, v);
+}
+
+static inline pcm_v4 pcm_load_pairs(const float *lo, const float *hi)
+{
+	pcm_v4 v = _mm_setzero_ps();
+	v = _mm_loadl_pi(v, (const __m64 *)lo);
+	return _mm_loadh_pi(v, (const __m64 *)hi);
+}
+
+static inline pcm_u4 pcm_xorshift4(pcm_u4 &x)
+{
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	return x;
+}
+
+static inline pcm_v4 pcm_uniform4(pcm_u4 x)
+{
+	__m128i bits = _mm_or_si128(_mm_srli_epi32(x, 9),
+				    _mm_set1_epi32(0x3f800000));
+	return _mm_sub_ps(_mm_castsi128_ps(bits), _mm_set1_ps(1.0f));
+}
+
+static inline pcm_u4 pcm_state4(const PcmDither *d)
+{
+	return _mm_loadu_si128((const __m128i *)d->state);
+}
+
+static inline void pcm_save_state4(PcmDither *d, pcm_u4 x)
+{
+	_mm_storeu_si128((__m128i *)d->state, x);
+}
+
+/*scaled, dithered, clamped and rounded to nearest*/
+static inline pcm_u4 pcm_quantize4(pcm_v4 v, pcm_v4 scale, pcm_v4 lo,
+				   pcm_v4 hi, pcm_u4 *x)
+{
+	v = _mm_mul_ps(v, scale);
+	if (x) {
+		pcm_v4 r1 = pcm_uniform4(pcm_xorshift4(*x));
+		pcm_v4 r2 = pcm_uniform4(pcm_xorshift4(*x));
+		v = _mm_add_ps(v, _mm_sub_ps(r1, r2));
+	}
+	/*NaN to 0 like pcm_quantize, max_ps would make it lo*/
+	v = _mm_and_ps(v, _mm_cmpord_ps(v, v));
+	v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+	return _mm_cvtps_epi32(v);
+}
+
+static inline void pcm_store_s16x8(int16_t *o, pcm_u4 a, pcm_u4 b)
+{
+	_mm_storeu_si128((__m128i *)o, _mm_packs_epi32(a, b));
+}
+
+static inline void pcm_store_s32x4(int32_t *o, pcm_u4 a)
+{
+	_mm_storeu_si128((__m128i *)o, a);
+}
+
+static inline pcm_v4 pcm_set1(float f)
+{
+	return _mm_set1_ps(f);
+}
+
+static inline pcm_v4 pcm_add(pcm_v4 a, pcm_v4 b)
+{
+	return _mm_add_ps(a, b);
+}
+
+static inline pcm_v4 pcm_sub(pcm_v4 a, pcm_v4 b)
+{
+	return _mm_sub_ps(a, b);
+}
+
+static inline pcm_v4 pcm_mul(pcm_v4 a, pcm_v4 b)
+{
+	return _mm_mul_ps(a, b);
+}
+
+static inline float pcm_hsum(pcm_v4 v)
+{
+	__m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+static inline pcm_v4 pcm_abs(pcm_v4 v)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+}
+
+static inline pcm_v4 pcm_max4(pcm_v4 a, pcm_v4 b)
+{
+	return _mm_max_ps(a, b);
+}
+
+static inline float pcm_hmax(pcm_v4 v)
+{
+	__m128 m = _mm_max_ps(v, _mm_movehl_ps(v, v));
+	m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+	return _mm_cvtss_f32(m);
+}
+#else
+typedef float32x4_t pcm_v4;
+typedef uint32x4_t pcm_u4;
+
+static inline pcm_v4 pcm_load(const float *p)
+{
+	return vld1q_f32(p);
+}
+
+static inline void pcm_store(float *p, pcm_v4 v)
+{
+	vst1q_f32(p, v);
+}
+
+static inline void pcm_transpose4(pcm_v4 &a, pcm_v4 &b, pcm_v4 &c, pcm_v4 &d)
+{
+	float32x4x2_t ab = vtrnq_f32(a, b);
+	float32x4x2_t cd = vtrnq_f32(c, d);
+	a = vcombine_f32(vget_low_f32(ab.val[0]), vget_low_f32(cd.val[0]));
+	b = vcombine_f32(vget_low_f32(ab.val[1]), vget_low_f32(cd.val[1]));
+	c = vcombine_f32(vget_high_f32(ab.val[0]), vget_high_f32(cd.val[0]));
+	d = vcombine_f32(vget_high_f32(ab.val[1]), vget_high_f32(cd.val[1]));
+}
+
+static inline void pcm_zip(pcm_v4 a, pcm_v4 b, pcm_v4 &lo, pcm_v4 &hi)
+{
+	float32x4x2_t z = vzipq_f32(a, b);
+	lo = z.val[0];
+	hi = z.val[1];
+}
+
+static inline void pcm_unzip(pcm_v4 lo, pcm_v4 hi, pcm_v4 &a, pcm_v4 &b)
+{
+	float32x4x2_t u = vuzpq_f32(lo, hi);
+	a = u.val[0];
+	b = u.val[1];
+}
+
+static inline void pcm_store_lo(float *p, pcm_v4 v)
+{
+	vst1_f32(p, vget_low_f32(v));
+}
+
+static inline void pcm_store_hi(float *p, pcm_v4 v)
+{
+	vst1_f32(p, vget_high_f32(v));
+}
+
+static inline pcm_v4 pcm_load_pairs(const float *lo, const float *hi)
+{
+	return vcombine_f32(vld1_f32(lo), vld1_f32(hi));
+}
+
+static inline pcm_u4 pcm_xorshift4(pcm_u4 &x)
+{
+	x = veorq_u32(x, vshlq_n_u32(x, 13));
+	x = veorq_u32(x, vshrq_n_u32(x, 17));
+	x = veorq_u32(x, vshlq_n_u32(x, 5));
+	return x;
+}
+
+static inline pcm_v4 pcm_uniform4(pcm_u4 x)
+{
+	uint32x4_t bits =
+		vorrq_u32(vshrq_n_u32(x, 9), vdupq_n_u32(0x3f800000));
+	return vsubq_f32(vreinterpretq_f32_u32(bits), vdupq_n_f32(1.0f));
+}
+
+static inline pcm_u4 pcm_state4(const PcmDither *d)
+{
+	return vld1q_u32(d->state);
+}
+
+static inline void pcm_save_state4(PcmDither *d, pcm_u4 x)
+{
+	vst1q_u32(d->state, x);
+}
+
+static inline pcm_u4 pcm_quantize4(pcm_v4 v, pcm_v4 scale, pcm_v4 lo,
+				   pcm_v4 hi, pcm_u4 *x)
+{
+	v = vmulq_f32(v, scale);
+	if (x) {
+		pcm_v4 r1 = pcm_uniform4(pcm_xorshift4(*x));
+		pcm_v4 r2 = pcm_uniform4(pcm_xorshift4(*x));
+		v = vaddq_f32(v, vsubq_f32(r1, r2));
+	}
+	/*NaN to 0 like pcm_quantize, vmaxnm would make it lo*/
+	v = vreinterpretq_f32_u32(
+		vandq_u32(vreinterpretq_u32_f32(v), vceqq_f32(v, v)));
+	v = vminq_f32(vmaxq_f32(v, lo), hi);
+	return vreinterpretq_u32_s32(vcvtnq_s32_f32(v));
+}
+
+static inline void pcm_store_s16x8(int16_t *o, pcm_u4 a, pcm_u4 b)
+{
+	vst1q_s16(o, vcombine_s16(vqmovn_s32(vreinterpretq_s32_u32(a)),
+				  vqmovn_s32(vreinterpretq_s32_u32(b))));
+}
+
+static inline void pcm_store_s32x4(int32_t *o, pcm_u4 a)
+{
+	vst1q_s32(o, vreinterpretq_s32_u32(a));
+}
+
+static inline pcm_v4 pcm_set1(float f)
+{
+	return vdupq_n_f32(f);
+}
+
+static inline pcm_v4 pcm_add(pcm_v4 a, pcm_v4 b)
+{
+	return vaddq_f32(a, b);
+}
+
+static inline pcm_v4 pcm_sub(pcm_v4 a, pcm_v4 b)
+{
+	return vsubq_f32(a, b);
+}
+
+static inline pcm_v4 pcm_mul(pcm_v4 a, pcm_v4 b)
+{
+	return vmulq_f32(a, b);
+}
+
+static inline float pcm_hsum(pcm_v4 v)
+{
+	return vaddvq_f32(v);
+}
+
+static inline pcm_v4 pcm_abs(pcm_v4 v)
+{
+	return vabsq_f32(v);
+}
+
+static inline pcm_v4 pcm_max4(pcm_v4 a, pcm_v4 b)
+{
+	return vmaxq_f32(a, b);
+}
+
+static inline float pcm_hmax(pcm_v4 v)
+{
+	return vmaxvq_f32(v);
+}
+#endif
+
+/*channels [c0, c1) of frames [0, frames), frames a multiple of 4*/
+static inline void pcm_interleave_simd(float *out, const float *const *in,
+				       size_t offset, size_t channels,
+				       size_t c0, size_t c1, size_t frames)
+{
+	size_t c = c0;
+	if (c0 == 0 && c1 == 2 && channels == 2) {
+		const float *l = in[0] + offset;
+		const float *r = in[1] + offset;
+		for (size_t f = 0; f < frames; f += 4) {
+			pcm_v4 lo, hi;
+			pcm_zip(pcm_load(l + f), pcm_load(r + f), lo, hi);
+			pcm_store(out + 2 * f, lo);
+			pcm_store(out + 2 * f + 4, hi);
+		}
+		return;
+	}
+	for (; c + 4 <= c1; c += 4) {
+		const float *s0 = in[c] + offset;
+		const float *s1 = in[c + 1] + offset;
+		const float *s2 = in[c + 2] + offset;
+		const float *s3 = in[c + 3] + offset;
+		for (size_t f = 0; f < frames; f += 4) {
+			pcm_v4 a = pcm_load(s0 + f), b = pcm_load(s1 + f);
+			pcm_v4 d = pcm_load(s2 + f), e = pcm_load(s3 + f);
+			pcm_transpose4(a, b, d, e);
+			float *o = out + f * channels + c;
+			pcm_store(o, a);
+			pcm_store(o + channels, b);
+			pcm_store(o + 2 * channels, d);
+			pcm_store(o + 3 * channels, e);
+		}
+	}
+	for (; c + 2 <= c1; c += 2) {
+		const float *s0 = in[c] + offset;
+		const float *s1 = in[c + 1] + offset;
+		for (size_t f = 0; f < frames; f += 4) {
+			pcm_v4 lo, hi;
+			pcm_zip(pcm_load(s0 + f), pcm_load(s1 + f), lo, hi);
+			float *o = out + f * channels + c;
+			pcm_store_lo(o, lo);
+			pcm_store_hi(o + channels, lo);
+			pcm_store_lo(o + 2 * channels, hi);
+			pcm_store_hi(o + 3 * channels, hi);
+		}
+	}
+	if (c < c1) {
+		const float *s = in[c] + offset;
+		float *o = out + c;
+		for (size_t f = 0; f < frames; f++, o += channels)
+			*o = s[f];
+	}
+}
+
+static inline void pcm_deinterleave_simd(float *const *out, const float *in,
+					 size_t offset, size_t channels,
+					 size_t c0, size_t c1, size_t frames)
+{
+	size_t c = c0;
+	if (c0 == 0 && c1 == 2 && channels == 2) {
+		float *l = out[0] + offset;
+		float *r = out[1] + offset;
+		for (size_t f = 0; f < frames; f += 4) {
+			pcm_v4 a, b;
+			pcm_unzip(pcm_load(in + 2 * f), pcm_load(in + 2 * f + 4),
+				  a, b);
+			pcm_store(l + f, a);
+			pcm_store(r + f, b);
+		}
+		return;
+	}
+	for (; c + 4 <= c1; c += 4) {
+		for (size_t f = 0; f < frames; f += 4) {
+			const float *s = in + f * channels + c;
+			pcm_v4 a = pcm_load(s), b = pcm_load(s + channels);
+			pcm_v4 d = pcm_load(s + 2 * channels);
+			pcm_v4 e = pcm_load(s + 3 * channels);
+			pcm_transpose4(a, b, d, e);
+			pcm_store(out[c] + offset + f, a);
+			pcm_store(out[c + 1] + offset + f, b);
+			pcm_store(out[c + 2] + offset + f, d);
+			pcm_store(out[c + 3] + offset + f, e);
+		}
+	}
+	for (; c + 2 <= c1; c += 2) {
+		for (size_t f = 0; f < frames; f += 4) {
+			const float *s = in + f * channels + c;
+			pcm_v4 lo = pcm_load_pairs(s, s + channels);
+			pcm_v4 hi = pcm_load_pairs(s + 2 * channels,
+						   s + 3 * channels);
+			pcm_v4 a, b;
+			pcm_unzip(lo, hi, a, b);
+			pcm_store(out[c] + offset + f, a);
+			pcm_store(out[c + 1] + offset + f, b);
+		}
+	}
+	if (c < c1) {
+		float *o = out[c] + offset;
+		const float *s = in + c;
+		for (size_t f = 0; f < frames; f++, s += channels)
+			o[f] = *s;
+	}
+}
+
+/*returns the number of samples converted, the rest is left to scalar*/
+static inline size_t pcm_convert_simd(void *out, const float *in,
+				      size_t samples, pcm_format format,
+				      PcmDither *d)
+{
+	pcm_v4 scale = pcm_set1(pcm_scale(format));
+	pcm_v4 lo = pcm_set1(-pcm_scale(format));
+	pcm_v4 hi = pcm_set1(pcm_max(format));
+	pcm_u4 x{};
+	pcm_u4 *dither = nullptr;
+	if (d && format != pcm_s32) {
+		x = pcm_state4(d);
+		dither = &x;
+	}
+	size_t n = samples & ~(size_t)7;
+	for (size_t i = 0; i < n; i += 8) {
+		pcm_u4 a = pcm_quantize4(pcm_load(in + i), scale, lo, hi,
+					 dither);
+		pcm_u4 b = pcm_quantize4(pcm_load(in + i + 4), scale, lo, hi,
+					 dither);
+		if (format == pcm_s16) {
+			pcm_store_s16x8((int16_t *)out + i, a, b);
+		} else if (format == pcm_s32) {
+			pcm_store_s32x4((int32_t *)out + i, a);
+			pcm_store_s32x4((int32_t *)out + i + 4, b);
+		} else {
+			int32_t s[8];
+			pcm_store_s32x4(s, a);
+			pcm_store_s32x4(s + 4, b);
+			uint8_t *o = (uint8_t *)out + i * 3;
+			for (int k = 0; k < 8; k++)
+				pcm_store_s24(o + k * 3, s[k]);
+		}
+	}
+	if (dither)
+		pcm_save_state4(d, x);
+	return n;
+}
+
+static inline size_t pcm_mix_simd(float *dst, const float *src,
+				  size_t samples)
+{
+	size_t n = samples & ~(size_t)7;
+	for (size_t i = 0; i < n; i += 8) {
+		pcm_store(dst + i, pcm_add(pcm_load(dst + i), pcm_load(src + i)));
+		pcm_store(dst + i + 4,
+			  pcm_add(pcm_load(dst + i + 4), pcm_load(src + i + 4)));
+	}
+	return n;
+}
+
+static inline size_t pcm_dot_simd(const float *a, const float *b, size_t n,
+				  float *sum)
+{
+	size_t done = n & ~(size_t)7;
+	pcm_v4 s0 = pcm_set1(0.0f), s1 = pcm_set1(0.0f);
+	for (size_t i = 0; i < done; i += 8) {
+		s0 = pcm_add(s0, pcm_mul(pcm_load(a + i), pcm_load(b + i)));
+		s1 = pcm_add(s1, pcm_mul(pcm_load(a + i + 4),
+					 pcm_load(b + i + 4)));
+	}
+	*sum = pcm_hsum(pcm_add(s0, s1));
+	return done;
+}
+
+static inline size_t pcm_lerp_simd(float *dst, const float *a, const float *b,
+				   float t, size_t n)
+{
+	size_t done = n & ~(size_t)3;
+	pcm_v4 vt = pcm_set1(t);
+	for (size_t i = 0; i < done; i += 4) {
+		pcm_v4 va = pcm_load(a + i);
+		pcm_store(dst + i,
+			  pcm_add(va, pcm_mul(pcm_sub(pcm_load(b + i), va),
+					      vt)));
+	}
+	return done;
+}
+
+static inline size_t pcm_copy_level_simd(float *dst, const float *src,
+					 size_t n, float *peak, float *sumSq)
+{
+	size_t done = n & ~(size_t)7;
+	pcm_v4 p0 = pcm_set1(0.0f), p1 = pcm_set1(0.0f);
+	pcm_v4 s0 = pcm_set1(0.0f), s1 = pcm_set1(0.0f);
+	for (size_t i = 0; i < done; i += 8) {
+		pcm_v4 a = pcm_load(src + i);
+		pcm_v4 b = pcm_load(src + i + 4);
+		pcm_store(dst + i, a);
+		pcm_store(dst + i + 4, b);
+		p0 = pcm_max4(p0, pcm_abs(a));
+		p1 = pcm_max4(p1, pcm_abs(b));
+		s0 = pcm_add(s0, pcm_mul(a, a));
+		s1 = pcm_add(s1, pcm_mul(b, b));
+	}
+	*peak = pcm_hmax(pcm_max4(p0, p1));
+	*sumSq = pcm_hsum(pcm_add(s0, s1));
+	return done;
+}
+#endif
+
+/* ------------------------------------------------------------------------
+ * 8 lanes, AVX2
+ */
+
+#ifdef PCM_X86
+PCM_AVX2 static inline void pcm_transpose8(__m256 r[8])
+{
+	__m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+	__m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+	__m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+	__m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+	__m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+	__m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+	__m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+	__m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+	__m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+	r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+	r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+	r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+	r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+	r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+	r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+	r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+	r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+/*groups of 8 channels, frames a multiple of 8, returns channels done*/
+PCM_AVX2 static inline size_t pcm_interleave_avx2(float *out,
+						  const float *const *in,
+						  size_t offset,
+						  size_t channels,
+						  size_t frames)
+{
+	if (channels == 2) {
+		const float *l = in[0] + offset;
+		const float *r = in[1] + offset;
+		for (size_t f = 0; f < frames; f += 8) {
+			__m256 a = _mm256_loadu_ps(l + f);
+			__m256 b = _mm256_loadu_ps(r + f);
+			__m256 lo = _mm256_unpacklo_ps(a, b);
+			__m256 hi = _mm256_unpackhi_ps(a, b);
+			_mm256_storeu_ps(out + 2 * f,
+					 _mm256_permute2f128_ps(lo, hi, 0x20));
+			_mm256_storeu_ps(out + 2 * f + 8,
+					 _mm256_permute2f128_ps(lo, hi, 0x31));
+		}
+		return 2;
+	}
+	size_t c = 0;
+	for (; c + 8 <= channels; c += 8) {
+		for (size_t f = 0; f < frames; f += 8) {
+			__m256 r[8];
+			for (int k = 0; k < 8; k++)
+				r[k] = _mm256_loadu_ps(in[c + k] + offset + f);
+			pcm_transpose8(r);
+			float *o = out + f * channels + c;
+			for (int k = 0; k < 8; k++)
+				_mm256_storeu_ps(o + k * channels, r[k]);
+		}
+	}
+	return c;
+}
+
+PCM_AVX2 static inline size_t pcm_deinterleave_avx2(float *const *out,
+						    const float *in,
+						    size_t offset,
+						    size_t channels,
+						    size_t frames)
+{
+	if (channels == 2) {
+		float *l = out[0] + offset;
+		float *r = out[1] + offset;
+		for (size_t f = 0; f < frames; f += 8) {
+			__m256 x = _mm256_loadu_ps(in + 2 * f);
+			__m256 y = _mm256_loadu_ps(in + 2 * f + 8);
+			/*lo holds frames 0-1 and 4-5, hi 2-3 and 6-7*/
+			__m256 lo = _mm256_permute2f128_ps(x, y, 0x20);
+			__m256 hi = _mm256_permute2f128_ps(x, y, 0x31);
+			_mm256_storeu_ps(l + f,
+					 _mm256_shuffle_ps(lo, hi,
+							   _MM_SHUFFLE(2, 0, 2,
+								       0)));
+			_mm256_storeu_ps(r + f,
+					 _mm256_shuffle_ps(lo, hi,
+							   _MM_SHUFFLE(3, 1, 3,
+								       1)));
+		}
+		return 2;
+	}
+	size_t c = 0;
+	for (; c + 8 <= channels; c += 8) {
+		for (size_t f = 0; f < frames; f += 8) {
+			__m256 r[8];
+			const float *s = in + f * channels + c;
+			for (int k = 0; k < 8; k++)
+				r[k] = _mm256_loadu_ps(s + k * channels);
+			pcm_transpose8(r);
+			for (int k = 0; k < 8; k++)
+				_mm256_storeu_ps(out[c + k] + offset + f, r[k]);
+		}
+	}
+	return c;
+}
+
+PCM_AVX2 static inline __m256i pcm_xorshift8(__m256i &x)
+{
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+	return x;
+}
+
+PCM_AVX2 static inline __m256 pcm_uniform8(__m256i x)
+{
+	__m256i bits = _mm256_or_si256(_mm256_srli_epi32(x, 9),
+				       _mm256_set1_epi32(0x3f800000));
+	return _mm256_sub_ps(_mm256_castsi256_ps(bits), _mm256_set1_ps(1.0f));
+}
+
+PCM_AVX2 static inline size_t pcm_convert_avx2(void *out, const float *in,
+					       size_t samples,
+					       pcm_format format, PcmDither *d)
+{
+	__m256 scale = _mm256_set1_ps(pcm_scale(format));
+	__m256 lo = _mm256_set1_ps(-pcm_scale(format));
+	__m256 hi = _mm256_set1_ps(pcm_max(format));
+	bool dither = d && format != pcm_s32;
+	__m256i x = dither ? _mm256_loadu_si256((const __m256i *)d->state)
+			   : _mm256_setzero_si256();
+	/*bytes 0-2, 4-6, 8-10, 12-14 of each lane to the bottom 12*/
+	const __m256i pack24 = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1,
+		2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	size_t n = samples & ~(size_t)15;
+	/*24 bit stores spill 4 bytes past the block, leave room for it*/
+	if (format == pcm_s24 && n && samples - n < 2)
+		n -= 16;
+	for (size_t i = 0; i < n; i += 16) {
+		__m256i v[2];
+		for (int k = 0; k < 2; k++) {
+			__m256 f = _mm256_mul_ps(
+				_mm256_loadu_ps(in + i + k * 8), scale);
+			if (dither) {
+				__m256 r1 = pcm_uniform8(pcm_xorshift8(x));
+				__m256 r2 = pcm_uniform8(pcm_xorshift8(x));
+				f = _mm256_add_ps(f, _mm256_sub_ps(r1, r2));
+			}
+			/*NaN to 0 like pcm_quantize*/
+			f = _mm256_and_ps(f, _mm256_cmp_ps(f, f, _CMP_ORD_Q));
+			f = _mm256_min_ps(_mm256_max_ps(f, lo), hi);
+			v[k] = _mm256_cvtps_epi32(f);
+		}
+		if (format == pcm_s16) {
+			/*packs works per lane, fix the qword order after*/
+			__m256i p = _mm256_packs_epi32(v[0], v[1]);
+			p = _mm256_permute4x64_epi64(p, _MM_SHUFFLE(3, 1, 2, 0));
+			_mm256_storeu_si256((__m256i *)((int16_t *)out + i), p);
+		} else if (format == pcm_s32) {
+			_mm256_storeu_si256((__m256i *)((int32_t *)out + i),
+					    v[0]);
+			_mm256_storeu_si256((__m256i *)((int32_t *)out + i + 8),
+					    v[1]);
+		} else {
+			uint8_t *o = (uint8_t *)out + i * 3;
+			for (int k = 0; k < 2; k++) {
+				__m256i p = _mm256_shuffle_epi8(v[k], pack24);
+				_mm_storeu_si128(
+					(__m128i *)(o + k * 24),
+					_mm256_castsi256_si128(p));
+				_mm_storeu_si128(
+					(__m128i *)(o + k * 24 + 12),
+					_mm256_extracti128_si256(p, 1));
+			}
+		}
+	}
+	if (dither)
+		_mm256_storeu_si256((__m256i *)d->state, x);
+	return n;
+}
+
+PCM_AVX2 static inline size_t pcm_mix_avx2(float *dst, const float *src,
+					   size_t samples)
+{
+	size_t n = samples & ~(size_t)15;
+	for (size_t i = 0; i < n; i += 16) {
+		__m256 a = _mm256_add_ps(_mm256_loadu_ps(dst + i),
+					 _mm256_loadu_ps(src + i));
+		__m256 b = _mm256_add_ps(_mm256_loadu_ps(dst + i + 8),
+					 _mm256_loadu_ps(src + i + 8));
+		_mm256_storeu_ps(dst + i, a);
+		_mm256_storeu_ps(dst + i + 8, b);
+	}
+	return n;
+}
+
+PCM_AVX2 static inline size_t pcm_dot_avx2(const float *a, const float *b,
+					   size_t n, float *sum)
+{
+	size_t done = n & ~(size_t)15;
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	for (size_t i = 0; i < done; i += 16) {
+		s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+						     _mm256_loadu_ps(b + i)));
+		s1 = _mm256_add_ps(s1,
+				   _mm256_mul_ps(_mm256_loadu_ps(a + i + 8),
+						 _mm256_loadu_ps(b + i + 8)));
+	}
+	__m256 s = _mm256_add_ps(s0, s1);
+	__m128 h = _mm_add_ps(_mm256_castps256_ps128(s),
+			      _mm256_extractf128_ps(s, 1));
+	h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+	h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 1));
+	*sum = _mm_cvtss_f32(h);
+	return done;
+}
+
+PCM_AVX2 static inline size_t pcm_lerp_avx2(float *dst, const float *a,
+					    const float *b, float t, size_t n)
+{
+	size_t done = n & ~(size_t)7;
+	__m256 vt = _mm256_set1_ps(t);
+	for (size_t i = 0; i < done; i += 8) {
+		__m256 va = _mm256_loadu_ps(a + i);
+		__m256 d = _mm256_sub_ps(_mm256_loadu_ps(b + i), va);
+		_mm256_storeu_ps(dst + i,
+				 _mm256_add_ps(va, _mm256_mul_ps(d, vt)));
+	}
+	return done;
+}
+
+PCM_AVX2 static inline size_t pcm_copy_level_avx2(float *dst, const float *src,
+						  size_t n, float *peak,
+						  float *sumSq)
+{
+	size_t done = n & ~(size_t)15;
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	__m256 p0 = _mm256_setzero_ps(), p1 = _mm256_setzero_ps();
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	for (size_t i = 0; i < done; i += 16) {
+		__m256 a = _mm256_loadu_ps(src + i);
+		__m256 b = _mm256_loadu_ps(src + i + 8);
+		_mm256_storeu_ps(dst + i, a);
+		_mm256_storeu_ps(dst + i + 8, b);
+		p0 = _mm256_max_ps(p0, _mm256_andnot_ps(sign, a));
+		p1 = _mm256_max_ps(p1, _mm256_andnot_ps(sign, b));
+		s0 = _mm256_add_ps(s0, _mm256_mul_ps(a, a));
+		s1 = _mm256_add_ps(s1, _mm256_mul_ps(b, b));
+	}
+	__m256 p = _mm256_max_ps(p0, p1);
+	__m128 m = _mm_max_ps(_mm256_castps256_ps128(p),
+			      _mm256_extractf128_ps(p, 1));
+	m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+	m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+	*peak = _mm_cvtss_f32(m);
+	__m256 s = _mm256_add_ps(s0, s1);
+	__m128 h = _mm_add_ps(_mm256_castps256_ps128(s),
+			      _mm256_extractf128_ps(s, 1));
+	h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+	h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 1));
+	*sumSq = _mm_cvtss_f32(h);
+	return done;
+}
+#endif
+
+/* ------------------------------------------------------------------------
+ * dispatch
+ */
+
+static inline void pcm_interleave_f32_isa(pcm_isa isa, float *out,
+					  const float *const *in,
+					  size_t offset, size_t channels,
+					  size_t frames)
+{
+	size_t done = 0;
+#ifdef PCM_X86
+	if (isa == pcm_isa_avx2) {
+		done = frames & ~(size_t)7;
+		size_t c = pcm_interleave_avx2(out, in, offset, channels, done);
+		if (c < channels)
+			pcm_interleave_simd(out, in, offset, channels, c,
+					    channels, done);
+	}
+#endif
+#if defined(PCM_X86) || defined(PCM_NEON)
+	if (isa == pcm_isa_simd) {
+		done = frames & ~(size_t)3;
+		pcm_interleave_simd(out, in, offset, channels, 0, channels,
+				    done);
+	}
+#endif
+	pcm_interleave_scalar(out, in, offset, channels, done, frames);
+}
+
+static inline void pcm_deinterleave_f32_isa(pcm_isa isa, float *const *out,
+					    const float *in, size_t offset,
+					    size_t channels, size_t frames)
+{
+	size_t done = 0;
+#ifdef PCM_X86
+	if (isa == pcm_isa_avx2) {
+		done = frames & ~(size_t)7;
+		size_t c =
+			pcm_deinterleave_avx2(out, in, offset, channels, done);
+		if (c < channels)
+			pcm_deinterleave_simd(out, in, offset, channels, c,
+					      channels, done);
+	}
+#endif
+#if defined(PCM_X86) || defined(PCM_NEON)
+	if (isa == pcm_isa_simd) {
+		done = frames & ~(size_t)3;
+		pcm_deinterleave_simd(out, in, offset, channels, 0, channels,
+				      done);
+	}
+#endif
+	pcm_deinterleave_scalar(out, in, offset, channels, done, frames);
+}
+
+static inline void pcm_convert_isa(pcm_isa isa, void *out, const float *in,
+				   size_t samples, pcm_format format,
+				   PcmDither *d)
+{
+	if (format == pcm_f32) {
+		memcpy(out, in, samples * sizeof(float));
+		return;
+	}
+	size_t done = 0;
+#ifdef PCM_X86
+	if (isa == pcm_isa_avx2)
+		done = pcm_convert_avx2(out, in, samples, format, d);
+#endif
+#if defined(PCM_X86) || defined(PCM_NEON)
+	if (isa == pcm_isa_simd)
+		done = pcm_convert_simd(out, in, samples, format, d);
+#endif
+	pcm_convert_scalar(out, in, done, samples, format, d);
+}
+
+static inline void pcm_mix_f32_isa(pcm_isa isa, float *dst, const float *src,
+				   size_t samples)
+{
+	size_t done = 0;
+#ifdef PCM_X86
+	if (isa == pcm_isa_avx2)
+		done = pcm_mix_avx2(dst, src, samples);
+#endif
+#if defined(PCM_X86) || defined(PCM_NEON)
+	if (isa == pcm_isa_simd)
+		done = pcm_mix_simd(dst, src, samples);
+#endif
+	pcm_mix_scalar(dst, src, done, samples);
+}
+
+/*dst += src*/
+static inline void pcm_mix_f32(float *dst, const float *src, size_t samples)
+{
+	pcm_mix_f32_isa(pcm_best_isa(), dst, src, samples);
+}
+
+static inline float pcm_dot_f32_isa(pcm_isa isa, const float *a,
+				    const float *b, size_t n)
+{
+	size_t done = 0;
+	float sum = 0.0f;
+#ifdef PCM_X86
+	if (isa == pcm_isa_avx2)
+		done = pcm_dot_avx2(a, b, n, &sum);
+#endif
+#if defined(PCM_X86) || defined(PCM_NEON)
+	if (isa == pcm_isa_simd)
+		done = pcm_dot_simd(a, b, n, &sum);
+#endif
+	return pcm_dot_scalar(a, b, done, n, sum);
+}
+
+/*dst = a + (b - a) * t*/
+static inline void pcm_lerp_f32_isa(pcm_isa isa, float *dst, const float *a,
+				    const float *b, float t, size_t n)
+{
+	size_t done = 0;
+#ifdef PCM_X86
+	if (isa == pcm_isa_avx2)
+		done = pcm_lerp_avx2(dst, a, b, t, n);
+#endif
+#if defined(PCM_X86) || defined(PCM_NEON)
+	if (isa == pcm_isa_simd)
+		done = pcm_lerp_simd(dst, a, b, t, n);
+#endif
+	pcm_lerp_scalar(dst, a, b, t, done, n);
+}
+
+/*dst = src, also returns the peak magnitude and the sum of squares*/
+static inline void pcm_copy_level_f32_isa(pcm_isa isa, float *dst,
+					  const float *src, size_t n,
+					  float *peak, float *sumSq)
+{
+	size_t done = 0;
+	*peak = 0.0f;
+	*sumSq = 0.0f;
+#ifdef PCM_X86
+	if (isa == pcm_isa_avx2)
+		done = pcm_copy_level_avx2(dst, src, n, peak, sumSq);
+#endif
+#if defined(PCM_X86) || defined(PCM_NEON)
+	if (isa == pcm_isa_simd)
+		done = pcm_copy_level_simd(dst, src, n, peak, sumSq);
+#endif
+	pcm_copy_level_scalar(dst, src, done, n, peak, sumSq);
+}
+
+static inline void pcm_copy_level_f32(float *dst, const float *src, size_t n,
+				      float *peak, float *sumSq)
+{
+	pcm_copy_level_f32_isa(pcm_best_isa(), dst, src, n, peak, sumSq);
+}
+
+static inline void pcm_interleave_f32(float *out, const float *const *in,
+				      size_t channels, size_t frames)
+{
+	pcm_interleave_f32_isa(pcm_best_isa(), out, in, 0, channels, frames);
+}
+
+static inline void pcm_deinterleave_f32(float *const *out, const float *in,
+					size_t channels, size_t frames)
+{
+	pcm_deinterleave_f32_isa(pcm_best_isa(), out, in, 0, channels,
+				 frames);
+}
+
+static inline void pcm_convert(void *out, const float *in, size_t samples,
+			       pcm_format format, PcmDither *d)
+{
+	pcm_convert_isa(pcm_best_isa(), out, in, samples, format, d);
+}
+
+static inline void pcm_interleave_isa(pcm_isa isa, void *out,
+				      const float *const *in, size_t channels,
+				      size_t frames, pcm_format format,
+				      PcmDither *d)
+{
+	if (format == pcm_f32 || !channels) {
+		pcm_interleave_f32_isa(isa, (float *)out, in, 0, channels,
+				       frames);
+		return;
+	}
+
+	/*transpose a cache sized block to float, then convert it*/
+	alignas(32) float block[PCM_BLOCK];
+	size_t step = PCM_BLOCK / channels;
+	if (step >= 8)
+		step &= ~(size_t)7;
+	size_t size = pcm_sample_bytes(format);
+	uint8_t *o = (uint8_t *)out;
+	if (!step) {
+		for (size_t f = 0; f < frames; f++) {
+			for (size_t c = 0; c < channels; c++, o += size)
+				pcm_convert_scalar(o, in[c] + f, 0, 1, format,
+						   d);
+		}
+		return;
+	}
+	for (size_t f = 0; f < frames; f += step) {
+		size_t n = frames - f < step ? frames - f : step;
+		pcm_interleave_f32_isa(isa, block, in, f, channels, n);
+		pcm_convert_isa(isa, o, block, n * channels, format, d);
+		o += n * channels * size;
+	}
+}
+
+/*interleaves planar float channels into any output format*/
+static inline void pcm_interleave(void *out, const float *const *in,
+				  size_t channels, size_t frames,
+				  pcm_format format, PcmDither *d)
+{
+	pcm_interleave_isa(pcm_best_isa(), out, in, channels, frames, format,
+			   d);
+}
+
+/* ------------------------------------------------------------------------
+ * benchmark, compares every available version against scalar
+ */
+
+static inline std::string pcm_kernels_benchmark()
+{
+	const size_t frames = 1024;
+	const int rounds = 200;
+	const size_t layouts[] = {2, 6, 8, 34};
+	std::vector<pcm_isa> isas = {pcm_isa_scalar};
+#if defined(PCM_X86) || defined(PCM_NEON)
+	isas.push_back(pcm_isa_simd);
+#endif
+	if (pcm_cpu_avx2())
+		isas.push_back(pcm_isa_avx2);
+
+	std::vector<float> planar(34 * frames);
+	std::vector<float *> ptrs(34);
+	uint32_t seed = 1;
+	for (size_t i = 0; i < planar.size(); i++)
+		planar[i] = pcm_uniform(pcm_xorshift(seed)) * 2.4f - 1.2f;
+	for (size_t c = 0; c < 34; c++)
+		ptrs[c] = planar.data() + c * frames;
+	std::vector<uint8_t> ref(34 * frames * 4), out(34 * frames * 4);
+	std::vector<float> back(34 * frames);
+	std::vector<float *> backPtrs(34);
+	for (size_t c = 0; c < 34; c++)
+		backPtrs[c] = back.data() + c * frames;
+
+	std::string report;
+	char line[256];
+	const char *names[] = {"interleave f32", "deinterleave f32",
+			       "interleave s16", "interleave s24",
+			       "interleave s32", "mix f32", "copy level f32"};
+	for (int kernel = 0; kernel < 7; kernel++) {
+		for (size_t channels : layouts) {
+			size_t samples = frames * channels;
+			size_t bytes = samples *
+				       (kernel < 2 || kernel >= 5 ? 4
+						   : pcm_sample_bytes(
+							     (pcm_format)(kernel -
+									  1)));
+			double scalarNs = 0.0;
+			if (kernel == 1)
+				pcm_interleave_f32_isa(pcm_isa_scalar,
+						       (float *)ref.data(),
+						       ptrs.data(), 0, channels,
+						       frames);
+			int len = snprintf(line, sizeof(line), "\n%s %uch:",
+					   names[kernel], (unsigned)channels);
+			for (pcm_isa isa : isas) {
+				std::vector<uint8_t> &dst =
+					isa == pcm_isa_scalar ? ref : out;
+				if (kernel == 5)
+					memset(dst.data(), 0, bytes);
+				uint64_t start = os_gettime_ns();
+				for (int r = 0; r < rounds; r++) {
+					switch (kernel) {
+					case 0:
+						pcm_interleave_f32_isa(
+							isa, (float *)dst.data(),
+							ptrs.data(), 0,
+							channels, frames);
+						break;
+					case 1:
+						pcm_deinterleave_f32_isa(
+							isa, backPtrs.data(),
+							(const float *)
+								ref.data(),
+							0, channels, frames);
+						break;
+					case 5:
+						pcm_mix_f32_isa(
+							isa, (float *)dst.data(),
+							planar.data(), samples);
+						break;
+					case 6: {
+						float peak, sumSq;
+						pcm_copy_level_f32_isa(
+							isa, (float *)dst.data(),
+							planar.data(), samples,
+							&peak, &sumSq);
+						break;
+					}
+					default:
+						pcm_interleave_isa(
+							isa, dst.data(),
+							ptrs.data(), channels,
+							frames,
+							(pcm_format)(kernel - 1),
+							nullptr);
+						break;
+					}
+				}
+				double ns = (double)(os_gettime_ns() - start) /
+					    ((double)rounds * samples);
+				bool match = true;
+				if (kernel == 1)
+					match = memcmp(back.data(),
+						       planar.data(),
+						       samples * 4) == 0;
+				else if (isa != pcm_isa_scalar)
+					match = memcmp(ref.data(), out.data(),
+						       bytes) == 0;
+				if (isa == pcm_isa_scalar)
+					scalarNs = ns;
+				len += snprintf(line + len, sizeof(line) - len,
+						" %s %.2f ns/sample (%.1fx)%s",
+						pcm_isa_name(isa), ns,
+						ns > 0.0 ? scalarNs / ns : 0.0,
+						match ? "" : " MISMATCH");
+			}
+			report += line;
+		}
+	}
+	return report;
+}
@@ -0,0 +1,304 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Shared memory layout for Voicemeeter stages exported by obs-voicemeeter
+ * and a small reader for other processes. This header has no OBS
+ * dependencies so it can be dropped into any consumer.
+ *
+ * The mapping is a VmShmHeader followed by slotCount slots of slotSize
+ * bytes. Each slot is a VmShmSlot followed by planar float channels of
+ * maxFrames samples. The writer marks a slot odd while it is being filled
+ * and stores 2 * n + 2 once buffer n is complete, readers check the slot
+ * sequence before and after using the samples so they never need a copy.
+ *
+ * Mapping name: "obs-voicemeeter-<stage>" (Local\ namespace on Windows,
+ * /obs-voicemeeter-<stage> under /dev/shm elsewhere). On Windows writers
+ * pulse the manual-reset event "<mapping>-event", a client that is not
+ * already waiting misses that pulse, so clients must poll writeCount with a
+ * short timeout instead of trusting the event alone (VmShmClient::Wait does
+ * so every VMSHM_POLL_MS). Elsewhere writers bump header.notify and wake
+ * futex waiters on it.
+ */
+
+#define VMSHM_MAGIC 0x48534D56 /*"VMSH"*/
+#define VMSHM_VERSION 1
+#define VMSHM_SLOTS 16
+#define VMSHM_MAX_CHANNELS 128
+#define VMSHM_MAX_FRAMES 2048
+/*longest a waiting client sleeps before rechecking writeCount*/
+#define VMSHM_POLL_MS 1
+
+struct VmShmHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t headerSize;
+	uint32_t slotCount;
+	uint32_t slotSize;
+	uint32_t maxChannels;
+	uint32_t maxFrames;
+	uint32_t stage;
+	/*number of buffers published so far*/
+	std::atomic<uint64_t> writeCount;
+	std::atomic<uint32_t> notify;
+	uint32_t reserved[13];
+};
+
+struct VmShmSlot {
+	std::atomic<uint64_t> sequence;
+	uint64_t ts;
+	uint32_t sampleRate;
+	uint32_t frames;
+	uint32_t channels;
+	uint32_t reserved[9];
+};
+
+static inline size_t vmshm_slot_size()
+{
+	return sizeof(VmShmSlot) +
+	       sizeof(float) * VMSHM_MAX_CHANNELS * VMSHM_MAX_FRAMES;
+}
+
+static inline size_t vmshm_mapping_size()
+{
+	return sizeof(VmShmHeader) + VMSHM_SLOTS * vmshm_slot_size();
+}
+
+static inline std::string vmshm_name(const char *stage)
+{
+#ifdef _WIN32
+	return std::string("Local\\obs-voicemeeter-") + stage;
+#else
+	return std::string("/obs-voicemeeter-") + stage;
+#endif
+}
+
+static inline VmShmSlot *vmshm_slot(VmShmHeader *h, uint64_t n)
+{
+	return (VmShmSlot *)((uint8_t *)h + h->headerSize +
+			     (n % h->slotCount) * (size_t)h->slotSize);
+}
+
+static inline float *vmshm_channel(VmShmSlot *s, uint32_t channel,
+				   uint32_t maxFrames)
+{
+	return (float *)(s + 1) + (size_t)channel * maxFrames;
+}
+
+static inline uint64_t vmshm_now_ms()
+{
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000 + (uint64_t)t.tv_nsec / 1000000;
+#endif
+}
+
+#ifndef _WIN32
+static inline void vmshm_futex_wake(std::atomic<uint32_t> *word)
+{
+	syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT_MAX, nullptr,
+		nullptr, 0);
+}
+
+static inline void vmshm_futex_wait(std::atomic<uint32_t> *word,
+				    uint32_t expected, uint32_t timeoutMs)
+{
+	struct timespec t;
+	t.tv_sec = timeoutMs / 1000;
+	t.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+	syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, &t,
+		nullptr, 0);
+}
+#endif
+
+class VmShmClient {
+	VmShmHeader *_header = nullptr;
+	size_t _size = 0;
+	uint64_t _readCount = 0;
+	uint64_t _dropped = 0;
+	const VmShmSlot *_current = nullptr;
+	uint64_t _currentSequence = 0;
+#ifdef _WIN32
+	HANDLE _mapping = nullptr;
+	HANDLE _event = nullptr;
+#else
+	int _fd = -1;
+#endif
+
+public:
+	~VmShmClient() { Close(); }
+
+	/*stage is "insert-in", "insert-out" or "main"*/
+	bool Open(const char *stage)
+	{
+		Close();
+		std::string name = vmshm_name(stage);
+#ifdef _WIN32
+		_mapping = OpenFileMappingA(FILE_MAP_READ, false, name.c_str());
+		if (!_mapping)
+			return false;
+		_header = (VmShmHeader *)MapViewOfFile(_mapping, FILE_MAP_READ,
+							0, 0, 0);
+		_event = OpenEventA(SYNCHRONIZE, false,
+				    (name + "-event").c_str());
+#else
+		_fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if (_fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(_fd, &st) != 0) {
+			Close();
+			return false;
+		}
+		_size = (size_t)st.st_size;
+		void *p = mmap(nullptr, _size, PROT_READ, MAP_SHARED, _fd, 0);
+		_header = p == MAP_FAILED ? nullptr : (VmShmHeader *)p;
+#endif
+		if (!_header || _header->magic != VMSHM_MAGIC ||
+		    _header->version != VMSHM_VERSION ||
+		    _header->headerSize < sizeof(VmShmHeader)) {
+			Close();
+			return false;
+		}
+		_readCount = _header->writeCount.load(std::memory_order_acquire);
+		return true;
+	}
+
+	void Close()
+	{
+#ifdef _WIN32
+		if (_header)
+			UnmapViewOfFile(_header);
+		if (_event)
+			CloseHandle(_event);
+		if (_mapping)
+			CloseHandle(_mapping);
+		_event = nullptr;
+		_mapping = nullptr;
+#else
+		if (_header)
+			munmap(_header, _size);
+		if (_fd >= 0)
+			close(_fd);
+		_fd = -1;
+#endif
+		_header = nullptr;
+		_current = nullptr;
+	}
+
+	bool Valid() const { return _header != nullptr; }
+
+	const VmShmHeader *Header() const { return _header; }
+
+	/*buffers that were overwritten before this client read them*/
+	uint64_t Dropped() const { return _dropped; }
+
+	/*
+	 * Waits until a buffer newer than the last one read is published.
+	 * The event or futex only shortens the wait, writeCount is rechecked
+	 * at least every VMSHM_POLL_MS so a missed pulse costs one slice.
+	 */
+	bool Wait(uint32_t timeoutMs)
+	{
+		if (!_header)
+			return false;
+		uint64_t deadline = vmshm_now_ms() + timeoutMs;
+		for (;;) {
+			if (_header->writeCount.load(
+				    std::memory_order_acquire) != _readCount)
+				return true;
+			uint64_t now = vmshm_now_ms();
+			if (now >= deadline)
+				return false;
+			uint32_t slice = deadline - now < VMSHM_POLL_MS
+						 ? (uint32_t)(deadline - now)
+						 : VMSHM_POLL_MS;
+#ifdef _WIN32
+			if (_event)
+				WaitForSingleObject(_event, slice);
+			else
+				Sleep(slice);
+#else
+			uint32_t notify =
+				_header->notify.load(std::memory_order_acquire);
+			if (_header->writeCount.load(
+				    std::memory_order_acquire) == _readCount)
+				vmshm_futex_wait(&_header->notify, notify,
+						 slice);
+#endif
+		}
+	}
+
+	/*
+	 * Returns the next unread buffer in place, or nullptr if there is
+	 * none. The samples stay valid until the writer laps the ring, call
+	 * Release once done to find out whether that happened.
+	 */
+	const VmShmSlot *Acquire()
+	{
+		if (!_header)
+			return nullptr;
+		uint64_t written =
+			_header->writeCount.load(std::memory_order_acquire);
+		/*keep one slot of distance from the writer*/
+		uint64_t maxLag = _header->slotCount - 1;
+		if (written - _readCount > maxLag) {
+			_dropped += written - _readCount - maxLag;
+			_readCount = written - maxLag;
+		}
+		while (_readCount != written) {
+			VmShmSlot *s = vmshm_slot(_header, _readCount);
+			uint64_t expected = 2 * _readCount + 2;
+			uint64_t seq = s->sequence.load(std::memory_order_acquire);
+			_readCount++;
+			if (seq == expected) {
+				_current = s;
+				_currentSequence = seq;
+				return s;
+			}
+			_dropped++;
+		}
+		return nullptr;
+	}
+
+	const float *Channel(const VmShmSlot *slot, uint32_t channel) const
+	{
+		if (!slot || channel >= slot->channels)
+			return nullptr;
+		return vmshm_channel((VmShmSlot *)slot, channel,
+				     _header->maxFrames);
+	}
+
+	/*true if the buffer was not overwritten while it was in use*/
+	bool Release(const VmShmSlot *slot)
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		bool intact = slot == _current &&
+			      slot->sequence.load(std::memory_order_relaxed) ==
+				      _currentSequence;
+		_current = nullptr;
+		if (!intact)
+			_dropped++;
+		return intact;
+	}
+};
@@ -0,0 +1,186 @@
+#pragma once
+#include <util/platform.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include "circle-buffer.h"
+#include "shm-client.h"
+#ifndef _WIN32
+#include <sys/file.h>
+#endif
+
+/*
+ * Mirrors one stage into a shared memory broadcast ring (see shm-client.h
+ * for the layout). Registered as a StreamableBuffer listener so a single
+ * Voicemeeter callback registration can feed any number of processes, the
+ * copy into the mapping happens on the listener's reader thread.
+ */
+
+template<class Data> class ShmExporter : public StreamableReader<Data> {
+	std::string _name;
+	std::string _mappingName;
+	VmShmHeader *_header = nullptr;
+	uint64_t _writeCount = 0;
+#ifdef _WIN32
+	WinHandle _writer;
+	WinHandle _mapping;
+	WinHandle _event;
+#else
+	int _fd = -1;
+#endif
+
+public:
+	~ShmExporter() { Close(); }
+
+	std::string Name() { return _name; }
+
+	bool Open(const char *stage, uint32_t stageId)
+	{
+		Close();
+		_name = std::string("shm ") + stage;
+		_mappingName = vmshm_name(stage);
+		size_t size = vmshm_mapping_size();
+#ifdef _WIN32
+		/*clients may keep the mapping of a previous run open, which
+		 *is fine, a second exporter on the same name is not*/
+		_writer = CreateMutexA(nullptr, false,
+				       (_mappingName + "-writer").c_str());
+		if (!_writer.Valid() || GetLastError() == ERROR_ALREADY_EXISTS) {
+			blog(LOG_ERROR,
+			     "shm export: %s is published by another exporter",
+			     _mappingName.c_str());
+			Close();
+			return false;
+		}
+		_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr,
+					      PAGE_READWRITE,
+					      (DWORD)((uint64_t)size >> 32),
+					      (DWORD)size,
+					      _mappingName.c_str());
+		if (!_mapping.Valid()) {
+			blog(LOG_ERROR, "shm export: could not create %s (%lu)",
+			     _mappingName.c_str(), GetLastError());
+			Close();
+			return false;
+		}
+		if (GetLastError() == ERROR_ALREADY_EXISTS)
+			blog(LOG_INFO, "shm export: reusing %s held by clients",
+			     _mappingName.c_str());
+		_header = (VmShmHeader *)MapViewOfFile(
+			_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+		_event = CreateEventA(nullptr, true, false,
+				      (_mappingName + "-event").c_str());
+#else
+		_fd = shm_open(_mappingName.c_str(), O_RDWR | O_CREAT, 0644);
+		if (_fd < 0 || ftruncate(_fd, (off_t)size) != 0) {
+			blog(LOG_ERROR, "shm export: could not create %s",
+			     _mappingName.c_str());
+			Close();
+			return false;
+		}
+		if (flock(_fd, LOCK_EX | LOCK_NB) != 0) {
+			blog(LOG_ERROR,
+			     "shm export: %s is published by another exporter",
+			     _mappingName.c_str());
+			/*not ours to unlink*/
+			close(_fd);
+			_fd = -1;
+			Close();
+			return false;
+		}
+		void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			       MAP_SHARED, _fd, 0);
+		_header = p == MAP_FAILED ? nullptr : (VmShmHeader *)p;
+#endif
+		if (!_header) {
+			Close();
+			return false;
+		}
+
+		/*bump the write count past anything a previous run published
+		 *so attached clients resynchronise instead of stalling*/
+		_writeCount = _header->magic == VMSHM_MAGIC
+				      ? _header->writeCount.load() + VMSHM_SLOTS
+				      : 0;
+		_header->magic = 0;
+		_header->version = VMSHM_VERSION;
+		_header->headerSize = sizeof(VmShmHeader);
+		_header->slotCount = VMSHM_SLOTS;
+		_header->slotSize = (uint32_t)vmshm_slot_size();
+		_header->maxChannels = VMSHM_MAX_CHANNELS;
+		_header->maxFrames = VMSHM_MAX_FRAMES;
+		_header->stage = stageId;
+		for (uint32_t i = 0; i < VMSHM_SLOTS; i++)
+			vmshm_slot(_header, i)->sequence = 0;
+		_header->writeCount.store(_writeCount,
+					  std::memory_order_release);
+		/*magic last, clients ignore a half initialised header*/
+		std::atomic_thread_fence(std::memory_order_release);
+		_header->magic = VMSHM_MAGIC;
+		blog(LOG_INFO, "shm export: publishing %s",
+		     _mappingName.c_str());
+		return true;
+	}
+
+	void Close()
+	{
+		this->Disconnect();
+#ifdef _WIN32
+		if (_header)
+			UnmapViewOfFile(_header);
+		_event = nullptr;
+		_mapping = nullptr;
+		_writer = nullptr;
+#else
+		if (_header)
+			munmap(_header, vmshm_mapping_size());
+		if (_fd >= 0) {
+			close(_fd);
+			shm_unlink(_mappingName.c_str());
+		}
+		_fd = -1;
+#endif
+		_header = nullptr;
+	}
+
+	bool Active() const { return _header != nullptr; }
+
+	void Read(const Data *buf)
+	{
+		TraceScope trace("ShmExporter::Read");
+		if (!_header)
+			return;
+		uint64_t n = _writeCount;
+		VmShmSlot *slot = vmshm_slot(_header, n);
+		uint32_t channels = (uint32_t)min(buf->data.audiobuffer_nbi,
+						  VMSHM_MAX_CHANNELS);
+		uint32_t frames = (uint32_t)min(buf->data.audiobuffer_nbs,
+						VMSHM_MAX_FRAMES);
+
+		slot->sequence.store(2 * n + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot->ts = buf->ts;
+		slot->sampleRate = (uint32_t)buf->data.audiobuffer_sr;
+		slot->frames = frames;
+		slot->channels = channels;
+		for (uint32_t c = 0; c < channels; c++)
+			memcpy(vmshm_channel(slot, c, VMSHM_MAX_FRAMES),
+			       buf->data.audiobuffer_r[c],
+			       frames * sizeof(float));
+		slot->sequence.store(2 * n + 2, std::memory_order_release);
+
+		_writeCount = n + 1;
+		_header->writeCount.store(_writeCount,
+					  std::memory_order_release);
+#ifdef _WIN32
+		/*a pulse only wakes clients already waiting, the others find
+		 *writeCount on their next poll (see VmShmClient::Wait)*/
+		SetEvent(_event);
+		ResetEvent(_event);
+#else
+		_header->notify.fetch_add(1, std::memory_order_release);
+		vmshm_futex_wake(&_header->notify);
+#endif
+	}
+};
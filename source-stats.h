@@ -0,0 +1,103 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+#define STATS_WINDOW_NS 1000000000ULL
+
+/*
+ * Live statistics for one source. Update is only ever called from the
+ * source's reader thread, it accumulates over a one second window and then
+ * publishes the results with relaxed stores so the properties dialog can
+ * read them at any time without locking.
+ */
+class SourceStats {
+	/*reader thread only*/
+	uint64_t _windowStart = 0;
+	uint64_t _windowFrames = 0;
+	uint64_t _windowCalls = 0;
+	uint64_t _windowReadNs = 0;
+	uint64_t _windowPeakNs = 0;
+	uint64_t _windowJitterNs = 0;
+	uint64_t _lastTs = 0;
+	uint64_t _lastExpectedNs = 0;
+
+public:
+	std::atomic<uint64_t> lagFrames{0};
+	std::atomic<double> lagMs{0.0};
+	std::atomic<uint64_t> droppedFrames{0};
+	std::atomic<double> callRate{0.0};
+	std::atomic<uint64_t> readAvgNs{0};
+	std::atomic<uint64_t> readPeakNs{0};
+	std::atomic<double> sampleRate{0.0};
+	std::atomic<double> jitterUs{0.0};
+
+	void Reset()
+	{
+		_windowStart = 0;
+		_windowFrames = 0;
+		_windowCalls = 0;
+		_windowReadNs = 0;
+		_windowPeakNs = 0;
+		_windowJitterNs = 0;
+		_lastTs = 0;
+		_lastExpectedNs = 0;
+		lagFrames = 0;
+		lagMs = 0.0;
+		droppedFrames = 0;
+		callRate = 0.0;
+		readAvgNs = 0;
+		readPeakNs = 0;
+		sampleRate = 0.0;
+		jitterUs = 0.0;
+	}
+
+	/*lag is the buffers queued behind this one as reported by Stream,
+	 *dropped is the number of buffers overwritten since the last update*/
+	void Update(uint64_t ts, uint32_t frames, uint32_t rate, uint64_t lag,
+		    uint64_t dropped, uint64_t readNs)
+	{
+		std::memory_order relaxed = std::memory_order_relaxed;
+		lagFrames.store(lag * frames, relaxed);
+		lagMs.store(rate ? (double)(lag * frames) * 1000.0 / rate : 0.0,
+			    relaxed);
+		if (dropped)
+			droppedFrames.fetch_add(dropped * frames, relaxed);
+
+		if (_lastTs && ts > _lastTs) {
+			uint64_t delta = ts - _lastTs;
+			_windowJitterNs += delta > _lastExpectedNs
+						   ? delta - _lastExpectedNs
+						   : _lastExpectedNs - delta;
+		}
+		_lastTs = ts;
+		_lastExpectedNs = rate ? (uint64_t)frames * 1000000000ULL / rate
+				       : 0;
+
+		if (!_windowStart)
+			_windowStart = ts;
+		_windowFrames += frames;
+		_windowCalls++;
+		_windowReadNs += readNs;
+		if (readNs > _windowPeakNs)
+			_windowPeakNs = readNs;
+
+		uint64_t elapsed = ts - _windowStart;
+		if (elapsed < STATS_WINDOW_NS)
+			return;
+
+		double seconds = (double)elapsed / 1000000000.0;
+		sampleRate.store((double)_windowFrames / seconds, relaxed);
+		callRate.store((double)_windowCalls / seconds, relaxed);
+		readAvgNs.store(_windowReadNs / _windowCalls, relaxed);
+		readPeakNs.store(_windowPeakNs, relaxed);
+		jitterUs.store((double)_windowJitterNs / _windowCalls / 1000.0,
+			       relaxed);
+
+		_windowStart = ts;
+		_windowFrames = 0;
+		_windowCalls = 0;
+		_windowReadNs = 0;
+		_windowPeakNs = 0;
+		_windowJitterNs = 0;
+	}
+};
@@ -0,0 +1,264 @@
+#pragma once
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <windows.h>
+
+/*
+ * Begin/end event capture for the callback and reader threads.
+ *
+ * Each thread that records claims one ring the first time it traces, after
+ * that recording is an atomic load and two stores. Turning tracing on
+ * allocates every ring (some 24 MiB) so no traced thread ever allocates.
+ * Tracer::Dump writes everything captured so far as Chrome trace-event JSON
+ * (chrome://tracing, ui.perfetto.dev).
+ */
+
+#define TRACE_MAX_THREADS 64
+/*the capture window, some 15 s of callback events at 512 samples*/
+#define TRACE_EVENTS_PER_THREAD (1 << 14)
+#define TRACE_NAME_SIZE 64
+
+struct TraceEvent {
+	const char *name;
+	uint64_t ts;
+	char phase;
+};
+
+struct TraceThread {
+	TraceEvent *events;
+	std::atomic<size_t> writeIndex;
+	std::atomic<bool> used;
+	DWORD tid;
+	char name[TRACE_NAME_SIZE];
+};
+
+/*releases the thread's ring when the thread exits so reader threads that
+ *come and go with source updates don't exhaust the slots*/
+struct TraceThreadLocal {
+	TraceThread *thread = nullptr;
+	char name[TRACE_NAME_SIZE] = {0};
+
+	~TraceThreadLocal()
+	{
+		if (thread)
+			thread->used = false;
+	}
+};
+
+class Tracer {
+	std::atomic<bool> _enabled;
+	TraceThread _threads[TRACE_MAX_THREADS];
+
+	static TraceEvent *allocRing()
+	{
+		return (TraceEvent *)bzalloc(sizeof(TraceEvent) *
+					     TRACE_EVENTS_PER_THREAD);
+	}
+
+	static TraceThreadLocal &local()
+	{
+		static thread_local TraceThreadLocal l;
+		return l;
+	}
+
+	TraceThread *thread()
+	{
+		TraceThreadLocal &l = local();
+		if (l.thread)
+			return l.thread;
+		/*prefer slots that never recorded so exited threads stay in
+		 *the dump as long as possible*/
+		for (int pass = 0; pass < 2; pass++) {
+			for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+				TraceThread &t = _threads[i];
+				bool expected = false;
+				if (!t.events || (pass == 0 && t.tid != 0))
+					continue;
+				if (!t.used.compare_exchange_strong(expected,
+								    true))
+					continue;
+				t.writeIndex = 0;
+				t.tid = GetCurrentThreadId();
+				strncpy(t.name, l.name, TRACE_NAME_SIZE - 1);
+				l.thread = &t;
+				return l.thread;
+			}
+		}
+		return nullptr;
+	}
+
+	bool record(const char *name, char phase)
+	{
+		TraceThread *t = thread();
+		if (!t)
+			return false;
+		size_t i = t->writeIndex.load(std::memory_order_relaxed);
+		TraceEvent &e = t->events[i % TRACE_EVENTS_PER_THREAD];
+		e.name = name;
+		e.phase = phase;
+		e.ts = os_gettime_ns();
+		t->writeIndex.store(i + 1, std::memory_order_release);
+		return true;
+	}
+
+	/*JSON string contents, names come from sources and users*/
+	static void writeString(FILE *f, const char *s)
+	{
+		for (; *s; s++) {
+			unsigned char c = (unsigned char)*s;
+			if (c == '"' || c == '\\')
+				fprintf(f, "\\%c", c);
+			else if (c < 0x20)
+				fprintf(f, "\\u%04x", c);
+			else
+				fputc(c, f);
+		}
+	}
+
+public:
+	Tracer() : _enabled(false)
+	{
+		for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+			_threads[i].events = nullptr;
+			_threads[i].writeIndex = 0;
+			_threads[i].used = false;
+			_threads[i].tid = 0;
+			_threads[i].name[0] = 0;
+		}
+	}
+
+	~Tracer()
+	{
+		/*threads may still hold pointers into the storage until unload*/
+		_enabled = false;
+		for (int i = 0; i < TRACE_MAX_THREADS; i++)
+			bfree(_threads[i].events);
+	}
+
+	/*acquire, the rings are allocated before tracing turns on*/
+	bool Enabled() const
+	{
+		return _enabled.load(std::memory_order_acquire);
+	}
+
+	/*rings are kept once allocated, a dump after turning tracing off
+	 *still has them*/
+	void Enable(bool enable)
+	{
+		if (enable) {
+			for (int i = 0; i < TRACE_MAX_THREADS; i++)
+				if (!_threads[i].events)
+					_threads[i].events = allocRing();
+		}
+		_enabled = enable;
+	}
+
+	/*true when the event was recorded, only then is End due*/
+	bool Begin(const char *name)
+	{
+		return Enabled() && record(name, 'B');
+	}
+
+	/*recorded even after tracing was turned off, so every recorded
+	 *begin gets its end*/
+	void End(const char *name) { record(name, 'E'); }
+
+	void Instant(const char *name)
+	{
+		if (Enabled())
+			record(name, 'i');
+	}
+
+	/*remembered per thread, copied into the ring once one is claimed*/
+	void ThreadName(const char *name)
+	{
+		TraceThreadLocal &l = local();
+		strncpy(l.name, name, TRACE_NAME_SIZE - 1);
+		if (l.thread)
+			strncpy(l.thread->name, name, TRACE_NAME_SIZE - 1);
+	}
+
+	/*safe to call while recording, the oldest events of a ring that
+	 *wraps during the dump may be dropped*/
+	bool Dump(const char *path)
+	{
+		if (!_threads[0].events)
+			return false;
+		FILE *f = os_fopen(path, "wb");
+		if (!f)
+			return false;
+
+		DWORD pid = GetCurrentProcessId();
+		bool first = true;
+
+		fputs("{\"traceEvents\":[\n", f);
+		for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+			TraceThread &t = _threads[i];
+			if (t.tid == 0 || !t.events)
+				continue;
+			if (t.name[0]) {
+				fprintf(f,
+					"%s{\"name\":\"thread_name\",\"ph\":\"M\","
+					"\"pid\":%lu,\"tid\":%lu,"
+					"\"args\":{\"name\":\"",
+					first ? "" : ",\n", pid, t.tid);
+				writeString(f, t.name);
+				fputs("\"}}", f);
+				first = false;
+			}
+
+			size_t end = t.writeIndex.load(
+				std::memory_order_acquire);
+			size_t begin = end > TRACE_EVENTS_PER_THREAD
+					       ? end - TRACE_EVENTS_PER_THREAD
+					       : 0;
+			/*an unmatched end at the start of a wrapped ring
+			 *confuses the viewer, skip ahead to the first begin*/
+			while (begin < end &&
+			       t.events[begin % TRACE_EVENTS_PER_THREAD]
+					       .phase == 'E')
+				begin++;
+
+			for (size_t j = begin; j < end; j++) {
+				const TraceEvent &e =
+					t.events[j % TRACE_EVENTS_PER_THREAD];
+				fprintf(f, "%s{\"name\":\"", first ? "" : ",\n");
+				writeString(f, e.name);
+				fprintf(f,
+					"\",\"ph\":\"%c\","
+					"\"ts\":%llu.%03llu,\"pid\":%lu,"
+					"\"tid\":%lu%s}",
+					e.phase,
+					(unsigned long long)(e.ts / 1000),
+					(unsigned long long)(e.ts % 1000), pid,
+					t.tid,
+					e.phase == 'i' ? ",\"s\":\"t\"" : "");
+				first = false;
+			}
+		}
+		fputs("\n],\"displayTimeUnit\":\"ns\"}\n", f);
+		fclose(f);
+		return true;
+	}
+};
+
+static Tracer tracer;
+
+class TraceScope {
+	const char *_name;
+	bool _begun;
+
+public:
+	TraceScope(const char *name) : _name(name), _begun(tracer.Begin(name))
+	{
+	}
+	~TraceScope()
+	{
+		if (_begun)
+			tracer.End(_name);
+	}
+};
@@ -0,0 +1,255 @@
+#pragma once
+#include <util/base.h>
+#include <util/platform.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <windows.h>
+#include <util/windows/WinHandle.hpp>
+#include "vm-params.h"
+
+/*
+ * Fader automation for scene transitions.
+ *
+ * Rules name the parameters (strip and bus gains) a scene should end up at,
+ * one scene per line:
+ *
+ *     BRB: Strip[3].Gain=-30, Bus[1].Gain=-12
+ *     *: Strip[3].Gain=0
+ *
+ * "*" applies to every scene that does not set the parameter itself, which
+ * is how a ducked strip is restored. A ramp starts at the cached value (or
+ * where a running ramp on the same parameter is) and ends at the target
+ * after the transition duration. The ramp thread interpolates every
+ * VM_AUTOMATION_TICK_MS, drops steps smaller than VM_AUTOMATION_MIN_STEP and
+ * sends the values of all running ramps as one script per tick.
+ */
+
+#define VM_AUTOMATION_TICK_MS 20
+#define VM_AUTOMATION_MIN_STEP 0.05f
+
+struct VmRampTarget {
+	std::string param;
+	float value;
+};
+
+struct VmSceneRule {
+	std::string scene;
+	std::vector<VmRampTarget> targets;
+};
+
+static std::string vm_trim(const std::string &s)
+{
+	size_t b = s.find_first_not_of(" \t\r");
+	size_t e = s.find_last_not_of(" \t\r");
+	return b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
+}
+
+/*the scene name ends at the last ':' before the first '=', parameter
+ *names never contain one*/
+static std::vector<VmSceneRule> vm_automation_parse(const std::string &text)
+{
+	std::vector<VmSceneRule> rules;
+	std::stringstream lines(text);
+	std::string line;
+	while (std::getline(lines, line)) {
+		size_t colon = line.rfind(':', line.find('='));
+		if (colon == std::string::npos)
+			continue;
+		VmSceneRule rule;
+		rule.scene = vm_trim(line.substr(0, colon));
+		std::stringstream items(line.substr(colon + 1));
+		std::string item;
+		while (std::getline(items, item, ',')) {
+			size_t eq = item.find('=');
+			if (eq == std::string::npos)
+				continue;
+			std::string param = vm_trim(item.substr(0, eq));
+			std::string value = vm_trim(item.substr(eq + 1));
+			char *end = nullptr;
+			float v = strtof(value.c_str(), &end);
+			if (param.empty() || end == value.c_str())
+				continue;
+			rule.targets.push_back({param, v});
+		}
+		if (!rule.scene.empty() && !rule.targets.empty())
+			rules.push_back(std::move(rule));
+	}
+	return rules;
+}
+
+class VmAutomation {
+	struct Ramp {
+		std::string param;
+		float from;
+		float to;
+		float sent;
+		uint64_t start;
+		uint64_t duration;
+	};
+
+	VmParamCache &_cache;
+	VmParamWriter &_writer;
+
+	std::vector<Ramp> _ramps;
+	std::mutex _lock;
+
+	WinHandle _thread;
+	WinHandle _stopSignal;
+	WinHandle _wakeSignal;
+
+	std::atomic<uint64_t> _started{0};
+	std::atomic<uint64_t> _ticks{0};
+	std::atomic<uint64_t> _steps{0};
+	std::atomic<uint64_t> _dropped{0};
+
+	static float value(const Ramp &r, uint64_t now)
+	{
+		if (now - r.start >= r.duration)
+			return r.to;
+		double t = (double)(now - r.start) / (double)r.duration;
+		return r.from + (float)((r.to - r.from) * t);
+	}
+
+	/*returns whether ramps are still running*/
+	bool tick()
+	{
+		uint64_t now = os_gettime_ns();
+		uint64_t steps = 0, dropped = 0;
+		bool running;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			for (size_t i = 0; i < _ramps.size();) {
+				Ramp &r = _ramps[i];
+				float v = value(r, now);
+				bool done = v == r.to;
+				/*sent is NAN before the first value*/
+				bool small = fabsf(v - r.sent) <
+					     VM_AUTOMATION_MIN_STEP;
+				if (small && !done) {
+					dropped++;
+				} else if (v != r.sent) {
+					_writer.Set(r.param.c_str(), v);
+					r.sent = v;
+					steps++;
+				}
+				if (done) {
+					_ramps[i] = std::move(_ramps.back());
+					_ramps.pop_back();
+				} else {
+					i++;
+				}
+			}
+			running = !_ramps.empty();
+		}
+		if (steps)
+			_writer.Flush();
+		_ticks.fetch_add(1, std::memory_order_relaxed);
+		_steps.fetch_add(steps, std::memory_order_relaxed);
+		_dropped.fetch_add(dropped, std::memory_order_relaxed);
+		return running;
+	}
+
+	static DWORD WINAPI Run(void *data)
+	{
+		VmAutomation *a = static_cast<VmAutomation *>(data);
+		os_set_thread_name("obs-voicemeeter: automation");
+		HANDLE signals[] = {a->_stopSignal, a->_wakeSignal};
+		DWORD timeout = INFINITE;
+		for (;;) {
+			DWORD ret = WaitForMultipleObjects(2, signals, false,
+							   timeout);
+			if (ret == WAIT_OBJECT_0)
+				break;
+			timeout = a->tick() ? VM_AUTOMATION_TICK_MS : INFINITE;
+		}
+		return 0;
+	}
+
+public:
+	VmAutomation(VmParamCache &cache, VmParamWriter &writer)
+		: _cache(cache), _writer(writer)
+	{
+		_stopSignal = CreateEvent(nullptr, true, false, nullptr);
+		_wakeSignal = CreateEvent(nullptr, false, false, nullptr);
+	}
+
+	~VmAutomation() { Stop(); }
+
+	void Start()
+	{
+		if (_thread.Valid())
+			return;
+		ResetEvent(_stopSignal);
+		_thread = CreateThread(nullptr, 0, Run, this, 0, nullptr);
+	}
+
+	/*running ramps are dropped where they are*/
+	void Stop()
+	{
+		if (!_thread.Valid())
+			return;
+		SetEvent(_stopSignal);
+		WaitForSingleObject(_thread, INFINITE);
+		_thread = nullptr;
+		std::lock_guard<std::mutex> lock(_lock);
+		_ramps.clear();
+	}
+
+	/*handle is the parameter's cache subscription, without a cached value
+	 *the target is set at the next tick*/
+	void Fade(const std::string &param, int handle, float to,
+		  uint64_t durationNs)
+	{
+		uint64_t now = os_gettime_ns();
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			Ramp *r = nullptr;
+			for (Ramp &existing : _ramps)
+				if (existing.param == param)
+					r = &existing;
+			float from;
+			if (r) {
+				from = value(*r, now);
+			} else if (!_cache.Float(handle, from)) {
+				from = to;
+				durationNs = 0;
+			}
+			if (!r) {
+				_ramps.push_back({param, from, to, NAN, now, 0});
+				r = &_ramps.back();
+			}
+			r->from = from;
+			r->to = to;
+			r->start = now;
+			r->duration = durationNs;
+		}
+		_started.fetch_add(1, std::memory_order_relaxed);
+		SetEvent(_wakeSignal);
+	}
+
+	std::string Stats()
+	{
+		size_t running;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			running = _ramps.size();
+		}
+		char text[256];
+		snprintf(text, sizeof(text),
+			 "%u running, %llu ramps, %llu ticks, %llu values sent, "
+			 "%llu below %.2f dB dropped",
+			 (unsigned)running, (unsigned long long)_started.load(),
+			 (unsigned long long)_ticks.load(),
+			 (unsigned long long)_steps.load(),
+			 (unsigned long long)_dropped.load(),
+			 VM_AUTOMATION_MIN_STEP);
+		return text;
+	}
+};
@@ -0,0 +1,389 @@
+#pragma once
+#include <obs-module.h>
+#include <util/platform.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <windows.h>
+#include <util/windows/WinHandle.hpp>
+#include "sample-kernels.h"
+#include "vm-spectrum.h"
+
+/*
+ * Delay between two channels by GCC-PHAT: the cross spectrum of each
+ * windowed block pair, whitened to unit magnitude so every frequency
+ * votes equally, is averaged over blocks and transformed back. The peak
+ * of that correlation is the lag of the second channel behind the first,
+ * its height (1 for identical shifted signals, near 0 for unrelated ones)
+ * is the confidence.
+ *
+ * The reader thread only copies hops of both channels into a small ring,
+ * a worker thread does the transforms. Blocks where either channel is
+ * quiet are skipped, a hop the worker can't take in time is dropped on
+ * both channels together, so the pair stays aligned.
+ *
+ * VmDelayLine holds back one channel by a whole number of samples to
+ * compensate what was measured.
+ */
+
+#define VM_DELAY_FFT 32768
+#define VM_DELAY_OVERLAP 4
+#define VM_DELAY_HOP (VM_DELAY_FFT / VM_DELAY_OVERLAP)
+/*hops queued for the worker*/
+#define VM_DELAY_BLOCKS 8
+/*lags past a quarter of the window overlap too little to measure*/
+#define VM_DELAY_MAX_LAG (VM_DELAY_FFT / 4)
+/*weight of the newest block in the running average*/
+#define VM_DELAY_AVERAGE 0.1f
+#define VM_DELAY_QUIET_DB -70.0f
+/*below this an estimate is too weak to compensate*/
+#define VM_DELAY_CONFIDENCE 0.1f
+
+struct VmDelayEstimate {
+	uint64_t ts;
+	/*blocks averaged, 0 before the first*/
+	uint64_t blocks;
+	long sampleRate;
+	/*positive when the second channel lags the first*/
+	int samples;
+	double ms;
+	float confidence;
+};
+
+class VmDelayEstimator {
+	pcm_isa _isa = min(pcm_best_isa(), pcm_isa_simd);
+	std::shared_ptr<const VmFftPlan> _plan;
+
+	/*hops of both channels, written by the reader, read by the worker*/
+	std::vector<float> _blocks[VM_DELAY_BLOCKS];
+	long _blockRate[VM_DELAY_BLOCKS];
+	uint64_t _blockTs[VM_DELAY_BLOCKS];
+	std::atomic<uint64_t> _submitted{0};
+	std::atomic<uint64_t> _consumed{0};
+	/*reader only*/
+	size_t _fill = 0;
+
+	/*worker only*/
+	std::vector<float> _history[2];
+	size_t _hops = 0;
+	long _sampleRate = 0;
+	std::vector<float> _re;
+	std::vector<float> _im;
+	std::vector<float> _aRe;
+	std::vector<float> _aIm;
+	std::vector<float> _avgRe;
+	std::vector<float> _avgIm;
+	std::vector<float> _corr;
+	uint64_t _averaged = 0;
+
+	WinHandle _blockReady;
+	WinHandle _stopSignal;
+	WinHandle _thread;
+	bool _running = false;
+
+	std::mutex _estimateLock;
+	VmDelayEstimate _estimate = {};
+	std::atomic<bool> _reset{false};
+
+	std::atomic<uint64_t> _transforms{0};
+	std::atomic<uint64_t> _quiet{0};
+	std::atomic<uint64_t> _overruns{0};
+	std::atomic<uint64_t> _busyNs{0};
+	std::atomic<uint64_t> _audioNs{0};
+
+	static float energyDb(const float *x, size_t n)
+	{
+		float sum = 0.0f;
+		for (size_t i = 0; i < n; i++)
+			sum += x[i] * x[i];
+		sum /= n;
+		return sum > 0.0f ? 10.0f * log10f(sum) : -INFINITY;
+	}
+
+	void restart(long sampleRate)
+	{
+		_sampleRate = sampleRate;
+		_hops = 0;
+		_averaged = 0;
+		std::fill(_avgRe.begin(), _avgRe.end(), 0.0f);
+		std::fill(_avgIm.begin(), _avgIm.end(), 0.0f);
+		std::lock_guard<std::mutex> lock(_estimateLock);
+		_estimate = {};
+		_estimate.sampleRate = sampleRate;
+	}
+
+	void analyze(uint64_t ts)
+	{
+		uint64_t start = os_gettime_ns();
+		const VmFftPlan &plan = *_plan;
+		if (energyDb(_history[0].data(), VM_DELAY_FFT) <
+			    VM_DELAY_QUIET_DB ||
+		    energyDb(_history[1].data(), VM_DELAY_FFT) <
+			    VM_DELAY_QUIET_DB) {
+			_quiet.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		float *aRe = _aRe.data(), *aIm = _aIm.data();
+		vm_fft_real_isa(_isa, plan, _history[0].data(), _re.data(),
+				_im.data(),
+				[aRe, aIm](size_t k, float r, float i) {
+					aRe[k] = r;
+					aIm[k] = i;
+				});
+		/*conj(A) B, whitened, into the running average*/
+		float *avgRe = _avgRe.data(), *avgIm = _avgIm.data();
+		float weight = _averaged ? VM_DELAY_AVERAGE : 1.0f;
+		vm_fft_real_isa(
+			_isa, plan, _history[1].data(), _re.data(), _im.data(),
+			[=](size_t k, float br, float bi) {
+				float cr = aRe[k] * br + aIm[k] * bi;
+				float ci = aRe[k] * bi - aIm[k] * br;
+				float mag = sqrtf(cr * cr + ci * ci);
+				float g = mag > 1e-20f ? 1.0f / mag : 0.0f;
+				avgRe[k] += weight * (cr * g - avgRe[k]);
+				avgIm[k] += weight * (ci * g - avgIm[k]);
+			});
+		_averaged++;
+		vm_fft_real_inverse_isa(_isa, plan, avgRe, avgIm, _re.data(),
+					_im.data(), _corr.data());
+
+		/*lag l sits at l for l >= 0 and at size + l below*/
+		int best = 0;
+		float peak = _corr[0];
+		for (int l = 1; l <= VM_DELAY_MAX_LAG; l++) {
+			if (_corr[l] > peak) {
+				peak = _corr[l];
+				best = l;
+			}
+			if (_corr[VM_DELAY_FFT - l] > peak) {
+				peak = _corr[VM_DELAY_FFT - l];
+				best = -l;
+			}
+		}
+		/*parabola through the neighbours for the fraction*/
+		float y0 = _corr[(best - 1 + VM_DELAY_FFT) % VM_DELAY_FFT];
+		float y2 = _corr[(best + 1 + VM_DELAY_FFT) % VM_DELAY_FFT];
+		float d = y0 - 2.0f * peak + y2;
+		double frac = d < 0.0f ? 0.5 * (y0 - y2) / d : 0.0;
+
+		{
+			std::lock_guard<std::mutex> lock(_estimateLock);
+			_estimate.ts = ts;
+			_estimate.blocks = _averaged;
+			_estimate.sampleRate = _sampleRate;
+			_estimate.samples = best;
+			_estimate.ms = 1000.0 * (best + frac) / _sampleRate;
+			_estimate.confidence = max(0.0f, min(peak, 1.0f));
+		}
+		_transforms.fetch_add(1, std::memory_order_relaxed);
+		_busyNs.fetch_add(os_gettime_ns() - start,
+				  std::memory_order_relaxed);
+	}
+
+	void consume()
+	{
+		while (_consumed.load(std::memory_order_relaxed) <
+		       _submitted.load(std::memory_order_acquire)) {
+			uint64_t c = _consumed.load(std::memory_order_relaxed);
+			size_t i = c % VM_DELAY_BLOCKS;
+			if (_reset.exchange(false) ||
+			    _blockRate[i] != _sampleRate)
+				restart(_blockRate[i]);
+			const float *block = _blocks[i].data();
+			for (int ch = 0; ch < 2; ch++) {
+				float *h = _history[ch].data();
+				memmove(h, h + VM_DELAY_HOP,
+					(VM_DELAY_FFT - VM_DELAY_HOP) *
+						sizeof(float));
+				memcpy(h + VM_DELAY_FFT - VM_DELAY_HOP,
+				       block + ch * VM_DELAY_HOP,
+				       VM_DELAY_HOP * sizeof(float));
+			}
+			uint64_t ts = _blockTs[i];
+			_consumed.store(c + 1, std::memory_order_release);
+			_audioNs.fetch_add(VM_DELAY_HOP * 1000000000ULL /
+						   _sampleRate,
+					   std::memory_order_relaxed);
+			if (++_hops >= VM_DELAY_OVERLAP)
+				analyze(ts);
+		}
+	}
+
+	static DWORD WINAPI Run(void *data)
+	{
+		VmDelayEstimator *e = static_cast<VmDelayEstimator *>(data);
+		os_set_thread_name("obs-voicemeeter: delay estimator");
+		SetThreadPriority(GetCurrentThread(),
+				  THREAD_PRIORITY_BELOW_NORMAL);
+		HANDLE signals[2] = {e->_blockReady, e->_stopSignal};
+		while (WaitForMultipleObjects(2, signals, false, INFINITE) ==
+		       WAIT_OBJECT_0)
+			e->consume();
+		return 0;
+	}
+
+public:
+	VmDelayEstimator()
+	{
+		_blockReady = CreateEvent(nullptr, false, false, nullptr);
+		_stopSignal = CreateEvent(nullptr, true, false, nullptr);
+	}
+
+	~VmDelayEstimator() { Stop(); }
+
+	bool Running() const { return _running; }
+
+	/*UI thread, before the reader is attached*/
+	void Start()
+	{
+		if (_running)
+			return;
+		/*allocated once, everything stays this size*/
+		if (!_plan) {
+			_plan = vm_fft_plan(VM_DELAY_FFT);
+			for (std::vector<float> &b : _blocks)
+				b.assign(2 * VM_DELAY_HOP, 0.0f);
+			for (std::vector<float> &h : _history)
+				h.assign(VM_DELAY_FFT, 0.0f);
+			_re.resize(VM_DELAY_FFT / 2);
+			_im.resize(VM_DELAY_FFT / 2);
+			_aRe.resize(VM_DELAY_FFT / 2 + 1);
+			_aIm.resize(VM_DELAY_FFT / 2 + 1);
+			_avgRe.resize(VM_DELAY_FFT / 2 + 1);
+			_avgIm.resize(VM_DELAY_FFT / 2 + 1);
+			_corr.resize(VM_DELAY_FFT);
+		}
+		for (std::vector<float> &h : _history)
+			std::fill(h.begin(), h.end(), 0.0f);
+		_submitted = 0;
+		_consumed = 0;
+		_fill = 0;
+		restart(0);
+		ResetEvent(_stopSignal);
+		_thread = CreateThread(nullptr, 0, Run, this, 0, nullptr);
+		_running = true;
+	}
+
+	/*UI thread, after the reader is disconnected*/
+	void Stop()
+	{
+		if (!_running)
+			return;
+		SetEvent(_stopSignal);
+		WaitForSingleObject(_thread, INFINITE);
+		_thread = nullptr;
+		_running = false;
+	}
+
+	/*any thread, starts the average over*/
+	void Reset() { _reset = true; }
+
+	/*reader thread, frames of both channels*/
+	void Feed(const float *a, const float *b, size_t frames,
+		  long sampleRate, uint64_t ts)
+	{
+		if (!_running || sampleRate <= 0)
+			return;
+		while (frames) {
+			uint64_t s = _submitted.load(std::memory_order_relaxed);
+			size_t i = s % VM_DELAY_BLOCKS;
+			float *block = _blocks[i].data();
+			size_t n = min(frames, (size_t)VM_DELAY_HOP - _fill);
+			memcpy(block + _fill, a, n * sizeof(float));
+			memcpy(block + VM_DELAY_HOP + _fill, b,
+			       n * sizeof(float));
+			_fill += n;
+			a += n;
+			b += n;
+			frames -= n;
+			if (_fill < VM_DELAY_HOP)
+				break;
+			_fill = 0;
+			/*the worker fell behind, this hop is dropped on both*/
+			if (s + 1 - _consumed.load(std::memory_order_acquire) >=
+			    VM_DELAY_BLOCKS) {
+				_overruns.fetch_add(1,
+						    std::memory_order_relaxed);
+				continue;
+			}
+			_blockRate[i] = sampleRate;
+			_blockTs[i] = ts;
+			_submitted.store(s + 1, std::memory_order_release);
+			SetEvent(_blockReady);
+		}
+	}
+
+	VmDelayEstimate Estimate()
+	{
+		std::lock_guard<std::mutex> lock(_estimateLock);
+		return _estimate;
+	}
+
+	std::string Stats()
+	{
+		uint64_t transforms = _transforms.load();
+		uint64_t busy = _busyNs.load(), audio = _audioNs.load();
+		char text[256];
+		snprintf(text, sizeof(text),
+			 "%s, %llu transforms (%llu quiet), %.2f ms per "
+			 "transform, %.3f%% of a core, %llu hops dropped",
+			 pcm_isa_name(_isa), (unsigned long long)transforms,
+			 (unsigned long long)_quiet.load(),
+			 transforms ? busy / 1e6 / transforms : 0.0,
+			 audio ? 100.0 * busy / audio : 0.0,
+			 (unsigned long long)_overruns.load());
+		return text;
+	}
+};
+
+/*holds one channel back, the reader thread of a route plan owns it*/
+class VmDelayLine {
+	std::vector<float> _ring;
+	std::vector<float> _out;
+	size_t _write = 0;
+
+public:
+	/*forgets what was held, the next block is delayed behind silence*/
+	void Reset()
+	{
+		std::fill(_ring.begin(), _ring.end(), 0.0f);
+		_write = 0;
+	}
+
+	/*a pointer to frames delayed by delay samples, valid until the next
+	 *call*/
+	const float *Process(const float *in, size_t frames, size_t delay)
+	{
+		delay = min(delay, (size_t)VM_DELAY_MAX_LAG);
+		size_t need = delay + frames;
+		if (_ring.size() < need) {
+			size_t size = 1024;
+			while (size < need)
+				size *= 2;
+			/*grows only with the block size, keeps what it had*/
+			std::vector<float> ring(size, 0.0f);
+			size_t old = _ring.size();
+			for (size_t i = 0; i < old; i++)
+				ring[(_write - old + i) & (size - 1)] =
+					_ring[(_write + i) & (old - 1)];
+			_ring.swap(ring);
+		}
+		if (_out.size() < frames)
+			_out.resize(frames);
+		size_t mask = _ring.size() - 1;
+		for (size_t f = 0; f < frames; f++) {
+			_ring[(_write + f) & mask] = in[f];
+			_out[f] = _ring[(_write + f - delay) & mask];
+		}
+		_write += frames;
+		return _out.data();
+	}
+};
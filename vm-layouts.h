@@ -0,0 +1,158 @@
+#pragma once
+#include <obs-module.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Strip and bus layouts of every Voicemeeter edition, resolved at compile
+ * time into one entry per stage channel. A channel index maps directly to
+ * the strip or bus it belongs to and its sub-channel, nothing is searched
+ * or allocated at runtime. The main stage carries the inputs followed by
+ * the outputs.
+ */
+
+#define VM_MAX_STAGE_CHANNELS 98
+#define VM_COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+struct vm_strip {
+	enum speaker_layout layout;
+	const char *name;
+};
+
+struct vm_channel {
+	const char *strip;
+	const char *sub;
+	/*strip or bus number within its edition*/
+	int index;
+};
+
+struct vm_stage_table {
+	vm_channel channels[VM_MAX_STAGE_CHANNELS];
+	int count;
+};
+
+static constexpr size_t vm_layout_channels(enum speaker_layout layout)
+{
+	return layout == SPEAKERS_MONO ? 1 : layout == SPEAKERS_7POINT1 ? 8 : 2;
+}
+
+static constexpr const char *vm_sub_name(size_t sub)
+{
+	switch (sub) {
+	case 0:
+		return "(L)";
+	case 1:
+		return "(R)";
+	case 2:
+		return "(C)";
+	case 3:
+		return "(LFE)";
+	case 4:
+		return "(SL)";
+	case 5:
+		return "(SR)";
+	case 6:
+		return "(BL)";
+	default:
+		return "(BR)";
+	}
+}
+
+static constexpr vm_stage_table vm_table(const vm_strip *a, size_t na,
+					 const vm_strip *b = nullptr,
+					 size_t nb = 0)
+{
+	vm_stage_table t{};
+	for (size_t i = 0; i < na + nb; i++) {
+		const vm_strip &s = i < na ? a[i] : b[i - na];
+		for (size_t c = 0; c < vm_layout_channels(s.layout); c++)
+			t.channels[t.count++] = {s.name, vm_sub_name(c),
+						 (int)(i < na ? i : i - na)};
+	}
+	return t;
+}
+
+static constexpr vm_strip vm_normal_inputs[] = {
+	{SPEAKERS_STEREO, "Strip 1"},
+	{SPEAKERS_STEREO, "Strip 2"},
+	{SPEAKERS_7POINT1, "Virtual Input"},
+};
+
+static constexpr vm_strip vm_normal_outputs[] = {
+	{SPEAKERS_7POINT1, "Output A1 / A2"},
+	{SPEAKERS_7POINT1, "Virtual Output"},
+};
+
+static constexpr vm_strip vm_banana_inputs[] = {
+	{SPEAKERS_STEREO, "Strip 1"},
+	{SPEAKERS_STEREO, "Strip 2"},
+	{SPEAKERS_STEREO, "Strip 3"},
+	{SPEAKERS_7POINT1, "Virtual Input"},
+	{SPEAKERS_7POINT1, "Virtual Input (AUX)"},
+};
+
+static constexpr vm_strip vm_banana_outputs[] = {
+	{SPEAKERS_7POINT1, "Output A1"},
+	{SPEAKERS_7POINT1, "Output A2"},
+	{SPEAKERS_7POINT1, "Output A3"},
+	{SPEAKERS_7POINT1, "Virtual Output B1"},
+	{SPEAKERS_7POINT1, "Virtual Output B2"},
+};
+
+static constexpr vm_strip vm_potato_inputs[] = {
+	{SPEAKERS_STEREO, "Strip 1"},
+	{SPEAKERS_STEREO, "Strip 2"},
+	{SPEAKERS_STEREO, "Strip 3"},
+	{SPEAKERS_STEREO, "Strip 4"},
+	{SPEAKERS_STEREO, "Strip 5"},
+	{SPEAKERS_7POINT1, "Virtual Input"},
+	{SPEAKERS_7POINT1, "Virtual Input (AUX)"},
+	{SPEAKERS_7POINT1, "Virtual Input 8"},
+};
+
+static constexpr vm_strip vm_potato_outputs[] = {
+	{SPEAKERS_7POINT1, "Output A1"},
+	{SPEAKERS_7POINT1, "Output A2"},
+	{SPEAKERS_7POINT1, "Output A3"},
+	{SPEAKERS_7POINT1, "Output A4"},
+	{SPEAKERS_7POINT1, "Output A5"},
+	{SPEAKERS_7POINT1, "Virtual Output B1"},
+	{SPEAKERS_7POINT1, "Virtual Output B2"},
+	{SPEAKERS_7POINT1, "Virtual Output B3"},
+};
+
+#define VM_STAGE_TABLES(in, out)                                   \
+	{                                                          \
+		vm_table(in, VM_COUNT(in)), vm_table(out, VM_COUNT(out)), \
+			vm_table(in, VM_COUNT(in), out, VM_COUNT(out))    \
+	}
+
+/*indexed by voicemeeter_type then stage*/
+static constexpr vm_stage_table vm_tables[4][3] = {
+	{},
+	VM_STAGE_TABLES(vm_normal_inputs, vm_normal_outputs),
+	VM_STAGE_TABLES(vm_banana_inputs, vm_banana_outputs),
+	VM_STAGE_TABLES(vm_potato_inputs, vm_potato_outputs),
+};
+
+/*strips and buses per voicemeeter_type, the first vm_bus_a buses are the
+ *hardware (A) outputs, the others the virtual (B) outputs*/
+static constexpr int vm_strip_count[4] = {0, (int)VM_COUNT(vm_normal_inputs),
+					  (int)VM_COUNT(vm_banana_inputs),
+					  (int)VM_COUNT(vm_potato_inputs)};
+static constexpr int vm_bus_count[4] = {0, (int)VM_COUNT(vm_normal_outputs),
+					(int)VM_COUNT(vm_banana_outputs),
+					(int)VM_COUNT(vm_potato_outputs)};
+static constexpr int vm_bus_a[4] = {0, 1, 3, 5};
+#define VM_MAX_STRIPS 8
+#define VM_MAX_BUSES 8
+
+static_assert(vm_tables[1][0].count == 12 && vm_tables[1][1].count == 16 &&
+		      vm_tables[1][2].count == 28,
+	      "Voicemeeter channel counts");
+static_assert(vm_tables[2][0].count == 22 && vm_tables[2][1].count == 40 &&
+		      vm_tables[2][2].count == 62,
+	      "Voicemeeter Banana channel counts");
+static_assert(vm_tables[3][0].count == 34 && vm_tables[3][1].count == 64 &&
+		      vm_tables[3][2].count == 98,
+	      "Voicemeeter Potato channel counts");
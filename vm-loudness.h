@@ -0,0 +1,684 @@
+#pragma once
+#include <util/platform.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "circle-buffer.h"
+#include "sample-kernels.h"
+#include "vm-meters.h"
+
+/*
+ * EBU R128 / ITU-R BS.1770 loudness of selected buses of a stage.
+ *
+ * Registered as a StreamableBuffer listener, all work happens on its reader
+ * thread. Every channel runs through the K-weighting filters (a high shelf
+ * followed by the RLB high pass) four channels per vector, and the weighted
+ * mean squares are summed over 100 ms hops. The last 4 hops give momentary
+ * loudness, the last 30 short term loudness.
+ *
+ * Each momentary block (400 ms, 75% overlap) above the -70 LUFS absolute
+ * gate goes into a histogram of VM_LOUDNESS_BIN_LU wide bins holding the
+ * block count and energy. A cursor bin follows the relative gate (10 LU
+ * below the mean of the gated blocks) and keeps the sums of all bins at or
+ * above it, so integrated loudness costs the few bins the gate moved, not
+ * a pass over the programme. Blocks in the bin the gate falls into count
+ * as above it, off by at most one bin width.
+ *
+ * True peak interpolates 4x with a polyphase windowed sinc, phase 0 is the
+ * input itself so it never reads below the sample peak.
+ */
+
+#define VM_LOUDNESS_MAX_BUSES 8
+#define VM_LOUDNESS_MAX_CHANNELS 8
+#define VM_LOUDNESS_HOP_MS 100
+#define VM_LOUDNESS_MOMENTARY_HOPS 4
+#define VM_LOUDNESS_SHORT_HOPS 30
+#define VM_LOUDNESS_GATE -70.0
+#define VM_LOUDNESS_RELATIVE -10.0
+#define VM_LOUDNESS_BIN_LU 0.1
+#define VM_LOUDNESS_BINS 1000
+#define VM_TRUEPEAK_PHASES 4
+#define VM_TRUEPEAK_TAPS 12
+#define VM_TRUEPEAK_HISTORY (VM_TRUEPEAK_TAPS - 1)
+
+struct VmLoudnessBus {
+	/*first stage channel and count, up to VM_LOUDNESS_MAX_CHANNELS*/
+	int first;
+	int channels;
+	/*bus number within the edition*/
+	int index;
+	std::string name;
+};
+
+struct VmLoudnessValues {
+	/*LUFS, -inf until enough audio was measured*/
+	float momentary;
+	float shortTerm;
+	float integrated;
+	float momentaryMax;
+	/*dBTP since the last reset*/
+	float truePeak;
+};
+
+struct VmLoudnessSnapshot {
+	uint64_t ts;
+	int buses;
+	VmLoudnessValues values[VM_LOUDNESS_MAX_BUSES];
+};
+
+/*two cascaded biquads, transposed direct form II*/
+struct VmKWeighting {
+	float b[2][3];
+	float a[2][2];
+
+	void Build(double sampleRate)
+	{
+		/*BS.1770 stage 1 (head shelf) and stage 2 (RLB), derived for
+		 *any rate from their analog prototypes*/
+		double f0 = 1681.974450955533;
+		double q = 0.7071752369554196;
+		double k = tan(M_PI * f0 / sampleRate);
+		double vh = pow(10.0, 3.999843853973347 / 20.0);
+		double vb = pow(vh, 0.4996667741545416);
+		double a0 = 1.0 + k / q + k * k;
+		b[0][0] = (float)((vh + vb * k / q + k * k) / a0);
+		b[0][1] = (float)(2.0 * (k * k - vh) / a0);
+		b[0][2] = (float)((vh - vb * k / q + k * k) / a0);
+		a[0][0] = (float)(2.0 * (k * k - 1.0) / a0);
+		a[0][1] = (float)((1.0 - k / q + k * k) / a0);
+
+		f0 = 38.13547087602444;
+		q = 0.5003270373238773;
+		k = tan(M_PI * f0 / sampleRate);
+		a0 = 1.0 + k / q + k * k;
+		b[1][0] = 1.0f;
+		b[1][1] = -2.0f;
+		b[1][2] = 1.0f;
+		a[1][0] = (float)(2.0 * (k * k - 1.0) / a0);
+		a[1][1] = (float)((1.0 - k / q + k * k) / a0);
+	}
+};
+
+/*taps of phase p reversed, so output n of phase p is the dot product with
+ *input [n - VM_TRUEPEAK_HISTORY, n]*/
+static inline void vm_truepeak_taps(float taps[VM_TRUEPEAK_PHASES]
+					      [VM_TRUEPEAK_TAPS])
+{
+	const double half = VM_TRUEPEAK_TAPS / 2.0;
+	for (int p = 0; p < VM_TRUEPEAK_PHASES; p++) {
+		double sum = 0.0;
+		double h[VM_TRUEPEAK_TAPS];
+		for (int j = 0; j < VM_TRUEPEAK_TAPS; j++) {
+			/*distance of input n - j from output n - 6 + p / 4*/
+			double t = j + (double)p / VM_TRUEPEAK_PHASES - half;
+			double x = M_PI * t;
+			double sinc = fabs(x) < 1e-9 ? 1.0 : sin(x) / x;
+			double w = t / half;
+			w = fabs(w) >= 1.0 ? 0.0
+					   : 0.42 + 0.5 * cos(M_PI * w) +
+						     0.08 * cos(2.0 * M_PI * w);
+			h[j] = sinc * w;
+			sum += h[j];
+		}
+		/*unity gain at DC for every phase*/
+		for (int j = 0; j < VM_TRUEPEAK_TAPS; j++)
+			taps[p][VM_TRUEPEAK_TAPS - 1 - j] = (float)(h[j] / sum);
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * kernels, lanes are up to four channels of one bus
+ */
+
+/*adds the squared K-weighted samples of each lane to sums*/
+static inline void vm_kweight_scalar(const float *const *in, size_t frames,
+				     const VmKWeighting &k, float state[4][4],
+				     float sums[4])
+{
+	for (int l = 0; l < 4; l++) {
+		float s0 = state[0][l], s1 = state[1][l];
+		float s2 = state[2][l], s3 = state[3][l];
+		float sum = 0.0f;
+		const float *x = in[l];
+		for (size_t f = 0; f < frames; f++) {
+			float y = k.b[0][0] * x[f] + s0;
+			s0 = k.b[0][1] * x[f] - k.a[0][0] * y + s1;
+			s1 = k.b[0][2] * x[f] - k.a[0][1] * y;
+			float z = y + s2;
+			s2 = -2.0f * y - k.a[1][0] * z + s3;
+			s3 = y - k.a[1][1] * z;
+			sum += z * z;
+		}
+		state[0][l] = s0;
+		state[1][l] = s1;
+		state[2][l] = s2;
+		state[3][l] = s3;
+		sums[l] += sum;
+	}
+}
+
+/*max |x| of all 4x interpolated samples, in starts with the history*/
+static inline float vm_truepeak_scalar(const float *in, size_t frames,
+				       const float taps[VM_TRUEPEAK_PHASES]
+						       [VM_TRUEPEAK_TAPS])
+{
+	float peak = 0.0f;
+	for (size_t f = 0; f < frames; f++) {
+		for (int p = 0; p < VM_TRUEPEAK_PHASES; p++) {
+			float v = 0.0f;
+			for (int j = 0; j < VM_TRUEPEAK_TAPS; j++)
+				v += taps[p][j] * in[f + j];
+			v = fabsf(v);
+			if (v > peak)
+				peak = v;
+		}
+	}
+	return peak;
+}
+
+#if defined(PCM_X86) || defined(PCM_NEON)
+static inline pcm_v4 vm_biquad4(pcm_v4 x, pcm_v4 &s0, pcm_v4 &s1, pcm_v4 b0,
+				pcm_v4 b1, pcm_v4 b2, pcm_v4 a1, pcm_v4 a2)
+{
+	pcm_v4 y = pcm_add(pcm_mul(b0, x), s0);
+	s0 = pcm_add(pcm_sub(pcm_mul(b1, x), pcm_mul(a1, y)), s1);
+	s1 = pcm_sub(pcm_mul(b2, x), pcm_mul(a2, y));
+	return y;
+}
+
+/*one frame of every lane per vector, four frames transposed at a time*/
+static inline void vm_kweight_simd(const float *const *in, size_t frames,
+				   const VmKWeighting &k, float state[4][4],
+				   float sums[4])
+{
+	pcm_v4 b00 = pcm_set1(k.b[0][0]), b01 = pcm_set1(k.b[0][1]);
+	pcm_v4 b02 = pcm_set1(k.b[0][2]), a00 = pcm_set1(k.a[0][0]);
+	pcm_v4 a01 = pcm_set1(k.a[0][1]), b10 = pcm_set1(k.b[1][0]);
+	pcm_v4 b11 = pcm_set1(k.b[1][1]), b12 = pcm_set1(k.b[1][2]);
+	pcm_v4 a10 = pcm_set1(k.a[1][0]), a11 = pcm_set1(k.a[1][1]);
+	pcm_v4 s0 = pcm_load(state[0]), s1 = pcm_load(state[1]);
+	pcm_v4 s2 = pcm_load(state[2]), s3 = pcm_load(state[3]);
+	pcm_v4 acc = pcm_set1(0.0f);
+	auto step = [&](pcm_v4 x) {
+		pcm_v4 y = vm_biquad4(x, s0, s1, b00, b01, b02, a00, a01);
+		pcm_v4 z = vm_biquad4(y, s2, s3, b10, b11, b12, a10, a11);
+		acc = pcm_add(acc, pcm_mul(z, z));
+	};
+	size_t f = 0;
+	for (; f + 4 <= frames; f += 4) {
+		pcm_v4 x0 = pcm_load(in[0] + f), x1 = pcm_load(in[1] + f);
+		pcm_v4 x2 = pcm_load(in[2] + f), x3 = pcm_load(in[3] + f);
+		pcm_transpose4(x0, x1, x2, x3);
+		step(x0);
+		step(x1);
+		step(x2);
+		step(x3);
+	}
+	for (; f < frames; f++) {
+		float x[4] = {in[0][f], in[1][f], in[2][f], in[3][f]};
+		step(pcm_load(x));
+	}
+	pcm_store(state[0], s0);
+	pcm_store(state[1], s1);
+	pcm_store(state[2], s2);
+	pcm_store(state[3], s3);
+	pcm_store(sums, pcm_add(pcm_load(sums), acc));
+}
+
+/*the four phases of one frame are summed with one transpose*/
+static inline float vm_truepeak_simd(const float *in, size_t frames,
+				     const float taps[VM_TRUEPEAK_PHASES]
+						     [VM_TRUEPEAK_TAPS])
+{
+	pcm_v4 t[VM_TRUEPEAK_PHASES][3];
+	for (int p = 0; p < VM_TRUEPEAK_PHASES; p++)
+		for (int j = 0; j < 3; j++)
+			t[p][j] = pcm_load(taps[p] + 4 * j);
+	pcm_v4 peak = pcm_set1(0.0f);
+	for (size_t f = 0; f < frames; f++) {
+		pcm_v4 x0 = pcm_load(in + f), x1 = pcm_load(in + f + 4);
+		pcm_v4 x2 = pcm_load(in + f + 8);
+		pcm_v4 p[VM_TRUEPEAK_PHASES];
+		for (int i = 0; i < VM_TRUEPEAK_PHASES; i++)
+			p[i] = pcm_add(pcm_add(pcm_mul(x0, t[i][0]),
+					       pcm_mul(x1, t[i][1])),
+				       pcm_mul(x2, t[i][2]));
+		pcm_transpose4(p[0], p[1], p[2], p[3]);
+		pcm_v4 v = pcm_add(pcm_add(p[0], p[1]), pcm_add(p[2], p[3]));
+		peak = pcm_max4(peak, pcm_abs(v));
+	}
+	return pcm_hmax(peak);
+}
+#endif
+
+static inline void vm_kweight_isa(pcm_isa isa, const float *const *in,
+				  size_t frames, const VmKWeighting &k,
+				  float state[4][4], float sums[4])
+{
+#if defined(PCM_X86) || defined(PCM_NEON)
+	if (isa != pcm_isa_scalar) {
+		vm_kweight_simd(in, frames, k, state, sums);
+		return;
+	}
+#endif
+	UNUSED_PARAMETER(isa);
+	vm_kweight_scalar(in, frames, k, state, sums);
+}
+
+static inline float vm_truepeak_isa(pcm_isa isa, const float *in,
+				    size_t frames,
+				    const float taps[VM_TRUEPEAK_PHASES]
+						    [VM_TRUEPEAK_TAPS])
+{
+#if defined(PCM_X86) || defined(PCM_NEON)
+	if (isa != pcm_isa_scalar)
+		return vm_truepeak_simd(in, frames, taps);
+#endif
+	UNUSED_PARAMETER(isa);
+	return vm_truepeak_scalar(in, frames, taps);
+}
+
+static inline float vm_lufs(double energy)
+{
+	return energy > 0.0 ? (float)(-0.691 + 10.0 * log10(energy))
+			    : -INFINITY;
+}
+
+/* ------------------------------------------------------------------------
+ * meter
+ */
+
+template<class Data> class VmLoudnessMeter : public StreamableReader<Data> {
+	struct Bus {
+		VmLoudnessBus config;
+		/*lanes beyond the bus read the zero buffer with weight 0*/
+		int lanes;
+		float weights[VM_LOUDNESS_MAX_CHANNELS];
+		float state[VM_LOUDNESS_MAX_CHANNELS / 4][4][4];
+		float sums[VM_LOUDNESS_MAX_CHANNELS];
+		float history[VM_LOUDNESS_MAX_CHANNELS][VM_TRUEPEAK_HISTORY];
+		double hops[VM_LOUDNESS_SHORT_HOPS];
+		uint64_t hopCount;
+		float momentaryMax;
+		float truePeak;
+		/*gated blocks, bins from the absolute gate up*/
+		uint64_t binCount[VM_LOUDNESS_BINS];
+		double binEnergy[VM_LOUDNESS_BINS];
+		uint64_t gatedCount;
+		double gatedEnergy;
+		/*sums of the bins at or above the cursor*/
+		int cursor;
+		uint64_t aboveCount;
+		double aboveEnergy;
+		VmLoudnessValues values;
+	};
+
+	std::string _name;
+	/*the filters have no AVX2 version*/
+	pcm_isa _isa = min(pcm_best_isa(), pcm_isa_simd);
+	std::vector<Bus> _buses;
+	VmKWeighting _k = {};
+	float _taps[VM_TRUEPEAK_PHASES][VM_TRUEPEAK_TAPS];
+	long _sampleRate = 0;
+	size_t _hopFrames = 0;
+	size_t _hopPosition = 0;
+	std::vector<float> _zeros;
+	std::vector<float> _scratch;
+	std::atomic<bool> _reset{false};
+
+	/*odd while the reader writes*/
+	std::atomic<uint32_t> _sequence{0};
+	VmLoudnessSnapshot _snapshot = {};
+
+	std::atomic<uint64_t> _blocks{0};
+	std::atomic<uint64_t> _busyNs{0};
+	std::atomic<uint64_t> _maxBlockNs{0};
+	std::atomic<uint64_t> _audioNs{0};
+	std::atomic<uint64_t> _channelFrames{0};
+
+	static void clear(Bus &b)
+	{
+		memset(b.state, 0, sizeof(b.state));
+		memset(b.sums, 0, sizeof(b.sums));
+		memset(b.history, 0, sizeof(b.history));
+		b.hopCount = 0;
+		b.momentaryMax = -INFINITY;
+		b.truePeak = 0.0f;
+		memset(b.binCount, 0, sizeof(b.binCount));
+		memset(b.binEnergy, 0, sizeof(b.binEnergy));
+		b.gatedCount = 0;
+		b.gatedEnergy = 0.0;
+		b.cursor = 0;
+		b.aboveCount = 0;
+		b.aboveEnergy = 0.0;
+		b.values = {-INFINITY, -INFINITY, -INFINITY, -INFINITY,
+			    -INFINITY};
+	}
+
+	/*moves the cursor to the relative gate, one bin at a time*/
+	static void gate(Bus &b)
+	{
+		double relative = vm_lufs(b.gatedEnergy / b.gatedCount) +
+				  VM_LOUDNESS_RELATIVE;
+		int target = (int)floor((relative - VM_LOUDNESS_GATE) /
+					VM_LOUDNESS_BIN_LU);
+		target = max(0, min(target, VM_LOUDNESS_BINS - 1));
+		while (b.cursor < target) {
+			b.aboveCount -= b.binCount[b.cursor];
+			b.aboveEnergy -= b.binEnergy[b.cursor];
+			b.cursor++;
+		}
+		while (b.cursor > target) {
+			b.cursor--;
+			b.aboveCount += b.binCount[b.cursor];
+			b.aboveEnergy += b.binEnergy[b.cursor];
+		}
+	}
+
+	void hop(Bus &b)
+	{
+		double energy = 0.0;
+		for (int c = 0; c < b.config.channels; c++)
+			energy += (double)b.weights[c] * b.sums[c];
+		energy /= (double)_hopFrames;
+		memset(b.sums, 0, sizeof(b.sums));
+		/*silence would otherwise leave the filters in denormals*/
+		for (auto &lane : b.state)
+			for (auto &s : lane)
+				for (float &v : s)
+					if (fabsf(v) < 1e-25f)
+						v = 0.0f;
+
+		b.hops[b.hopCount++ % VM_LOUDNESS_SHORT_HOPS] = energy;
+		auto mean = [&b](int hops) {
+			double sum = 0.0;
+			for (int i = 1; i <= hops; i++)
+				sum += b.hops[(b.hopCount - i) %
+					      VM_LOUDNESS_SHORT_HOPS];
+			return sum / hops;
+		};
+		if (b.hopCount >= VM_LOUDNESS_SHORT_HOPS)
+			b.values.shortTerm =
+				vm_lufs(mean(VM_LOUDNESS_SHORT_HOPS));
+		if (b.hopCount < VM_LOUDNESS_MOMENTARY_HOPS)
+			return;
+
+		double block = mean(VM_LOUDNESS_MOMENTARY_HOPS);
+		float momentary = vm_lufs(block);
+		b.values.momentary = momentary;
+		if (momentary > b.momentaryMax)
+			b.momentaryMax = momentary;
+		if (momentary < VM_LOUDNESS_GATE)
+			return;
+		int bin = (int)((momentary - VM_LOUDNESS_GATE) /
+				VM_LOUDNESS_BIN_LU);
+		bin = min(bin, VM_LOUDNESS_BINS - 1);
+		b.binCount[bin]++;
+		b.binEnergy[bin] += block;
+		b.gatedCount++;
+		b.gatedEnergy += block;
+		if (bin >= b.cursor) {
+			b.aboveCount++;
+			b.aboveEnergy += block;
+		}
+		gate(b);
+		b.values.integrated =
+			b.aboveCount ? vm_lufs(b.aboveEnergy / b.aboveCount)
+				     : -INFINITY;
+	}
+
+	void publish(uint64_t ts)
+	{
+		uint32_t s = _sequence.load(std::memory_order_relaxed);
+		_sequence.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		int count = (int)_buses.size();
+		for (int i = 0; i < count; i++) {
+			Bus &b = _buses[i];
+			b.values.momentaryMax = b.momentaryMax;
+			b.values.truePeak = vm_meter_db(b.truePeak);
+			_snapshot.values[i] = b.values;
+		}
+		_snapshot.buses = count;
+		_snapshot.ts = ts;
+		_sequence.store(s + 2, std::memory_order_release);
+	}
+
+	void measure(Bus &b, const float *const *channels, size_t offset,
+		     size_t frames)
+	{
+		for (int g = 0; g < b.lanes / 4; g++) {
+			const float *in[4];
+			for (int l = 0; l < 4; l++) {
+				int c = g * 4 + l;
+				in[l] = c < b.config.channels
+						? channels[c] + offset
+						: _zeros.data();
+			}
+			vm_kweight_isa(_isa, in, frames, _k, b.state[g],
+				       b.sums + g * 4);
+		}
+	}
+
+	void truePeak(Bus &b, const float *const *channels, size_t frames)
+	{
+		/*4 floats of slack so the last vector load stays in bounds*/
+		if (_scratch.size() < frames + VM_TRUEPEAK_HISTORY + 4)
+			_scratch.resize(frames + VM_TRUEPEAK_HISTORY + 4);
+		float *x = _scratch.data();
+		for (int c = 0; c < b.config.channels; c++) {
+			memcpy(x, b.history[c], sizeof(b.history[c]));
+			memcpy(x + VM_TRUEPEAK_HISTORY, channels[c],
+			       frames * sizeof(float));
+			float peak = vm_truepeak_isa(_isa, x, frames, _taps);
+			if (peak > b.truePeak)
+				b.truePeak = peak;
+			memcpy(b.history[c], x + frames, sizeof(b.history[c]));
+		}
+	}
+
+public:
+	VmLoudnessMeter() { vm_truepeak_taps(_taps); }
+
+	std::string Name() { return _name; }
+
+	/*only while disconnected*/
+	void Configure(const char *stage,
+		       const std::vector<VmLoudnessBus> &buses)
+	{
+		_name = std::string("loudness ") + stage;
+		_buses.clear();
+		_buses.resize(min(buses.size(), (size_t)VM_LOUDNESS_MAX_BUSES));
+		for (size_t i = 0; i < _buses.size(); i++) {
+			Bus &b = _buses[i];
+			b.config = buses[i];
+			b.config.channels = min(b.config.channels,
+						VM_LOUDNESS_MAX_CHANNELS);
+			b.lanes = (b.config.channels + 3) & ~3;
+			/*BS.1770 weights for 7.1 buses, LFE is not measured
+			 *and the surrounds count 1.5 dB more*/
+			for (int c = 0; c < VM_LOUDNESS_MAX_CHANNELS; c++)
+				b.weights[c] = c == 3 && b.config.channels == 8
+						       ? 0.0f
+						       : c >= 4 ? 1.41f : 1.0f;
+			clear(b);
+		}
+		_sampleRate = 0;
+		publish(0);
+	}
+
+	/*integrated loudness, maxima and true peak, at the next block*/
+	void Reset() { _reset = true; }
+
+	void Read(const Data *buf)
+	{
+		TraceScope trace("VmLoudnessMeter::Read");
+		uint64_t start = os_gettime_ns();
+		long sr = buf->data.audiobuffer_sr;
+		size_t frames = (size_t)buf->data.audiobuffer_nbs;
+		if (sr <= 0 || !frames || _buses.empty())
+			return;
+		bool reset = _reset.exchange(false);
+		if (sr != _sampleRate) {
+			_sampleRate = sr;
+			_k.Build((double)sr);
+			_hopFrames = (size_t)sr * VM_LOUDNESS_HOP_MS / 1000;
+			_hopPosition = 0;
+			reset = true;
+		}
+		if (reset)
+			for (Bus &b : _buses)
+				clear(b);
+		if (_zeros.size() < frames)
+			_zeros.resize(frames);
+
+		const float *const *channels = buf->data.audiobuffer_r;
+		int available = (int)buf->data.audiobuffer_nbi;
+		uint64_t measured = 0;
+		bool hopped = false;
+		for (size_t offset = 0; offset < frames;) {
+			size_t n = min(frames - offset,
+				       _hopFrames - _hopPosition);
+			for (Bus &b : _buses)
+				if (b.config.first + b.config.channels <=
+				    available)
+					measure(b, channels + b.config.first,
+						offset, n);
+			offset += n;
+			_hopPosition += n;
+			if (_hopPosition == _hopFrames) {
+				for (Bus &b : _buses)
+					hop(b);
+				_hopPosition = 0;
+				hopped = true;
+			}
+		}
+		for (Bus &b : _buses) {
+			if (b.config.first + b.config.channels > available)
+				continue;
+			truePeak(b, channels + b.config.first, frames);
+			measured += b.config.channels;
+		}
+		if (hopped || reset)
+			publish(buf->ts);
+
+		uint64_t ns = os_gettime_ns() - start;
+		_blocks.fetch_add(1, std::memory_order_relaxed);
+		_busyNs.fetch_add(ns, std::memory_order_relaxed);
+		if (ns > _maxBlockNs.load(std::memory_order_relaxed))
+			_maxBlockNs.store(ns, std::memory_order_relaxed);
+		_audioNs.fetch_add(frames * 1000000000ULL / sr,
+				   std::memory_order_relaxed);
+		_channelFrames.fetch_add(measured * frames,
+					 std::memory_order_relaxed);
+	}
+
+	/*any thread, false before Configure*/
+	bool Read(VmLoudnessSnapshot &out) const
+	{
+		for (int tries = 0;; tries++) {
+			uint32_t s = _sequence.load(std::memory_order_acquire);
+			if (s & 1) {
+				if (tries > 64)
+					SwitchToThread();
+				continue;
+			}
+			if (!s)
+				return false;
+			memcpy(&out, &_snapshot, sizeof(out));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (_sequence.load(std::memory_order_relaxed) == s)
+				return true;
+		}
+	}
+
+	/*cost of the measured channels, as share of one core*/
+	std::string Stats()
+	{
+		uint64_t blocks = _blocks.load(), busy = _busyNs.load();
+		uint64_t audio = _audioNs.load();
+		uint64_t channelFrames = _channelFrames.load();
+		char text[256];
+		snprintf(text, sizeof(text),
+			 "%s, %llu blocks, %.1f us avg %.1f us max per block, "
+			 "%.3f%% of a core, %.2f ns per channel sample, "
+			 "%llu dropped",
+			 pcm_isa_name(_isa), (unsigned long long)blocks,
+			 blocks ? busy / 1000.0 / blocks : 0.0,
+			 _maxBlockNs.load() / 1000.0,
+			 audio ? 100.0 * busy / audio : 0.0,
+			 channelFrames ? (double)busy / channelFrames : 0.0,
+			 (unsigned long long)this->Dropped());
+		return text;
+	}
+};
+
+/*realtime factor per channel for a main stage sized block*/
+static inline std::string vm_loudness_benchmark()
+{
+	const size_t frames = 512;
+	const int rounds = 400;
+	std::vector<pcm_isa> isas = {pcm_isa_scalar};
+#if defined(PCM_X86) || defined(PCM_NEON)
+	isas.push_back(pcm_isa_simd);
+#endif
+	std::vector<float> in(4 * frames + VM_TRUEPEAK_HISTORY + 4);
+	uint32_t seed = 1;
+	for (float &v : in)
+		v = pcm_uniform(pcm_xorshift(seed)) * 2.0f - 1.0f;
+	const float *lanes[4] = {in.data(), in.data() + frames,
+				 in.data() + 2 * frames,
+				 in.data() + 3 * frames};
+	VmKWeighting k;
+	k.Build(48000.0);
+	float taps[VM_TRUEPEAK_PHASES][VM_TRUEPEAK_TAPS];
+	vm_truepeak_taps(taps);
+
+	std::string report;
+	char line[192];
+	for (int kernel = 0; kernel < 2; kernel++) {
+		int len = snprintf(line, sizeof(line), "\n%s 48 kHz:",
+				   kernel ? "true peak 4x" : "k-weighting");
+		float ref = 0.0f;
+		for (pcm_isa isa : isas) {
+			float state[4][4] = {}, sums[4] = {};
+			float result = 0.0f;
+			uint64_t start = os_gettime_ns();
+			for (int r = 0; r < rounds; r++) {
+				if (kernel)
+					for (int l = 0; l < 4; l++)
+						result = max(result,
+							     vm_truepeak_isa(
+								     isa,
+								     lanes[l],
+								     frames,
+								     taps));
+				else
+					vm_kweight_isa(isa, lanes, frames, k,
+						       state, sums);
+			}
+			double seconds =
+				(double)(os_gettime_ns() - start) / 1e9;
+			if (!kernel)
+				result = sums[0] + sums[1] + sums[2] + sums[3];
+			if (isa == pcm_isa_scalar)
+				ref = result;
+			bool match = fabsf(result - ref) <=
+				     1e-4f * fabsf(ref) + 1e-6f;
+			len += snprintf(line + len, sizeof(line) - len,
+					" %s %.0fx realtime per channel%s",
+					pcm_isa_name(isa),
+					seconds > 0.0 ? 4.0 * rounds * frames /
+								48000.0 /
+								seconds
+						      : 0.0,
+					match ? "" : " MISMATCH");
+		}
+		report += line;
+	}
+	return report;
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <windows.h>
+
+/*
+ * Per channel levels of a stage, measured by the audio callback while it
+ * copies the block into the stage ring (see pcm_copy_level_f32), so they
+ * describe exactly the frames the plugin captured and cost no DLL calls.
+ *
+ * The callback publishes one snapshot per block under a sequence counter.
+ * Readers copy it at any rate and retry if the callback was writing, they
+ * never block it. Peak hold keeps the highest peak for VM_METER_HOLD_MS,
+ * clips counts blocks that reached full scale.
+ */
+
+#define VM_METER_MAX_CHANNELS 128
+#define VM_METER_HOLD_MS 1500
+#define VM_METER_CLIP 1.0f
+
+struct VmMeterChannel {
+	float peak;
+	float rms;
+	float hold;
+	uint32_t clips;
+};
+
+struct VmMeterSnapshot {
+	uint64_t ts;
+	uint64_t cycle;
+	int channels;
+	VmMeterChannel levels[VM_METER_MAX_CHANNELS];
+};
+
+class VmMeter {
+	/*odd while the callback writes*/
+	std::atomic<uint32_t> _sequence{0};
+	VmMeterSnapshot _snapshot = {};
+	std::atomic<bool> _resetClips{false};
+	/*callback only*/
+	uint64_t _holdTs[VM_METER_MAX_CHANNELS] = {};
+
+public:
+	/*audio callback, squares are the sums of squares over frames*/
+	void Publish(const float *peaks, const float *squares, int channels,
+		     int frames, uint64_t ts, uint64_t cycle)
+	{
+		if (channels > VM_METER_MAX_CHANNELS)
+			channels = VM_METER_MAX_CHANNELS;
+		bool resetClips = _resetClips.exchange(false);
+		uint32_t s = _sequence.load(std::memory_order_relaxed);
+		_sequence.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		float scale = frames > 0 ? 1.0f / frames : 0.0f;
+		uint64_t holdNs = VM_METER_HOLD_MS * 1000000ULL;
+		for (int i = 0; i < channels; i++) {
+			VmMeterChannel &c = _snapshot.levels[i];
+			c.peak = peaks[i];
+			c.rms = sqrtf(squares[i] * scale);
+			if (c.peak >= c.hold || ts - _holdTs[i] >= holdNs) {
+				c.hold = c.peak;
+				_holdTs[i] = ts;
+			}
+			if (resetClips)
+				c.clips = 0;
+			if (c.peak >= VM_METER_CLIP)
+				c.clips++;
+		}
+		_snapshot.channels = channels;
+		_snapshot.ts = ts;
+		_snapshot.cycle = cycle;
+		_sequence.store(s + 2, std::memory_order_release);
+	}
+
+	/*any thread, false before the first block*/
+	bool Read(VmMeterSnapshot &out) const
+	{
+		for (int tries = 0;; tries++) {
+			uint32_t s = _sequence.load(std::memory_order_acquire);
+			if (s & 1) {
+				if (tries > 64)
+					SwitchToThread();
+				continue;
+			}
+			if (!s)
+				return false;
+			memcpy(&out, &_snapshot, sizeof(out));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (_sequence.load(std::memory_order_relaxed) == s)
+				return true;
+		}
+	}
+
+	/*applied with the next block*/
+	void ResetClips() { _resetClips = true; }
+};
+
+static inline float vm_meter_db(float v)
+{
+	return v > 0.0f ? 20.0f * log10f(v) : -INFINITY;
+}
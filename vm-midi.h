@@ -0,0 +1,302 @@
+#pragma once
+#include <util/base.h>
+#include <util/platform.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <windows.h>
+#include <util/windows/WinHandle.hpp>
+#include "VoicemeeterRemote.h"
+
+/*
+ * MIDI input from Voicemeeter.
+ *
+ * A poll thread drains VBVMR_GetMidiMessage every VM_MIDI_FAST_MS for
+ * VM_MIDI_ACTIVE_MS after the last message and every VM_MIDI_SLOW_MS when
+ * idle. Raw bytes are parsed (running status, system exclusive and real
+ * time bytes skipped) into fixed size events in a single producer/single
+ * consumer queue. The notify function is called when the queue goes from
+ * drained to pending, the consumer drains it on its own thread and reports
+ * back how each event was handled so the latency from poll to action can
+ * be measured.
+ *
+ * Bindings map note, control change and program change messages to hotkey
+ * names, one per line:
+ *
+ *     note 1 60: OBSBasic.StartRecording
+ *     cc 1 20: libobs.mute@Mic/Aux
+ *     pc 1 3: OBSBasic.SelectScene@BRB
+ *
+ * Channels are 1-16, "@<source>" picks the hotkey of one source.
+ */
+
+#define VM_MIDI_QUEUE_SIZE 256
+#define VM_MIDI_FAST_MS 1
+#define VM_MIDI_SLOW_MS 20
+#define VM_MIDI_ACTIVE_MS 2000
+#define VM_MIDI_BUFFER 1024
+
+enum vm_midi_type {
+	vm_midi_note_off = 0x80,
+	vm_midi_note = 0x90,
+	vm_midi_cc = 0xB0,
+	vm_midi_pc = 0xC0,
+};
+
+struct VmMidiEvent {
+	uint64_t ts;
+	uint8_t status;
+	uint8_t data1;
+	uint8_t data2;
+};
+
+struct VmMidiBinding {
+	uint32_t key;
+	std::string hotkey;
+	std::string source;
+};
+
+/*note off shares the key of its note*/
+static inline uint32_t vm_midi_key(uint8_t status, uint8_t number)
+{
+	uint32_t type = status & 0xF0;
+	if (type == vm_midi_note_off)
+		type = vm_midi_note;
+	return type << 16 | (uint32_t)(status & 0x0F) << 8 | number;
+}
+
+static std::vector<VmMidiBinding> vm_midi_parse(const std::string &text)
+{
+	std::vector<VmMidiBinding> bindings;
+	std::stringstream lines(text);
+	std::string line;
+	while (std::getline(lines, line)) {
+		size_t colon = line.find(':');
+		if (colon == std::string::npos)
+			continue;
+		char type[8] = {0};
+		int channel = 0, number = 0;
+		if (sscanf(line.substr(0, colon).c_str(), "%7s %d %d", type,
+			   &channel, &number) != 3 ||
+		    channel < 1 || channel > 16 || number < 0 || number > 127)
+			continue;
+		uint8_t status;
+		if (strcmp(type, "note") == 0)
+			status = vm_midi_note;
+		else if (strcmp(type, "cc") == 0)
+			status = vm_midi_cc;
+		else if (strcmp(type, "pc") == 0)
+			status = vm_midi_pc;
+		else
+			continue;
+
+		std::string target = line.substr(colon + 1);
+		size_t b = target.find_first_not_of(" \t");
+		size_t e = target.find_last_not_of(" \t\r");
+		if (b == std::string::npos)
+			continue;
+		target = target.substr(b, e - b + 1);
+		size_t at = target.find('@');
+		VmMidiBinding binding;
+		binding.key = vm_midi_key(status | (channel - 1), number);
+		binding.hotkey = target.substr(0, at);
+		if (at != std::string::npos)
+			binding.source = target.substr(at + 1);
+		bindings.push_back(std::move(binding));
+	}
+	return bindings;
+}
+
+class VmMidiParser {
+	uint8_t _status = 0;
+	uint8_t _data[2] = {0, 0};
+	int _count = 0;
+	bool _sysex = false;
+
+public:
+	template<class F> void Parse(const uint8_t *bytes, size_t size, F &&emit)
+	{
+		for (size_t i = 0; i < size; i++) {
+			uint8_t b = bytes[i];
+			if (b >= 0xF8)
+				continue;
+			if (b >= 0xF0) {
+				/*system common cancels running status, F7 ends
+				 *system exclusive*/
+				_sysex = b == 0xF0;
+				_status = 0;
+				_count = 0;
+				continue;
+			}
+			if (b & 0x80) {
+				_sysex = false;
+				_status = b;
+				_count = 0;
+				continue;
+			}
+			if (_sysex || !_status)
+				continue;
+			_data[_count++] = b;
+			uint8_t type = _status & 0xF0;
+			int need = type == 0xC0 || type == 0xD0 ? 1 : 2;
+			if (_count == need) {
+				emit(_status, _data[0], need == 2 ? _data[1] : 0);
+				_count = 0;
+			}
+		}
+	}
+};
+
+class VmMidiPump {
+	VmMidiEvent _queue[VM_MIDI_QUEUE_SIZE];
+	std::atomic<size_t> _head{0};
+	std::atomic<size_t> _tail{0};
+	std::atomic<bool> _notified{false};
+
+	T_VBVMR_GetMidiMessage _getMidi = nullptr;
+	void (*_notify)() = nullptr;
+
+	WinHandle _thread;
+	WinHandle _stopSignal;
+	/*poll thread only*/
+	VmMidiParser _parser;
+
+	std::atomic<int> _interval{VM_MIDI_SLOW_MS};
+	std::atomic<uint64_t> _events{0};
+	std::atomic<uint64_t> _dropped{0};
+	/*consumer only*/
+	uint64_t _handled = 0;
+	uint64_t _unmapped = 0;
+	uint64_t _latencyNs = 0;
+	uint64_t _maxLatencyNs = 0;
+
+	bool push(const VmMidiEvent &e)
+	{
+		size_t head = _head.load(std::memory_order_relaxed);
+		if (head - _tail.load(std::memory_order_acquire) >=
+		    VM_MIDI_QUEUE_SIZE) {
+			_dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		_queue[head % VM_MIDI_QUEUE_SIZE] = e;
+		_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	/*returns whether anything was received*/
+	bool poll()
+	{
+		uint8_t bytes[VM_MIDI_BUFFER];
+		bool received = false;
+		uint64_t now = 0;
+		auto emit = [&](uint8_t status, uint8_t d1, uint8_t d2) {
+			if (push({now, status, d1, d2}))
+				_events.fetch_add(1, std::memory_order_relaxed);
+		};
+		long n;
+		while ((n = _getMidi(bytes, sizeof(bytes))) > 0) {
+			now = os_gettime_ns();
+			_parser.Parse(bytes, (size_t)n, emit);
+			received = true;
+			if (n < (long)sizeof(bytes))
+				break;
+		}
+		if (received && !_notified.exchange(true))
+			_notify();
+		return received;
+	}
+
+	static DWORD WINAPI Run(void *data)
+	{
+		VmMidiPump *pump = static_cast<VmMidiPump *>(data);
+		os_set_thread_name("obs-voicemeeter: midi");
+		uint64_t lastActivity = 0;
+		while (WaitForSingleObject(pump->_stopSignal,
+					   pump->_interval) == WAIT_TIMEOUT) {
+			uint64_t now = os_gettime_ns();
+			if (pump->poll())
+				lastActivity = now;
+			bool active = lastActivity &&
+				      now - lastActivity <
+					      VM_MIDI_ACTIVE_MS * 1000000ULL;
+			pump->_interval = active ? VM_MIDI_FAST_MS
+						 : VM_MIDI_SLOW_MS;
+		}
+		return 0;
+	}
+
+public:
+	VmMidiPump()
+	{
+		_stopSignal = CreateEvent(nullptr, true, false, nullptr);
+	}
+
+	~VmMidiPump() { Stop(); }
+
+	void Start(T_VBVMR_GetMidiMessage getMidi, void (*notify)())
+	{
+		if (_thread.Valid())
+			return;
+		_getMidi = getMidi;
+		_notify = notify;
+		_interval = VM_MIDI_SLOW_MS;
+		ResetEvent(_stopSignal);
+		_thread = CreateThread(nullptr, 0, Run, this, 0, nullptr);
+	}
+
+	void Stop()
+	{
+		if (!_thread.Valid())
+			return;
+		SetEvent(_stopSignal);
+		WaitForSingleObject(_thread, INFINITE);
+		_thread = nullptr;
+	}
+
+	/*consumer thread, events queued while draining notify again*/
+	template<class F> void Drain(F &&f)
+	{
+		_notified = false;
+		size_t tail = _tail.load(std::memory_order_relaxed);
+		while (tail != _head.load(std::memory_order_acquire)) {
+			VmMidiEvent e = _queue[tail % VM_MIDI_QUEUE_SIZE];
+			_tail.store(++tail, std::memory_order_release);
+			f(e);
+		}
+	}
+
+	/*consumer thread, right after the event's action ran*/
+	void Handled(const VmMidiEvent &e, bool mapped)
+	{
+		if (!mapped) {
+			_unmapped++;
+			return;
+		}
+		uint64_t latency = os_gettime_ns() - e.ts;
+		_handled++;
+		_latencyNs += latency;
+		if (latency > _maxLatencyNs)
+			_maxLatencyNs = latency;
+	}
+
+	/*consumer thread*/
+	std::string Stats()
+	{
+		char text[256];
+		snprintf(text, sizeof(text),
+			 "%llu events (%llu dropped), %llu actions, %llu "
+			 "unmapped, polling every %d ms, latency %.2f ms avg "
+			 "%.2f ms max",
+			 (unsigned long long)_events.load(),
+			 (unsigned long long)_dropped.load(),
+			 (unsigned long long)_handled,
+			 (unsigned long long)_unmapped, _interval.load(),
+			 _handled ? _latencyNs / 1000000.0 / _handled : 0.0,
+			 _maxLatencyNs / 1000000.0);
+		return text;
+	}
+};
@@ -0,0 +1,518 @@
+#pragma once
+#include <util/base.h>
+#include <util/platform.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <windows.h>
+#include <util/windows/WinHandle.hpp>
+#include "VoicemeeterRemote.h"
+
+/*
+ * Cache of Voicemeeter parameters (gains, mutes, labels, bus routing).
+ *
+ * Parameters are subscribed by name and read through the returned handle.
+ * A low priority thread asks VBVMR_IsParametersDirty every VM_PARAM_POLL_MS
+ * and only when Voicemeeter reports a change, or a parameter was just
+ * subscribed, fetches every subscribed parameter in one batch. Readers never
+ * call into the DLL and never lock: numbers are atomics, strings are
+ * guarded by a sequence counter readers retry on.
+ *
+ * Handles stay valid for the lifetime of the cache, an unsubscribed name
+ * keeps its slot and gets it back when subscribed again.
+ *
+ * Writes go through VmParamWriter, which keeps only the last value per
+ * parameter and sends everything written within VM_WRITE_WINDOW_MS of the
+ * first pending write as one VBVMR_SetParameters script.
+ */
+
+#define VM_PARAM_MAX 256
+#define VM_PARAM_NAME 64
+#define VM_PARAM_TEXT 128
+#define VM_PARAM_POLL_MS 50
+#define VM_WRITE_WINDOW_MS 10
+#define VM_SCRIPT_MAX 4096
+
+enum vm_param_kind {
+	vm_param_float,
+	vm_param_string,
+};
+
+struct VmParam {
+	char name[VM_PARAM_NAME];
+	vm_param_kind kind;
+	std::atomic<int> refs{0};
+	std::atomic<bool> valid{false};
+	std::atomic<float> value{0.0f};
+	/*odd while text is being written*/
+	std::atomic<uint32_t> sequence{0};
+	char text[VM_PARAM_TEXT];
+};
+
+class VmParamCache {
+	VmParam _params[VM_PARAM_MAX];
+	std::atomic<int> _count{0};
+	std::atomic<bool> _pending{false};
+	std::mutex _lock;
+
+	T_VBVMR_IsParametersDirty _isDirty = nullptr;
+	T_VBVMR_GetParameterFloat _getFloat = nullptr;
+	T_VBVMR_GetParameterStringA _getString = nullptr;
+
+	WinHandle _thread;
+	WinHandle _stopSignal;
+	/*poll thread only*/
+	bool _connected = false;
+
+	std::atomic<uint64_t> _dllCalls{0};
+	std::atomic<uint64_t> _reads{0};
+	std::atomic<uint64_t> _refreshes{0};
+	/*GetParameter calls a clean poll did not make*/
+	std::atomic<uint64_t> _skipped{0};
+	/*moves when a string parameter changes, appears or goes away*/
+	std::atomic<uint64_t> _textGeneration{1};
+	/*Stats caller only*/
+	uint64_t _statsTime = 0;
+	uint64_t _statsCalls = 0;
+	uint64_t _statsReads = 0;
+
+	/*false when the text is unchanged*/
+	bool store(VmParam &p, const char *text)
+	{
+		char value[VM_PARAM_TEXT];
+		snprintf(value, sizeof(value), "%s", text);
+		/*only the poll thread writes, it may read without the lock*/
+		if (strcmp(p.text, value) == 0)
+			return false;
+		uint32_t s = p.sequence.load(std::memory_order_relaxed);
+		p.sequence.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(p.text, value, sizeof(p.text));
+		p.sequence.store(s + 2, std::memory_order_release);
+		return true;
+	}
+
+	void invalidate(VmParam &p)
+	{
+		if (p.valid.exchange(false) && p.kind == vm_param_string)
+			_textGeneration.fetch_add(1, std::memory_order_release);
+	}
+
+	void refresh()
+	{
+		int count = _count.load(std::memory_order_acquire);
+		uint64_t calls = 0;
+		for (int i = 0; i < count; i++) {
+			VmParam &p = _params[i];
+			if (!p.refs.load(std::memory_order_relaxed))
+				continue;
+			calls++;
+			if (p.kind == vm_param_float) {
+				float v;
+				if (_getFloat(p.name, &v) != 0) {
+					invalidate(p);
+					continue;
+				}
+				p.value.store(v, std::memory_order_relaxed);
+			} else {
+				/*the DLL fills up to 512 characters*/
+				char text[512] = {0};
+				if (_getString(p.name, text) != 0) {
+					invalidate(p);
+					continue;
+				}
+				bool changed = store(p, text);
+				if (!p.valid.exchange(true) || changed)
+					_textGeneration.fetch_add(
+						1, std::memory_order_release);
+				continue;
+			}
+			p.valid.store(true, std::memory_order_release);
+		}
+		_dllCalls.fetch_add(calls, std::memory_order_relaxed);
+		_refreshes.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void poll()
+	{
+		bool pending = _pending.exchange(false);
+		long dirty = _isDirty();
+		_dllCalls.fetch_add(1, std::memory_order_relaxed);
+		if (dirty < 0) {
+			/*not logged in or no Voicemeeter running*/
+			if (_connected) {
+				int count = _count.load(std::memory_order_acquire);
+				for (int i = 0; i < count; i++)
+					invalidate(_params[i]);
+			}
+			_connected = false;
+			if (pending)
+				_pending = true;
+			return;
+		}
+		if (dirty == 0 && !pending && _connected) {
+			uint64_t skipped = 0;
+			int count = _count.load(std::memory_order_acquire);
+			for (int i = 0; i < count; i++)
+				if (_params[i].refs > 0)
+					skipped++;
+			_skipped.fetch_add(skipped, std::memory_order_relaxed);
+			return;
+		}
+		_connected = true;
+		refresh();
+	}
+
+	static DWORD WINAPI Run(void *data)
+	{
+		VmParamCache *cache = static_cast<VmParamCache *>(data);
+		os_set_thread_name("obs-voicemeeter: parameters");
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+		while (WaitForSingleObject(cache->_stopSignal,
+					   VM_PARAM_POLL_MS) == WAIT_TIMEOUT)
+			cache->poll();
+		return 0;
+	}
+
+public:
+	VmParamCache()
+	{
+		_stopSignal = CreateEvent(nullptr, true, false, nullptr);
+		_statsTime = os_gettime_ns();
+	}
+
+	~VmParamCache() { Stop(); }
+
+	void Start(T_VBVMR_IsParametersDirty isDirty,
+		   T_VBVMR_GetParameterFloat getFloat,
+		   T_VBVMR_GetParameterStringA getString)
+	{
+		if (_thread.Valid())
+			return;
+		_isDirty = isDirty;
+		_getFloat = getFloat;
+		_getString = getString;
+		_connected = false;
+		ResetEvent(_stopSignal);
+		_thread = CreateThread(nullptr, 0, Run, this, 0, nullptr);
+	}
+
+	void Stop()
+	{
+		if (!_thread.Valid())
+			return;
+		SetEvent(_stopSignal);
+		WaitForSingleObject(_thread, INFINITE);
+		_thread = nullptr;
+	}
+
+	/*returns -1 when the cache is full*/
+	int Subscribe(const char *name, vm_param_kind kind)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		int count = _count.load(std::memory_order_relaxed);
+		for (int i = 0; i < count; i++) {
+			VmParam &p = _params[i];
+			if (p.kind != kind || strcmp(p.name, name) != 0)
+				continue;
+			if (p.refs++ == 0)
+				_pending = true;
+			return i;
+		}
+		if (count == VM_PARAM_MAX) {
+			blog(LOG_WARNING,
+			     "obs-voicemeeter: parameter cache full, %s not cached",
+			     name);
+			return -1;
+		}
+		VmParam &p = _params[count];
+		snprintf(p.name, sizeof(p.name), "%s", name);
+		p.kind = kind;
+		p.refs = 1;
+		_count.store(count + 1, std::memory_order_release);
+		_pending = true;
+		return count;
+	}
+
+	void Unsubscribe(int handle)
+	{
+		if (handle < 0 || handle >= VM_PARAM_MAX)
+			return;
+		std::lock_guard<std::mutex> lock(_lock);
+		VmParam &p = _params[handle];
+		if (p.refs > 0 && --p.refs == 0)
+			invalidate(p);
+	}
+
+	/*changes whenever a String read could give a different result*/
+	uint64_t TextGeneration() const
+	{
+		return _textGeneration.load(std::memory_order_acquire);
+	}
+
+	/*false until the parameter has been fetched*/
+	bool Float(int handle, float &out)
+	{
+		if (handle < 0 || handle >= VM_PARAM_MAX)
+			return false;
+		_reads.fetch_add(1, std::memory_order_relaxed);
+		VmParam &p = _params[handle];
+		if (!p.valid.load(std::memory_order_acquire))
+			return false;
+		out = p.value.load(std::memory_order_relaxed);
+		return true;
+	}
+
+	/*shows a value just queued to VmParamWriter before Voicemeeter
+	 *reports it, the next refresh replaces it*/
+	void Assume(int handle, float value)
+	{
+		if (handle < 0 || handle >= VM_PARAM_MAX)
+			return;
+		VmParam &p = _params[handle];
+		if (p.valid.load(std::memory_order_acquire))
+			p.value.store(value, std::memory_order_relaxed);
+	}
+
+	bool String(int handle, char *out, size_t size)
+	{
+		if (handle < 0 || handle >= VM_PARAM_MAX || !size)
+			return false;
+		_reads.fetch_add(1, std::memory_order_relaxed);
+		VmParam &p = _params[handle];
+		if (!p.valid.load(std::memory_order_acquire))
+			return false;
+		size_t n = min(size, sizeof(p.text));
+		for (;;) {
+			uint32_t s = p.sequence.load(std::memory_order_acquire);
+			if (s & 1)
+				continue;
+			memcpy(out, p.text, n);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (p.sequence.load(std::memory_order_relaxed) == s)
+				break;
+		}
+		out[n - 1] = 0;
+		return true;
+	}
+
+	/*rates since the previous call, skipped counts the GetParameter calls
+	 *polls did not make because Voicemeeter reported nothing dirty*/
+	std::string Stats()
+	{
+		uint64_t now = os_gettime_ns();
+		uint64_t calls = _dllCalls.load();
+		uint64_t reads = _reads.load();
+		double seconds = (now - _statsTime) / 1000000000.0;
+		if (seconds <= 0.0)
+			seconds = 1.0;
+		double callRate = (calls - _statsCalls) / seconds;
+		double readRate = (reads - _statsReads) / seconds;
+		_statsTime = now;
+		_statsCalls = calls;
+		_statsReads = reads;
+
+		int subscribed = 0;
+		int count = _count.load(std::memory_order_acquire);
+		for (int i = 0; i < count; i++)
+			subscribed += _params[i].refs > 0;
+
+		char text[256];
+		snprintf(text, sizeof(text),
+			 "%d parameters, %llu refreshes, %.1f DLL calls/s, "
+			 "%.1f cached reads/s, %llu GetParameter calls skipped",
+			 subscribed, (unsigned long long)_refreshes.load(),
+			 callRate, readRate,
+			 (unsigned long long)_skipped.load());
+		return text;
+	}
+};
+
+class VmParamWriter {
+	struct Pending {
+		std::string name;
+		std::string value;
+	};
+
+	/*in order of the first write to each parameter*/
+	std::vector<Pending> _pending;
+	std::unordered_map<std::string, size_t> _index;
+	uint64_t _firstWrite = 0;
+	std::mutex _lock;
+	/*keeps flushes from different threads in order*/
+	std::mutex _sendLock;
+
+	T_VBVMR_SetParameters _setParameters = nullptr;
+
+	WinHandle _thread;
+	WinHandle _stopSignal;
+	WinHandle _wakeSignal;
+
+	std::atomic<uint64_t> _writes{0};
+	std::atomic<uint64_t> _coalesced{0};
+	std::atomic<uint64_t> _scripts{0};
+	std::atomic<uint64_t> _failures{0};
+	std::atomic<uint64_t> _maxLatencyNs{0};
+
+	void queue(const char *name, std::string value)
+	{
+		bool wake = false;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			auto it = _index.find(name);
+			if (it != _index.end()) {
+				_pending[it->second].value = std::move(value);
+				_coalesced.fetch_add(1, std::memory_order_relaxed);
+			} else {
+				wake = _pending.empty();
+				if (wake)
+					_firstWrite = os_gettime_ns();
+				_index.emplace(name, _pending.size());
+				_pending.push_back({name, std::move(value)});
+			}
+		}
+		_writes.fetch_add(1, std::memory_order_relaxed);
+		if (wake)
+			SetEvent(_wakeSignal);
+	}
+
+	void send(std::string &script)
+	{
+		if (script.empty())
+			return;
+		long ret = _setParameters(&script[0]);
+		_scripts.fetch_add(1, std::memory_order_relaxed);
+		if (ret != 0) {
+			_failures.fetch_add(1, std::memory_order_relaxed);
+			blog(LOG_WARNING,
+			     "obs-voicemeeter: parameter script failed (%ld)",
+			     ret);
+		}
+		script.clear();
+	}
+
+	void flush()
+	{
+		std::lock_guard<std::mutex> sending(_sendLock);
+		std::vector<Pending> pending;
+		uint64_t first;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			pending.swap(_pending);
+			_index.clear();
+			first = _firstWrite;
+		}
+		if (pending.empty())
+			return;
+
+		std::string script;
+		script.reserve(VM_SCRIPT_MAX);
+		for (const Pending &p : pending) {
+			size_t len = p.name.size() + p.value.size() + 2;
+			if (script.size() + len > VM_SCRIPT_MAX)
+				send(script);
+			script += p.name;
+			script += '=';
+			script += p.value;
+			script += ';';
+		}
+		send(script);
+
+		uint64_t latency = os_gettime_ns() - first;
+		uint64_t max = _maxLatencyNs.load(std::memory_order_relaxed);
+		if (latency > max)
+			_maxLatencyNs.store(latency, std::memory_order_relaxed);
+	}
+
+	static DWORD WINAPI Run(void *data)
+	{
+		VmParamWriter *w = static_cast<VmParamWriter *>(data);
+		os_set_thread_name("obs-voicemeeter: parameter writer");
+		HANDLE signals[] = {w->_stopSignal, w->_wakeSignal};
+		while (WaitForMultipleObjects(2, signals, false, INFINITE) ==
+		       WAIT_OBJECT_0 + 1) {
+			/*let the rest of a scene change arrive, the first write
+			 *waits at most the window*/
+			if (WaitForSingleObject(w->_stopSignal,
+						VM_WRITE_WINDOW_MS) !=
+			    WAIT_TIMEOUT)
+				break;
+			w->flush();
+		}
+		w->flush();
+		return 0;
+	}
+
+public:
+	VmParamWriter()
+	{
+		_stopSignal = CreateEvent(nullptr, true, false, nullptr);
+		_wakeSignal = CreateEvent(nullptr, false, false, nullptr);
+	}
+
+	~VmParamWriter() { Stop(); }
+
+	void Start(T_VBVMR_SetParameters setParameters)
+	{
+		if (_thread.Valid())
+			return;
+		_setParameters = setParameters;
+		ResetEvent(_stopSignal);
+		_thread = CreateThread(nullptr, 0, Run, this, 0, nullptr);
+	}
+
+	/*sends whatever is still pending*/
+	void Stop()
+	{
+		if (!_thread.Valid())
+			return;
+		SetEvent(_stopSignal);
+		WaitForSingleObject(_thread, INFINITE);
+		_thread = nullptr;
+	}
+
+	/*sends pending writes now instead of at the end of the window*/
+	void Flush() { flush(); }
+
+	void Set(const char *name, float value)
+	{
+		char text[32];
+		snprintf(text, sizeof(text), "%.3f", value);
+		queue(name, text);
+	}
+
+	void SetString(const char *name, const char *value)
+	{
+		/*script strings are quoted, quotes cannot be escaped*/
+		std::string text = "\"";
+		for (const char *c = value; *c; c++)
+			if (*c != '"')
+				text += *c;
+		text += '"';
+		queue(name, std::move(text));
+	}
+
+	/*every write would have been one VBVMR_SetParameter* call*/
+	std::string Stats()
+	{
+		uint64_t writes = _writes.load();
+		uint64_t scripts = _scripts.load();
+		char text[256];
+		snprintf(text, sizeof(text),
+			 "%llu writes, %llu coalesced, %llu scripts (%llu failed), "
+			 "%llu DLL calls saved, %.1f ms max flush latency",
+			 (unsigned long long)writes,
+			 (unsigned long long)_coalesced.load(),
+			 (unsigned long long)scripts,
+			 (unsigned long long)_failures.load(),
+			 (unsigned long long)(writes > scripts ? writes - scripts
+							      : 0),
+			 _maxLatencyNs.load() / 1000000.0);
+		return text;
+	}
+};
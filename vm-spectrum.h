@@ -0,0 +1,594 @@
+#pragma once
+#include <util/platform.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "circle-buffer.h"
+#include "sample-kernels.h"
+
+/*
+ * Spectrum of subscribed channels of a stage.
+ *
+ * Registered as a StreamableBuffer listener, every subscribed channel
+ * collects its samples into a window and runs a Hann windowed real FFT
+ * each 1/VM_SPECTRUM_OVERLAP window. The real FFT is a complex FFT of half
+ * the size on split real/imaginary arrays, whose butterflies run four at a
+ * time with the pcm_v4 wrappers once a stage is wide enough. The bins are
+ * reduced to VM_SPECTRUM_BANDS log spaced bands (the loudest bin of each),
+ * which rise at once and fall over VM_SPECTRUM_RELEASE_MS.
+ *
+ * Plans (bit reversal, twiddles, window) are built once per size and
+ * shared. A slot holds the buffers of one (size, channel) pair and stays
+ * cached after its last subscriber left, nothing is computed for it until
+ * it is subscribed again. Each slot publishes into two snapshots, readers
+ * copy the last complete one and only retry if the analyzer lapped them.
+ */
+
+#define VM_SPECTRUM_MIN_SIZE 256
+#define VM_SPECTRUM_MAX_SIZE 16384
+#define VM_SPECTRUM_DEFAULT_SIZE 2048
+#define VM_SPECTRUM_OVERLAP 4
+#define VM_SPECTRUM_BANDS 64
+#define VM_SPECTRUM_MIN_HZ 20.0
+#define VM_SPECTRUM_FLOOR_DB -120.0f
+#define VM_SPECTRUM_RELEASE_MS 300
+#define VM_SPECTRUM_SLOTS 8
+
+struct VmSpectrumSnapshot {
+	uint64_t ts;
+	/*transforms so far, 0 before the first*/
+	uint64_t count;
+	int bands;
+	/*geometric centre of each band*/
+	float hz[VM_SPECTRUM_BANDS];
+	/*dBFS, a full scale sine reads 0*/
+	float db[VM_SPECTRUM_BANDS];
+};
+
+struct VmFftPlan {
+	/*real size and the complex size it is computed with*/
+	size_t size = 0;
+	size_t half = 0;
+	std::vector<uint32_t> bitrev;
+	/*Hann, scaled so a full scale sine has magnitude 1*/
+	std::vector<float> window;
+	/*stage with h butterflies per group starts at h - 1*/
+	std::vector<float> twRe;
+	std::vector<float> twIm;
+	/*e^(-2 pi i k / size), splits the half size result*/
+	std::vector<float> postRe;
+	std::vector<float> postIm;
+
+	void Build(size_t n)
+	{
+		size = n;
+		half = n / 2;
+		int bits = 0;
+		while ((size_t)1 << bits < half)
+			bits++;
+		bitrev.resize(half);
+		for (size_t i = 0; i < half; i++) {
+			uint32_t r = 0;
+			for (int b = 0; b < bits; b++)
+				r |= (uint32_t)((i >> b) & 1) << (bits - 1 - b);
+			bitrev[i] = r;
+		}
+		window.resize(n);
+		for (size_t i = 0; i < n; i++)
+			window[i] = (float)((1.0 - cos(2.0 * M_PI * i / n)) *
+					    2.0 / n);
+		twRe.resize(half);
+		twIm.resize(half);
+		for (size_t h = 1; h < half; h *= 2) {
+			for (size_t j = 0; j < h; j++) {
+				double a = -M_PI * j / h;
+				twRe[h - 1 + j] = (float)cos(a);
+				twIm[h - 1 + j] = (float)sin(a);
+			}
+		}
+		postRe.resize(half + 1);
+		postIm.resize(half + 1);
+		for (size_t k = 0; k <= half; k++) {
+			double a = -2.0 * M_PI * k / n;
+			postRe[k] = (float)cos(a);
+			postIm[k] = (float)sin(a);
+		}
+	}
+};
+
+/*shared plan of one power of two size*/
+static inline std::shared_ptr<const VmFftPlan> vm_fft_plan(size_t size)
+{
+	static std::mutex lock;
+	static std::map<size_t, std::shared_ptr<const VmFftPlan>> plans;
+	std::lock_guard<std::mutex> guard(lock);
+	auto found = plans.find(size);
+	if (found != plans.end())
+		return found->second;
+	std::shared_ptr<VmFftPlan> plan = std::make_shared<VmFftPlan>();
+	plan->Build(size);
+	plans[size] = plan;
+	return plan;
+}
+
+static inline size_t vm_spectrum_size(size_t size)
+{
+	size_t n = VM_SPECTRUM_MIN_SIZE;
+	while (n < size && n < VM_SPECTRUM_MAX_SIZE)
+		n *= 2;
+	return n;
+}
+
+/* ------------------------------------------------------------------------
+ * kernels
+ */
+
+/*butterflies with h per group, for every group of the transform*/
+static inline void vm_fft_stage_scalar(float *re, float *im, size_t n,
+				       size_t h, const float *twRe,
+				       const float *twIm)
+{
+	for (size_t s = 0; s < n; s += 2 * h) {
+		for (size_t j = 0; j < h; j++) {
+			size_t a = s + j, b = a + h;
+			float br = re[b] * twRe[j] - im[b] * twIm[j];
+			float bi = re[b] * twIm[j] + im[b] * twRe[j];
+			re[b] = re[a] - br;
+			im[b] = im[a] - bi;
+			re[a] += br;
+			im[a] += bi;
+		}
+	}
+}
+
+#if defined(PCM_X86) || defined(PCM_NEON)
+/*h a multiple of 4*/
+static inline void vm_fft_stage_simd(float *re, float *im, size_t n, size_t h,
+				     const float *twRe, const float *twIm)
+{
+	for (size_t s = 0; s < n; s += 2 * h) {
+		for (size_t j = 0; j < h; j += 4) {
+			size_t a = s + j, b = a + h;
+			pcm_v4 wr = pcm_load(twRe + j), wi = pcm_load(twIm + j);
+			pcm_v4 xr = pcm_load(re + b), xi = pcm_load(im + b);
+			pcm_v4 br = pcm_sub(pcm_mul(xr, wr), pcm_mul(xi, wi));
+			pcm_v4 bi = pcm_add(pcm_mul(xr, wi), pcm_mul(xi, wr));
+			pcm_v4 ar = pcm_load(re + a), ai = pcm_load(im + a);
+			pcm_store(re + b, pcm_sub(ar, br));
+			pcm_store(im + b, pcm_sub(ai, bi));
+			pcm_store(re + a, pcm_add(ar, br));
+			pcm_store(im + a, pcm_add(ai, bi));
+		}
+	}
+}
+#endif
+
+/*in place complex transform of plan.half points, input bit reversed*/
+static inline void vm_fft_stages_isa(pcm_isa isa, const VmFftPlan &plan,
+				     float *re, float *im)
+{
+	size_t m = plan.half;
+	for (size_t h = 1; h < m; h *= 2) {
+		const float *twRe = plan.twRe.data() + h - 1;
+		const float *twIm = plan.twIm.data() + h - 1;
+#if defined(PCM_X86) || defined(PCM_NEON)
+		if (isa != pcm_isa_scalar && h >= 4) {
+			vm_fft_stage_simd(re, im, m, h, twRe, twIm);
+			continue;
+		}
+#endif
+		vm_fft_stage_scalar(re, im, m, h, twRe, twIm);
+	}
+	UNUSED_PARAMETER(isa);
+}
+
+/*bins [0, size / 2] of the windowed input, each passed to bin(k, re, im),
+ *re and im hold size / 2 floats of scratch*/
+template<class F>
+static inline void vm_fft_real_isa(pcm_isa isa, const VmFftPlan &plan,
+				   const float *in, float *re, float *im,
+				   F &&bin)
+{
+	size_t m = plan.half;
+	const float *w = plan.window.data();
+	for (size_t k = 0; k < m; k++) {
+		uint32_t j = plan.bitrev[k];
+		re[j] = in[2 * k] * w[2 * k];
+		im[j] = in[2 * k + 1] * w[2 * k + 1];
+	}
+	vm_fft_stages_isa(isa, plan, re, im);
+
+	/*even and odd samples were packed as one complex signal*/
+	for (size_t k = 0; k <= m; k++) {
+		size_t a = k % m, b = (m - k) % m;
+		float er = 0.5f * (re[a] + re[b]);
+		float ei = 0.5f * (im[a] - im[b]);
+		float or_ = 0.5f * (im[a] + im[b]);
+		float oi = -0.5f * (re[a] - re[b]);
+		float xr = er + plan.postRe[k] * or_ - plan.postIm[k] * oi;
+		float xi = ei + plan.postRe[k] * oi + plan.postIm[k] * or_;
+		bin(k, xr, xi);
+	}
+}
+
+/*power of bins [0, size / 2] of the windowed input, re and im hold
+ *size / 2 floats of scratch*/
+static inline void vm_fft_power_isa(pcm_isa isa, const VmFftPlan &plan,
+				    const float *in, float *re, float *im,
+				    float *power)
+{
+	vm_fft_real_isa(isa, plan, in, re, im,
+			[power](size_t k, float xr, float xi) {
+				power[k] = xr * xr + xi * xi;
+			});
+}
+
+/*size real samples from the bins [0, size / 2] of a real signal, without
+ *a window, re and im hold size / 2 floats of scratch*/
+static inline void vm_fft_real_inverse_isa(pcm_isa isa, const VmFftPlan &plan,
+					   const float *binRe,
+					   const float *binIm, float *re,
+					   float *im, float *out)
+{
+	size_t m = plan.half;
+	/*pack the even and odd halves back into one complex spectrum and
+	 *conjugate it, so the forward stages compute the inverse*/
+	for (size_t k = 0; k < m; k++) {
+		float ar = binRe[k], ai = binIm[k];
+		float br = binRe[m - k], bi = -binIm[m - k];
+		float er = ar + br, ei = ai + bi;
+		float dr = ar - br, di = ai - bi;
+		/*odd half times e^(2 pi i k / size)*/
+		float or_ = dr * plan.postRe[k] + di * plan.postIm[k];
+		float oi = di * plan.postRe[k] - dr * plan.postIm[k];
+		uint32_t j = plan.bitrev[k];
+		re[j] = 0.5f * (er - oi);
+		im[j] = -0.5f * (ei + or_);
+	}
+	vm_fft_stages_isa(isa, plan, re, im);
+	float scale = 1.0f / m;
+	for (size_t k = 0; k < m; k++) {
+		out[2 * k] = re[k] * scale;
+		out[2 * k + 1] = -im[k] * scale;
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * analyzer
+ */
+
+template<class Data> class VmSpectrum : public StreamableReader<Data> {
+	struct Slot {
+		/*subscription, changed under _lock*/
+		int channel = -1;
+		size_t size = 0;
+		std::atomic<int> refs{0};
+		std::shared_ptr<const VmFftPlan> plan;
+		/*bumped whenever the reader has to start over*/
+		std::atomic<uint32_t> config{0};
+		/*reader only, rebuilt from the subscription when config moves*/
+		uint32_t adopted = 0;
+		std::shared_ptr<const VmFftPlan> fft;
+		size_t fftSize = 0;
+		std::vector<float> history;
+		std::vector<float> re;
+		std::vector<float> im;
+		std::vector<float> power;
+		size_t fill = 0;
+		long sampleRate = 0;
+		uint32_t bandLo[VM_SPECTRUM_BANDS];
+		uint32_t bandHi[VM_SPECTRUM_BANDS];
+		float hz[VM_SPECTRUM_BANDS];
+		float smooth[VM_SPECTRUM_BANDS];
+		float release = 0.0f;
+		uint64_t count = 0;
+		/*generation being written and last complete one*/
+		std::atomic<uint32_t> begun{0};
+		std::atomic<uint32_t> published{0};
+		VmSpectrumSnapshot snapshots[2];
+	};
+
+	std::string _name;
+	pcm_isa _isa = min(pcm_best_isa(), pcm_isa_simd);
+	Slot _slots[VM_SPECTRUM_SLOTS];
+	/*subscriptions against the reader's snapshot of them, never held
+	 *while transforming nor by Read(snapshot)*/
+	std::mutex _lock;
+
+	/*what the reader copies of a subscription under the lock*/
+	struct Job {
+		Slot *slot;
+		int channel;
+		size_t size;
+		std::shared_ptr<const VmFftPlan> plan;
+		uint32_t config;
+	};
+
+	std::atomic<uint64_t> _transforms{0};
+	std::atomic<uint64_t> _busyNs{0};
+	std::atomic<uint64_t> _audioNs{0};
+
+	void adopt(Slot &s, const Job &j)
+	{
+		s.adopted = j.config;
+		s.fft = j.plan;
+		s.fftSize = j.size;
+		s.history.assign(j.size, 0.0f);
+		s.re.assign(j.size / 2, 0.0f);
+		s.im.assign(j.size / 2, 0.0f);
+		s.power.assign(j.size / 2 + 1, 0.0f);
+		s.sampleRate = 0;
+	}
+
+	void setup(Slot &s, long sampleRate)
+	{
+		s.sampleRate = sampleRate;
+		memset(s.history.data(), 0, s.fftSize * sizeof(float));
+		s.fill = 0;
+		s.count = 0;
+		double nyquist = sampleRate / 2.0;
+		double binHz = (double)sampleRate / s.fftSize;
+		double ratio = pow(nyquist / VM_SPECTRUM_MIN_HZ,
+				   1.0 / VM_SPECTRUM_BANDS);
+		double lo = VM_SPECTRUM_MIN_HZ;
+		for (int b = 0; b < VM_SPECTRUM_BANDS; b++) {
+			double hi = lo * ratio;
+			uint32_t first = (uint32_t)(lo / binHz + 0.5);
+			uint32_t last = (uint32_t)(hi / binHz + 0.5);
+			/*low bands narrower than a bin show the nearest*/
+			s.bandLo[b] = min(first, (uint32_t)(s.fftSize / 2));
+			s.bandHi[b] = max(last, s.bandLo[b] + 1);
+			s.bandHi[b] =
+				min(s.bandHi[b], (uint32_t)(s.fftSize / 2 + 1));
+			s.hz[b] = (float)sqrt(lo * hi);
+			s.smooth[b] = VM_SPECTRUM_FLOOR_DB;
+			lo = hi;
+		}
+		double hopMs = 1000.0 * s.fftSize / VM_SPECTRUM_OVERLAP /
+			       sampleRate;
+		s.release = (float)exp(-hopMs / VM_SPECTRUM_RELEASE_MS);
+	}
+
+	void transform(Slot &s, uint64_t ts)
+	{
+		vm_fft_power_isa(_isa, *s.fft, s.history.data(), s.re.data(),
+				 s.im.data(), s.power.data());
+		for (int b = 0; b < VM_SPECTRUM_BANDS; b++) {
+			float peak = 0.0f;
+			for (uint32_t k = s.bandLo[b]; k < s.bandHi[b]; k++)
+				peak = max(peak, s.power[k]);
+			float db = peak > 0.0f ? 10.0f * log10f(peak)
+					       : VM_SPECTRUM_FLOOR_DB;
+			db = max(db, VM_SPECTRUM_FLOOR_DB);
+			float &v = s.smooth[b];
+			v = db >= v ? db : db + (v - db) * s.release;
+		}
+		s.count++;
+
+		/*resubscribed meanwhile, the UI already waits for new data*/
+		if (s.config.load(std::memory_order_acquire) != s.adopted)
+			return;
+		uint32_t n = s.published.load(std::memory_order_relaxed) + 1;
+		s.begun.store(n, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		VmSpectrumSnapshot &out = s.snapshots[n & 1];
+		out.ts = ts;
+		out.count = s.count;
+		out.bands = VM_SPECTRUM_BANDS;
+		memcpy(out.hz, s.hz, sizeof(out.hz));
+		memcpy(out.db, s.smooth, sizeof(out.db));
+		s.published.store(n, std::memory_order_release);
+	}
+
+	void feed(Slot &s, const float *in, size_t frames, uint64_t ts)
+	{
+		size_t hop = s.fftSize / VM_SPECTRUM_OVERLAP;
+		while (frames) {
+			size_t n = min(frames, s.fftSize - s.fill);
+			memcpy(s.history.data() + s.fill, in,
+			       n * sizeof(float));
+			s.fill += n;
+			in += n;
+			frames -= n;
+			if (s.fill < s.fftSize)
+				break;
+			transform(s, ts);
+			_transforms.fetch_add(1, std::memory_order_relaxed);
+			memmove(s.history.data(), s.history.data() + hop,
+				(s.fftSize - hop) * sizeof(float));
+			s.fill = s.fftSize - hop;
+		}
+	}
+
+public:
+	std::string Name() { return _name; }
+
+	void SetName(const char *stage)
+	{
+		_name = std::string("spectrum ") + stage;
+	}
+
+	/*UI thread, -1 when every slot is subscribed*/
+	int Subscribe(int channel, size_t size)
+	{
+		size = vm_spectrum_size(size);
+		std::lock_guard<std::mutex> lock(_lock);
+		int reuse = -1;
+		for (int i = 0; i < VM_SPECTRUM_SLOTS; i++) {
+			Slot &s = _slots[i];
+			if (s.channel == channel && s.size == size) {
+				/*a cached slot starts over from silence*/
+				if (!s.refs)
+					s.config++;
+				s.refs++;
+				return i;
+			}
+			/*prefer a slot never used over a cached one*/
+			if (!s.refs &&
+			    (reuse < 0 || (s.channel < 0 &&
+					    _slots[reuse].channel >= 0)))
+				reuse = i;
+		}
+		if (reuse < 0)
+			return -1;
+		Slot &s = _slots[reuse];
+		s.channel = channel;
+		s.size = size;
+		s.plan = vm_fft_plan(size);
+		s.config++;
+		s.begun = 0;
+		s.published = 0;
+		s.refs = 1;
+		return reuse;
+	}
+
+	void Unsubscribe(int handle)
+	{
+		if (handle < 0 || handle >= VM_SPECTRUM_SLOTS)
+			return;
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_slots[handle].refs > 0)
+			_slots[handle].refs--;
+	}
+
+	bool Subscribed()
+	{
+		for (Slot &s : _slots)
+			if (s.refs > 0)
+				return true;
+		return false;
+	}
+
+	void Read(const Data *buf)
+	{
+		TraceScope trace("VmSpectrum::Read");
+		uint64_t start = os_gettime_ns();
+		long sr = buf->data.audiobuffer_sr;
+		size_t frames = (size_t)buf->data.audiobuffer_nbs;
+		if (sr <= 0 || !frames)
+			return;
+		Job jobs[VM_SPECTRUM_SLOTS];
+		int count = 0;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			for (Slot &s : _slots) {
+				if (s.refs <= 0 ||
+				    s.channel >= buf->data.audiobuffer_nbi)
+					continue;
+				jobs[count++] = {&s, s.channel, s.size, s.plan,
+						 s.config.load()};
+			}
+		}
+		for (int i = 0; i < count; i++) {
+			Slot &s = *jobs[i].slot;
+			if (s.adopted != jobs[i].config)
+				adopt(s, jobs[i]);
+			if (s.sampleRate != sr)
+				setup(s, sr);
+			feed(s, buf->data.audiobuffer_r[jobs[i].channel],
+			     frames, buf->ts);
+		}
+		_busyNs.fetch_add(os_gettime_ns() - start,
+				  std::memory_order_relaxed);
+		_audioNs.fetch_add(frames * 1000000000ULL / sr,
+				   std::memory_order_relaxed);
+	}
+
+	/*any thread, false before the first transform*/
+	bool Read(int handle, VmSpectrumSnapshot &out) const
+	{
+		if (handle < 0 || handle >= VM_SPECTRUM_SLOTS)
+			return false;
+		const Slot &s = _slots[handle];
+		for (int tries = 0;; tries++) {
+			uint32_t n =
+				s.published.load(std::memory_order_acquire);
+			if (!n)
+				return false;
+			memcpy(&out, &s.snapshots[n & 1], sizeof(out));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			/*the copied snapshot is written again at n + 2*/
+			if (s.begun.load(std::memory_order_relaxed) < n + 2)
+				return true;
+			if (tries > 64)
+				SwitchToThread();
+		}
+	}
+
+	std::string Stats()
+	{
+		int active = 0, cached = 0;
+		for (Slot &s : _slots) {
+			if (s.refs > 0)
+				active++;
+			else if (s.channel >= 0)
+				cached++;
+		}
+		uint64_t busy = _busyNs.load(), audio = _audioNs.load();
+		uint64_t transforms = _transforms.load();
+		char text[256];
+		snprintf(text, sizeof(text),
+			 "%s, %d channels (%d cached), %llu transforms, "
+			 "%.2f us per transform, %.3f%% of a core, "
+			 "%llu dropped",
+			 pcm_isa_name(_isa), active, cached,
+			 (unsigned long long)transforms,
+			 transforms ? busy / 1000.0 / transforms : 0.0,
+			 audio ? 100.0 * busy / audio : 0.0,
+			 (unsigned long long)this->Dropped());
+		return text;
+	}
+};
+
+/*transforms per second of one channel*/
+static inline std::string vm_spectrum_benchmark()
+{
+	const size_t sizes[] = {1024, 4096};
+	const int rounds = 200;
+	std::vector<pcm_isa> isas = {pcm_isa_scalar};
+#if defined(PCM_X86) || defined(PCM_NEON)
+	isas.push_back(pcm_isa_simd);
+#endif
+	std::string report;
+	char line[192];
+	for (size_t size : sizes) {
+		std::shared_ptr<const VmFftPlan> plan = vm_fft_plan(size);
+		std::vector<float> in(size), re(size / 2), im(size / 2);
+		std::vector<float> ref(size / 2 + 1), power(size / 2 + 1);
+		uint32_t seed = 1;
+		for (float &v : in)
+			v = pcm_uniform(pcm_xorshift(seed)) * 2.0f - 1.0f;
+		int len = snprintf(line, sizeof(line), "\nfft %u:",
+				   (unsigned)size);
+		for (pcm_isa isa : isas) {
+			std::vector<float> &out =
+				isa == pcm_isa_scalar ? ref : power;
+			uint64_t start = os_gettime_ns();
+			for (int r = 0; r < rounds; r++)
+				vm_fft_power_isa(isa, *plan, in.data(),
+						 re.data(), im.data(),
+						 out.data());
+			double seconds =
+				(double)(os_gettime_ns() - start) / 1e9;
+			bool match = true;
+			for (size_t k = 0; k < out.size(); k++)
+				if (fabsf(out[k] - ref[k]) >
+				    1e-3f * ref[k] + 1e-9f)
+					match = false;
+			len += snprintf(line + len, sizeof(line) - len,
+					" %s %.0f per second%s",
+					pcm_isa_name(isa),
+					seconds > 0.0 ? rounds / seconds : 0.0,
+					match ? "" : " MISMATCH");
+		}
+		report += line;
+	}
+	return report;
+}
@@ -0,0 +1,404 @@
+#pragma once
+#include <obs-module.h>
+#include <util/platform.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "sample-kernels.h"
+#include "vm-spectrum.h"
+
+/*
+ * Voice activity detection on the reader side of a route plan.
+ *
+ * VmVadAnalyzer mixes the channels of a block to mono while summing their
+ * energy, then measures the spectral flatness (geometric over arithmetic
+ * mean of the power) of the last VM_VAD_FFT samples between VM_VAD_LOW_HZ
+ * and VM_VAD_HIGH_HZ. Voiced speech is loud and tonal there, noise and
+ * hum are either quiet or flat. A plan analyzes a block once, however many
+ * sources detect on it.
+ *
+ * VmVoiceDetector holds the decision of one source: speech needs to pass
+ * the threshold for VM_VAD_ATTACK_MS to switch on and may fall
+ * VM_VAD_HYSTERESIS_DB below it, silence needs to last the hold time to
+ * switch off. Changes are pushed as events into a bounded multi producer
+ * queue that any number of reader threads feed without locking and the UI
+ * thread drains.
+ */
+
+#define VM_VAD_FFT 256
+#define VM_VAD_LOW_HZ 300.0
+#define VM_VAD_HIGH_HZ 4000.0
+#define VM_VAD_FLATNESS 0.4f
+/*weight of the newest block in the smoothed power spectrum*/
+#define VM_VAD_SMOOTHING 0.3f
+#define VM_VAD_FLOOR_DB -80.0f
+#define VM_VAD_HYSTERESIS_DB 6.0f
+#define VM_VAD_ATTACK_MS 30
+#define VM_VAD_QUEUE_SIZE 256
+
+struct VmVadFeatures {
+	/*mono energy in dBFS*/
+	float db;
+	/*smoothed, near 0 for a voice or tone, near 1 for noise and silence*/
+	float flatness;
+};
+
+/*adds the channels into mono scaled by scale, returns its sum of squares*/
+static inline float vm_vad_mix_scalar(float *mono, const float *const *in,
+				      int channels, size_t frames, float scale)
+{
+	float sum = 0.0f;
+	for (size_t f = 0; f < frames; f++) {
+		float v = 0.0f;
+		for (int c = 0; c < channels; c++)
+			v += in[c][f];
+		v *= scale;
+		mono[f] = v;
+		sum += v * v;
+	}
+	return sum;
+}
+
+#if defined(PCM_X86) || defined(PCM_NEON)
+static inline float vm_vad_mix_simd(float *mono, const float *const *in,
+				    int channels, size_t frames, float scale)
+{
+	pcm_v4 s = pcm_set1(scale);
+	pcm_v4 acc = pcm_set1(0.0f);
+	size_t f = 0;
+	for (; f + 4 <= frames; f += 4) {
+		pcm_v4 v = pcm_load(in[0] + f);
+		for (int c = 1; c < channels; c++)
+			v = pcm_add(v, pcm_load(in[c] + f));
+		v = pcm_mul(v, s);
+		pcm_store(mono + f, v);
+		acc = pcm_add(acc, pcm_mul(v, v));
+	}
+	return pcm_hsum(acc) + vm_vad_mix_scalar(mono + f, in, channels,
+						 frames - f, scale);
+}
+#endif
+
+static inline float vm_vad_mix_isa(pcm_isa isa, float *mono,
+				   const float *const *in, int channels,
+				   size_t frames, float scale)
+{
+#if defined(PCM_X86) || defined(PCM_NEON)
+	if (isa != pcm_isa_scalar)
+		return vm_vad_mix_simd(mono, in, channels, frames, scale);
+#endif
+	UNUSED_PARAMETER(isa);
+	return vm_vad_mix_scalar(mono, in, channels, frames, scale);
+}
+
+class VmVadAnalyzer {
+	pcm_isa _isa;
+	std::shared_ptr<const VmFftPlan> _plan;
+	std::vector<float> _mono;
+	/*last VM_VAD_FFT mono samples, oldest first*/
+	std::vector<float> _window;
+	std::vector<float> _re;
+	std::vector<float> _im;
+	std::vector<float> _power;
+	std::vector<float> _smooth;
+
+public:
+	VmVadAnalyzer(pcm_isa isa = min(pcm_best_isa(), pcm_isa_simd))
+		: _isa(isa)
+	{
+	}
+
+	VmVadFeatures Analyze(const float *const *in, int channels,
+			      size_t frames, long sampleRate)
+	{
+		if (!_plan) {
+			_plan = vm_fft_plan(VM_VAD_FFT);
+			_window.assign(VM_VAD_FFT, 0.0f);
+			_re.resize(VM_VAD_FFT / 2);
+			_im.resize(VM_VAD_FFT / 2);
+			_power.resize(VM_VAD_FFT / 2 + 1);
+			_smooth.assign(VM_VAD_FFT / 2 + 1, 0.0f);
+		}
+		if (_mono.size() < frames)
+			_mono.resize(frames);
+		VmVadFeatures features = {VM_VAD_FLOOR_DB, 1.0f};
+		if (channels <= 0 || !frames || sampleRate <= 0)
+			return features;
+
+		float sum = vm_vad_mix_isa(_isa, _mono.data(), in, channels,
+					   frames, 1.0f / channels);
+		if (frames >= VM_VAD_FFT) {
+			memcpy(_window.data(),
+			       _mono.data() + frames - VM_VAD_FFT,
+			       VM_VAD_FFT * sizeof(float));
+		} else {
+			memmove(_window.data(), _window.data() + frames,
+				(VM_VAD_FFT - frames) * sizeof(float));
+			memcpy(_window.data() + VM_VAD_FFT - frames,
+			       _mono.data(), frames * sizeof(float));
+		}
+		float energy = sum / frames;
+		features.db = energy > 0.0f ? 10.0f * log10f(energy)
+					    : VM_VAD_FLOOR_DB;
+		/*nothing below the floor can be speech, skip the transform*/
+		if (features.db <= VM_VAD_FLOOR_DB) {
+			features.db = VM_VAD_FLOOR_DB;
+			return features;
+		}
+
+		vm_fft_power_isa(_isa, *_plan, _window.data(), _re.data(),
+				 _im.data(), _power.data());
+		double binHz = (double)sampleRate / VM_VAD_FFT;
+		size_t lo = (size_t)(VM_VAD_LOW_HZ / binHz + 0.5);
+		size_t hi = min((size_t)(VM_VAD_HIGH_HZ / binHz + 0.5),
+				(size_t)VM_VAD_FFT / 2);
+		lo = max(lo, (size_t)1);
+		if (hi <= lo)
+			return features;
+		/*a single frame of noise is far from flat, smoothing over a
+		 *few blocks keeps the harmonics of a voice and flattens it*/
+		double logSum = 0.0, linSum = 0.0;
+		for (size_t k = lo; k < hi; k++) {
+			_smooth[k] +=
+				VM_VAD_SMOOTHING * (_power[k] - _smooth[k]);
+			double p = _smooth[k] + 1e-20;
+			logSum += log(p);
+			linSum += p;
+		}
+		double n = (double)(hi - lo);
+		features.flatness = (float)(exp(logSum / n) / (linSum / n));
+		return features;
+	}
+};
+
+class VmVoiceDetector {
+	std::atomic<bool> _enabled{false};
+	std::atomic<float> _threshold{-45.0f};
+	std::atomic<uint32_t> _holdMs{400};
+	std::atomic<bool> _active{false};
+	/*reader only, how long the opposite decision has held*/
+	uint64_t _runNs = 0;
+
+public:
+	void Configure(bool enabled, float thresholdDb, uint32_t holdMs)
+	{
+		_threshold = thresholdDb;
+		_holdMs = holdMs;
+		_enabled = enabled;
+	}
+
+	bool Enabled() const
+	{
+		return _enabled.load(std::memory_order_relaxed);
+	}
+
+	bool Active() const { return _active.load(std::memory_order_relaxed); }
+
+	/*reader thread, true when the debounced decision changed, a disabled
+	 *detector that was active goes quiet at once*/
+	bool Update(const VmVadFeatures &f, uint64_t blockNs)
+	{
+		bool active = _active.load(std::memory_order_relaxed);
+		if (!Enabled()) {
+			_runNs = 0;
+			_active.store(false, std::memory_order_relaxed);
+			return active;
+		}
+		float threshold = _threshold.load(std::memory_order_relaxed);
+		if (active)
+			threshold -= VM_VAD_HYSTERESIS_DB;
+		bool speech = f.db > threshold && f.flatness < VM_VAD_FLATNESS;
+		if (speech == active) {
+			_runNs = 0;
+			return false;
+		}
+		_runNs += blockNs;
+		uint64_t needMs = active ? _holdMs.load(
+						   std::memory_order_relaxed)
+					 : VM_VAD_ATTACK_MS;
+		if (_runNs < needMs * 1000000ULL)
+			return false;
+		_runNs = 0;
+		_active.store(!active, std::memory_order_relaxed);
+		return true;
+	}
+};
+
+struct VmVadEvent {
+	/*owned weak reference, released by whoever pops the event*/
+	obs_weak_source_t *source;
+	bool active;
+	float db;
+	uint64_t ts;
+};
+
+/*bounded multi producer, single consumer, after Vyukov's MPMC queue*/
+class VmVadQueue {
+	struct Cell {
+		std::atomic<size_t> sequence;
+		VmVadEvent event;
+	};
+
+	Cell _cells[VM_VAD_QUEUE_SIZE];
+	std::atomic<size_t> _head{0};
+	/*consumer only*/
+	size_t _tail = 0;
+	std::atomic<bool> _notified{false};
+
+	std::atomic<uint64_t> _events{0};
+	std::atomic<uint64_t> _dropped{0};
+	std::atomic<uint64_t> _blocks{0};
+	std::atomic<uint64_t> _analyzeNs{0};
+	std::atomic<uint64_t> _audioNs{0};
+	/*consumer only*/
+	uint64_t _handled = 0;
+	uint64_t _latencyNs = 0;
+	uint64_t _maxLatencyNs = 0;
+
+public:
+	VmVadQueue()
+	{
+		for (size_t i = 0; i < VM_VAD_QUEUE_SIZE; i++)
+			_cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	/*any thread, false when full, sets notify when the consumer needs
+	 *waking*/
+	bool Push(const VmVadEvent &e, bool &notify)
+	{
+		size_t pos = _head.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell &c = _cells[pos % VM_VAD_QUEUE_SIZE];
+			size_t seq = c.sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (_head.compare_exchange_weak(
+					    pos, pos + 1,
+					    std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				_dropped.fetch_add(1,
+						   std::memory_order_relaxed);
+				return false;
+			} else {
+				pos = _head.load(std::memory_order_relaxed);
+			}
+		}
+		Cell &c = _cells[pos % VM_VAD_QUEUE_SIZE];
+		c.event = e;
+		c.sequence.store(pos + 1, std::memory_order_release);
+		_events.fetch_add(1, std::memory_order_relaxed);
+		notify = !_notified.exchange(true);
+		return true;
+	}
+
+	/*consumer thread, events pushed while draining notify again*/
+	template<class F> void Drain(F &&f)
+	{
+		_notified.exchange(false);
+		for (;;) {
+			Cell &c = _cells[_tail % VM_VAD_QUEUE_SIZE];
+			size_t seq = c.sequence.load(std::memory_order_acquire);
+			if (seq != _tail + 1)
+				break;
+			VmVadEvent e = c.event;
+			c.sequence.store(_tail + VM_VAD_QUEUE_SIZE,
+					 std::memory_order_release);
+			_tail++;
+			f(e);
+			uint64_t latency = os_gettime_ns() - e.ts;
+			_handled++;
+			_latencyNs += latency;
+			if (latency > _maxLatencyNs)
+				_maxLatencyNs = latency;
+		}
+	}
+
+	/*reader threads, cost of one analyzed block*/
+	void Analyzed(uint64_t ns, uint64_t audioNs)
+	{
+		_blocks.fetch_add(1, std::memory_order_relaxed);
+		_analyzeNs.fetch_add(ns, std::memory_order_relaxed);
+		_audioNs.fetch_add(audioNs, std::memory_order_relaxed);
+	}
+
+	/*consumer thread*/
+	std::string Stats()
+	{
+		uint64_t blocks = _blocks.load(), busy = _analyzeNs.load();
+		uint64_t audio = _audioNs.load();
+		char text[256];
+		snprintf(text, sizeof(text),
+			 "%llu blocks, %.2f us per block, %.4f%% of a core "
+			 "per plan, %llu events (%llu dropped), latency "
+			 "%.2f ms avg %.2f ms max",
+			 (unsigned long long)blocks,
+			 blocks ? busy / 1000.0 / blocks : 0.0,
+			 audio ? 100.0 * busy / audio : 0.0,
+			 (unsigned long long)_events.load(),
+			 (unsigned long long)_dropped.load(),
+			 _handled ? _latencyNs / 1000000.0 / _handled : 0.0,
+			 _maxLatencyNs / 1000000.0);
+		return text;
+	}
+};
+
+/*cost of detecting on eight mono strips, each on its own plan*/
+static inline std::string vm_vad_benchmark()
+{
+	const int strips = 8, blocks = 500;
+	const size_t frames = 512;
+	const long rate = 48000;
+	std::vector<pcm_isa> isas = {pcm_isa_scalar};
+#if defined(PCM_X86) || defined(PCM_NEON)
+	isas.push_back(pcm_isa_simd);
+#endif
+	/*a 200 Hz pulse train with harmonics over noise, roughly voiced*/
+	std::vector<float> in(frames * blocks);
+	uint32_t seed = 1;
+	for (size_t i = 0; i < in.size(); i++) {
+		double t = (double)i / rate;
+		float v = 0.0f;
+		for (int h = 1; h <= 10; h++)
+			v += (float)(sin(2.0 * M_PI * 200.0 * h * t) / h);
+		in[i] = 0.05f * v +
+			0.001f * (pcm_uniform(pcm_xorshift(seed)) - 0.5f);
+	}
+
+	std::string report;
+	char line[192];
+	std::vector<VmVadFeatures> ref(blocks);
+	double audioNs = 1e9 * frames * blocks / rate;
+	for (pcm_isa isa : isas) {
+		std::vector<VmVadAnalyzer> analyzers(strips,
+						     VmVadAnalyzer(isa));
+		bool match = true;
+		uint64_t start = os_gettime_ns();
+		for (int b = 0; b < blocks; b++) {
+			const float *block = in.data() + b * frames;
+			for (VmVadAnalyzer &a : analyzers) {
+				VmVadFeatures f =
+					a.Analyze(&block, 1, frames, rate);
+				if (isa == pcm_isa_scalar)
+					ref[b] = f;
+				else if (fabsf(f.db - ref[b].db) > 0.01f ||
+					 fabsf(f.flatness - ref[b].flatness) >
+						 0.01f)
+					match = false;
+			}
+		}
+		double ns = (double)(os_gettime_ns() - start);
+		snprintf(line, sizeof(line),
+			 "\n%d strips %s: %.2f us per block, %.4f%% of a "
+			 "core%s",
+			 strips, pcm_isa_name(isa), ns / blocks / 1000.0,
+			 100.0 * ns / audioNs, match ? "" : " MISMATCH");
+		report += line;
+	}
+	return report;
+}